@@ -0,0 +1,773 @@
+#include "hashdb.h"
+#include "hashdb_define.h"
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+
+enum {
+        /* default number of keys */
+        DEFAULT_NR_KEY          = 1 << 21,
+        /* default number of keys per batch */
+        DEFAULT_BATCH           = 32,
+        /* max number of threads */
+        MAX_THREAD              = 64,
+};
+
+/* slice of keys handled by one thread */
+struct slice {
+        struct hashdb   *sl_hp;
+        struct hashdb_shards *sl_sp;
+        hashdb_size_t   sl_batch;
+        hashdb_size_t   sl_start;
+        hashdb_size_t   sl_end;
+        hashdb_size_t   sl_found;
+};
+
+/* strtol with error checking */
+static long e_strtol(const char *nptr, char **endptr, int base);
+
+/* print usage and exit */
+static void usage(char *progname);
+
+/* current time in nanoseconds */
+static double now(void);
+
+/* print result of one benchmark */
+static void report(const char *name, double start, hashdb_size_t nr_ops);
+
+/* print percentiles of per-op latencies (sorts them) */
+static void report_lat(const char *name, double *lats, hashdb_size_t nr_ops);
+
+/* qsort() comparison of two doubles */
+static int cmp_double(const void *a, const void *b);
+
+/* hash for 8 byte keys */
+static hashdb_size_t key_hash(const void *key, hashdb_size_t size);
+
+/* get built-in hash function (0 for key_hash()) */
+static hashdb_hashfn_t builtin_hash(long id);
+
+/* hash of 8 byte key */
+static hashdb_size_t u64_hash(uint64_t x);
+
+/* are keys equal? */
+#define U64_EQ(a, b) \
+        ((a) == (b))
+
+/* typed calls for 8 byte keys and values (u64_set(), u64_get(), ...) */
+HASHDB_DEFINE(u64, uint64_t, uint64_t, u64_hash, U64_EQ)
+
+/* copy out values of slice of keys */
+static void *get_slice(void *arg);
+
+/* add slice of keys to shards a batch at a time */
+static void *shard_set_slice(void *arg);
+
+/* look up slice of keys in shards a batch at a time */
+static void *shard_get_slice(void *arg);
+
+/* commit after every batch of changes (HASHDB_FLAG_WAL) */
+static void commit(struct hashdb *hp,
+                   hashdb_size_t nr_done,
+                   hashdb_size_t batch);
+
+/* keys in random order */
+static uint64_t *keys;
+static void     **keyps;
+static void     **ptrs;
+
+int
+main(int argc, char **argv)
+{
+        struct hashdb_shards *sp = NULL;
+        struct hashdb *hp = NULL;
+        hashdb_size_t nr_shards = 0;
+        hashdb_size_t nr_builders = 0;
+        hashdb_size_t cache_pct = 0;
+        hashdb_size_t nr_keys = DEFAULT_NR_KEY;
+        hashdb_size_t batch = DEFAULT_BATCH;
+        hashdb_size_t nr_threads = 1;
+        struct slice slices[MAX_THREAD];
+        pthread_t threads[MAX_THREAD];
+        hashdb_size_t found;
+        hashdb_size_t i;
+        hashdb_size_t j;
+        int durability = HASHDB_DURABLE_BATCH;
+        hashdb_hashfn_t hashfn = key_hash;
+        hashdb_size_t *hashes = NULL;
+        hashdb_size_t nr_nodes;
+        double *lats = NULL;
+        struct hashdb_cursor cursor;
+        uint64_t flags = 0;
+        bool typed = false;
+        double start;
+        int c;
+
+        while ((c = getopt(argc, argv,
+                           "n:B:HsKAIct:wd:Tx:PURWk:Se:L:g")) != -1) {
+                switch (c) {
+                case 'n':
+                        nr_keys = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'B':
+                        batch = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'H':
+                        flags |= HASHDB_FLAG_HASH;
+                        break;
+                case 's':
+                        flags |= HASHDB_FLAG_SWISS;
+                        break;
+                case 'K':
+                        flags |= HASHDB_FLAG_CUCKOO;
+                        break;
+                case 'A':
+                        flags |= HASHDB_FLAG_SOA;
+                        break;
+                case 'I':
+                        flags |= HASHDB_FLAG_INDEX32;
+                        break;
+                case 'c':
+                        flags |= HASHDB_FLAG_CONCURRENT;
+                        break;
+                case 't':
+                        nr_threads = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'w':
+                        flags |= HASHDB_FLAG_WAL;
+                        break;
+                case 'd':
+                        durability = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'T':
+                        typed = true;
+                        break;
+                case 'x':
+                        hashfn = builtin_hash(e_strtol(optarg, NULL, 10));
+                        break;
+                case 'P':
+                        flags |= HASHDB_FLAG_POPULATE;
+                        break;
+                case 'U':
+                        flags |= HASHDB_FLAG_HUGE;
+                        break;
+                case 'R':
+                        flags |= HASHDB_FLAG_RANDOM;
+                        break;
+                case 'W':
+                        flags |= HASHDB_FLAG_PREWARM;
+                        break;
+                case 'k':
+                        nr_shards = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'S':
+                        flags |= HASHDB_FLAG_STATS;
+                        break;
+                case 'e':
+                        cache_pct = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'L':
+                        nr_builders = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'g':
+                        flags |= HASHDB_FLAG_GROW;
+                        break;
+                default:
+                        usage(argv[0]);
+                        /* does not return */
+                }
+        }
+        if (!nr_keys || !batch || cache_pct > 100)
+                usage(argv[0]);
+        if (!nr_threads || nr_threads > MAX_THREAD)
+                usage(argv[0]);
+        if (nr_threads > 1 && !(flags & HASHDB_FLAG_CONCURRENT) && !nr_shards)
+                usage(argv[0]);
+
+        keys = malloc(sizeof(*keys) * nr_keys);
+        keyps = malloc(sizeof(*keyps) * nr_keys);
+        ptrs = malloc(sizeof(*ptrs) * batch);
+        hashes = malloc(sizeof(*hashes) * batch);
+        if (!keys || !keyps || !ptrs || !hashes)
+                err(EX_SOFTWARE, "malloc()");
+        nr_nodes = nr_keys;
+        if (flags & HASHDB_FLAG_GROW) {
+                nr_nodes = HASHDB_GROW_MIN;
+                lats = malloc(sizeof(*lats) * nr_keys);
+                if (!lats)
+                        err(EX_SOFTWARE, "malloc()");
+        }
+
+        srand(1);
+        for (i = 0; i < nr_keys; ++i)
+                keys[i] = i;
+        for (i = nr_keys - 1; i > 0; --i) {
+                uint64_t tmp;
+
+                j = ((hashdb_size_t)rand() << 31 | rand()) % (i + 1);
+                tmp = keys[i];
+                keys[i] = keys[j];
+                keys[j] = tmp;
+        }
+        for (i = 0; i < nr_keys; ++i)
+                keyps[i] = &keys[i];
+
+        if (typed) {
+                hp = u64_init("benchdb", flags, nr_nodes, nr_keys, 0666);
+        } else {
+                hp = hashdb_init("benchdb",
+                                 flags,
+                                 nr_nodes,
+                                 nr_keys,
+                                 sizeof(uint64_t),
+                                 sizeof(uint64_t),
+                                 hashfn,
+                                 NULL,
+                                 0666);
+        }
+        if (!hp)
+                err(EX_SOFTWARE, "hashdb_init()");
+        if ((flags & HASHDB_FLAG_WAL) &&
+            hashdb_set_durability(hp, durability))
+                err(EX_SOFTWARE, "hashdb_set_durability()");
+
+        start = now();
+        for (i = 0; i < nr_keys; ++i) {
+                double op = lats ? now() : 0;
+
+                if (typed ? !u64_set(hp, keys[i], keys[i]) :
+                            !hashdb_set(hp, &keys[i], &keys[i]))
+                        err(EX_SOFTWARE, "hashdb_set()");
+                if (lats)
+                        lats[i] = now() - op;
+                commit(hp, i + 1, batch);
+        }
+        commit(hp, 0, batch);
+        report("set", start, nr_keys);
+        if (lats)
+                report_lat("set_grow", lats, nr_keys);
+
+        /* lookups below are the first ones through the new mapping */
+        if (hashdb_free(&hp, false))
+                err(EX_SOFTWARE, "hashdb_free()");
+        start = now();
+        if (typed)
+                hp = u64_open("benchdb", flags);
+        else
+                hp = hashdb_open("benchdb", flags, hashfn, NULL);
+        if (!hp)
+                err(EX_SOFTWARE, "hashdb_open()");
+        report("open", start, 1);
+        if ((flags & HASHDB_FLAG_WAL) &&
+            hashdb_set_durability(hp, durability))
+                err(EX_SOFTWARE, "hashdb_set_durability()");
+
+        start = now();
+        found = 0;
+        for (i = 0; i < nr_keys; ++i) {
+                if (typed)
+                        found += u64_get(hp, keys[nr_keys - i - 1]) != NULL;
+                else
+                        found += hashdb_get(hp, &keys[nr_keys - i - 1]) != NULL;
+        }
+        report("get", start, nr_keys);
+        if (found != nr_keys)
+                errx(EX_SOFTWARE, "get found %zu", (size_t)found);
+
+        start = now();
+        for (i = 0; i < nr_threads; ++i) {
+                slices[i].sl_hp = hp;
+                slices[i].sl_start = nr_keys * i / nr_threads;
+                slices[i].sl_end = nr_keys * (i + 1) / nr_threads;
+                slices[i].sl_found = 0;
+                if (pthread_create(&threads[i], NULL, get_slice, &slices[i]))
+                        errx(EX_SOFTWARE, "pthread_create()");
+        }
+        found = 0;
+        for (i = 0; i < nr_threads; ++i) {
+                pthread_join(threads[i], NULL);
+                found += slices[i].sl_found;
+        }
+        report("get_threads", start, nr_keys);
+        if (found != nr_keys)
+                errx(EX_SOFTWARE, "get_threads found %zu", (size_t)found);
+
+        start = now();
+        found = 0;
+        for (i = 0; i < nr_keys; i += batch) {
+                hashdb_size_t nr = nr_keys - i < batch ? nr_keys - i : batch;
+
+                if (hashdb_get_many(hp, keyps + i, ptrs, nr))
+                        err(EX_SOFTWARE, "hashdb_get_many()");
+                for (j = 0; j < nr; ++j)
+                        found += ptrs[j] != NULL;
+        }
+        report("get_many", start, nr_keys);
+        if (found != nr_keys)
+                errx(EX_SOFTWARE, "get_many found %zu", (size_t)found);
+
+        start = now();
+        if (hashdb_cursor_open(hp, &cursor, 1))
+                err(EX_SOFTWARE, "hashdb_cursor_open()");
+        for (found = 0; hashdb_cursor_next(&cursor); ++found)
+                ;
+        hashdb_cursor_close(&cursor, 1);
+        report("scan", start, nr_keys);
+        if (found != nr_keys)
+                errx(EX_SOFTWARE, "scan found %zu", (size_t)found);
+
+        start = now();
+        found = 0;
+        for (i = 0; i < nr_keys; ++i)
+                found += hp->hd_hashfn(&keys[i], sizeof(keys[i])) & 1;
+        report("hash", start, nr_keys);
+
+        start = now();
+        for (i = 0; i < nr_keys; i += batch) {
+                hashdb_size_t nr = nr_keys - i < batch ? nr_keys - i : batch;
+
+                if (hashdb_hash_many(hp, keyps + i, hashes, nr))
+                        err(EX_SOFTWARE, "hashdb_hash_many()");
+                for (j = 0; j < nr; ++j)
+                        found -= hashes[j] & 1;
+        }
+        report("hash_many", start, nr_keys);
+        if (found)
+                errx(EX_SOFTWARE, "hash_many differs from hash");
+
+        start = now();
+        for (i = 0; i < nr_keys; i += batch) {
+                hashdb_size_t nr = nr_keys - i < batch ? nr_keys - i : batch;
+
+                if (hashdb_set_many(hp, keyps + i, keyps + i, nr) != nr)
+                        err(EX_SOFTWARE, "hashdb_set_many()");
+                commit(hp, 0, batch);
+        }
+        report("set_many", start, nr_keys);
+
+        start = now();
+        for (i = 0; i < nr_keys; i += 2) {
+                if (typed ? u64_rm(hp, keys[i]) : hashdb_rm(hp, &keys[i]))
+                        err(EX_SOFTWARE, "hashdb_rm()");
+                commit(hp, (i / 2) + 1, batch);
+        }
+        commit(hp, 0, batch);
+        report("rm", start, (nr_keys + 1) / 2);
+
+        /* pairs left are laid out bucket by bucket, a batch at a time */
+        if (!(flags & (HASHDB_FLAG_SWISS | HASHDB_FLAG_CUCKOO))) {
+                int ret;
+
+                start = now();
+                while (!(ret = hashdb_compact(hp, batch)))
+                        ;
+                if (ret < 0)
+                        err(EX_SOFTWARE, "hashdb_compact()");
+                report("compact", start, nr_keys / 2);
+
+                start = now();
+                found = 0;
+                for (i = 1; i < nr_keys; i += 2) {
+                        if (typed)
+                                found += u64_get(hp, keys[i]) != NULL;
+                        else
+                                found += hashdb_get(hp, &keys[i]) != NULL;
+                }
+                report("get_compact", start, nr_keys / 2);
+                if (found != nr_keys / 2)
+                        errx(EX_SOFTWARE, "get_compact found %zu",
+                             (size_t)found);
+        }
+
+        /* counters only cover calls since the reopen after set */
+        if (flags & HASHDB_FLAG_STATS) {
+                struct hashdb_stats st;
+
+                start = now();
+                if (hashdb_stats(hp, &st))
+                        err(EX_SOFTWARE, "hashdb_stats()");
+                report("stats", start, 1);
+                printf("%-12s %10zu gets %8.2f probes/op %6zu max probes\n",
+                       "",
+                       (size_t)st.ht_gets,
+                       (double)st.ht_probes /
+                       (st.ht_gets + st.ht_sets + st.ht_rms + 1),
+                       (size_t)st.ht_max_probes);
+                printf("%-12s %10zu live %8zu%% load %6zu max chain\n",
+                       "",
+                       (size_t)st.ht_nr_live,
+                       (size_t)st.ht_load,
+                       (size_t)st.ht_hist_max);
+        }
+
+        /* latencies are only kept by builds with HASHDB_TRACE */
+        for (i = 0; i < HASHDB_NR_OPS; ++i) {
+                struct hashdb_latency lat;
+
+                if (hashdb_latency(hp, i, &lat))
+                        break;
+                printf("%-12s %10zu timed %6zuns p50 %6zuns p99 %6zuns max\n",
+                       i == HASHDB_OP_GET ? "latency get" :
+                       i == HASHDB_OP_SET ? "latency set" : "latency rm",
+                       (size_t)lat.hy_count,
+                       (size_t)hashdb_latency_percentile(&lat, 50),
+                       (size_t)hashdb_latency_percentile(&lat, 99),
+                       (size_t)lat.hy_max);
+        }
+
+        if (hashdb_free(&hp, true))
+                err(EX_SOFTWARE, "hashdb_free()");
+
+        /* same pairs again, written bucket by bucket in one go */
+        if (nr_builders &&
+            !(flags & (HASHDB_FLAG_SWISS | HASHDB_FLAG_CUCKOO))) {
+                uint64_t *recs = malloc(sizeof(*recs) * 2 * nr_keys);
+
+                if (!recs)
+                        err(EX_SOFTWARE, "malloc()");
+                for (i = 0; i < nr_keys; ++i) {
+                        recs[2 * i] = keys[i];
+                        recs[(2 * i) + 1] = keys[i];
+                }
+
+                start = now();
+                if (hashdb_build("benchdb",
+                                 flags & HASHDB_FLAGS_FORMAT,
+                                 recs,
+                                 nr_keys,
+                                 nr_keys,
+                                 sizeof(uint64_t),
+                                 sizeof(uint64_t),
+                                 hashfn,
+                                 NULL,
+                                 0666,
+                                 HASHDB_DUPS_ERROR,
+                                 nr_builders))
+                        err(EX_SOFTWARE, "hashdb_build()");
+                report("build", start, nr_keys);
+                free(recs);
+
+                hp = hashdb_open("benchdb", flags, hashfn, NULL);
+                if (!hp)
+                        err(EX_SOFTWARE, "hashdb_open()");
+                start = now();
+                found = 0;
+                for (i = 0; i < nr_keys; ++i)
+                        found += hashdb_get(hp, &keys[i]) != NULL;
+                report("get_build", start, nr_keys);
+                if (found != nr_keys)
+                        errx(EX_SOFTWARE, "get_build found %zu",
+                             (size_t)found);
+
+                if (hashdb_free(&hp, true))
+                        err(EX_SOFTWARE, "hashdb_free()");
+        }
+
+        /*
+         * threads write different shards, so they need no -c. keys do
+         * not split evenly, so shards may have to grow
+         */
+        if (nr_shards) {
+                sp = hashdb_shards_init("benchdb",
+                                        flags | HASHDB_FLAG_GROW,
+                                        nr_shards,
+                                        nr_keys,
+                                        nr_keys,
+                                        sizeof(uint64_t),
+                                        sizeof(uint64_t),
+                                        hashfn,
+                                        NULL,
+                                        0666);
+                if (!sp)
+                        err(EX_SOFTWARE, "hashdb_shards_init()");
+
+                start = now();
+                for (i = 0; i < nr_threads; ++i) {
+                        slices[i].sl_sp = sp;
+                        slices[i].sl_batch = batch;
+                        slices[i].sl_start = nr_keys * i / nr_threads;
+                        slices[i].sl_end = nr_keys * (i + 1) / nr_threads;
+                        slices[i].sl_found = 0;
+                        if (pthread_create(&threads[i], NULL,
+                                           shard_set_slice, &slices[i]))
+                                errx(EX_SOFTWARE, "pthread_create()");
+                }
+                found = 0;
+                for (i = 0; i < nr_threads; ++i) {
+                        pthread_join(threads[i], NULL);
+                        found += slices[i].sl_found;
+                }
+                report("shard_set", start, nr_keys);
+                if (found != nr_keys)
+                        errx(EX_SOFTWARE, "shard_set added %zu",
+                             (size_t)found);
+
+                start = now();
+                for (i = 0; i < nr_threads; ++i) {
+                        slices[i].sl_found = 0;
+                        if (pthread_create(&threads[i], NULL,
+                                           shard_get_slice, &slices[i]))
+                                errx(EX_SOFTWARE, "pthread_create()");
+                }
+                found = 0;
+                for (i = 0; i < nr_threads; ++i) {
+                        pthread_join(threads[i], NULL);
+                        found += slices[i].sl_found;
+                }
+                report("shard_get", start, nr_keys);
+                if (found != nr_keys)
+                        errx(EX_SOFTWARE, "shard_get found %zu",
+                             (size_t)found);
+
+                if (hashdb_shards_free(&sp, true))
+                        err(EX_SOFTWARE, "hashdb_shards_free()");
+        }
+
+        /*
+         * cache of cache_pct% of keys: 80% of lookups go to 20% of
+         * keys, and a miss adds the key, evicting another one
+         */
+        if (cache_pct) {
+                hashdb_size_t nr_nodes = nr_keys * cache_pct / 100;
+                hashdb_size_t key;
+
+                hp = hashdb_init("benchdb",
+                                 (flags & (HASHDB_FLAG_HASH |
+                                           HASHDB_FLAG_STATS)) |
+                                 HASHDB_FLAG_EVICT,
+                                 nr_nodes ? nr_nodes : 1,
+                                 nr_nodes ? nr_nodes : 1,
+                                 sizeof(uint64_t),
+                                 sizeof(uint64_t),
+                                 hashfn,
+                                 NULL,
+                                 0666);
+                if (!hp)
+                        err(EX_SOFTWARE, "hashdb_init()");
+
+                start = now();
+                found = 0;
+                for (i = 0; i < nr_keys; ++i) {
+                        if (rand() % 10 < 8)
+                                key = keys[rand() % ((nr_keys + 4) / 5)];
+                        else
+                                key = keys[rand() % nr_keys];
+                        if (hashdb_get(hp, &key))
+                                ++found;
+                        else if (!hashdb_set(hp, &key, &key))
+                                err(EX_SOFTWARE, "hashdb_set()");
+                }
+                report("cache", start, nr_keys);
+                printf("%-12s %10zu hits %8.2f%% hit ratio\n",
+                       "",
+                       (size_t)found,
+                       (double)found * 100 / nr_keys);
+
+                if (hashdb_free(&hp, true))
+                        err(EX_SOFTWARE, "hashdb_free()");
+        }
+
+        free(hashes);
+        free(lats);
+        free(ptrs);
+        free(keyps);
+        free(keys);
+        return 0;
+}
+
+static long
+e_strtol(const char *nptr, char **endptr, int base)
+{
+        long res;
+
+        errno = 0;
+        res = strtol(nptr, endptr, base);
+        if (errno)
+                err(EX_SOFTWARE, "strtol(%s)", nptr);
+
+        return res;
+}
+
+static void
+usage(char *progname)
+{
+        fprintf(stderr, "%s: Usage\n", progname);
+        fprintf(stderr, "\t-n:  number of keys\n");
+        fprintf(stderr, "\t-B:  number of keys per batch\n");
+        fprintf(stderr, "\t-H:  store hash of key in each node\n");
+        fprintf(stderr, "\t-s:  use open addressing table format\n");
+        fprintf(stderr, "\t-K:  use cuckoo hashing table format\n");
+        fprintf(stderr, "\t-A:  keep values apart from keys\n");
+        fprintf(stderr, "\t-I:  link nodes by 32-bit index\n");
+        fprintf(stderr, "\t-c:  enable concurrent mode\n");
+        fprintf(stderr, "\t-t:  number of threads (needs -c)\n");
+        fprintf(stderr, "\t-w:  log changes, committing every batch\n");
+        fprintf(stderr, "\t-d:  durability (0: none, 1: batch, 2: op)\n");
+        fprintf(stderr, "\t-T:  use typed calls (HASHDB_DEFINE)\n");
+        fprintf(stderr, "\t-x:  built-in hash (1: xx, 2: wy, 3: crc32c)\n");
+        fprintf(stderr, "\t-P:  fault in whole file when mapping it\n");
+        fprintf(stderr, "\t-U:  ask for huge pages\n");
+        fprintf(stderr, "\t-R:  turn off readahead\n");
+        fprintf(stderr, "\t-W:  fault in file from a background thread\n");
+        fprintf(stderr, "\t-k:  number of shards (also run shard tests)\n");
+        fprintf(stderr, "\t-S:  count operations and print statistics\n");
+        fprintf(stderr, "\t-e:  cache size in %% of keys (run cache test)\n");
+        fprintf(stderr, "\t-L:  number of build threads (run build test)\n");
+        fprintf(stderr, "\t-g:  start small and grow (print set latency)\n");
+        exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report(const char *name, double start, hashdb_size_t nr_ops)
+{
+        double ns = now() - start;
+
+        printf("%-12s %10zu ops %8.1f ns/op %10.0f ops/s\n",
+               name,
+               (size_t)nr_ops,
+               ns / nr_ops,
+               nr_ops / (ns / 1e9));
+}
+
+static void
+report_lat(const char *name, double *lats, hashdb_size_t nr_ops)
+{
+        qsort(lats, nr_ops, sizeof(*lats), cmp_double);
+        printf("%-12s %10.0f p50 ns %8.0f p99 ns %10.0f max ns\n",
+               name,
+               lats[nr_ops / 2],
+               lats[nr_ops - 1 - nr_ops / 100],
+               lats[nr_ops - 1]);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+
+        return (x > y) - (x < y);
+}
+
+static hashdb_size_t
+key_hash(const void *key, hashdb_size_t size)
+{
+        uint64_t x;
+
+        memcpy(&x, key, sizeof(x));
+        return u64_hash(x);
+}
+
+static hashdb_hashfn_t
+builtin_hash(long id)
+{
+        switch (id) {
+        case 0:
+                return key_hash;
+        case HASHDB_HASH_XX:
+                return hashdb_hash_xx;
+        case HASHDB_HASH_WY:
+                return hashdb_hash_wy;
+        case HASHDB_HASH_CRC32C:
+                return hashdb_hash_crc32c;
+        default:
+                usage("bench");
+                return NULL;
+        }
+}
+
+static hashdb_size_t
+u64_hash(uint64_t x)
+{
+        /* splitmix64 finalizer */
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+}
+
+static void *
+get_slice(void *arg)
+{
+        struct slice *sl = arg;
+        uint64_t value;
+        hashdb_size_t i;
+
+        for (i = sl->sl_start; i < sl->sl_end; ++i)
+                sl->sl_found += !hashdb_get_copy(sl->sl_hp, &keys[i], &value);
+
+        return NULL;
+}
+
+static void *
+shard_set_slice(void *arg)
+{
+        struct slice *sl = arg;
+        hashdb_size_t nr;
+        hashdb_size_t i;
+
+        for (i = sl->sl_start; i < sl->sl_end; i += nr) {
+                nr = sl->sl_end - i;
+                if (nr > sl->sl_batch)
+                        nr = sl->sl_batch;
+                sl->sl_found += hashdb_shards_set_many(sl->sl_sp,
+                                                       keyps + i,
+                                                       keyps + i,
+                                                       nr);
+        }
+
+        return NULL;
+}
+
+static void *
+shard_get_slice(void *arg)
+{
+        struct slice *sl = arg;
+        void **found = NULL;
+        hashdb_size_t nr;
+        hashdb_size_t i;
+        hashdb_size_t j;
+
+        found = malloc(sizeof(*found) * sl->sl_batch);
+        if (!found)
+                err(EX_SOFTWARE, "malloc()");
+
+        for (i = sl->sl_start; i < sl->sl_end; i += nr) {
+                nr = sl->sl_end - i;
+                if (nr > sl->sl_batch)
+                        nr = sl->sl_batch;
+                if (hashdb_shards_get_many(sl->sl_sp, keyps + i, found, nr))
+                        err(EX_SOFTWARE, "hashdb_shards_get_many()");
+                for (j = 0; j < nr; ++j)
+                        sl->sl_found += found[j] != NULL;
+        }
+
+        free(found);
+        return NULL;
+}
+
+static void
+commit(struct hashdb *hp, hashdb_size_t nr_done, hashdb_size_t batch)
+{
+        if (!hp->hd_wal || nr_done % batch)
+                return;
+
+        if (hashdb_commit(hp))
+                err(EX_SOFTWARE, "hashdb_commit()");
+}
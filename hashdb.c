@@ -1,6 +1,154 @@
-#include "hashdb.h"
+#include "hashdb_priv.h"
+#include "hashdb_compact.h"
+#include "hashdb_cuckoo.h"
+#include "hashdb_evict.h"
+#include "hashdb_cursor.h"
+#include "hashdb_hash.h"
+#include "hashdb_prewarm.h"
+#include "hashdb_stats.h"
+#include "hashdb_trace.h"
+#include "hashdb_swiss.h"
+#include "hashdb_var.h"
+#include "hashdb_wal.h"
 
-static hashdb_size_t default_hashfn(const void *key, hashdb_size_t size);
+/* set hd_actual, hd_node_tab and hd_hash_tab from hd_data and header */
+static void hashdb_set_ptrs(struct hashdb *hp);
+
+/* map hd_file_size bytes of database file */
+static int hashdb_map(struct hashdb *hp);
+
+/* hashdb_remap() with prewarm thread kept off mapping */
+static int hashdb_remap_locked(struct hashdb *hp, hashdb_size_t file_size);
+
+/* flags for mmap() of database file */
+static int hashdb_map_flags(struct hashdb *hp);
+
+/* give kernel advice about mapping (HASHDB_FLAG_HUGE, HASHDB_FLAG_RANDOM) */
+static void hashdb_advise(struct hashdb *hp);
+
+/* unmap database file */
+static int hashdb_unmap(struct hashdb *hp);
+
+/* set up locks and free node caches for HASHDB_FLAG_CONCURRENT */
+static int hashdb_conc_init(struct hashdb *hp);
+
+/* tear down locks and free node caches */
+static void hashdb_conc_free(struct hashdb *hp);
+
+/* take resize lock (shared or exclusive) */
+static int hashdb_lock_resize(struct hashdb *hp, bool excl);
+
+/* release resize lock */
+static void hashdb_unlock_resize(struct hashdb *hp);
+
+/* take resize lock for a change, checking it may still be made */
+static int hashdb_lock_write(struct hashdb *hp, bool excl);
+
+/* take lock in file, marking table dirty if its owner died */
+static int hashdb_lock_robust(struct hashdb *hp, pthread_mutex_t *lock);
+
+/* take every lock in file, repairing table if dirty (HASHDB_FLAG_SHARED) */
+static int hashdb_lock_all(struct hashdb *hp);
+
+/* release every lock in file */
+static void hashdb_unlock_all(struct hashdb *hp);
+
+/* wait for holder of lock in file to be done, repairing if it died */
+static int hashdb_shared_wait(struct hashdb *hp, pthread_mutex_t *lock);
+
+/* take free list lock of file (HASHDB_FLAG_SHARED) */
+static int hashdb_lock_alloc(struct hashdb *hp);
+
+/* release free list lock of file */
+static void hashdb_unlock_alloc(struct hashdb *hp);
+
+/*
+ * take lock of stripe of bucket (shared or exclusive). with
+ * HASHDB_FLAG_SHARED fails with EAGAIN if bucket has to be looked up again
+ */
+static int hashdb_lock_bucket(struct hashdb *hp,
+                              hashdb_size_t bucket,
+                              bool excl);
+
+/* release lock of stripe of bucket */
+static void hashdb_unlock_bucket(struct hashdb *hp, hashdb_size_t bucket);
+
+/* take node off free list (0 if empty) and count it as live */
+static hashdb_size_t hashdb_node_alloc(struct hashdb *hp);
+
+/* put node on free list and count it as not live */
+static void hashdb_node_free(struct hashdb *hp, hashdb_size_t node);
+
+/* give cached free nodes back to free list (all: reuse removed nodes too) */
+static void hashdb_cache_drain(struct hashdb *hp, bool all);
+
+/* mark start of split or growth for lock-free readers */
+static void hashdb_seq_lock(struct hashdb *hp);
+
+/* mark end of split or growth */
+static void hashdb_seq_unlock(struct hashdb *hp);
+
+/* wait until readers that started before now have finished */
+static void hashdb_synchronize(struct hashdb *hp);
+
+/* set up process-shared locks in new file header */
+static int hashdb_shared_init(struct hashdb_header *hdr);
+
+/* size database file should be according to header */
+static hashdb_size_t hashdb_layout_size(struct hashdb *hp);
+
+/* map part of file another process added (HASHDB_FLAG_SHARED) */
+static int hashdb_sync(struct hashdb *hp);
+
+/* rebuild table after a writer died part way through a change */
+static int hashdb_repair(struct hashdb *hp);
+
+/* rebuild chains from nodes in them at last checkpoint (HASHDB_FLAG_WAL) */
+static int hashdb_rebuild(struct hashdb *hp,
+                          unsigned char *live,
+                          hashdb_size_t size);
+
+/* are pairs kept in slots (HASHDB_FORMAT_SWISS, HASHDB_FORMAT_CUCKOO)? */
+static bool hashdb_slotted(const struct hashdb_header *hdr);
+
+/* are pairs saved while slots are rebuilt (HASHDB_FLAG_WAL, SHARED)? */
+static bool hashdb_slots_kept(struct hashdb *hp);
+
+/* redo rebuild of slots cut short, for opens that do not repair */
+static int hashdb_slots_restore(struct hashdb *hp);
+
+/* finish moving hash table after node table grew or shrank */
+static void hashdb_move_hash_tab(struct hashdb *hp);
+
+/* move up to nr words of hash table, lowest buckets first */
+static void hashdb_move_chunk(struct hashdb *hp, hashdb_size_t nr);
+
+/* would hash table overlap its old place if moved in order? */
+static bool hashdb_move_overlaps(struct hashdb *hp);
+
+/* hashdb_move_hash_tab() for lock-free readers (resize lock held) */
+static void hashdb_move_finish(struct hashdb *hp);
+
+/* give back node table past hh_bump after compaction */
+static int hashdb_shrink(struct hashdb *hp);
+
+/* sync database file and start log over (force: even if log is small) */
+static int hashdb_checkpoint(struct hashdb *hp, bool force);
+
+/* hashdb_checkpoint() with resize lock held exclusively */
+static int hashdb_checkpoint_locked(struct hashdb *hp);
+
+/* save which nodes are in chains for hashdb_rebuild() */
+static int hashdb_save_live(struct hashdb *hp);
+
+/* repair table and replay log left by a crash (HASHDB_FLAG_WAL) */
+static int hashdb_recover(struct hashdb *hp);
+
+/* commit or checkpoint log after changes if durability or size says so */
+static int hashdb_wal_done(struct hashdb *hp);
+
+/* compact all at once between checkpoints (HASHDB_FLAG_WAL) */
+static int hashdb_compact_wal(struct hashdb *hp);
 
 struct hashdb *
 hashdb_init(const char *path,
@@ -14,11 +162,8 @@ hashdb_init(const char *path,
             mode_t mode)
 {
         struct hashdb_header *hdr = NULL;
-        struct hashdb_node *np = NULL;
         struct hashdb *hp = NULL;
-        unsigned char *p = NULL;
         hashdb_size_t next;
-        hashdb_size_t i;
         int saved_errno;
 
         errno = EINVAL;
@@ -34,11 +179,49 @@ hashdb_init(const char *path,
                 goto ret;
         if (!value_size)
                 goto ret;
+        if ((flags & HASHDB_FLAG_SHARED) && (flags & HASHDB_FLAG_CONCURRENT))
+                goto ret;
+        if (flags & HASHDB_FLAG_RDONLY)
+                goto ret;
+        if ((flags & HASHDB_FLAG_VAR) &&
+            (flags & (HASHDB_FLAG_SWISS | HASHDB_FLAG_WAL)))
+                goto ret;
+        if ((flags & HASHDB_FLAG_CUCKOO) &&
+            (flags & (HASHDB_FLAG_SWISS | HASHDB_FLAG_VAR)))
+                goto ret;
+        if ((flags & HASHDB_FLAG_SOA) && (flags & (HASHDB_FLAG_SWISS |
+                                                  HASHDB_FLAG_CUCKOO |
+                                                  HASHDB_FLAG_VAR)))
+                goto ret;
+        if ((flags & HASHDB_FLAG_INDEX32) && (flags & (HASHDB_FLAG_SWISS |
+                                                      HASHDB_FLAG_CUCKOO |
+                                                      HASHDB_FLAG_VAR)))
+                goto ret;
+        if ((flags & HASHDB_FLAG_INDEX32) && nr_nodes > UINT32_MAX)
+                goto ret;
+        if ((flags & HASHDB_FLAG_EVICT) && (flags & (HASHDB_FLAG_GROW |
+                                                    HASHDB_FLAG_SWISS |
+                                                    HASHDB_FLAG_CUCKOO |
+                                                    HASHDB_FLAG_CONCURRENT |
+                                                    HASHDB_FLAG_SHARED |
+                                                    HASHDB_FLAG_VAR)))
+                goto ret;
         errno = 0;
 
         hp = malloc(sizeof(*hp));
         if (!hp)
                 goto ret;
+        hp->hd_flags = flags;
+        hp->hd_lock_depth = 0;
+        hp->hd_lock_excl = false;
+        hp->hd_lock_seq = 0;
+        hp->hd_nr_cursors = 0;
+        hp->hd_wal = NULL;
+        hp->hd_prewarm = NULL;
+        hp->hd_latency = NULL;
+        hp->hd_clock = NULL;
+        if (hashdb_stats_init(hp) || hashdb_trace_init(hp))
+                goto free_hp;
 
         hp->hd_path = strdup(path);
         if (!hp->hd_path)
@@ -49,62 +232,148 @@ hashdb_init(const char *path,
                 goto free_hd_path;
 
         /* allocate space for database */
-        key_size = NEXT_MULTPLE_OF_8(key_size);
-        value_size = NEXT_MULTPLE_OF_8(value_size);
-        hp->hd_node_size = sizeof(next) + key_size + value_size;
-        hp->hd_file_size = sizeof(hp->hd_hdr);
-        hp->hd_file_size += hp->hd_node_size * (nr_nodes + 1);
-        hp->hd_file_size += sizeof(hashdb_size_t) * nr_buckets;
+        if ((flags & HASHDB_FLAG_INDEX32) && !(flags & HASHDB_FLAG_HASH)) {
+                key_size = NEXT_MULTPLE_OF_4(key_size);
+                value_size = NEXT_MULTPLE_OF_4(value_size);
+        } else {
+                key_size = NEXT_MULTPLE_OF_8(key_size);
+                value_size = NEXT_MULTPLE_OF_8(value_size);
+        }
+        if (flags & (HASHDB_FLAG_SWISS | HASHDB_FLAG_CUCKOO)) {
+                /* nodes are slots and buckets are groups of slots */
+                flags &= ~HASHDB_FLAG_HASH;
+                if (flags & HASHDB_FLAG_SWISS) {
+                        nr_nodes = hashdb_swiss_cap(nr_nodes);
+                        nr_buckets = nr_nodes / HASHDB_SWISS_GROUP;
+                } else {
+                        nr_nodes = hashdb_cuckoo_cap(nr_nodes);
+                        nr_buckets = nr_nodes / HASHDB_CUCKOO_SLOTS;
+                }
+                hp->hd_key_off = 0;
+                hp->hd_node_size = key_size + value_size;
+                hp->hd_head_size = key_size;
+                hp->hd_block_shift = 0;
+                hp->hd_link_size = sizeof(next);
+                hp->hd_file_size = hashdb_swiss_file_size(nr_nodes,
+                                hp->hd_node_size);
+        } else {
+                /* runs are only walked through their first node */
+                if (flags & HASHDB_FLAG_VAR)
+                        flags |= HASHDB_FLAG_HASH;
+                hp->hd_link_size = sizeof(next);
+                if (flags & HASHDB_FLAG_INDEX32)
+                        hp->hd_link_size = sizeof(uint32_t);
+
+                /* stored hash is 8 byte aligned after hn_next */
+                hp->hd_key_off = hp->hd_link_size;
+                if (flags & HASHDB_FLAG_HASH)
+                        hp->hd_key_off = sizeof(next) + sizeof(hashdb_size_t);
+                if (flags & HASHDB_FLAG_VAR)
+                        hp->hd_key_off += sizeof(struct hashdb_var);
+                hp->hd_node_size = hp->hd_key_off + key_size + value_size;
+                hp->hd_head_size = hp->hd_key_off + key_size;
+                hp->hd_block_shift = 0;
+                if (flags & HASHDB_FLAG_SOA) {
+                        nr_nodes = HASHDB_SOA_ROUND(nr_nodes);
+                        hp->hd_block_shift = HASHDB_SOA_SHIFT;
+                }
+                hp->hd_file_size = sizeof(*hp->hd_hdr);
+                hp->hd_file_size += hp->hd_node_size * (nr_nodes + 1);
+                hp->hd_file_size += hp->hd_link_size * nr_buckets;
+        }
+        /* file is all holes, so nothing below has to be zeroed */
+        if (ftruncate(hp->hd_fd, 0))
+                goto close_fd_and_unlink;
         if (ftruncate(hp->hd_fd, hp->hd_file_size))
                 goto close_fd_and_unlink;
 
-        hp->hd_data = mmap(NULL,
-                           hp->hd_file_size,
-                           PROT_READ | PROT_WRITE,
-                           MAP_SHARED,
-                           hp->hd_fd,
-                           0);
-        if (!hp->hd_data)
+        if (hashdb_map(hp))
                 goto close_fd_and_unlink;
 
         /* initialize file header */
-        hdr = &hp->hd_hdr;
+        hdr = hp->hd_hdr;
+        hdr->hh_magic = HASHDB_MAGIC;
+        hdr->hh_version = HASHDB_VERSION;
         hdr->hh_nr_nodes = nr_nodes;
         hdr->hh_nr_buckets = nr_buckets;
         hdr->hh_key_size = key_size;
         hdr->hh_value_size = value_size;
-        hdr->hh_free = 1;
-        memcpy(hp->hd_data, hdr, sizeof(*hdr));
-
-        /* initialize free list */
-        p = UCHAR_P(hp->hd_data);
-        hp->hd_actual = p + sizeof(*hdr);
-        hp->hd_node_tab = hp->hd_actual + hp->hd_node_size;
-        p = hp->hd_node_tab;
-        for (i = 0; i < nr_nodes - 1; ++i) {
-                np = HASHDB_NODE_P(p);
-                np->hn_next = (i + 1) + 1;
-                p += hp->hd_node_size;
-        }
-        np = HASHDB_NODE_P(p);
-        np->hn_next = 0;
-
-        /* initialize hash table */
-        p = hp->hd_node_tab + (hp->hd_node_size * nr_nodes);
-        hp->hd_hash_tab = p;
-        memset(p, 0, sizeof(hashdb_size_t) * nr_buckets);
+        hdr->hh_free = 0;
+        hdr->hh_nr_live = 0;
+        hdr->hh_bucket_cap = nr_buckets;
+        hdr->hh_split = 0;
+        hdr->hh_base_buckets = nr_buckets;
+        hdr->hh_max_load = HASHDB_DEFAULT_MAX_LOAD;
+        hdr->hh_flags = flags & HASHDB_FLAGS_FORMAT;
+        hdr->hh_format = HASHDB_FORMAT_CHAIN;
+        hdr->hh_nr_tomb = 0;
+        hdr->hh_move_from = 0;
+        hdr->hh_move_left = 0;
+        hdr->hh_bump = 1;
+        hdr->hh_nr_free = 0;
+        hdr->hh_compact_next = 0;
+        hdr->hh_compact_bucket = 0;
+        hdr->hh_shard = 0;
+        hdr->hh_nr_shards = 0;
+        if (flags & HASHDB_FLAG_VAR)
+                hdr->hh_format = HASHDB_FORMAT_VAR;
+        if (flags & HASHDB_FLAG_SWISS)
+                hdr->hh_format = HASHDB_FORMAT_SWISS;
+        if (flags & HASHDB_FLAG_CUCKOO)
+                hdr->hh_format = HASHDB_FORMAT_CUCKOO;
+        hdr->hh_seq = 0;
+        if (hashdb_shared_init(hdr))
+                goto unmap;
+
+        /* nodes are handed out from hh_bump, so there is no free list yet */
+        hashdb_set_ptrs(hp);
+        if (hashdb_slotted(hdr))
+                hashdb_swiss_format(hp);
 
         hp->hd_hashfn = hashfn;
         if (!hp->hd_hashfn)
-                hp->hd_hashfn = default_hashfn;
+                hp->hd_hashfn = hashdb_hash_xx;
+        hdr->hh_hash = hashdb_hash_id(hp->hd_hashfn);
 
         hp->hd_cmpfn = cmpfn;
         if (!hp->hd_cmpfn)
                 hp->hd_cmpfn = memcmp;
 
         hp->hd_flags = flags;
+        if (hashdb_conc_init(hp))
+                goto unmap;
+        if ((flags & HASHDB_FLAG_WAL) && hashdb_wal_open(hp, mode, true))
+                goto conc_free;
+        /* a crash before the first checkpoint rebuilds an empty table */
+        if ((flags & HASHDB_FLAG_WAL) && hashdb_checkpoint(hp, true))
+                goto wal_close;
+        if (!(flags & HASHDB_FLAG_WAL) && hashdb_wal_drop_live(hp))
+                goto conc_free;
+        /* pairs of an old file must not come back into this one */
+        if (hashdb_wal_drop_slots(hp))
+                goto wal_close;
+        /* nor may its clean close skip recovery of this one */
+        if (hashdb_wal_drop_clean(hp))
+                goto wal_close;
+        if (hashdb_evict_init(hp))
+                goto wal_close;
+        if (hashdb_prewarm_start(hp))
+                goto evict_free;
         goto ret;
 
+evict_free:
+        hashdb_evict_free(hp);
+wal_close:
+        saved_errno = errno;
+        if (hp->hd_wal)
+                hashdb_wal_close(hp, true);
+        errno = saved_errno;
+conc_free:
+        hashdb_conc_free(hp);
+unmap:
+        saved_errno = errno;
+        hashdb_unmap(hp);
+        errno = saved_errno;
 close_fd_and_unlink:
         saved_errno = errno;
         close(hp->hd_fd);
@@ -116,374 +385,3713 @@ free_hd_path:
         free(hp->hd_path);
         hp->hd_path = NULL;
 free_hp:
+        hashdb_stats_free(hp);
+        hashdb_trace_free(hp);
         free(hp);
         hp = NULL;
 ret:
         return hp;
 }
 
-static hashdb_size_t
-default_hashfn(const void *key, hashdb_size_t size)
+static void
+hashdb_set_ptrs(struct hashdb *hp)
 {
-        const unsigned char *p = key;
-        hashdb_size_t hash = 0;
-        hashdb_size_t i;
+        unsigned char *p = UCHAR_P(hp->hd_data);
 
-        for (i = 0; i < size; ++i)
-                hash = hash * HASHDB_MULTIPLIER + *p++;
+        if (hashdb_slotted(hp->hd_hdr)) {
+                hashdb_swiss_set_ptrs(hp);
+                return;
+        }
 
-        return hash;
+        /* read by lock-free readers */
+        p += sizeof(*hp->hd_hdr);
+        __atomic_store_n(&hp->hd_actual, p, __ATOMIC_RELAXED);
+        p += hp->hd_node_size;
+        __atomic_store_n(&hp->hd_node_tab, p, __ATOMIC_RELAXED);
+        p += hp->hd_node_size * hp->hd_hdr->hh_nr_nodes;
+        __atomic_store_n(&hp->hd_hash_tab, p, __ATOMIC_RELAXED);
 }
 
-/* check sanity of hashdb */
-static int hashdb_sanity(const struct hashdb *hp);
+hashdb_size_t
+hashdb_bucket(const struct hashdb_header *hdr, hashdb_size_t hash)
+{
+        hashdb_size_t split;
+        hashdb_size_t base;
 
-int
-hashdb_free(struct hashdb **hpp, bool fully)
+        /* lock-free readers call this while a split may be running */
+        base = __atomic_load_n(&hdr->hh_base_buckets, __ATOMIC_RELAXED);
+        split = __atomic_load_n(&hdr->hh_split, __ATOMIC_RELAXED);
+
+        /* buckets before split pointer have already been split */
+        return HASHDB_BUCKET(hash, base, split);
+}
+
+static int
+hashdb_map(struct hashdb *hp)
 {
-        struct hashdb *hp = NULL;
+        hashdb_size_t size;
+        void *base = NULL;
+        int prot;
 
-        if (hpp == NULL) {
-                errno = EINVAL;
-                return -1;
-        }
-        hp = *hpp;
+        /* stray writes to a read-only hashdb fault instead */
+        prot = PROT_READ | PROT_WRITE;
+        if (hp->hd_flags & HASHDB_FLAG_RDONLY)
+                prot = PROT_READ;
 
-        if (hashdb_sanity(hp))
-                return -1;
+        hp->hd_map_size = 0;
+        if (!(hp->hd_flags & (HASHDB_FLAG_CONCURRENT | HASHDB_FLAG_SHARED))) {
+                hp->hd_data = mmap(NULL,
+                                   hp->hd_file_size,
+                                   prot,
+                                   hashdb_map_flags(hp),
+                                   hp->hd_fd,
+                                   0);
+                hp->hd_hdr = hp->hd_data;
+                if (hp->hd_data == MAP_FAILED)
+                        return -1;
+                hashdb_advise(hp);
+                return 0;
+        }
 
-        if (munmap(hp->hd_data, hp->hd_file_size))
-                return -1;
+        /*
+         * other threads hold pointers into the mapping, and lock-free
+         * readers extend it when another process grows the file, so
+         * reserve address space up front and grow the mapping in place
+         */
+        size = HASHDB_MAP_RESERVE;
+        for (;;) {
+                base = mmap(NULL,
+                            size,
+                            PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1,
+                            0);
+                if (base != MAP_FAILED)
+                        break;
 
-        if (hp->hd_fd >= 0 && close(hp->hd_fd))
-                return -1;
+                /* settle for less if address space is limited */
+                size /= 2;
+                if (size < hp->hd_file_size)
+                        return -1;
+        }
 
-        if (hp->hd_fd >= 0 && fully && unlink(hp->hd_path))
+        hp->hd_data = mmap(base,
+                           hp->hd_file_size,
+                           prot,
+                           hashdb_map_flags(hp) | MAP_FIXED,
+                           hp->hd_fd,
+                           0);
+        if (hp->hd_data == MAP_FAILED) {
+                munmap(base, size);
                 return -1;
+        }
 
-        free(hp->hd_path);
-        free(hp);
-        *hpp = NULL;
+        hp->hd_hdr = hp->hd_data;
+        hp->hd_map_size = size;
+        hashdb_advise(hp);
         return 0;
 }
 
 static int
-hashdb_sanity(const struct hashdb *hp)
+hashdb_map_flags(struct hashdb *hp)
 {
-        const struct hashdb_header *hdr = NULL;
-        const unsigned char *p = NULL;
+        if (hp->hd_flags & HASHDB_FLAG_POPULATE)
+                return MAP_SHARED | MAP_POPULATE;
 
-        errno = EINVAL;
-        if (!hp)
-                return -1;
-        if (!(hp->hd_flags & HASHDB_FLAG_SANE_MODE)) {
-                errno = 0;
+        return MAP_SHARED;
+}
+
+static void
+hashdb_advise(struct hashdb *hp)
+{
+        /*
+         * lookups jump around all of the file, node table and hash table
+         * alike, so advice covers the whole mapping. it is only advice,
+         * so a kernel without huge pages is not an error
+         */
+        if (hp->hd_flags & HASHDB_FLAG_HUGE)
+                madvise(hp->hd_data, hp->hd_file_size, MADV_HUGEPAGE);
+        if (hp->hd_flags & HASHDB_FLAG_RANDOM)
+                madvise(hp->hd_data, hp->hd_file_size, MADV_RANDOM);
+}
+
+static int
+hashdb_unmap(struct hashdb *hp)
+{
+        if (hp->hd_map_size)
+                return munmap(hp->hd_data, hp->hd_map_size);
+
+        return munmap(hp->hd_data, hp->hd_file_size);
+}
+
+int
+hashdb_remap(struct hashdb *hp, hashdb_size_t file_size)
+{
+        int ret;
+
+        /* prewarm thread must not read pages while they go away */
+        hashdb_prewarm_lock(hp);
+        ret = hashdb_remap_locked(hp, file_size);
+        if (!ret)
+                hashdb_advise(hp);
+        hashdb_prewarm_unlock(hp);
+        return ret;
+}
+
+static int
+hashdb_remap_locked(struct hashdb *hp, hashdb_size_t file_size)
+{
+        hashdb_size_t page;
+        hashdb_size_t off;
+        void *data = NULL;
+
+        if (!hp->hd_map_size) {
+                data = mremap(hp->hd_data,
+                              hp->hd_file_size,
+                              file_size,
+                              MREMAP_MAYMOVE);
+                if (data == MAP_FAILED)
+                        return -1;
+
+                hp->hd_data = data;
+                hp->hd_hdr = data;
+                hp->hd_file_size = file_size;
                 return 0;
         }
-        if (!hp->hd_path)
-                return -1;
-        if (hp->hd_fd < 0)
-                return -1;
-        if (!hp->hd_node_size)
-                return -1;
-        if (!hp->hd_file_size)
-                return -1;
-        if (!hp->hd_data)
-                return -1;
-        if (!hp->hd_node_tab)
-                return -1;
-        if (!hp->hd_actual)
-                return -1;
-        if (!hp->hd_hash_tab)
-                return -1;
-        if (!hp->hd_hashfn)
-                return -1;
-        if (!hp->hd_cmpfn)
-                return -1;
 
-        hdr = &hp->hd_hdr;
-        p = hp->hd_data;
-        if (hp->hd_actual != p + sizeof(*hdr))
-                return -1;
-
-        if (hp->hd_node_tab != p + sizeof(*hdr) + hp->hd_node_size)
+        if (file_size > hp->hd_map_size) {
+                errno = ENOMEM;
                 return -1;
+        }
 
-        p = hp->hd_node_tab;
-        if (hp->hd_hash_tab != p + (hp->hd_node_size * hdr->hh_nr_nodes))
-                return -1;
+        /* reserved mapping only grows, the end of it is just not used */
+        if (file_size <= hp->hd_file_size) {
+                hp->hd_file_size = file_size;
+                return 0;
+        }
 
-        if (!hdr->hh_nr_nodes)
-                return -1;
-        if (!hdr->hh_nr_buckets)
-                return -1;
-        if (!hdr->hh_key_size)
-                return -1;
-        if (!hdr->hh_value_size)
-                return -1;
+        /*
+         * map new part of file right after the old part. the last page
+         * of the old part is already mapped and readers may be on it
+         */
+        page = sysconf(_SC_PAGESIZE);
+        off = hp->hd_file_size + page - 1;
+        off -= off % page;
+        if (file_size > off) {
+                data = mmap(UCHAR_P(hp->hd_data) + off,
+                            file_size - off,
+                            PROT_READ | PROT_WRITE,
+                            hashdb_map_flags(hp) | MAP_FIXED,
+                            hp->hd_fd,
+                            off);
+                if (data == MAP_FAILED)
+                        return -1;
+        }
 
-        errno = 0;
+        hp->hd_file_size = file_size;
         return 0;
 }
 
-struct hashdb *
-hashdb_open(const char *path,
-            uint64_t flags,
-            hashdb_hashfn_t hashfn,
-            hashdb_cmpfn_t cmpfn)
+static int
+hashdb_conc_init(struct hashdb *hp)
 {
-        struct hashdb_header *hdr = NULL;
-        struct hashdb *hp = NULL;
-        unsigned char *p = NULL;
-        struct stat stats;
-        hashdb_size_t next;
-        int saved_errno;
+        hashdb_size_t i;
+        int err;
 
-        errno = 0;
-        if (!path)
-                goto ret;
-        if (!*path)
-                goto ret;
-        errno = 0;
+        hp->hd_stripes = NULL;
+        hp->hd_caches = NULL;
+        hp->hd_readers = NULL;
+        hp->hd_epoch = 0;
+        hp->hd_seq = 0;
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT))
+                return 0;
 
-        hp = malloc(sizeof(*hp));
-        if (!hp)
-                goto ret;
+        err = posix_memalign((void **)&hp->hd_stripes,
+                             HASHDB_CACHE_LINE,
+                             sizeof(*hp->hd_stripes) * HASHDB_NR_STRIPES);
+        if (err)
+                goto fail;
 
-        hp->hd_path = strdup(path);
-        if (!hp->hd_path)
-                goto free_hp;
+        err = posix_memalign((void **)&hp->hd_caches,
+                             HASHDB_CACHE_LINE,
+                             sizeof(*hp->hd_caches) * HASHDB_NR_CACHES);
+        if (err)
+                goto free_stripes;
 
-        hp->hd_fd = open(path, O_RDWR);
-        if (hp->hd_fd < 0)
-                goto free_hd_path;
+        err = posix_memalign((void **)&hp->hd_readers,
+                             HASHDB_CACHE_LINE,
+                             sizeof(*hp->hd_readers) * HASHDB_NR_READERS);
+        if (err)
+                goto free_caches;
 
-        if (fstat(hp->hd_fd, &stats))
-                goto close_fd;
+        for (i = 0; i < HASHDB_NR_STRIPES; ++i) {
+                pthread_rwlock_init(&hp->hd_stripes[i].hs_lock, NULL);
+                hp->hd_stripes[i].hs_seq = 0;
+        }
 
-        hdr = &hp->hd_hdr;
-        hp->hd_file_size = stats.st_size;
-        hp->hd_data = mmap(NULL,
-                           hp->hd_file_size,
-                           PROT_READ | PROT_WRITE,
-                           MAP_SHARED,
-                           hp->hd_fd,
-                           0);
-        if (!hp->hd_data)
-                goto close_fd;
-        memcpy(hdr, hp->hd_data, sizeof(*hdr));
+        for (i = 0; i < HASHDB_NR_CACHES; ++i) {
+                pthread_mutex_init(&hp->hd_caches[i].hc_lock, NULL);
+                hp->hd_caches[i].hc_nr = 0;
+                hp->hd_caches[i].hc_live = 0;
+                hp->hd_caches[i].hc_nr_retired = 0;
+        }
 
-        hp->hd_node_size = sizeof(next) + hdr->hh_key_size + hdr->hh_value_size;
+        for (i = 0; i < HASHDB_NR_READERS; ++i) {
+                hp->hd_readers[i].hr_active[0] = 0;
+                hp->hd_readers[i].hr_active[1] = 0;
+        }
 
-        p = UCHAR_P(hp->hd_data);
-        hp->hd_actual = p + sizeof(*hdr);
-        hp->hd_node_tab = hp->hd_actual + hp->hd_node_size;
+        pthread_rwlock_init(&hp->hd_resize_lock, NULL);
+        pthread_mutex_init(&hp->hd_alloc_lock, NULL);
+        return 0;
 
-        p = hp->hd_node_tab;
-        hp->hd_hash_tab = p + (hp->hd_node_size * hdr->hh_nr_nodes);
+free_caches:
+        free(hp->hd_caches);
+        hp->hd_caches = NULL;
+free_stripes:
+        free(hp->hd_stripes);
+        hp->hd_stripes = NULL;
+fail:
+        errno = err;
+        return -1;
+}
 
-        hp->hd_hashfn = hashfn;
-        if (!hp->hd_hashfn)
-                hp->hd_hashfn = default_hashfn;
+static void
+hashdb_conc_free(struct hashdb *hp)
+{
+        hashdb_size_t i;
 
-        hp->hd_cmpfn = cmpfn;
-        if (!hp->hd_cmpfn)
-                hp->hd_cmpfn = memcmp;
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT))
+                return;
 
-        hp->hd_flags = flags;
-        goto ret;
+        for (i = 0; i < HASHDB_NR_STRIPES; ++i)
+                pthread_rwlock_destroy(&hp->hd_stripes[i].hs_lock);
 
-close_fd:
-        saved_errno = errno;
-        close(hp->hd_fd);
-        hp->hd_fd = -1;
-        errno = saved_errno;
-free_hd_path:
-        free(hp->hd_path);
-        hp->hd_path = NULL;
-free_hp:
-        free(hp);
-        hp = NULL;
-ret:
-        return hp;
+        for (i = 0; i < HASHDB_NR_CACHES; ++i)
+                pthread_mutex_destroy(&hp->hd_caches[i].hc_lock);
+
+        pthread_rwlock_destroy(&hp->hd_resize_lock);
+        pthread_mutex_destroy(&hp->hd_alloc_lock);
+        free(hp->hd_stripes);
+        free(hp->hd_caches);
+        free(hp->hd_readers);
+        hp->hd_stripes = NULL;
+        hp->hd_caches = NULL;
+        hp->hd_readers = NULL;
 }
 
-int
-hashdb_dump(struct hashdb *hp, FILE *fp)
+static int
+hashdb_lock_resize(struct hashdb *hp, bool excl)
 {
-        struct hashdb_header *hdr = NULL;
-        hashdb_size_t freelistlen;
-        hashdb_size_t curr;
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t seq;
 
-        if (hashdb_sanity(hp))
-                return -1;
+        if (hp->hd_flags & HASHDB_FLAG_SHARED) {
+                /* recovery makes changes with lock already held */
+                if (hp->hd_lock_depth++)
+                        return 0;
 
-        hdr = &hp->hd_hdr;
-        fprintf(fp, "nr_nodes:    %zu\n", (size_t)hdr->hh_nr_nodes);
-        fprintf(fp, "nr_buckets:  %zu\n", (size_t)hdr->hh_nr_buckets);
-        fprintf(fp, "key_size:    %zu\n", (size_t)hdr->hh_key_size);
-        fprintf(fp, "value_size:  %zu\n", (size_t)hdr->hh_value_size);
-        fprintf(fp, "free:        %zu\n", (size_t)hdr->hh_free);
+                if (excl) {
+                        if (!hashdb_lock_all(hp))
+                                return 0;
+                        --hp->hd_lock_depth;
+                        return -1;
+                }
 
-        curr = hdr->hh_free;
-        freelistlen = 0;
-        while (curr) {
-                unsigned char *p = NULL;
+                /* bucket locks check that no split or growth ran since */
+                for (;;) {
+                        seq = __atomic_load_n(&hdr->hh_seq, __ATOMIC_ACQUIRE);
+                        if ((seq & 1) ||
+                            __atomic_load_n(&hdr->hh_dirty, __ATOMIC_ACQUIRE)) {
+                                if (hashdb_shared_wait(hp, &hdr->hh_lock))
+                                        break;
+                                continue;
+                        }
 
-                p = hp->hd_actual + (hp->hd_node_size * curr);
-                curr = HASHDB_NODE_P(p)->hn_next;
-                ++freelistlen;
+                        /* header may be torn, so only give up if it was not */
+                        if (!hashdb_sync(hp)) {
+                                hp->hd_lock_seq = seq;
+                                return 0;
+                        }
+                        if (__atomic_load_n(&hdr->hh_seq, __ATOMIC_ACQUIRE) ==
+                            seq)
+                                break;
+                }
+                --hp->hd_lock_depth;
+                return -1;
         }
 
-        fprintf(fp, "freelistlen: %zu\n", freelistlen);
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT))
+                return 0;
+
+        if (excl)
+                pthread_rwlock_wrlock(&hp->hd_resize_lock);
+        else
+                pthread_rwlock_rdlock(&hp->hd_resize_lock);
         return 0;
 }
 
-void *
-hashdb_set(struct hashdb *hp, void *key, void *value)
+static void
+hashdb_unlock_resize(struct hashdb *hp)
 {
-        struct hashdb_header *hdr = NULL;
-        unsigned char *p = NULL;
-        hashdb_size_t *bp = NULL;
-        hashdb_size_t hash;
-        hashdb_size_t bucket;
-        hashdb_size_t curr;
-        hashdb_size_t save;
-        hashdb_size_t free;
-        hashdb_size_t next;
-        void *keyp = NULL;
-        void *valp = NULL;
+        if (hp->hd_flags & HASHDB_FLAG_SHARED) {
+                if (!--hp->hd_lock_depth && hp->hd_lock_excl)
+                        hashdb_unlock_all(hp);
+                return;
+        }
 
-        if (hashdb_sanity(hp))
-                return NULL;
+        if (hp->hd_flags & HASHDB_FLAG_CONCURRENT)
+                pthread_rwlock_unlock(&hp->hd_resize_lock);
+}
 
-        hdr = &hp->hd_hdr;
-        hash = hp->hd_hashfn(key, hdr->hh_key_size);
-        bucket = hash % hdr->hh_nr_buckets;
-        bp = (hashdb_size_t *)(hp->hd_hash_tab +
-                        (sizeof(hashdb_size_t) * bucket));
-        memcpy(&curr, bp, sizeof(curr));
-        save = curr;
+static int
+hashdb_lock_robust(struct hashdb *hp, pthread_mutex_t *lock)
+{
+        int err;
 
-        while (curr) {
-                p = hp->hd_actual + (hp->hd_node_size * curr);
-                next = HASHDB_NODE_P(p)->hn_next;
-                keyp = p + sizeof(hashdb_size_t);
-                valp = UCHAR_P(keyp) + hdr->hh_key_size;
-                if (!hp->hd_cmpfn(key, keyp, hdr->hh_key_size)) {
-                        memcpy(valp, value, hdr->hh_value_size);
-                        return keyp;
+        err = pthread_mutex_lock(lock);
+        if (err == EOWNERDEAD) {
+                /* whoever takes every lock next repairs the table */
+                __atomic_store_n(&hp->hd_hdr->hh_dirty, 1, __ATOMIC_SEQ_CST);
+                err = pthread_mutex_consistent(lock);
+        }
+        if (err) {
+                errno = err;
+                return -1;
+        }
+
+        return 0;
+}
+
+static int
+hashdb_lock_all(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        struct hashdb_lock *lp = NULL;
+        hashdb_size_t i;
+        int err;
+
+        /* same order as writers: bucket locks, then free list lock */
+        for (i = 0; i < HASHDB_NR_LOCKS; ++i) {
+                if (hashdb_lock_robust(hp, &hdr->hh_locks[i].hl_lock))
+                        goto unlock;
+        }
+        if (hashdb_lock_robust(hp, &hdr->hh_lock))
+                goto unlock;
+        hp->hd_lock_excl = true;
+
+        /* another process may have grown the file */
+        if (hashdb_sync(hp))
+                goto unlock_all;
+
+        /*
+         * owner died holding a lock, so table may be half changed.
+         * if repair fails the table stays dirty and is tried again
+         */
+        if (__atomic_load_n(&hdr->hh_dirty, __ATOMIC_ACQUIRE)) {
+                /* dead writer may have left it odd */
+                if (!(hdr->hh_seq & 1))
+                        hashdb_seq_lock(hp);
+                if (hashdb_repair(hp))
+                        goto unlock_all;
+                for (i = 0; i < HASHDB_NR_LOCKS; ++i) {
+                        lp = &hdr->hh_locks[i];
+                        __atomic_store_n(&lp->hl_seq,
+                                         lp->hl_seq + (lp->hl_seq & 1),
+                                         __ATOMIC_RELAXED);
                 }
+                __atomic_store_n(&hdr->hh_dirty, 0, __ATOMIC_RELAXED);
+                hashdb_seq_unlock(hp);
+        }
+        return 0;
 
-                curr = next;
+unlock_all:
+        err = errno;
+        hashdb_unlock_all(hp);
+        errno = err;
+        return -1;
+
+unlock:
+        err = errno;
+        while (i--)
+                pthread_mutex_unlock(&hdr->hh_locks[i].hl_lock);
+        errno = err;
+        return -1;
+}
+
+static void
+hashdb_unlock_all(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t i;
+
+        hp->hd_lock_excl = false;
+        pthread_mutex_unlock(&hdr->hh_lock);
+        for (i = HASHDB_NR_LOCKS; i--; )
+                pthread_mutex_unlock(&hdr->hh_locks[i].hl_lock);
+}
+
+static int
+hashdb_shared_wait(struct hashdb *hp, pthread_mutex_t *lock)
+{
+        /* lock is only free once its holder is done or dead */
+        if (hashdb_lock_robust(hp, lock))
+                return -1;
+        pthread_mutex_unlock(lock);
+
+        if (!__atomic_load_n(&hp->hd_hdr->hh_dirty, __ATOMIC_ACQUIRE))
+                return 0;
+        if (hashdb_lock_all(hp))
+                return -1;
+        hashdb_unlock_all(hp);
+        return 0;
+}
+
+static int
+hashdb_shared_init(struct hashdb_header *hdr)
+{
+        pthread_mutexattr_t attr;
+        hashdb_size_t i;
+        int err;
+
+        err = pthread_mutexattr_init(&attr);
+        if (err)
+                goto fail;
+
+        /* a writer that dies must not leave a lock held forever */
+        err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        if (!err)
+                err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        if (!err)
+                err = pthread_mutex_init(&hdr->hh_lock, &attr);
+        for (i = 0; !err && i < HASHDB_NR_LOCKS; ++i) {
+                err = pthread_mutex_init(&hdr->hh_locks[i].hl_lock, &attr);
+                hdr->hh_locks[i].hl_seq = 0;
         }
+        hdr->hh_dirty = 0;
 
-        if (!hdr->hh_free) {
-                errno = ENOMEM;
-                return NULL;
+        pthread_mutexattr_destroy(&attr);
+        if (err)
+                goto fail;
+        return 0;
+
+fail:
+        errno = err;
+        return -1;
+}
+
+static hashdb_size_t
+hashdb_layout_size(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t nr_nodes;
+        hashdb_size_t size;
+
+        nr_nodes = __atomic_load_n(&hdr->hh_nr_nodes, __ATOMIC_RELAXED);
+        if (hashdb_slotted(hdr))
+                return hashdb_swiss_file_size(nr_nodes, hp->hd_node_size);
+
+        size = sizeof(*hdr);
+        size += hp->hd_node_size * (nr_nodes + 1);
+        size += hp->hd_link_size *
+                __atomic_load_n(&hdr->hh_bucket_cap, __ATOMIC_RELAXED);
+        return size;
+}
+
+static int
+hashdb_sync(struct hashdb *hp)
+{
+        hashdb_size_t size;
+
+        /* reserved mapping never moves, so only the new part is mapped */
+        size = hashdb_layout_size(hp);
+        if (size > hp->hd_file_size && hashdb_remap(hp, size))
+                return -1;
+
+        hashdb_set_ptrs(hp);
+        return 0;
+}
+
+static void
+hashdb_move_hash_tab(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *dst = NULL;
+        unsigned char *src = NULL;
+        hashdb_size_t chunk;
+        hashdb_size_t left;
+        hashdb_size_t end;
+        hashdb_size_t i;
+
+        if (!hdr->hh_move_left) {
+                __atomic_store_n(&hdr->hh_move_from, 0, __ATOMIC_RELEASE);
+                return;
         }
 
-        free = hdr->hh_free;
-        p = hp->hd_actual + (hp->hd_node_size * free);
-        next = HASHDB_NODE_P(p)->hn_next;
-        keyp = p + sizeof(hashdb_size_t);
-        valp = UCHAR_P(keyp) + hdr->hh_key_size;
+        /*
+         * shrinking copies a chunk over words that were already copied,
+         * so a chunk is never bigger than the distance moved
+         */
+        dst = hp->hd_hash_tab;
+        src = HASHDB_BLOCK_AT(hp, hp->hd_actual, hdr->hh_move_from + 1);
+        if (!hashdb_move_overlaps(hp)) {
+                chunk = (src > dst ? src - dst : dst - src) / hp->hd_link_size;
+                while (hdr->hh_move_left)
+                        hashdb_move_chunk(hp, chunk);
+                return;
+        }
 
-        memcpy(keyp, key, hdr->hh_key_size);
-        memcpy(valp, value, hdr->hh_value_size);
-        hdr->hh_free = next;
-        memcpy(hp->hd_data, hdr, sizeof(*hdr));
-        HASHDB_NODE_P(p)->hn_next = save;
-        memcpy(bp, &free, sizeof(free));
-        return keyp;
+        /*
+         * grown by too little to clear it, so copy a word at a time
+         * from the end instead of memmove(), since lock-free readers
+         * may be walking it. a chunk never overwrites its own source,
+         * so if the writer dies the chunk it was on can be copied again
+         */
+        chunk = (dst - src) / hp->hd_link_size;
+        while ((end = hdr->hh_move_left)) {
+                left = end > chunk ? end - chunk : 0;
+                for (i = end; i > left; --i) {
+                        hashdb_link_store(hp,
+                                HASHDB_BUCKET_LINK(hp, dst, i - 1),
+                                hashdb_link_load(hp,
+                                        HASHDB_BUCKET_LINK(hp, src, i - 1)));
+                }
+                __atomic_store_n(&hdr->hh_move_left, left, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&hdr->hh_move_from, 0, __ATOMIC_RELEASE);
 }
 
-void *
-hashdb_get(struct hashdb *hp, void *key)
+static void
+hashdb_move_chunk(struct hashdb *hp, hashdb_size_t nr)
 {
-        struct hashdb_header *hdr = NULL;
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *dst = NULL;
+        unsigned char *src = NULL;
+        hashdb_size_t start;
+        hashdb_size_t end;
+        hashdb_size_t i;
+
+        /* old hash table starts where the old node table ended */
+        dst = hp->hd_hash_tab;
+        src = HASHDB_BLOCK_AT(hp, hp->hd_actual, hdr->hh_move_from + 1);
+        start = hdr->hh_bucket_cap - hdr->hh_move_left;
+        end = hdr->hh_move_left > nr ? start + nr : hdr->hh_bucket_cap;
+        for (i = start; i < end; ++i) {
+                hashdb_link_store(hp,
+                                  HASHDB_BUCKET_LINK(hp, dst, i),
+                                  hashdb_link_load(hp,
+                                        HASHDB_BUCKET_LINK(hp, src, i)));
+        }
+
+        /* nodes under words copied can be handed out from here on */
+        __atomic_store_n(&hdr->hh_move_left,
+                         hdr->hh_bucket_cap - end,
+                         __ATOMIC_RELEASE);
+        if (end == hdr->hh_bucket_cap)
+                __atomic_store_n(&hdr->hh_move_from, 0, __ATOMIC_RELEASE);
+}
+
+static bool
+hashdb_move_overlaps(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+
+        if (hdr->hh_move_from > hdr->hh_nr_nodes)
+                return false;
+
+        return hp->hd_node_size * (hdr->hh_nr_nodes - hdr->hh_move_from) <
+                hp->hd_link_size * hdr->hh_bucket_cap;
+}
+
+static void
+hashdb_move_finish(struct hashdb *hp)
+{
+        if (!hp->hd_hdr->hh_move_left)
+                return;
+
+        hashdb_seq_lock(hp);
+        hashdb_move_hash_tab(hp);
+        hashdb_seq_unlock(hp);
+}
+
+void
+hashdb_move_step(struct hashdb *hp)
+{
+        if (!hp->hd_hdr->hh_move_left)
+                return;
+
+        /*
+         * lock-free readers that looked a bucket up in the chunk retry,
+         * so new nodes can be written over its old place right away
+         */
+        hashdb_seq_lock(hp);
+        hashdb_move_chunk(hp, HASHDB_MOVE_CHUNK);
+        hashdb_seq_unlock(hp);
+}
+
+hashdb_size_t
+hashdb_bump_end(const struct hashdb *hp)
+{
+        const struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t moved;
+
+        if (!hdr->hh_move_left || hdr->hh_move_from > hdr->hh_nr_nodes)
+                return hdr->hh_nr_nodes + 1;
+
+        /* with HASHDB_FLAG_SOA a block is free only once all of it is */
+        moved = hp->hd_link_size * (hdr->hh_bucket_cap - hdr->hh_move_left);
+        moved /= hp->hd_node_size << hp->hd_block_shift;
+        return hdr->hh_move_from + 1 + (moved << hp->hd_block_shift);
+}
+
+static int
+hashdb_shrink(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t old_nr_nodes;
+        hashdb_size_t nr_nodes;
+        hashdb_size_t size;
+
+        /* keep some room so the next inserts do not grow it right back */
+        old_nr_nodes = hdr->hh_nr_nodes;
+        nr_nodes = hdr->hh_bump - 1;
+        nr_nodes += nr_nodes / HASHDB_COMPACT_SLACK;
+        if (nr_nodes < HASHDB_GROW_MIN)
+                nr_nodes = HASHDB_GROW_MIN;
+        if (hp->hd_block_shift)
+                nr_nodes = HASHDB_SOA_ROUND(nr_nodes);
+        if (nr_nodes >= old_nr_nodes)
+                return 0;
+
+        hashdb_seq_lock(hp);
+        hashdb_move_hash_tab(hp);
+        __atomic_store_n(&hdr->hh_move_from, old_nr_nodes, __ATOMIC_RELEASE);
+        hdr->hh_move_left = hdr->hh_bucket_cap;
+        __atomic_store_n(&hdr->hh_nr_nodes, nr_nodes, __ATOMIC_RELEASE);
+        hashdb_set_ptrs(hp);
+        hashdb_move_hash_tab(hp);
+        hashdb_seq_unlock(hp);
+
+        /* readers that saw the old hash table may still be reading it */
+        hashdb_synchronize(hp);
+        size = hashdb_layout_size(hp);
+        if (hashdb_remap(hp, size))
+                return -1;
+
+        /* a crash must not leave a header saying the file is bigger */
+        if (hp->hd_wal && msync(hp->hd_data, sizeof(*hdr), MS_SYNC))
+                return -1;
+
+        return ftruncate(hp->hd_fd, size);
+}
+
+static bool
+hashdb_slotted(const struct hashdb_header *hdr)
+{
+        return hdr->hh_format == HASHDB_FORMAT_SWISS ||
+                hdr->hh_format == HASHDB_FORMAT_CUCKOO;
+}
+
+static int
+hashdb_repair(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *seen = NULL;
         unsigned char *p = NULL;
-        hashdb_size_t *bp = NULL;
-        hashdb_size_t hash;
+        void *link = NULL;
+        void *bp = NULL;
+        hashdb_size_t nr_buckets;
+        hashdb_size_t nr_live;
         hashdb_size_t bucket;
         hashdb_size_t curr;
-        hashdb_size_t next;
+        hashdb_size_t hash;
+        hashdb_size_t run;
+        hashdb_size_t b;
         void *keyp = NULL;
 
-        if (hashdb_sanity(hp))
-                return NULL;
+        if (hdr->hh_format == HASHDB_FORMAT_SWISS)
+                return hashdb_swiss_repair(hp);
+        if (hdr->hh_format == HASHDB_FORMAT_CUCKOO)
+                return hashdb_cuckoo_repair(hp);
 
-        hdr = &hp->hd_hdr;
-        hash = hp->hd_hashfn(key, hdr->hh_key_size);
-        bucket = hash % hdr->hh_nr_buckets;
-        bp = (hashdb_size_t *)(hp->hd_hash_tab +
-                        (sizeof(hashdb_size_t) * bucket));
-        memcpy(&curr, bp, sizeof(curr));
+        /* finish moving hash table if it got that far */
+        if (!hdr->hh_move_from || hdr->hh_move_from == hdr->hh_nr_nodes) {
+                hdr->hh_move_from = 0;
+                hdr->hh_move_left = 0;
+        }
+        hashdb_move_hash_tab(hp);
 
-        while (curr) {
-                p = hp->hd_actual + (hp->hd_node_size * curr);
-                next = HASHDB_NODE_P(p)->hn_next;
-                keyp = p + sizeof(hashdb_size_t);
-                if (!hp->hd_cmpfn(key, keyp, hdr->hh_key_size))
-                        return keyp;
-                curr = next;
+        seen = calloc(hdr->hh_nr_nodes + 1, 1);
+        if (!seen)
+                return -1;
+
+        /* split may have stopped between updating these */
+        if (hdr->hh_split >= hdr->hh_base_buckets) {
+                hdr->hh_base_buckets *= 2;
+                hdr->hh_split = 0;
         }
+        hdr->hh_nr_buckets = hdr->hh_base_buckets + hdr->hh_split;
 
-        return NULL;
+        /*
+         * keep every pair a bucket can still reach. pairs in the wrong
+         * bucket (including the buddy of a split that did not finish)
+         * are moved to the right one, and bad links are cut
+         */
+        nr_buckets = hdr->hh_nr_buckets;
+        if (nr_buckets < hdr->hh_bucket_cap)
+                ++nr_buckets;
+        nr_live = 0;
+        for (b = 0; b < nr_buckets; ++b) {
+                link = HASHDB_BUCKET_LINK(hp, hp->hd_hash_tab, b);
+                while ((curr = hashdb_link_get(hp, link))) {
+                        if (curr > hdr->hh_nr_nodes || seen[curr] == 1) {
+                                hashdb_link_set(hp, link, 0);
+                                break;
+                        }
+
+                        p = HASHDB_NODE(hp, curr);
+
+                        /* run of a variable size pair has to fit too */
+                        run = 1;
+                        if (hdr->hh_format == HASHDB_FORMAT_VAR) {
+                                keyp = p + hp->hd_key_off;
+                                run = hashdb_var_run(hp,
+                                        HASHDB_VAR_KEY_SIZE(keyp),
+                                        HASHDB_VAR_VALUE_SIZE(keyp));
+                        }
+                        if (curr + run - 1 > hdr->hh_nr_nodes ||
+                            memchr(seen + curr, 1, run)) {
+                                hashdb_link_set(hp, link, 0);
+                                break;
+                        }
+
+                        if (hp->hd_flags & HASHDB_FLAG_HASH)
+                                hash = HASHDB_NODE_HASH(p);
+                        else
+                                hash = hp->hd_hashfn(p + hp->hd_key_off,
+                                                     hdr->hh_key_size);
+                        bucket = hashdb_bucket(hdr, hash);
+                        if (bucket == b) {
+                                memset(seen + curr, 1, run);
+                                ++nr_live;
+                                link = p;
+                                continue;
+                        }
+
+                        /* a torn link may lead back to a pair moved already */
+                        if (seen[curr]) {
+                                hashdb_link_set(hp, link, 0);
+                                break;
+                        }
+
+                        /* buckets already walked will not see it again */
+                        hashdb_link_set(hp, link, hashdb_link_get(hp, p));
+                        bp = HASHDB_BUCKET_LINK(hp, hp->hd_hash_tab, bucket);
+                        hashdb_link_set(hp, p, hashdb_link_get(hp, bp));
+                        hashdb_link_set(hp, bp, curr);
+                        memset(seen + curr, bucket < b ? 1 : 2, run);
+                        if (bucket < b)
+                                ++nr_live;
+                }
+        }
+
+        /* a node may have been linked in before hh_bump was stored */
+        for (curr = hdr->hh_nr_nodes; curr >= hdr->hh_bump; --curr) {
+                if (seen[curr]) {
+                        hdr->hh_bump = curr + 1;
+                        break;
+                }
+        }
+
+        /* everything else handed out before is free, runs split up */
+        hdr->hh_compact_next = 0;
+        hdr->hh_compact_bucket = 0;
+        hdr->hh_free = 0;
+        hdr->hh_nr_free = 0;
+        memset(hdr->hh_var_free, 0, sizeof(hdr->hh_var_free));
+        for (curr = hdr->hh_bump - 1; curr > 0; --curr) {
+                if (!seen[curr])
+                        hashdb_free_push(hp, curr);
+        }
+        hdr->hh_nr_live = nr_live;
+
+        free(seen);
+        return 0;
 }
 
-int
-hashdb_rm(struct hashdb *hp, void *key)
+static int
+hashdb_rebuild(struct hashdb *hp, unsigned char *live, hashdb_size_t size)
 {
-        struct hashdb_header *hdr = NULL;
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t key_off = hp->hd_key_off;
         unsigned char *p = NULL;
-        unsigned char *elemp = p;
-        unsigned char *bkt_p = NULL;
-        hashdb_size_t hash;
-        hashdb_size_t bucket;
+        unsigned char *q = NULL;
+        void *link = NULL;
+        hashdb_size_t nr_live;
         hashdb_size_t curr;
-        hashdb_size_t prev;
-        hashdb_size_t chainlen;
+        hashdb_size_t hash;
+        hashdb_size_t node;
+        struct stat stats;
 
-        if (hashdb_sanity(hp))
+        /*
+         * a header saying the table is bigger than the file got can not
+         * be rebuilt from (another process may have grown it, though)
+         */
+        if (fstat(hp->hd_fd, &stats))
+                return -1;
+        if (hashdb_layout_size(hp) > (hashdb_size_t)stats.st_size) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (hashdb_sync(hp))
                 return -1;
+        hdr = hp->hd_hdr;
 
-        hdr = &hp->hd_hdr;
-        hash = hp->hd_hashfn(key, hdr->hh_key_size);
-        bucket = hash % hdr->hh_nr_buckets;
-        bkt_p = hp->hd_hash_tab + (sizeof(hashdb_size_t) * bucket);
-        memcpy(&curr, bkt_p, sizeof(curr));
+        /* links may be torn, so the hash table is made anew in place */
+        hdr->hh_move_from = 0;
+        hdr->hh_move_left = 0;
+        if (hdr->hh_split >= hdr->hh_base_buckets) {
+                hdr->hh_base_buckets *= 2;
+                hdr->hh_split = 0;
+        }
+        hdr->hh_nr_buckets = hdr->hh_base_buckets + hdr->hh_split;
+        hashdb_set_ptrs(hp);
+        memset(hp->hd_hash_tab, 0, hp->hd_link_size * hdr->hh_bucket_cap);
 
-        prev = 0;
-        chainlen = 0;
-        while (curr) {
-                void *keyp = NULL;
+        /*
+         * a node in the list holds the pair it had then, or one put in
+         * after it was freed. the log redoes whatever changed, so of a
+         * key found twice either node will do
+         */
+        if (size > (hdr->hh_nr_nodes / 8) + 1)
+                size = (hdr->hh_nr_nodes / 8) + 1;
+        nr_live = 0;
+        for (curr = 1; curr < size * 8 && curr <= hdr->hh_nr_nodes; ++curr) {
+                if (!(live[curr / 8] & (1 << (curr % 8))))
+                        continue;
 
-                ++chainlen;
-                prev = curr;
-                p = hp->hd_actual + (hp->hd_node_size * curr);
-                keyp = p + sizeof(hashdb_size_t);
-                if (!hp->hd_cmpfn(key, keyp, hdr->hh_key_size))
-                        break;
+                p = HASHDB_NODE(hp, curr);
+                hash = hp->hd_hashfn(p + key_off, hdr->hh_key_size);
+                if (hp->hd_flags & HASHDB_FLAG_HASH)
+                        HASHDB_NODE_HASH(p) = hash;
+                link = hashdb_bucket_link(hp, hashdb_bucket(hdr, hash));
+                while ((node = hashdb_link_get(hp, link))) {
+                        q = HASHDB_NODE(hp, node);
+                        if (!hp->hd_cmpfn(q + key_off,
+                                          p + key_off,
+                                          hdr->hh_key_size))
+                                break;
+                        link = q;
+                }
+                if (node) {
+                        live[curr / 8] &= ~(1 << (curr % 8));
+                        continue;
+                }
 
-                curr = HASHDB_NODE_P(p)->hn_next;
+                hashdb_link_set(hp, p, 0);
+                hashdb_link_set(hp, link, curr);
+                if (curr >= hdr->hh_bump)
+                        hdr->hh_bump = curr + 1;
+                ++nr_live;
         }
+        if (hdr->hh_bump > hdr->hh_nr_nodes + 1)
+                hdr->hh_bump = hdr->hh_nr_nodes + 1;
 
-        if (!curr) {
-                errno = ENOENT;
-                return -1;
+        /* everything else handed out before is free */
+        hdr->hh_compact_next = 0;
+        hdr->hh_compact_bucket = 0;
+        hdr->hh_free = 0;
+        hdr->hh_nr_free = 0;
+        for (curr = hdr->hh_bump - 1; curr > 0; --curr) {
+                if (curr >= size * 8 || !(live[curr / 8] & (1 << (curr % 8))))
+                        hashdb_free_push(hp, curr);
         }
+        hdr->hh_nr_live = nr_live;
+        return 0;
+}
 
-        elemp = p;
-        if (chainlen > 1) {
-                p = hp->hd_actual + (hp->hd_node_size * prev);
-                HASHDB_NODE_P(p)->hn_next = HASHDB_NODE_P(elemp)->hn_next;
-        } else {
-                memset(bkt_p, 0, sizeof(hashdb_size_t));
+static int
+hashdb_lock_bucket(struct hashdb *hp, hashdb_size_t bucket, bool excl)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        struct hashdb_lock *lp = NULL;
+        pthread_rwlock_t *lock = NULL;
+
+        if (hp->hd_flags & HASHDB_FLAG_SHARED) {
+                lp = &hdr->hh_locks[bucket % HASHDB_NR_LOCKS];
+                if (!hp->hd_lock_excl) {
+                        if (hashdb_lock_robust(hp, &lp->hl_lock))
+                                return -1;
+
+                        /* split or growth may have moved key to another */
+                        if (__atomic_load_n(&hdr->hh_seq, __ATOMIC_ACQUIRE) !=
+                            hp->hd_lock_seq ||
+                            __atomic_load_n(&hdr->hh_dirty, __ATOMIC_ACQUIRE)) {
+                                pthread_mutex_unlock(&lp->hl_lock);
+                                errno = EAGAIN;
+                                return -1;
+                        }
+                }
+
+                /* lock-free readers of stripe retry */
+                if (excl) {
+                        __atomic_store_n(&lp->hl_seq, lp->hl_seq + 1,
+                                         __ATOMIC_RELAXED);
+                        __atomic_thread_fence(__ATOMIC_RELEASE);
+                }
+                return 0;
+        }
+
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT))
+                return 0;
+
+        lock = &hp->hd_stripes[bucket % HASHDB_NR_STRIPES].hs_lock;
+        if (excl)
+                pthread_rwlock_wrlock(lock);
+        else
+                pthread_rwlock_rdlock(lock);
+        return 0;
+}
+
+static void
+hashdb_unlock_bucket(struct hashdb *hp, hashdb_size_t bucket)
+{
+        struct hashdb_lock *lp = NULL;
+        pthread_rwlock_t *lock = NULL;
+
+        if (hp->hd_flags & HASHDB_FLAG_SHARED) {
+                lp = &hp->hd_hdr->hh_locks[bucket % HASHDB_NR_LOCKS];
+                if (lp->hl_seq & 1) {
+                        __atomic_store_n(&lp->hl_seq, lp->hl_seq + 1,
+                                         __ATOMIC_RELEASE);
+                }
+                if (!hp->hd_lock_excl)
+                        pthread_mutex_unlock(&lp->hl_lock);
+                return;
+        }
+
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT))
+                return;
+
+        lock = &hp->hd_stripes[bucket % HASHDB_NR_STRIPES].hs_lock;
+        pthread_rwlock_unlock(lock);
+}
+
+static int
+hashdb_lock_alloc(struct hashdb *hp)
+{
+        if (!(hp->hd_flags & HASHDB_FLAG_SHARED) || hp->hd_lock_excl)
+                return 0;
+
+        if (hashdb_lock_robust(hp, &hp->hd_hdr->hh_lock))
+                return -1;
+
+        /* free list may be half changed until table is repaired */
+        if (__atomic_load_n(&hp->hd_hdr->hh_dirty, __ATOMIC_ACQUIRE)) {
+                pthread_mutex_unlock(&hp->hd_hdr->hh_lock);
+                errno = EAGAIN;
+                return -1;
         }
 
-        HASHDB_NODE_P(elemp)->hn_next = hdr->hh_free;
-        hdr->hh_free = curr;
-        memcpy(hp->hd_data, hdr, sizeof(*hdr));
         return 0;
 }
+
+static void
+hashdb_unlock_alloc(struct hashdb *hp)
+{
+        if ((hp->hd_flags & HASHDB_FLAG_SHARED) && !hp->hd_lock_excl)
+                pthread_mutex_unlock(&hp->hd_hdr->hh_lock);
+}
+
+/* index of calling thread (0 means none yet) */
+static _Thread_local hashdb_size_t hashdb_thread_id;
+
+/* number of threads that have been given an index */
+static hashdb_size_t hashdb_nr_threads;
+
+/* get free node cache of calling thread */
+static struct hashdb_cache *hashdb_cache(struct hashdb *hp);
+
+/* move nodes from free list to cache (alloc lock held) */
+static void hashdb_cache_refill(struct hashdb *hp, struct hashdb_cache *cp);
+
+/* move nodes from cache to free list (alloc lock held) */
+static void hashdb_cache_flush(struct hashdb *hp,
+                               struct hashdb_cache *cp,
+                               hashdb_size_t nr);
+
+/* move removed nodes no reader can see into cache (all: every one) */
+static hashdb_size_t hashdb_reclaim(struct hashdb *hp,
+                                    struct hashdb_cache *cp,
+                                    bool all);
+
+/* start epoch if no reader is left in the one before (true if so) */
+static bool hashdb_epoch_advance(struct hashdb *hp);
+
+/* register calling thread as reader, returns parity of epoch */
+static hashdb_size_t hashdb_epoch_enter(struct hashdb *hp,
+                                        struct hashdb_reader **rpp);
+
+/* unregister reader */
+static void hashdb_epoch_exit(struct hashdb_reader *rp, hashdb_size_t idx);
+
+hashdb_size_t
+hashdb_thread(void)
+{
+        if (!hashdb_thread_id) {
+                hashdb_thread_id = __atomic_add_fetch(&hashdb_nr_threads,
+                                1, __ATOMIC_RELAXED);
+        }
+
+        return hashdb_thread_id;
+}
+
+static struct hashdb_cache *
+hashdb_cache(struct hashdb *hp)
+{
+        return &hp->hd_caches[hashdb_thread() % HASHDB_NR_CACHES];
+}
+
+hashdb_size_t
+hashdb_free_pop(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *p = NULL;
+        hashdb_size_t node;
+
+        node = hdr->hh_free;
+        if (node) {
+                p = HASHDB_NODE(hp, node);
+                hdr->hh_free = hashdb_link_get(hp, p);
+                --hdr->hh_nr_free;
+                if (hdr->hh_compact_next && hdr->hh_free) {
+                        p = HASHDB_NODE(hp, hdr->hh_free);
+                        hashdb_link_set(hp, HASHDB_FREE_PREV(hp, p), 0);
+                }
+                return node;
+        }
+
+        if (hdr->hh_bump >= hashdb_bump_end(hp))
+                return 0;
+
+        return hdr->hh_bump++;
+}
+
+void
+hashdb_free_push(struct hashdb *hp, hashdb_size_t node)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *p = NULL;
+
+        p = HASHDB_NODE(hp, node);
+        hashdb_link_set(hp, p, hdr->hh_free);
+        if (hdr->hh_compact_next) {
+                hashdb_link_set(hp, HASHDB_FREE_PREV(hp, p), 0);
+                if (hdr->hh_free) {
+                        p = HASHDB_NODE(hp, hdr->hh_free);
+                        hashdb_link_set(hp, HASHDB_FREE_PREV(hp, p), node);
+                }
+        }
+        hdr->hh_free = node;
+        ++hdr->hh_nr_free;
+}
+
+static void
+hashdb_cache_refill(struct hashdb *hp, struct hashdb_cache *cp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t node;
+
+        while (cp->hc_nr < HASHDB_CACHE_BATCH) {
+                node = hashdb_free_pop(hp);
+                if (!node)
+                        break;
+                cp->hc_nodes[cp->hc_nr++] = node;
+        }
+
+        __atomic_add_fetch(&hdr->hh_nr_live, cp->hc_live, __ATOMIC_RELAXED);
+        cp->hc_live = 0;
+}
+
+static void
+hashdb_cache_flush(struct hashdb *hp,
+                   struct hashdb_cache *cp,
+                   hashdb_size_t nr)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+
+        while (nr-- && cp->hc_nr)
+                hashdb_free_push(hp, cp->hc_nodes[--cp->hc_nr]);
+
+        __atomic_add_fetch(&hdr->hh_nr_live, cp->hc_live, __ATOMIC_RELAXED);
+        cp->hc_live = 0;
+}
+
+static hashdb_size_t
+hashdb_reclaim(struct hashdb *hp, struct hashdb_cache *cp, bool all)
+{
+        hashdb_size_t epoch;
+        hashdb_size_t left;
+        hashdb_size_t nr;
+
+        /*
+         * a reader that saw a node removed in epoch e is in e or
+         * earlier, and the epoch only gets to e + 2 once it is gone
+         */
+        epoch = __atomic_load_n(&hp->hd_epoch, __ATOMIC_ACQUIRE);
+        for (nr = 0; nr < cp->hc_nr_retired; ++nr) {
+                if (!all && cp->hc_retired_epoch[nr] + 2 > epoch)
+                        break;
+                if (cp->hc_nr == HASHDB_CACHE_SIZE) {
+                        pthread_mutex_lock(&hp->hd_alloc_lock);
+                        hashdb_cache_flush(hp, cp, HASHDB_CACHE_BATCH);
+                        pthread_mutex_unlock(&hp->hd_alloc_lock);
+                }
+                cp->hc_nodes[cp->hc_nr++] = cp->hc_retired[nr];
+        }
+
+        left = cp->hc_nr_retired - nr;
+        memmove(cp->hc_retired,
+                cp->hc_retired + nr,
+                sizeof(cp->hc_retired[0]) * left);
+        memmove(cp->hc_retired_epoch,
+                cp->hc_retired_epoch + nr,
+                sizeof(cp->hc_retired_epoch[0]) * left);
+        cp->hc_nr_retired = left;
+        return nr;
+}
+
+static bool
+hashdb_epoch_advance(struct hashdb *hp)
+{
+        struct hashdb_reader *rp = NULL;
+        hashdb_size_t epoch;
+        hashdb_size_t idx;
+        hashdb_size_t i;
+
+        /* readers of epoch - 1 share a counter with epoch + 1 */
+        epoch = __atomic_load_n(&hp->hd_epoch, __ATOMIC_SEQ_CST);
+        idx = (epoch + 1) & 1;
+        for (i = 0; i < HASHDB_NR_READERS; ++i) {
+                rp = &hp->hd_readers[i];
+                if (__atomic_load_n(&rp->hr_active[idx], __ATOMIC_SEQ_CST))
+                        return false;
+        }
+
+        /* losing the race means another thread advanced it */
+        __atomic_compare_exchange_n(&hp->hd_epoch,
+                                    &epoch,
+                                    epoch + 1,
+                                    false,
+                                    __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST);
+        return true;
+}
+
+static hashdb_size_t
+hashdb_epoch_enter(struct hashdb *hp, struct hashdb_reader **rpp)
+{
+        struct hashdb_reader *rp = NULL;
+        hashdb_size_t epoch;
+
+        rp = &hp->hd_readers[hashdb_thread() % HASHDB_NR_READERS];
+        *rpp = rp;
+
+        /* epoch must not move between reading it and counting ourself */
+        for (;;) {
+                epoch = __atomic_load_n(&hp->hd_epoch, __ATOMIC_SEQ_CST);
+                __atomic_add_fetch(&rp->hr_active[epoch & 1],
+                                   1,
+                                   __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&hp->hd_epoch, __ATOMIC_SEQ_CST) == epoch)
+                        return epoch & 1;
+                __atomic_sub_fetch(&rp->hr_active[epoch & 1],
+                                   1,
+                                   __ATOMIC_RELEASE);
+        }
+}
+
+static void
+hashdb_epoch_exit(struct hashdb_reader *rp, hashdb_size_t idx)
+{
+        __atomic_sub_fetch(&rp->hr_active[idx], 1, __ATOMIC_RELEASE);
+}
+
+static void
+hashdb_synchronize(struct hashdb *hp)
+{
+        hashdb_size_t epoch;
+
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT))
+                return;
+
+        epoch = __atomic_load_n(&hp->hd_epoch, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&hp->hd_epoch, __ATOMIC_SEQ_CST) < epoch + 2) {
+                if (!hashdb_epoch_advance(hp))
+                        sched_yield();
+        }
+}
+
+static hashdb_size_t
+hashdb_node_alloc(struct hashdb *hp)
+{
+        struct hashdb_cache *cp = NULL;
+        hashdb_size_t node;
+
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT)) {
+                if (hashdb_lock_alloc(hp))
+                        return 0;
+                node = hashdb_free_pop(hp);
+                if (node)
+                        ++hp->hd_hdr->hh_nr_live;
+                hashdb_unlock_alloc(hp);
+                return node;
+        }
+
+        /* reuse own removed nodes before going to the shared free list */
+        cp = hashdb_cache(hp);
+        pthread_mutex_lock(&cp->hc_lock);
+        if (!cp->hc_nr && cp->hc_nr_retired) {
+                hashdb_epoch_advance(hp);
+                hashdb_reclaim(hp, cp, false);
+        }
+
+        /* only go to the shared free list once per batch */
+        if (!cp->hc_nr) {
+                pthread_mutex_lock(&hp->hd_alloc_lock);
+                hashdb_cache_refill(hp, cp);
+                pthread_mutex_unlock(&hp->hd_alloc_lock);
+        }
+
+        node = 0;
+        if (cp->hc_nr) {
+                node = cp->hc_nodes[--cp->hc_nr];
+                ++cp->hc_live;
+        }
+        pthread_mutex_unlock(&cp->hc_lock);
+        return node;
+}
+
+static void
+hashdb_node_free(struct hashdb *hp, hashdb_size_t node)
+{
+        struct hashdb_cache *cp = NULL;
+        hashdb_size_t nr;
+
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT)) {
+                /* repair finds node again if free list cannot be had */
+                if (hashdb_lock_alloc(hp))
+                        return;
+                HASHDB_EVICT_DROP(hp, node);
+                hashdb_free_push(hp, node);
+                --hp->hd_hdr->hh_nr_live;
+                hashdb_unlock_alloc(hp);
+                return;
+        }
+
+        /* lock-free readers may still be on node, so it has to wait */
+        cp = hashdb_cache(hp);
+        pthread_mutex_lock(&cp->hc_lock);
+        while (cp->hc_nr_retired == HASHDB_CACHE_SIZE) {
+                hashdb_epoch_advance(hp);
+                if (!hashdb_reclaim(hp, cp, false))
+                        sched_yield();
+        }
+
+        /* node was unlinked before the epoch it is tagged with is read */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        nr = cp->hc_nr_retired++;
+        cp->hc_retired[nr] = node;
+        cp->hc_retired_epoch[nr] = __atomic_load_n(&hp->hd_epoch,
+                                                   __ATOMIC_SEQ_CST);
+        --cp->hc_live;
+        pthread_mutex_unlock(&cp->hc_lock);
+}
+
+static void
+hashdb_cache_drain(struct hashdb *hp, bool all)
+{
+        struct hashdb_cache *cp = NULL;
+        hashdb_size_t i;
+
+        /* read-only mapping has nothing cached and can not be written */
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT) ||
+            (hp->hd_flags & HASHDB_FLAG_RDONLY))
+                return;
+
+        /* give removed nodes a chance to become reusable */
+        if (!all) {
+                hashdb_epoch_advance(hp);
+                hashdb_epoch_advance(hp);
+        }
+
+        for (i = 0; i < HASHDB_NR_CACHES; ++i) {
+                cp = &hp->hd_caches[i];
+                pthread_mutex_lock(&cp->hc_lock);
+                hashdb_reclaim(hp, cp, all);
+                pthread_mutex_lock(&hp->hd_alloc_lock);
+                hashdb_cache_flush(hp, cp, HASHDB_CACHE_SIZE);
+                pthread_mutex_unlock(&hp->hd_alloc_lock);
+                pthread_mutex_unlock(&cp->hc_lock);
+        }
+}
+
+static void
+hashdb_seq_lock(struct hashdb *hp)
+{
+        hashdb_size_t *seqp = &hp->hd_seq;
+
+        /* other processes read the one in the file */
+        if (hp->hd_flags & HASHDB_FLAG_SHARED)
+                seqp = &hp->hd_hdr->hh_seq;
+        __atomic_store_n(seqp, *seqp + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+hashdb_seq_unlock(struct hashdb *hp)
+{
+        hashdb_size_t *seqp = &hp->hd_seq;
+
+        if (hp->hd_flags & HASHDB_FLAG_SHARED)
+                seqp = &hp->hd_hdr->hh_seq;
+        __atomic_store_n(seqp, *seqp + 1, __ATOMIC_RELEASE);
+}
+
+/* check sanity of hashdb */
+static int hashdb_sanity(struct hashdb *hp);
+
+/* check sanity of hashdb (resize lock held) */
+static int hashdb_sanity_locked(const struct hashdb *hp);
+
+/* fail with EINVAL unless pairs are of variable size exactly if var */
+static int hashdb_check_var(struct hashdb *hp, bool var);
+
+/* fail with EROFS if hashdb is read-only, EBUSY if cursors are open */
+static int hashdb_check_write(struct hashdb *hp);
+
+int
+hashdb_free(struct hashdb **hpp, bool fully)
+{
+        struct hashdb *hp = NULL;
+
+        if (hpp == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+        hp = *hpp;
+
+        if (hashdb_sanity(hp))
+                return -1;
+
+        /* cached free nodes go back on the free list in the file */
+        hashdb_cache_drain(hp, true);
+        hashdb_prewarm_stop(hp);
+
+        /* read-only opens can not finish moving hash table */
+        if (!(hp->hd_flags & HASHDB_FLAG_RDONLY) &&
+            hp->hd_hdr->hh_move_left) {
+                if (hashdb_lock_resize(hp, true))
+                        return -1;
+                hashdb_move_finish(hp);
+                hashdb_unlock_resize(hp);
+        }
+
+        /*
+         * clean shutdown leaves log empty and says so. other processes
+         * may still change a shared file, so it is never marked clean
+         */
+        if (hp->hd_wal && hashdb_checkpoint(hp, true))
+                return -1;
+        if (hp->hd_wal && !fully &&
+            !(hp->hd_flags & HASHDB_FLAG_SHARED) &&
+            hashdb_wal_save_clean(hp))
+                return -1;
+        if (hp->hd_wal && hashdb_wal_close(hp, fully))
+                return -1;
+        hashdb_conc_free(hp);
+        hashdb_evict_free(hp);
+
+        if (hashdb_unmap(hp))
+                return -1;
+
+        if (hp->hd_fd >= 0 && close(hp->hd_fd))
+                return -1;
+
+        if (hp->hd_fd >= 0 && fully && unlink(hp->hd_path))
+                return -1;
+
+        hashdb_stats_free(hp);
+        hashdb_trace_free(hp);
+        free(hp->hd_path);
+        free(hp);
+        *hpp = NULL;
+        return 0;
+}
+
+static int
+hashdb_sanity(struct hashdb *hp)
+{
+        int ret;
+
+        errno = EINVAL;
+        if (!hp)
+                return -1;
+        if (!(hp->hd_flags & HASHDB_FLAG_SANE_MODE)) {
+                errno = 0;
+                return 0;
+        }
+
+        /* another process may resize table while it is looked at */
+        do {
+                if (hashdb_lock_resize(hp, false))
+                        return -1;
+                ret = hashdb_sanity_locked(hp);
+                hashdb_unlock_resize(hp);
+        } while (ret && (hp->hd_flags & HASHDB_FLAG_SHARED) &&
+                 __atomic_load_n(&hp->hd_hdr->hh_seq, __ATOMIC_ACQUIRE) !=
+                 hp->hd_lock_seq);
+        return ret;
+}
+
+static int
+hashdb_check_var(struct hashdb *hp, bool var)
+{
+        if ((hp->hd_hdr->hh_format == HASHDB_FORMAT_VAR) != var) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        return 0;
+}
+
+static int
+hashdb_check_write(struct hashdb *hp)
+{
+        uint64_t flags;
+
+        /* other processes find a published file marked in its header */
+        flags = __atomic_load_n(&hp->hd_flags, __ATOMIC_ACQUIRE) |
+                __atomic_load_n(&hp->hd_hdr->hh_flags, __ATOMIC_ACQUIRE);
+        if (flags & HASHDB_FLAG_RDONLY) {
+                errno = EROFS;
+                return -1;
+        }
+        if (__atomic_load_n(&hp->hd_nr_cursors, __ATOMIC_ACQUIRE)) {
+                errno = EBUSY;
+                return -1;
+        }
+
+        return 0;
+}
+
+static int
+hashdb_lock_write(struct hashdb *hp, bool excl)
+{
+        int saved_errno;
+
+        if (hashdb_lock_resize(hp, excl))
+                return -1;
+
+        /*
+         * hashdb_publish() and hashdb_cursor_open() may have run since
+         * the unlocked check, and they take the lock exclusively
+         */
+        if (hashdb_check_write(hp)) {
+                saved_errno = errno;
+                hashdb_unlock_resize(hp);
+                errno = saved_errno;
+                return -1;
+        }
+
+        return 0;
+}
+
+static int
+hashdb_sanity_locked(const struct hashdb *hp)
+{
+        const struct hashdb_header *hdr = NULL;
+        const unsigned char *p = NULL;
+
+        errno = EINVAL;
+        if (!hp->hd_path)
+                return -1;
+        if (hp->hd_fd < 0)
+                return -1;
+        if (!hp->hd_node_size)
+                return -1;
+        if (hp->hd_key_off >= hp->hd_node_size)
+                return -1;
+        if (!hp->hd_file_size)
+                return -1;
+        if (!hp->hd_data)
+                return -1;
+        if (!hp->hd_node_tab)
+                return -1;
+        if (!hp->hd_actual)
+                return -1;
+        if (!hp->hd_hash_tab)
+                return -1;
+        if (!hp->hd_hashfn)
+                return -1;
+        if (!hp->hd_cmpfn)
+                return -1;
+
+        hdr = hp->hd_hdr;
+        p = hp->hd_data;
+        switch (hdr->hh_format) {
+        case HASHDB_FORMAT_CHAIN:
+        case HASHDB_FORMAT_VAR:
+                if (hp->hd_actual != p + sizeof(*hdr))
+                        return -1;
+
+                if (hp->hd_node_tab != p + sizeof(*hdr) + hp->hd_node_size)
+                        return -1;
+
+                p = hp->hd_node_tab + (hp->hd_node_size * hdr->hh_nr_nodes);
+                if (hp->hd_hash_tab != p)
+                        return -1;
+                if ((hdr->hh_nr_nodes + 1) & HASHDB_BLOCK_MASK(hp))
+                        return -1;
+                if (!hdr->hh_bump)
+                        return -1;
+                if (__atomic_load_n(&hdr->hh_bump, __ATOMIC_RELAXED) >
+                    hdr->hh_nr_nodes + 1)
+                        return -1;
+                break;
+        case HASHDB_FORMAT_SWISS:
+        case HASHDB_FORMAT_CUCKOO:
+                if (hp->hd_hash_tab != p + sizeof(*hdr))
+                        return -1;
+                if (hp->hd_node_tab != hp->hd_hash_tab + hdr->hh_nr_nodes)
+                        return -1;
+                if (hdr->hh_nr_nodes % HASHDB_SWISS_GROUP)
+                        return -1;
+                if (hdr->hh_nr_live + hdr->hh_nr_tomb > hdr->hh_nr_nodes)
+                        return -1;
+                break;
+        default:
+                return -1;
+        }
+
+        if (!hdr->hh_nr_nodes)
+                return -1;
+        if (!hdr->hh_nr_buckets)
+                return -1;
+        if (!hdr->hh_key_size)
+                return -1;
+        if (!hdr->hh_value_size)
+                return -1;
+        if (hdr->hh_nr_buckets > hdr->hh_bucket_cap)
+                return -1;
+        if (hdr->hh_split >= hdr->hh_base_buckets)
+                return -1;
+        if (hdr->hh_nr_buckets != hdr->hh_base_buckets + hdr->hh_split)
+                return -1;
+        if (__atomic_load_n(&hdr->hh_nr_live, __ATOMIC_RELAXED) >
+            hdr->hh_nr_nodes)
+                return -1;
+
+        errno = 0;
+        return 0;
+}
+
+struct hashdb *
+hashdb_open(const char *path,
+            uint64_t flags,
+            hashdb_hashfn_t hashfn,
+            hashdb_cmpfn_t cmpfn)
+{
+        struct hashdb_header *hdr = NULL;
+        struct hashdb *hp = NULL;
+        struct stat stats;
+        hashdb_size_t next;
+        int saved_errno;
+
+        errno = 0;
+        if (!path)
+                goto ret;
+        if (!*path)
+                goto ret;
+        errno = EINVAL;
+        if ((flags & HASHDB_FLAG_SHARED) && (flags & HASHDB_FLAG_CONCURRENT))
+                goto ret;
+        if ((flags & HASHDB_FLAG_RDONLY) && (flags & (HASHDB_FLAG_CONCURRENT |
+                                                     HASHDB_FLAG_SHARED |
+                                                     HASHDB_FLAG_WAL)))
+                goto ret;
+        if ((flags & HASHDB_FLAG_EVICT) && (flags & (HASHDB_FLAG_GROW |
+                                                    HASHDB_FLAG_CONCURRENT |
+                                                    HASHDB_FLAG_SHARED |
+                                                    HASHDB_FLAG_RDONLY)))
+                goto ret;
+        errno = 0;
+
+        hp = malloc(sizeof(*hp));
+        if (!hp)
+                goto ret;
+        hp->hd_flags = flags;
+        hp->hd_lock_depth = 0;
+        hp->hd_lock_excl = false;
+        hp->hd_lock_seq = 0;
+        hp->hd_nr_cursors = 0;
+        hp->hd_wal = NULL;
+        hp->hd_prewarm = NULL;
+        hp->hd_latency = NULL;
+        hp->hd_clock = NULL;
+        if (hashdb_stats_init(hp) || hashdb_trace_init(hp))
+                goto free_hp;
+
+        hp->hd_path = strdup(path);
+        if (!hp->hd_path)
+                goto free_hp;
+
+        hp->hd_fd = open(path,
+                         (flags & HASHDB_FLAG_RDONLY) ? O_RDONLY : O_RDWR);
+        if (hp->hd_fd < 0)
+                goto free_hd_path;
+
+        if (fstat(hp->hd_fd, &stats))
+                goto close_fd;
+
+        hp->hd_file_size = stats.st_size;
+        if (hashdb_map(hp))
+                goto close_fd;
+        hdr = hp->hd_hdr;
+
+        errno = EINVAL;
+        if (hp->hd_file_size < sizeof(*hdr))
+                goto unmap;
+        if (hdr->hh_magic != HASHDB_MAGIC)
+                goto unmap;
+        if (hdr->hh_version != HASHDB_VERSION)
+                goto unmap;
+
+        if (hdr->hh_format != HASHDB_FORMAT_CHAIN &&
+            hdr->hh_format != HASHDB_FORMAT_SWISS &&
+            hdr->hh_format != HASHDB_FORMAT_VAR &&
+            hdr->hh_format != HASHDB_FORMAT_CUCKOO)
+                goto unmap;
+        if (hdr->hh_format == HASHDB_FORMAT_VAR && (flags & HASHDB_FLAG_WAL))
+                goto unmap;
+        if (hdr->hh_format != HASHDB_FORMAT_CHAIN &&
+            (flags & HASHDB_FLAG_EVICT))
+                goto unmap;
+        if ((hdr->hh_flags & HASHDB_FLAG_SOA) &&
+            (hdr->hh_format != HASHDB_FORMAT_CHAIN ||
+             (hdr->hh_nr_nodes + 1) % HASHDB_SOA_BLOCK))
+                goto unmap;
+        if ((hdr->hh_flags & HASHDB_FLAG_INDEX32) &&
+            (hdr->hh_format != HASHDB_FORMAT_CHAIN ||
+             hdr->hh_nr_nodes > UINT32_MAX))
+                goto unmap;
+        /* nothing can finish growth or shrinking left part way */
+        if ((flags & HASHDB_FLAG_RDONLY) && hdr->hh_move_from)
+                goto unmap;
+        errno = 0;
+
+        hp->hd_link_size = sizeof(next);
+        if (hdr->hh_flags & HASHDB_FLAG_INDEX32)
+                hp->hd_link_size = sizeof(uint32_t);
+        hp->hd_key_off = hp->hd_link_size;
+        if (hdr->hh_flags & HASHDB_FLAG_HASH)
+                hp->hd_key_off = sizeof(next) + sizeof(hashdb_size_t);
+        if (hdr->hh_format == HASHDB_FORMAT_VAR)
+                hp->hd_key_off += sizeof(struct hashdb_var);
+        if (hashdb_slotted(hdr))
+                hp->hd_key_off = 0;
+        hp->hd_node_size = hp->hd_key_off + hdr->hh_key_size +
+                hdr->hh_value_size;
+        hp->hd_head_size = hp->hd_key_off + hdr->hh_key_size;
+        hp->hd_block_shift = 0;
+        if (hdr->hh_flags & HASHDB_FLAG_SOA)
+                hp->hd_block_shift = HASHDB_SOA_SHIFT;
+        hashdb_set_ptrs(hp);
+
+        /* keys hashed differently would not be found */
+        errno = EINVAL;
+        hp->hd_hashfn = hashfn;
+        if (!hp->hd_hashfn)
+                hp->hd_hashfn = hashdb_hash_fn(hdr->hh_hash);
+        if (!hp->hd_hashfn || hashdb_hash_id(hp->hd_hashfn) != hdr->hh_hash)
+                goto unmap;
+        errno = 0;
+
+        hp->hd_cmpfn = cmpfn;
+        if (!hp->hd_cmpfn)
+                hp->hd_cmpfn = memcmp;
+
+        /* a published file must not change under its readers */
+        errno = EROFS;
+        if ((hdr->hh_flags & HASHDB_FLAG_RDONLY) && (flags & HASHDB_FLAG_WAL))
+                goto unmap;
+        errno = 0;
+
+        /* format flags come from the file (and so does being published) */
+        hp->hd_flags = (flags & ~HASHDB_FLAGS_FORMAT) | hdr->hh_flags;
+        if (hashdb_conc_init(hp))
+                goto unmap;
+        if ((flags & HASHDB_FLAG_WAL) &&
+            hashdb_wal_open(hp, stats.st_mode & 0777, false))
+                goto conc_free;
+        if ((flags & HASHDB_FLAG_WAL) && hashdb_recover(hp))
+                goto wal_close;
+        /*
+         * changes made without a log are not in the last list of nodes,
+         * and a crash while they are made leaves the file unclean
+         */
+        if (!(flags & (HASHDB_FLAG_WAL | HASHDB_FLAG_RDONLY)) &&
+            (hashdb_wal_drop_live(hp) || hashdb_wal_drop_clean(hp)))
+                goto conc_free;
+        /*
+         * a rebuild of slots cut short is redone. with HASHDB_FLAG_SHARED
+         * another process may still be in it, so taking all locks does it
+         */
+        if (!(flags & (HASHDB_FLAG_WAL | HASHDB_FLAG_RDONLY |
+                       HASHDB_FLAG_SHARED)) &&
+            hashdb_slots_restore(hp))
+                goto conc_free;
+        /* chains are only whole once log is redone */
+        if (hashdb_evict_init(hp))
+                goto wal_close;
+
+        /* started last, so no error path above has to stop it */
+        if (hashdb_prewarm_start(hp))
+                goto evict_free;
+        goto ret;
+
+evict_free:
+        hashdb_evict_free(hp);
+wal_close:
+        saved_errno = errno;
+        if (hp->hd_wal)
+                hashdb_wal_close(hp, false);
+        errno = saved_errno;
+conc_free:
+        hashdb_conc_free(hp);
+unmap:
+        saved_errno = errno;
+        hashdb_unmap(hp);
+        errno = saved_errno;
+close_fd:
+        saved_errno = errno;
+        close(hp->hd_fd);
+        hp->hd_fd = -1;
+        errno = saved_errno;
+free_hd_path:
+        free(hp->hd_path);
+        hp->hd_path = NULL;
+free_hp:
+        hashdb_stats_free(hp);
+        hashdb_trace_free(hp);
+        free(hp);
+        hp = NULL;
+ret:
+        return hp;
+}
+
+int
+hashdb_dump(struct hashdb *hp, FILE *fp)
+{
+        struct hashdb_header *hdr = NULL;
+        hashdb_size_t freelistlen;
+
+        if (hashdb_sanity(hp))
+                return -1;
+
+        if (hashdb_lock_resize(hp, true))
+                return -1;
+        hdr = hp->hd_hdr;
+        fprintf(fp, "nr_nodes:    %zu\n", (size_t)hdr->hh_nr_nodes);
+        fprintf(fp, "nr_buckets:  %zu\n", (size_t)hdr->hh_nr_buckets);
+        fprintf(fp, "key_size:    %zu\n", (size_t)hdr->hh_key_size);
+        fprintf(fp, "value_size:  %zu\n", (size_t)hdr->hh_value_size);
+        fprintf(fp, "free:        %zu\n", (size_t)hdr->hh_free);
+        fprintf(fp, "bump:        %zu\n", (size_t)hdr->hh_bump);
+        fprintf(fp, "nr_live:     %zu\n", (size_t)hdr->hh_nr_live);
+        fprintf(fp, "bucket_cap:  %zu\n", (size_t)hdr->hh_bucket_cap);
+        fprintf(fp, "split:       %zu\n", (size_t)hdr->hh_split);
+        fprintf(fp, "base:        %zu\n", (size_t)hdr->hh_base_buckets);
+        fprintf(fp, "max_load:    %zu\n", (size_t)hdr->hh_max_load);
+        fprintf(fp, "flags:       %zu\n", (size_t)hdr->hh_flags);
+        fprintf(fp, "format:      %zu\n", (size_t)hdr->hh_format);
+        fprintf(fp, "hash:        %zu\n", (size_t)hdr->hh_hash);
+        if (hashdb_slotted(hdr)) {
+                if (hdr->hh_format == HASHDB_FORMAT_SWISS)
+                        fprintf(fp, "nr_tomb:     %zu\n",
+                                (size_t)hdr->hh_nr_tomb);
+                hashdb_unlock_resize(hp);
+                return 0;
+        }
+
+        /* nodes past hh_bump were never used, but are free all the same */
+        freelistlen = hdr->hh_nr_free + (hdr->hh_nr_nodes + 1 - hdr->hh_bump);
+        hashdb_unlock_resize(hp);
+        fprintf(fp, "freelistlen: %zu\n", (size_t)freelistlen);
+        return 0;
+}
+
+/* hashdb_set() with hash of key already computed */
+static void *hashdb_set_hash(struct hashdb *hp,
+                             void *key,
+                             void *value,
+                             hashdb_size_t hash);
+
+/* hashdb_get() with hash of key already computed */
+static void *hashdb_get_hash(struct hashdb *hp, void *key, hashdb_size_t hash);
+
+/* hashdb_rm() with hash of key already computed */
+static int hashdb_rm_hash(struct hashdb *hp, void *key, hashdb_size_t hash);
+
+/* hashdb_set() of format with slots (resize lock held) */
+static void *hashdb_slot_set(struct hashdb *hp, void *key, void *value);
+
+/* hashdb_get() of format with slots (resize lock held) */
+static void *hashdb_slot_get(struct hashdb *hp, void *key);
+
+/* hashdb_rm() of format with slots (resize lock held) */
+static int hashdb_slot_rm(struct hashdb *hp, void *key);
+
+/* lock-free lookup, copying value out if value is not NULL */
+static void *hashdb_get_rcu(struct hashdb *hp,
+                            void *key,
+                            hashdb_size_t hash,
+                            void *value);
+
+/* overwrite value of pair so lock-free readers never copy half of it */
+static void hashdb_value_store(struct hashdb *hp,
+                               hashdb_size_t bucket,
+                               void *valp,
+                               const void *value);
+
+/* copy value of pair written by hashdb_value_store() */
+static void hashdb_value_load(struct hashdb *hp,
+                              hashdb_size_t bucket,
+                              void *value,
+                              const void *valp);
+
+/* write value into pair a word (hd_link_size bytes) at a time */
+static void hashdb_words_store(struct hashdb *hp,
+                               void *valp,
+                               const void *value);
+
+/* read value out of pair a word (hd_link_size bytes) at a time */
+static void hashdb_words_load(struct hashdb *hp,
+                              void *value,
+                              const void *valp);
+
+/* split next bucket if load factor is over max */
+static int hashdb_split(struct hashdb *hp);
+
+/* is load factor over max? */
+static bool hashdb_need_split(struct hashdb *hp);
+
+/* make sure free list is not empty, growing node table if needed */
+static int hashdb_make_room(struct hashdb *hp);
+
+/* hashdb_make_room() with resize lock held exclusively */
+static int hashdb_make_room_locked(struct hashdb *hp);
+
+int
+hashdb_set_max_load(struct hashdb *hp, hashdb_size_t max_load)
+{
+        if (hashdb_sanity(hp) || hashdb_check_write(hp))
+                return -1;
+
+        if (hashdb_slotted(hp->hd_hdr)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (hashdb_lock_write(hp, true))
+                return -1;
+        hp->hd_hdr->hh_max_load = max_load;
+        hashdb_unlock_resize(hp);
+        return 0;
+}
+
+int
+hashdb_set_durability(struct hashdb *hp, int durability)
+{
+        struct hashdb_wal *wp = NULL;
+
+        if (hashdb_sanity(hp))
+                return -1;
+
+        wp = hp->hd_wal;
+        if (!wp ||
+            durability < HASHDB_DURABLE_NONE ||
+            durability > HASHDB_DURABLE_OP) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        /* read without lock after each change */
+        pthread_mutex_lock(&wp->hw_lock);
+        __atomic_store_n(&wp->hw_durability, durability, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&wp->hw_lock);
+        return 0;
+}
+
+int
+hashdb_commit(struct hashdb *hp)
+{
+        if (hashdb_sanity(hp))
+                return -1;
+
+        if (!hp->hd_wal) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (hashdb_wal_commit(hp))
+                return -1;
+
+        return hashdb_checkpoint(hp, false);
+}
+
+static int
+hashdb_checkpoint(struct hashdb *hp, bool force)
+{
+        int ret = 0;
+
+        if (!force && !hashdb_wal_full(hp))
+                return 0;
+
+        if (hashdb_lock_resize(hp, true))
+                return -1;
+
+        /* another thread may have done it while we waited */
+        if (force || hashdb_wal_full(hp))
+                ret = hashdb_checkpoint_locked(hp);
+
+        hashdb_unlock_resize(hp);
+        return ret;
+}
+
+static int
+hashdb_checkpoint_locked(struct hashdb *hp)
+{
+        /* log can only start over once database file is on disk */
+        if (msync(hp->hd_data, hp->hd_file_size, MS_SYNC))
+                return -1;
+        if (hashdb_save_live(hp))
+                return -1;
+
+        return hashdb_wal_reset(hp);
+}
+
+static int
+hashdb_save_live(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *live = NULL;
+        hashdb_size_t size;
+        hashdb_size_t curr;
+        hashdb_size_t b;
+        void *link = NULL;
+        int ret;
+
+        /* slots are where they are, there are no links to go wrong */
+        if (hashdb_slotted(hdr))
+                return 0;
+
+        size = (hdr->hh_nr_nodes / 8) + 1;
+        live = calloc(size, 1);
+        if (!live)
+                return -1;
+
+        for (b = 0; b < hdr->hh_nr_buckets; ++b) {
+                link = hashdb_bucket_link(hp, b);
+                while ((curr = hashdb_link_get(hp, link))) {
+                        live[curr / 8] |= 1 << (curr % 8);
+                        link = HASHDB_NODE(hp, curr);
+                }
+        }
+
+        ret = hashdb_wal_save_live(hp, live, size);
+        free(live);
+        return ret;
+}
+
+static int
+hashdb_recover(struct hashdb *hp)
+{
+        unsigned char *live = NULL;
+        hashdb_size_t size;
+        int ret = -1;
+
+        /* other processes must not change table while it is redone */
+        if ((hp->hd_flags & HASHDB_FLAG_SHARED) &&
+            hashdb_lock_resize(hp, true))
+                return -1;
+
+        /*
+         * the last checkpoint synced the whole file and emptied the
+         * log. the mark goes before anything can change the file again
+         */
+        if (hashdb_wal_has_clean(hp)) {
+                ret = hashdb_wal_drop_clean(hp);
+                goto unlock;
+        }
+
+        /*
+         * the kernel may have written back a link without the node it
+         * points to, even if the log is empty, so chains are rebuilt
+         * from the nodes in them at the last checkpoint. without that
+         * list (slotted, or never checkpointed) links are all there is
+         */
+        if (!hashdb_slotted(hp->hd_hdr)) {
+                live = hashdb_wal_load_live(hp, &size);
+                if (!live && errno != ENOENT)
+                        goto unlock;
+        }
+
+        /* replayed changes bump their stripes, repair has to bump this */
+        hashdb_seq_lock(hp);
+        if (live)
+                ret = hashdb_rebuild(hp, live, size);
+        else
+                ret = hashdb_repair(hp);
+        hashdb_seq_unlock(hp);
+        free(live);
+        if (!ret)
+                ret = hashdb_wal_replay(hp);
+        if (!ret)
+                ret = hashdb_checkpoint(hp, true);
+
+unlock:
+        if (hp->hd_flags & HASHDB_FLAG_SHARED)
+                hashdb_unlock_resize(hp);
+        return ret;
+}
+
+static int
+hashdb_wal_done(struct hashdb *hp)
+{
+        struct hashdb_wal *wp = hp->hd_wal;
+
+        if (!wp)
+                return 0;
+
+        if (__atomic_load_n(&wp->hw_durability, __ATOMIC_RELAXED) ==
+            HASHDB_DURABLE_OP && hashdb_wal_commit(hp))
+                return -1;
+
+        return hashdb_checkpoint(hp, false);
+}
+
+void *
+hashdb_set(struct hashdb *hp, void *key, void *value)
+{
+        hashdb_size_t start;
+        void *keyp = NULL;
+        bool logged;
+
+        if (hashdb_sanity(hp) ||
+            hashdb_check_write(hp) ||
+            hashdb_check_var(hp, false))
+                return NULL;
+
+        start = HASHDB_TRACE_BEGIN(hp);
+        if (hashdb_slotted(hp->hd_hdr)) {
+                if (hashdb_lock_write(hp, true))
+                        goto out;
+                /* overwrite is logged first so a torn one can be redone */
+                logged = hp->hd_wal && hashdb_slot_get(hp, key);
+                if (logged)
+                        hashdb_wal_append(hp, HASHDB_WAL_SET, key, value);
+                keyp = hashdb_slot_set(hp, key, value);
+                if (keyp && hp->hd_wal && !logged)
+                        hashdb_wal_append(hp, HASHDB_WAL_SET, key, value);
+                hashdb_unlock_resize(hp);
+        } else {
+                keyp = hashdb_set_hash(hp, key, value,
+                                hp->hd_hashfn(key, hp->hd_hdr->hh_key_size));
+        }
+
+        if (keyp && hashdb_wal_done(hp))
+                keyp = NULL;
+out:
+        HASHDB_TRACE_END(hp, HASHDB_OP_SET, start);
+        return keyp;
+}
+
+static void *
+hashdb_slot_set(struct hashdb *hp, void *key, void *value)
+{
+        if (hp->hd_hdr->hh_format == HASHDB_FORMAT_SWISS)
+                return hashdb_swiss_set(hp, key, value);
+        return hashdb_cuckoo_set(hp, key, value);
+}
+
+static void *
+hashdb_slot_get(struct hashdb *hp, void *key)
+{
+        if (hp->hd_hdr->hh_format == HASHDB_FORMAT_SWISS)
+                return hashdb_swiss_get(hp, key);
+        return hashdb_cuckoo_get(hp, key);
+}
+
+static int
+hashdb_slot_rm(struct hashdb *hp, void *key)
+{
+        if (hp->hd_hdr->hh_format == HASHDB_FORMAT_SWISS)
+                return hashdb_swiss_rm(hp, key);
+        return hashdb_cuckoo_rm(hp, key);
+}
+
+static void *
+hashdb_set_hash(struct hashdb *hp,
+                void *key,
+                void *value,
+                hashdb_size_t hash)
+{
+        struct hashdb_header *hdr = NULL;
+        unsigned char *p = NULL;
+        void *bp = NULL;
+        hashdb_size_t probes;
+        hashdb_size_t bucket;
+        hashdb_size_t curr;
+        hashdb_size_t save;
+        hashdb_size_t free;
+        hashdb_size_t next;
+        void *keyp = NULL;
+        void *valp = NULL;
+
+retry:
+        if (hashdb_lock_write(hp, false))
+                return NULL;
+
+        /* growing may have moved the mapping */
+        hdr = hp->hd_hdr;
+        bucket = hashdb_bucket(hdr, hash);
+        if (hashdb_lock_bucket(hp, bucket, true)) {
+                hashdb_unlock_resize(hp);
+                if (errno == EAGAIN)
+                        goto retry;
+                return NULL;
+        }
+        bp = hashdb_bucket_link(hp, bucket);
+        curr = hashdb_link_load(hp, bp);
+        save = curr;
+
+        probes = 0;
+        while (curr) {
+                ++probes;
+                p = HASHDB_NODE(hp, curr);
+                next = hashdb_link_get(hp, p);
+                keyp = p + hp->hd_key_off;
+                if ((hp->hd_flags & HASHDB_FLAG_HASH) &&
+                    HASHDB_NODE_HASH(p) != hash) {
+                        curr = next;
+                        continue;
+                }
+                if (!hp->hd_cmpfn(key, keyp, hdr->hh_key_size)) {
+                        /* logged first so a torn overwrite can be redone */
+                        if (hp->hd_wal) {
+                                hashdb_wal_append(hp, HASHDB_WAL_SET,
+                                                  key, value);
+                        }
+                        valp = HASHDB_VALUE(hp, curr);
+                        hashdb_value_store(hp, bucket, valp, value);
+                        HASHDB_EVICT_TOUCH(hp, curr);
+                        HASHDB_STATS_COUNT(hp, HASHDB_STATS_SET, true,
+                                           probes);
+                        HASHDB_TRACE_PROBE(set, bucket, probes, true);
+                        goto unlock;
+                }
+
+                curr = next;
+        }
+
+        free = hashdb_node_alloc(hp);
+        if (!free && hp->hd_clock && !hashdb_evict(hp)) {
+                /* victim may have been head of this chain */
+                save = hashdb_link_load(hp, bp);
+                free = hashdb_node_alloc(hp);
+        }
+        if (!free) {
+                hashdb_unlock_bucket(hp, bucket);
+                hashdb_unlock_resize(hp);
+                /* free list is repaired first if a process died using it */
+                if (__atomic_load_n(&hdr->hh_dirty, __ATOMIC_ACQUIRE))
+                        goto retry;
+                /* other threads may be holding free nodes in caches */
+                if (!(hp->hd_flags & (HASHDB_FLAG_GROW |
+                                      HASHDB_FLAG_CONCURRENT)) &&
+                    !__atomic_load_n(&hdr->hh_move_left, __ATOMIC_RELAXED)) {
+                        errno = ENOMEM;
+                        return NULL;
+                }
+                if (hashdb_make_room(hp))
+                        return NULL;
+                goto retry;
+        }
+
+        p = HASHDB_NODE(hp, free);
+        keyp = p + hp->hd_key_off;
+        valp = HASHDB_VALUE(hp, free);
+
+        memcpy(keyp, key, hdr->hh_key_size);
+        memcpy(valp, value, hdr->hh_value_size);
+        if (hp->hd_flags & HASHDB_FLAG_HASH)
+                HASHDB_NODE_HASH(p) = hash;
+        hashdb_link_set(hp, p, save);
+
+        /* node is filled in before readers can find it */
+        hashdb_link_store(hp, bp, free);
+        HASHDB_EVICT_TOUCH(hp, free);
+        if (hp->hd_wal)
+                hashdb_wal_append(hp, HASHDB_WAL_SET, key, value);
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_SET, false, probes);
+        HASHDB_TRACE_PROBE(set, bucket, probes, false);
+        hashdb_unlock_bucket(hp, bucket);
+        hashdb_unlock_resize(hp);
+
+        /*
+         * insert already happened, so a failed split is not an error.
+         * growth is paid off a chunk of hash table per insert
+         */
+        if ((hashdb_need_split(hp) ||
+             __atomic_load_n(&hdr->hh_move_left, __ATOMIC_RELAXED)) &&
+            !hashdb_lock_write(hp, true)) {
+                hashdb_move_step(hp);
+                if (hashdb_split(hp))
+                        errno = 0;
+
+                /* split may have moved the mapping */
+                p = HASHDB_NODE(hp, free);
+                keyp = p + hp->hd_key_off;
+                hashdb_unlock_resize(hp);
+        }
+        errno = 0;
+        return keyp;
+
+unlock:
+        hashdb_unlock_bucket(hp, bucket);
+        hashdb_unlock_resize(hp);
+        return keyp;
+}
+
+int
+hashdb_grow(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t hash_tab_size;
+        hashdb_size_t old_nr_nodes;
+        hashdb_size_t nr_nodes;
+        hashdb_size_t file_size;
+        hashdb_size_t old_size;
+
+        /* nodes added last time have to be clear of the hash table */
+        hashdb_move_finish(hp);
+
+        /*
+         * double node table so growth is amortized over inserts, and
+         * add at least enough nodes for the hash table to move past
+         * them without ever overwriting itself
+         */
+        hash_tab_size = hp->hd_link_size * hdr->hh_bucket_cap;
+        old_nr_nodes = hdr->hh_nr_nodes;
+        nr_nodes = old_nr_nodes;
+        if (nr_nodes < HASHDB_GROW_MIN)
+                nr_nodes = HASHDB_GROW_MIN;
+        if (nr_nodes < (hash_tab_size / hp->hd_node_size) + 1)
+                nr_nodes = (hash_tab_size / hp->hd_node_size) + 1;
+        nr_nodes += old_nr_nodes;
+        if (hp->hd_block_shift)
+                nr_nodes = HASHDB_SOA_ROUND(nr_nodes);
+
+        /* UINT32_MAX is one less than a whole number of blocks */
+        if (hp->hd_link_size == sizeof(uint32_t) && nr_nodes > UINT32_MAX)
+                nr_nodes = UINT32_MAX;
+
+        old_size = hashdb_layout_size(hp);
+        file_size = old_size + (hp->hd_node_size * (nr_nodes - old_nr_nodes));
+        if (nr_nodes <= old_nr_nodes || file_size < old_size) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        if (ftruncate(hp->hd_fd, file_size))
+                return -1;
+
+        if (hashdb_remap(hp, file_size))
+                return -1;
+        hdr = hp->hd_hdr;
+
+        /*
+         * hash table follows node table, so it has to move past the new
+         * nodes. inserts move a chunk each (see hashdb_move_step()), and
+         * new nodes are past hh_bump, so they need no free list
+         */
+        hashdb_seq_lock(hp);
+        __atomic_store_n(&hdr->hh_move_from, old_nr_nodes, __ATOMIC_RELEASE);
+        __atomic_store_n(&hdr->hh_move_left, hdr->hh_bucket_cap,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&hdr->hh_nr_nodes, nr_nodes, __ATOMIC_RELEASE);
+        hashdb_set_ptrs(hp);
+
+        /* only if HASHDB_FLAG_INDEX32 kept node table from getting big */
+        if (hashdb_move_overlaps(hp))
+                hashdb_move_hash_tab(hp);
+        hashdb_seq_unlock(hp);
+        return 0;
+}
+
+static bool
+hashdb_need_split(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t nr_buckets;
+        hashdb_size_t nr_live;
+
+        if (!hdr->hh_max_load)
+                return false;
+
+        /* other threads may be changing these, but stale values are fine */
+        nr_live = __atomic_load_n(&hdr->hh_nr_live, __ATOMIC_RELAXED);
+        nr_buckets = __atomic_load_n(&hdr->hh_nr_buckets, __ATOMIC_RELAXED);
+        return nr_live * 100 > hdr->hh_max_load * nr_buckets;
+}
+
+static int
+hashdb_make_room(struct hashdb *hp)
+{
+        int ret = 0;
+
+        if (hashdb_lock_write(hp, true))
+                return -1;
+
+        /*
+         * other threads may be holding free nodes in their caches, and
+         * nodes they removed are reusable once no reader can be on them
+         */
+        hashdb_synchronize(hp);
+        hashdb_cache_drain(hp, true);
+        ret = hashdb_make_room_locked(hp);
+
+        hashdb_unlock_resize(hp);
+        return ret;
+}
+
+static int
+hashdb_make_room_locked(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+
+        if (hdr->hh_free || hdr->hh_bump < hashdb_bump_end(hp))
+                return 0;
+
+        if (!hdr->hh_move_left) {
+                if (!(hp->hd_flags & HASHDB_FLAG_GROW)) {
+                        errno = ENOMEM;
+                        return -1;
+                }
+                if (hashdb_grow(hp))
+                        return -1;
+                hdr = hp->hd_hdr;
+        }
+
+        /* nodes added are free once the hash table has moved off them */
+        while (hdr->hh_bump >= hashdb_bump_end(hp))
+                hashdb_move_step(hp);
+        return 0;
+}
+
+static int
+hashdb_split(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *p = NULL;
+        hashdb_size_t buckets[2];
+        void *tails[2];
+        void *bp = NULL;
+        hashdb_size_t bucket;
+        hashdb_size_t curr;
+        hashdb_size_t file_size;
+        hashdb_size_t cap;
+        void *keyp = NULL;
+
+        /* recheck, another thread may have split already */
+        if (!hashdb_need_split(hp))
+                return 0;
+
+        /* hash table can only grow once it is done moving */
+        if (hdr->hh_nr_buckets == hdr->hh_bucket_cap && hdr->hh_move_left)
+                return 0;
+
+        /* lock-free readers retry if they overlap with split */
+        hashdb_seq_lock(hp);
+
+        /* hash table is last in file so it can grow in place */
+        if (hdr->hh_nr_buckets == hdr->hh_bucket_cap) {
+                cap = hdr->hh_bucket_cap * 2;
+                file_size = hashdb_layout_size(hp);
+                file_size += hp->hd_link_size * hdr->hh_bucket_cap;
+                if (ftruncate(hp->hd_fd, file_size))
+                        goto fail;
+                if (hashdb_remap(hp, file_size))
+                        goto fail;
+
+                hdr = hp->hd_hdr;
+                hdr->hh_bucket_cap = cap;
+                hashdb_set_ptrs(hp);
+        }
+
+        /* rehash chain of split bucket into it and its new buddy */
+        buckets[0] = hdr->hh_split;
+        buckets[1] = hdr->hh_base_buckets + hdr->hh_split;
+        bp = hashdb_bucket_link(hp, buckets[0]);
+        curr = hashdb_link_load(hp, bp);
+        hashdb_link_store(hp, bp, 0);
+        tails[0] = bp;
+        tails[1] = hashdb_bucket_link(hp, buckets[1]);
+        hashdb_link_store(hp, tails[1], 0);
+
+        while (curr) {
+                p = HASHDB_NODE(hp, curr);
+                keyp = p + hp->hd_key_off;
+                if (hp->hd_flags & HASHDB_FLAG_HASH)
+                        bucket = HASHDB_NODE_HASH(p);
+                else
+                        bucket = hp->hd_hashfn(keyp, hdr->hh_key_size);
+                bucket %= hdr->hh_base_buckets * 2;
+                bucket = bucket != buckets[0];
+
+                hashdb_link_store(hp, tails[bucket], curr);
+                tails[bucket] = p;
+                curr = hashdb_link_get(hp, p);
+        }
+        hashdb_link_store(hp, tails[0], 0);
+        hashdb_link_store(hp, tails[1], 0);
+
+        /* read without resize lock by hashdb_need_split() and readers */
+        __atomic_store_n(&hdr->hh_nr_buckets,
+                         hdr->hh_nr_buckets + 1,
+                         __ATOMIC_RELAXED);
+        if (hdr->hh_split + 1 == hdr->hh_base_buckets) {
+                __atomic_store_n(&hdr->hh_base_buckets,
+                                 hdr->hh_base_buckets * 2,
+                                 __ATOMIC_RELAXED);
+                __atomic_store_n(&hdr->hh_split, 0, __ATOMIC_RELAXED);
+        } else {
+                __atomic_store_n(&hdr->hh_split,
+                                 hdr->hh_split + 1,
+                                 __ATOMIC_RELAXED);
+        }
+        hashdb_seq_unlock(hp);
+        return 0;
+
+fail:
+        hashdb_seq_unlock(hp);
+        return -1;
+}
+
+void *
+hashdb_get(struct hashdb *hp, void *key)
+{
+        hashdb_size_t start;
+        void *keyp = NULL;
+
+        if (hashdb_sanity(hp) || hashdb_check_var(hp, false))
+                return NULL;
+
+        start = HASHDB_TRACE_BEGIN(hp);
+        if (hashdb_slotted(hp->hd_hdr)) {
+                if (!hashdb_lock_resize(hp, true)) {
+                        keyp = hashdb_slot_get(hp, key);
+                        hashdb_unlock_resize(hp);
+                }
+        } else {
+                keyp = hashdb_get_hash(hp, key,
+                                hp->hd_hashfn(key, hp->hd_hdr->hh_key_size));
+        }
+
+        HASHDB_TRACE_END(hp, HASHDB_OP_GET, start);
+        return keyp;
+}
+
+void *
+hashdb_value(struct hashdb *hp, void *pair)
+{
+        hashdb_size_t block_size;
+        hashdb_size_t node;
+        hashdb_size_t off;
+
+        if (hp->hd_hdr->hh_format == HASHDB_FORMAT_VAR)
+                return HASHDB_VAR_VALUE(pair);
+        if (!hp->hd_block_shift)
+                return UCHAR_P(pair) + hp->hd_hdr->hh_key_size;
+
+        /* node is found from where its key is in its block */
+        off = UCHAR_P(pair) - hp->hd_key_off - hp->hd_actual;
+        block_size = hp->hd_node_size << hp->hd_block_shift;
+        node = ((off / block_size) << hp->hd_block_shift) +
+                ((off % block_size) / hp->hd_head_size);
+        return HASHDB_VALUE(hp, node);
+}
+
+const void *
+hashdb_get_const(struct hashdb *hp, const void *key)
+{
+        /* key is only ever read, hashdb_get() just does not say so */
+        return hashdb_get(hp, (void *)key);
+}
+
+static void *
+hashdb_get_hash(struct hashdb *hp, void *key, hashdb_size_t hash)
+{
+        struct hashdb_header *hdr = NULL;
+        unsigned char *p = NULL;
+        void *bp = NULL;
+        hashdb_size_t probes;
+        hashdb_size_t bucket;
+        hashdb_size_t curr;
+        hashdb_size_t next;
+        void *keyp = NULL;
+
+        if (hp->hd_flags & (HASHDB_FLAG_CONCURRENT | HASHDB_FLAG_SHARED))
+                return hashdb_get_rcu(hp, key, hash, NULL);
+
+        hdr = hp->hd_hdr;
+        if (hashdb_lock_resize(hp, false))
+                return NULL;
+        bucket = hashdb_bucket(hdr, hash);
+        if (hashdb_lock_bucket(hp, bucket, false)) {
+                hashdb_unlock_resize(hp);
+                return NULL;
+        }
+        bp = hashdb_bucket_link(hp, bucket);
+        curr = hashdb_link_get(hp, bp);
+
+        probes = 0;
+        while (curr) {
+                ++probes;
+                p = HASHDB_NODE(hp, curr);
+                next = hashdb_link_get(hp, p);
+                keyp = p + hp->hd_key_off;
+                if ((hp->hd_flags & HASHDB_FLAG_HASH) &&
+                    HASHDB_NODE_HASH(p) != hash) {
+                        curr = next;
+                        continue;
+                }
+                if (!hp->hd_cmpfn(key, keyp, hdr->hh_key_size))
+                        break;
+                curr = next;
+        }
+        if (!curr)
+                keyp = NULL;
+        else
+                HASHDB_EVICT_TOUCH(hp, curr);
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_GET, curr != 0, probes);
+        HASHDB_TRACE_PROBE(get, bucket, probes, curr != 0);
+
+        hashdb_unlock_bucket(hp, bucket);
+        hashdb_unlock_resize(hp);
+        return keyp;
+}
+
+static void *
+hashdb_get_rcu(struct hashdb *hp, void *key, hashdb_size_t hash, void *value)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        struct hashdb_reader *rp = NULL;
+        struct hashdb_lock *lp = NULL;
+        unsigned char *actual = NULL;
+        unsigned char *p = NULL;
+        hashdb_size_t nr_nodes;
+        hashdb_size_t bucket;
+        hashdb_size_t steps;
+        hashdb_size_t *seqp = NULL;
+        hashdb_size_t curr;
+        hashdb_size_t seq;
+        hashdb_size_t lseq = 0;
+        hashdb_size_t idx = 0;
+        void *link = NULL;
+        void *keyp = NULL;
+
+        /* other processes bump the sequence number in the file instead */
+        seqp = &hp->hd_seq;
+        if (hp->hd_flags & HASHDB_FLAG_SHARED)
+                seqp = &hdr->hh_seq;
+        if (hp->hd_flags & HASHDB_FLAG_CONCURRENT)
+                idx = hashdb_epoch_enter(hp, &rp);
+        bucket = 0;
+        steps = 0;
+retry:
+        /* wait out split or growth in progress */
+        seq = __atomic_load_n(seqp, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+                /* writer may have died, and waiting on its lock repairs */
+                if (!(hp->hd_flags & HASHDB_FLAG_SHARED)) {
+                        sched_yield();
+                } else if (hashdb_shared_wait(hp, &hdr->hh_lock)) {
+                        keyp = NULL;
+                        goto out;
+                }
+                goto retry;
+        }
+
+        /* header may be torn, so only give up if it was not */
+        if ((hp->hd_flags & HASHDB_FLAG_SHARED) && hashdb_sync(hp)) {
+                if (__atomic_load_n(seqp, __ATOMIC_ACQUIRE) != seq)
+                        goto retry;
+                keyp = NULL;
+                goto out;
+        }
+
+        /* layout has to come from one point in time to be safe to use */
+        actual = __atomic_load_n(&hp->hd_actual, __ATOMIC_RELAXED);
+        nr_nodes = __atomic_load_n(&hdr->hh_nr_nodes, __ATOMIC_RELAXED);
+        bucket = hashdb_bucket(hdr, hash);
+        link = hashdb_bucket_link(hp, bucket);
+
+        /* writers of other processes change chains of their stripe */
+        if (hp->hd_flags & HASHDB_FLAG_SHARED) {
+                lp = &hdr->hh_locks[bucket % HASHDB_NR_LOCKS];
+                lseq = __atomic_load_n(&lp->hl_seq, __ATOMIC_ACQUIRE);
+                if (lseq & 1) {
+                        keyp = NULL;
+                        if (hashdb_shared_wait(hp, &lp->hl_lock))
+                                goto out;
+                        goto retry;
+                }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seqp, __ATOMIC_RELAXED) != seq)
+                goto retry;
+
+        keyp = NULL;
+        curr = hashdb_link_load(hp, link);
+        for (steps = 0; curr; ++steps) {
+                /* chains only look broken if a split started under us */
+                if (curr > nr_nodes || steps > nr_nodes)
+                        break;
+
+                p = HASHDB_NODE_AT(hp, actual, curr);
+                if ((!(hp->hd_flags & HASHDB_FLAG_HASH) ||
+                     HASHDB_NODE_HASH(p) == hash) &&
+                    !hp->hd_cmpfn(key, p + hp->hd_key_off, hdr->hh_key_size)) {
+                        keyp = p + hp->hd_key_off;
+                        break;
+                }
+                curr = hashdb_link_load(hp, p);
+        }
+        if (keyp && value) {
+                hashdb_value_load(hp, bucket, value,
+                                  HASHDB_VALUE_AT(hp, actual, curr));
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seqp, __ATOMIC_RELAXED) != seq ||
+            (lp && __atomic_load_n(&lp->hl_seq, __ATOMIC_RELAXED) != lseq))
+                goto retry;
+out:
+        if (hp->hd_flags & HASHDB_FLAG_CONCURRENT)
+                hashdb_epoch_exit(rp, idx);
+        /* steps stops short of node holding key */
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_GET, keyp != NULL,
+                           steps + (keyp != NULL));
+        HASHDB_TRACE_PROBE(get, bucket, steps + (keyp != NULL), keyp != NULL);
+        return keyp;
+}
+
+static void
+hashdb_value_store(struct hashdb *hp,
+                   hashdb_size_t bucket,
+                   void *valp,
+                   const void *value)
+{
+        hashdb_size_t *seqp = NULL;
+
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT)) {
+                memcpy(valp, value, hp->hd_hdr->hh_value_size);
+                return;
+        }
+
+        /* stripe lock is held, so only one writer bumps the counter */
+        seqp = &hp->hd_stripes[bucket % HASHDB_NR_STRIPES].hs_seq;
+        __atomic_store_n(seqp, *seqp + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        hashdb_words_store(hp, valp, value);
+        __atomic_store_n(seqp, *seqp + 1, __ATOMIC_RELEASE);
+}
+
+static void
+hashdb_value_load(struct hashdb *hp,
+                  hashdb_size_t bucket,
+                  void *value,
+                  const void *valp)
+{
+        hashdb_size_t *seqp = NULL;
+        hashdb_size_t seq;
+
+        /* without stripes the caller checks the sequence number */
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT)) {
+                hashdb_words_load(hp, value, valp);
+                return;
+        }
+
+        seqp = &hp->hd_stripes[bucket % HASHDB_NR_STRIPES].hs_seq;
+        for (;;) {
+                seq = __atomic_load_n(seqp, __ATOMIC_ACQUIRE);
+                if (seq & 1)
+                        continue;
+
+                hashdb_words_load(hp, value, valp);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(seqp, __ATOMIC_RELAXED) == seq)
+                        return;
+        }
+}
+
+static void
+hashdb_words_store(struct hashdb *hp, void *valp, const void *value)
+{
+        const unsigned char *src = value;
+        hashdb_size_t size = hp->hd_hdr->hh_value_size;
+        hashdb_size_t word;
+        uint32_t half;
+        hashdb_size_t i;
+
+        /* value size is a multiple of hd_link_size, and so is its place */
+        if (hp->hd_link_size == sizeof(half)) {
+                for (i = 0; i < size / sizeof(half); ++i) {
+                        memcpy(&half, src + (sizeof(half) * i), sizeof(half));
+                        __atomic_store_n((uint32_t *)valp + i, half,
+                                         __ATOMIC_RELAXED);
+                }
+                return;
+        }
+
+        for (i = 0; i < size / sizeof(word); ++i) {
+                memcpy(&word, src + (sizeof(word) * i), sizeof(word));
+                __atomic_store_n((hashdb_size_t *)valp + i, word,
+                                 __ATOMIC_RELAXED);
+        }
+}
+
+static void
+hashdb_words_load(struct hashdb *hp, void *value, const void *valp)
+{
+        unsigned char *dst = value;
+        hashdb_size_t size = hp->hd_hdr->hh_value_size;
+        hashdb_size_t word;
+        uint32_t half;
+        hashdb_size_t i;
+
+        if (hp->hd_link_size == sizeof(half)) {
+                for (i = 0; i < size / sizeof(half); ++i) {
+                        half = __atomic_load_n((const uint32_t *)valp + i,
+                                               __ATOMIC_RELAXED);
+                        memcpy(dst + (sizeof(half) * i), &half, sizeof(half));
+                }
+                return;
+        }
+
+        for (i = 0; i < size / sizeof(word); ++i) {
+                word = __atomic_load_n((const hashdb_size_t *)valp + i,
+                                       __ATOMIC_RELAXED);
+                memcpy(dst + (sizeof(word) * i), &word, sizeof(word));
+        }
+}
+
+int
+hashdb_get_copy(struct hashdb *hp, void *key, void *value)
+{
+        struct hashdb_header *hdr = NULL;
+        hashdb_size_t start;
+        hashdb_size_t hash;
+        void *keyp = NULL;
+
+        if (hashdb_sanity(hp) || hashdb_check_var(hp, false))
+                return -1;
+
+        start = HASHDB_TRACE_BEGIN(hp);
+        hdr = hp->hd_hdr;
+        if (hashdb_slotted(hdr)) {
+                if (hashdb_lock_resize(hp, true))
+                        goto done;
+                keyp = hashdb_slot_get(hp, key);
+                if (keyp) {
+                        memcpy(value,
+                               UCHAR_P(keyp) + hdr->hh_key_size,
+                               hdr->hh_value_size);
+                }
+                hashdb_unlock_resize(hp);
+                goto done;
+        }
+
+        /* lookups only set errno if something went wrong */
+        errno = 0;
+        hash = hp->hd_hashfn(key, hdr->hh_key_size);
+        if (hp->hd_flags & (HASHDB_FLAG_CONCURRENT | HASHDB_FLAG_SHARED)) {
+                keyp = hashdb_get_rcu(hp, key, hash, value);
+                goto done;
+        }
+
+        keyp = hashdb_get_hash(hp, key, hash);
+        if (keyp)
+                memcpy(value, hashdb_value(hp, keyp), hdr->hh_value_size);
+done:
+        HASHDB_TRACE_END(hp, HASHDB_OP_GET, start);
+        if (!keyp) {
+                if (!errno)
+                        errno = ENOENT;
+                return -1;
+        }
+
+        return 0;
+}
+
+int
+hashdb_rm(struct hashdb *hp, void *key)
+{
+        hashdb_size_t start;
+        int ret = -1;
+
+        if (hashdb_sanity(hp) ||
+            hashdb_check_write(hp) ||
+            hashdb_check_var(hp, false))
+                return -1;
+
+        start = HASHDB_TRACE_BEGIN(hp);
+        if (hashdb_slotted(hp->hd_hdr)) {
+                if (hashdb_lock_write(hp, true))
+                        goto out;
+                ret = hashdb_slot_rm(hp, key);
+                if (!ret && hp->hd_wal)
+                        hashdb_wal_append(hp, HASHDB_WAL_RM, key, NULL);
+                hashdb_unlock_resize(hp);
+        } else {
+                ret = hashdb_rm_hash(hp, key,
+                                hp->hd_hashfn(key, hp->hd_hdr->hh_key_size));
+        }
+
+        if (!ret && hashdb_wal_done(hp))
+                ret = -1;
+out:
+        HASHDB_TRACE_END(hp, HASHDB_OP_RM, start);
+        return ret;
+}
+
+static int
+hashdb_rm_hash(struct hashdb *hp, void *key, hashdb_size_t hash)
+{
+        struct hashdb_header *hdr = NULL;
+        unsigned char *p = NULL;
+        unsigned char *elemp = p;
+        unsigned char *bkt_p = NULL;
+        hashdb_size_t bucket;
+        hashdb_size_t curr;
+        hashdb_size_t prev;
+        hashdb_size_t chainlen;
+
+retry:
+        if (hashdb_lock_write(hp, false))
+                return -1;
+        hdr = hp->hd_hdr;
+        bucket = hashdb_bucket(hdr, hash);
+        if (hashdb_lock_bucket(hp, bucket, true)) {
+                hashdb_unlock_resize(hp);
+                if (errno == EAGAIN)
+                        goto retry;
+                return -1;
+        }
+        bkt_p = hashdb_bucket_link(hp, bucket);
+        curr = hashdb_link_load(hp, bkt_p);
+
+        prev = 0;
+        chainlen = 0;
+        while (curr) {
+                void *keyp = NULL;
+
+                ++chainlen;
+                p = HASHDB_NODE(hp, curr);
+                keyp = p + hp->hd_key_off;
+                if ((!(hp->hd_flags & HASHDB_FLAG_HASH) ||
+                     HASHDB_NODE_HASH(p) == hash) &&
+                    !hp->hd_cmpfn(key, keyp, hdr->hh_key_size))
+                        break;
+
+                prev = curr;
+                curr = hashdb_link_get(hp, p);
+        }
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_RM, curr != 0, chainlen);
+        HASHDB_TRACE_PROBE(rm, bucket, chainlen, curr != 0);
+
+        if (!curr) {
+                hashdb_unlock_bucket(hp, bucket);
+                hashdb_unlock_resize(hp);
+                errno = ENOENT;
+                return -1;
+        }
+
+        /* unlinked node keeps its hn_next for readers still on it */
+        elemp = p;
+        if (chainlen > 1) {
+                p = HASHDB_NODE(hp, prev);
+                hashdb_link_store(hp, p, hashdb_link_get(hp, elemp));
+        } else {
+                hashdb_link_store(hp, bkt_p, hashdb_link_get(hp, elemp));
+        }
+
+        hashdb_node_free(hp, curr);
+        if (hp->hd_wal)
+                hashdb_wal_append(hp, HASHDB_WAL_RM, key, NULL);
+        hashdb_unlock_bucket(hp, bucket);
+        hashdb_unlock_resize(hp);
+        return 0;
+}
+
+/* hash keys of batch and prefetch their buckets and chain heads */
+static void hashdb_prefetch_batch(struct hashdb *hp,
+                                  void **keys,
+                                  hashdb_size_t *hashes,
+                                  hashdb_size_t *currs,
+                                  hashdb_size_t nr);
+
+/* look up batch of at most HASHDB_BATCH keys */
+static void hashdb_get_batch(struct hashdb *hp,
+                             void **keys,
+                             void **ptrs,
+                             hashdb_size_t nr);
+
+int
+hashdb_get_many(struct hashdb *hp, void **keys, void **ptrs, hashdb_size_t n)
+{
+        hashdb_size_t nr;
+        hashdb_size_t i;
+
+        if (hashdb_sanity(hp) || hashdb_check_var(hp, false))
+                return -1;
+
+        /* chain walks of batch are not done under locks */
+        if (hashdb_slotted(hp->hd_hdr) ||
+            (hp->hd_flags & (HASHDB_FLAG_CONCURRENT | HASHDB_FLAG_SHARED))) {
+                for (i = 0; i < n; ++i)
+                        ptrs[i] = hashdb_get(hp, keys[i]);
+                return 0;
+        }
+
+        for (i = 0; i < n; i += nr) {
+                nr = n - i;
+                if (nr > HASHDB_BATCH)
+                        nr = HASHDB_BATCH;
+                hashdb_get_batch(hp, keys + i, ptrs + i, nr);
+        }
+
+        return 0;
+}
+
+static void
+hashdb_prefetch_batch(struct hashdb *hp,
+                      void **keys,
+                      hashdb_size_t *hashes,
+                      hashdb_size_t *currs,
+                      hashdb_size_t nr)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *bps[HASHDB_BATCH];
+        unsigned char *p = NULL;
+        hashdb_size_t bucket;
+        hashdb_size_t i;
+
+        /* all bucket loads are independent, so issue them together */
+        hashdb_hash_keys(hp, keys, hashes, nr);
+        for (i = 0; i < nr; ++i) {
+                bucket = hashdb_bucket(hdr, hashes[i]);
+                bps[i] = hashdb_bucket_link(hp, bucket);
+                __builtin_prefetch(bps[i]);
+        }
+
+        /* same for the heads of the chains */
+        for (i = 0; i < nr; ++i) {
+                currs[i] = hashdb_link_get(hp, bps[i]);
+                if (!currs[i])
+                        continue;
+                p = HASHDB_NODE(hp, currs[i]);
+                __builtin_prefetch(p);
+                __builtin_prefetch(p + hp->hd_key_off);
+        }
+}
+
+static void
+hashdb_get_batch(struct hashdb *hp,
+                 void **keys,
+                 void **ptrs,
+                 hashdb_size_t nr)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t probes[HASHDB_BATCH];
+        hashdb_size_t hashes[HASHDB_BATCH];
+        hashdb_size_t currs[HASHDB_BATCH];
+        unsigned char *p = NULL;
+        hashdb_size_t left;
+        hashdb_size_t next;
+        hashdb_size_t i;
+        void *keyp = NULL;
+
+        hashdb_prefetch_batch(hp, keys, hashes, currs, nr);
+
+        left = 0;
+        for (i = 0; i < nr; ++i) {
+                ptrs[i] = NULL;
+                probes[i] = 0;
+                if (currs[i])
+                        ++left;
+        }
+
+        /*
+         * walk chains one hop at a time per key, so the miss on the
+         * next node of one chain overlaps with work on the others
+         */
+        while (left) {
+                for (i = 0; i < nr; ++i) {
+                        if (!currs[i])
+                                continue;
+
+                        ++probes[i];
+                        p = HASHDB_NODE(hp, currs[i]);
+                        next = hashdb_link_get(hp, p);
+                        keyp = p + hp->hd_key_off;
+                        if ((!(hp->hd_flags & HASHDB_FLAG_HASH) ||
+                             HASHDB_NODE_HASH(p) == hashes[i]) &&
+                            !hp->hd_cmpfn(keys[i], keyp, hdr->hh_key_size)) {
+                                HASHDB_EVICT_TOUCH(hp, currs[i]);
+                                ptrs[i] = keyp;
+                                next = 0;
+                        }
+
+                        currs[i] = next;
+                        if (!next) {
+                                --left;
+                                continue;
+                        }
+                        p = HASHDB_NODE(hp, next);
+                        __builtin_prefetch(p);
+                        __builtin_prefetch(p + hp->hd_key_off);
+                }
+        }
+
+        for (i = 0; hp->hd_counters && i < nr; ++i) {
+                hashdb_stats_count(hp, HASHDB_STATS_GET, ptrs[i] != NULL,
+                                   probes[i]);
+        }
+
+        /* empty without HASHDB_TRACE */
+        for (i = 0; i < nr; ++i) {
+                HASHDB_TRACE_PROBE(get, hashdb_bucket(hdr, hashes[i]),
+                                   probes[i], ptrs[i] != NULL);
+        }
+}
+
+int
+hashdb_hash_many(struct hashdb *hp,
+                 void **keys,
+                 hashdb_size_t *hashes,
+                 hashdb_size_t n)
+{
+        if (hashdb_sanity(hp) || hashdb_check_var(hp, false))
+                return -1;
+
+        hashdb_hash_keys(hp, keys, hashes, n);
+        return 0;
+}
+
+int
+hashdb_cursor_open(struct hashdb *hp,
+                   struct hashdb_cursor *cursors,
+                   hashdb_size_t nr)
+{
+        uint64_t *live = NULL;
+        hashdb_size_t first;
+        hashdb_size_t end;
+        hashdb_size_t i;
+
+        if (hashdb_sanity(hp))
+                return -1;
+        if (!cursors || !nr) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        /* no node may change hands while bitmap is built */
+        if (hashdb_lock_resize(hp, true))
+                return -1;
+        live = hashdb_cursor_map(hp, &first, &end);
+        if (live)
+                __atomic_add_fetch(&hp->hd_nr_cursors, 1, __ATOMIC_RELEASE);
+        hashdb_unlock_resize(hp);
+        if (!live)
+                return -1;
+
+        for (i = 0; i < nr; ++i) {
+                cursors[i].hi_hp = hp;
+                cursors[i].hi_live = live;
+                cursors[i].hi_node = first + ((end - first) * i / nr);
+                cursors[i].hi_end = first + ((end - first) * (i + 1) / nr);
+        }
+
+        return 0;
+}
+
+void
+hashdb_cursor_close(struct hashdb_cursor *cursors, hashdb_size_t nr)
+{
+        hashdb_size_t i;
+
+        if (!cursors || !nr || !cursors[0].hi_live)
+                return;
+
+        /* bitmap is shared, so only one free() */
+        free(cursors[0].hi_live);
+        __atomic_sub_fetch(&cursors[0].hi_hp->hd_nr_cursors,
+                           1,
+                           __ATOMIC_RELEASE);
+        for (i = 0; i < nr; ++i) {
+                cursors[i].hi_live = NULL;
+                cursors[i].hi_node = 0;
+                cursors[i].hi_end = 0;
+        }
+}
+
+int
+hashdb_compact(struct hashdb *hp, hashdb_size_t max_nodes)
+{
+        int ret = -1;
+
+        if (hashdb_sanity(hp) || hashdb_check_write(hp))
+                return -1;
+        if (hp->hd_hdr->hh_format != HASHDB_FORMAT_CHAIN) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (hashdb_lock_write(hp, true))
+                return -1;
+
+        /*
+         * nodes removed by other threads have to be on the free list
+         * to be told apart from pairs, so wait until none can be read
+         */
+        hashdb_synchronize(hp);
+        hashdb_cache_drain(hp, true);
+
+        /* a pair in the way needs one free node to go to */
+        if ((hp->hd_flags & HASHDB_FLAG_GROW) && hashdb_make_room_locked(hp))
+                goto unlock;
+
+        hashdb_seq_lock(hp);
+        if (hp->hd_wal)
+                ret = hashdb_compact_wal(hp);
+        else
+                ret = hashdb_compact_step(hp, max_nodes, NULL);
+        hashdb_seq_unlock(hp);
+
+        /* other processes may still be using the end of the file */
+        if (ret == 1 &&
+            (hp->hd_flags & HASHDB_FLAG_GROW) &&
+            !(hp->hd_flags & HASHDB_FLAG_SHARED) &&
+            hashdb_shrink(hp))
+                ret = -1;
+
+unlock:
+        hashdb_unlock_resize(hp);
+        return ret;
+}
+
+static int
+hashdb_compact_wal(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *held = NULL;
+        hashdb_size_t nr_held;
+        hashdb_size_t node;
+        int saved_errno;
+        int ret;
+
+        held = calloc(hdr->hh_nr_nodes + 1, 1);
+        if (!held)
+                return -1;
+
+        /*
+         * free nodes are not in the list a checkpoint saves, so they
+         * can be written over. nodes moved out of are only freed once
+         * the next checkpoint has left them out too, and if free nodes
+         * run out before that, it is taken early
+         */
+        ret = hashdb_checkpoint_locked(hp);
+        while (!ret) {
+                ret = hashdb_compact_step(hp, 0, held);
+                saved_errno = errno;
+                if (hashdb_checkpoint_locked(hp)) {
+                        ret = -1;
+                        break;
+                }
+
+                nr_held = 0;
+                for (node = 1; node <= hdr->hh_nr_nodes; ++node) {
+                        if (held[node]) {
+                                held[node] = 0;
+                                hashdb_free_push(hp, node);
+                                ++nr_held;
+                        }
+                }
+                errno = saved_errno;
+                if (ret < 0 && errno == ENOMEM && nr_held)
+                        ret = 0;
+        }
+
+        /* a remove between calls would write over a node in the list */
+        if (ret < 0) {
+                hdr->hh_compact_next = 0;
+                hdr->hh_compact_bucket = 0;
+                for (node = 1; node <= hdr->hh_nr_nodes; ++node) {
+                        if (held[node])
+                                hashdb_free_push(hp, node);
+                }
+        }
+
+        free(held);
+        return ret;
+}
+
+int
+hashdb_stats(struct hashdb *hp, struct hashdb_stats *sp)
+{
+        if (hashdb_sanity(hp))
+                return -1;
+        if (sp == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        /* no writer is inside a chain while resize lock is held */
+        memset(sp, 0, sizeof(*sp));
+        if (hashdb_lock_resize(hp, true))
+                return -1;
+        if (hp->hd_hdr->hh_format == HASHDB_FORMAT_SWISS)
+                hashdb_swiss_stats(hp, sp);
+        else if (hp->hd_hdr->hh_format == HASHDB_FORMAT_CUCKOO)
+                hashdb_cuckoo_stats(hp, sp);
+        else
+                hashdb_stats_walk(hp, sp);
+        hashdb_unlock_resize(hp);
+
+        hashdb_stats_sum(hp, sp);
+        return 0;
+}
+
+int
+hashdb_latency(struct hashdb *hp, int op, struct hashdb_latency *lp)
+{
+        if (hashdb_sanity(hp))
+                return -1;
+        if (op < 0 || op >= HASHDB_NR_OPS || lp == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (!hp->hd_latency) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        hashdb_trace_copy(hp, op, lp);
+        return 0;
+}
+
+int
+hashdb_publish(struct hashdb *hp, const char *path)
+{
+        char *new_path = NULL;
+        int ret = -1;
+
+        if (hashdb_sanity(hp) || hashdb_check_write(hp))
+                return -1;
+        if (!path || !*path || hp->hd_wal) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        new_path = strdup(path);
+        if (!new_path)
+                return -1;
+
+        /* whole file has to be on disk before anyone can open it */
+        if (hashdb_lock_write(hp, true))
+                goto free_new_path;
+        hashdb_move_finish(hp);
+        hashdb_synchronize(hp);
+        hashdb_cache_drain(hp, true);
+
+        /*
+         * readers of @path must not see it change, so the file says it
+         * is read-only from now on. writers in other processes that
+         * got past the check retry their bucket lock and see it
+         */
+        hashdb_seq_lock(hp);
+        __atomic_or_fetch(&hp->hd_hdr->hh_flags, HASHDB_FLAG_RDONLY,
+                          __ATOMIC_RELEASE);
+        hashdb_seq_unlock(hp);
+        if (msync(hp->hd_data, hp->hd_file_size, MS_SYNC))
+                goto clear;
+        if (fsync(hp->hd_fd))
+                goto clear;
+        if (rename(hp->hd_path, new_path))
+                goto clear;
+
+        free(hp->hd_path);
+        hp->hd_path = new_path;
+        new_path = NULL;
+
+        /*
+         * readers may open it from now on. with HASHDB_FLAG_SHARED
+         * lookups take locks in the file, so only the flags say so
+         */
+        __atomic_or_fetch(&hp->hd_flags, HASHDB_FLAG_RDONLY,
+                          __ATOMIC_RELEASE);
+        if (!(hp->hd_flags & HASHDB_FLAG_SHARED) &&
+            mprotect(hp->hd_data, hp->hd_file_size, PROT_READ))
+                goto unlock;
+        if (hashdb_sync_dir(hp->hd_path))
+                goto unlock;
+        ret = 0;
+        goto unlock;
+
+clear:
+        /* file was not published, so it may still change */
+        __atomic_and_fetch(&hp->hd_hdr->hh_flags, ~HASHDB_FLAG_RDONLY,
+                           __ATOMIC_RELEASE);
+unlock:
+        hashdb_unlock_resize(hp);
+free_new_path:
+        free(new_path);
+        return ret;
+}
+
+int
+hashdb_sync_dir(const char *path)
+{
+        const char *slash = NULL;
+        char *dir = NULL;
+        int saved_errno;
+        int ret = -1;
+        int fd;
+
+        /* rename is only on disk once its directory is */
+        slash = strrchr(path, '/');
+        if (!slash)
+                dir = strdup(".");
+        else if (slash == path)
+                dir = strdup("/");
+        else
+                dir = strndup(path, slash - path);
+        if (!dir)
+                return -1;
+
+        fd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
+                goto free_dir;
+        ret = fsync(fd);
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+
+free_dir:
+        free(dir);
+        return ret;
+}
+
+static bool
+hashdb_slots_kept(struct hashdb *hp)
+{
+        /* without a log or other processes nobody sees a torn rebuild */
+        return hp->hd_wal || (hp->hd_flags & HASHDB_FLAG_SHARED);
+}
+
+int
+hashdb_slots_save(struct hashdb *hp,
+                  const unsigned char *pairs,
+                  hashdb_size_t nr_pairs)
+{
+        if (!hashdb_slots_kept(hp))
+                return 0;
+
+        return hashdb_wal_save_slots(hp, pairs, nr_pairs * hp->hd_node_size);
+}
+
+int
+hashdb_slots_done(struct hashdb *hp)
+{
+        /* saved pairs may only go once the rebuilt table is on disk */
+        if (hp->hd_wal && msync(hp->hd_data, hp->hd_file_size, MS_SYNC))
+                return -1;
+
+        /* also dropped once an open without the flags restored them */
+        return hashdb_wal_drop_slots(hp);
+}
+
+static int
+hashdb_slots_restore(struct hashdb *hp)
+{
+        if (!hashdb_slotted(hp->hd_hdr) || !hashdb_wal_has_slots(hp))
+                return 0;
+
+        return hashdb_repair(hp);
+}
+
+unsigned char *
+hashdb_slots_load(struct hashdb *hp,
+                  hashdb_size_t *nr_pairsp,
+                  hashdb_size_t *nr_slotsp)
+{
+        unsigned char *pairs = NULL;
+        struct stat stats;
+        hashdb_size_t nr_slots;
+        hashdb_size_t size;
+
+        pairs = hashdb_wal_load_slots(hp, &size);
+        if (!pairs)
+                return NULL;
+        if (fstat(hp->hd_fd, &stats))
+                goto free_pairs;
+        if (size % hp->hd_node_size)
+                goto einval;
+
+        /* file was sized for old or new table, whichever it got to */
+        nr_slots = (stats.st_size - sizeof(struct hashdb_header)) /
+                   (1 + hp->hd_node_size);
+        if (!nr_slots || (nr_slots & (nr_slots - 1)) ||
+            hashdb_swiss_file_size(nr_slots, hp->hd_node_size) !=
+            (hashdb_size_t)stats.st_size)
+                goto einval;
+        if (hashdb_remap(hp, stats.st_size))
+                goto free_pairs;
+
+        *nr_pairsp = size / hp->hd_node_size;
+        *nr_slotsp = nr_slots;
+        return pairs;
+
+einval:
+        errno = EINVAL;
+free_pairs:
+        free(pairs);
+        return NULL;
+}
+
+int
+hashdb_replaced(struct hashdb *hp)
+{
+        struct stat mapped;
+        struct stat named;
+
+        if (hashdb_sanity(hp))
+                return -1;
+
+        if (fstat(hp->hd_fd, &mapped))
+                return -1;
+        if (stat(hp->hd_path, &named)) {
+                if (errno != ENOENT)
+                        return -1;
+                errno = 0;
+                return 1;
+        }
+
+        return mapped.st_dev != named.st_dev || mapped.st_ino != named.st_ino;
+}
+
+hashdb_size_t
+hashdb_set_many(struct hashdb *hp, void **keys, void **values, hashdb_size_t n)
+{
+        hashdb_size_t hashes[HASHDB_BATCH];
+        hashdb_size_t currs[HASHDB_BATCH];
+        hashdb_size_t nr;
+        hashdb_size_t i;
+        hashdb_size_t j;
+        int err;
+
+        if (hashdb_sanity(hp) ||
+            hashdb_check_write(hp) ||
+            hashdb_check_var(hp, false))
+                return 0;
+
+        for (i = 0; i < n; i += nr) {
+                nr = n - i;
+                if (nr > HASHDB_BATCH)
+                        nr = HASHDB_BATCH;
+
+                if (hashdb_slotted(hp->hd_hdr) ||
+                    (hp->hd_flags & (HASHDB_FLAG_CONCURRENT |
+                                     HASHDB_FLAG_SHARED))) {
+                        for (j = 0; j < nr; ++j) {
+                                if (!hashdb_set(hp, keys[i + j],
+                                                values[i + j]))
+                                        return i + j;
+                        }
+                        continue;
+                }
+
+                /* inserts may link into the same chain, so apply in order */
+                hashdb_prefetch_batch(hp, keys + i, hashes, currs, nr);
+                for (j = 0; j < nr; ++j) {
+                        if (!hashdb_set_hash(hp, keys[i + j], values[i + j],
+                                             hashes[j]))
+                                goto done;
+                }
+        }
+        j = 0;
+
+done:
+        /* one commit for whole batch, even a partly done one */
+        err = errno;
+        if (hashdb_wal_done(hp))
+                return 0;
+        errno = err;
+        return i + j;
+}
+
+hashdb_size_t
+hashdb_rm_many(struct hashdb *hp, void **keys, hashdb_size_t n)
+{
+        hashdb_size_t hashes[HASHDB_BATCH];
+        hashdb_size_t currs[HASHDB_BATCH];
+        hashdb_size_t nr_rm;
+        hashdb_size_t nr;
+        hashdb_size_t i;
+        hashdb_size_t j;
+
+        if (hashdb_sanity(hp) ||
+            hashdb_check_write(hp) ||
+            hashdb_check_var(hp, false))
+                return 0;
+
+        nr_rm = 0;
+        for (i = 0; i < n; i += nr) {
+                nr = n - i;
+                if (nr > HASHDB_BATCH)
+                        nr = HASHDB_BATCH;
+
+                if (hashdb_slotted(hp->hd_hdr) ||
+                    (hp->hd_flags & (HASHDB_FLAG_CONCURRENT |
+                                     HASHDB_FLAG_SHARED))) {
+                        for (j = 0; j < nr; ++j)
+                                nr_rm += !hashdb_rm(hp, keys[i + j]);
+                        continue;
+                }
+
+                hashdb_prefetch_batch(hp, keys + i, hashes, currs, nr);
+                for (j = 0; j < nr; ++j)
+                        nr_rm += !hashdb_rm_hash(hp, keys[i + j], hashes[j]);
+        }
+
+        if (hashdb_wal_done(hp))
+                return 0;
+        errno = 0;
+        return nr_rm;
+}
+
+void *
+hashdb_set_var(struct hashdb *hp,
+               void *key,
+               hashdb_size_t key_size,
+               void *value,
+               hashdb_size_t value_size)
+{
+        hashdb_size_t node;
+        void *keyp = NULL;
+
+        if (hashdb_sanity(hp) ||
+            hashdb_check_write(hp) ||
+            hashdb_check_var(hp, true))
+                return NULL;
+
+        if (hashdb_lock_write(hp, true))
+                return NULL;
+
+        node = hashdb_var_set(hp, key, key_size, value, value_size);
+        if (!node)
+                goto unlock;
+
+        /* insert already happened, so a failed split is not an error */
+        hashdb_move_step(hp);
+        if (hashdb_need_split(hp))
+                hashdb_split(hp);
+
+        /* growth or split may have moved the mapping */
+        keyp = HASHDB_NODE(hp, node) + hp->hd_key_off;
+        errno = 0;
+unlock:
+        hashdb_unlock_resize(hp);
+        return keyp;
+}
+
+void *
+hashdb_get_var(struct hashdb *hp, void *key, hashdb_size_t key_size)
+{
+        void *keyp = NULL;
+
+        if (hashdb_sanity(hp) || hashdb_check_var(hp, true))
+                return NULL;
+
+        if (hashdb_lock_resize(hp, true))
+                return NULL;
+        keyp = hashdb_var_get(hp, key, key_size);
+        hashdb_unlock_resize(hp);
+        return keyp;
+}
+
+int
+hashdb_get_copy_var(struct hashdb *hp,
+                    void *key,
+                    hashdb_size_t key_size,
+                    void *value,
+                    hashdb_size_t *value_size)
+{
+        void *keyp = NULL;
+        int ret = -1;
+
+        if (hashdb_sanity(hp) || hashdb_check_var(hp, true))
+                return -1;
+
+        if (hashdb_lock_resize(hp, true))
+                return -1;
+
+        keyp = hashdb_var_get(hp, key, key_size);
+        if (!keyp) {
+                errno = ENOENT;
+                goto unlock;
+        }
+        if (HASHDB_VAR_VALUE_SIZE(keyp) > *value_size) {
+                *value_size = HASHDB_VAR_VALUE_SIZE(keyp);
+                errno = ERANGE;
+                goto unlock;
+        }
+
+        *value_size = HASHDB_VAR_VALUE_SIZE(keyp);
+        memcpy(value, HASHDB_VAR_VALUE(keyp), *value_size);
+        ret = 0;
+unlock:
+        hashdb_unlock_resize(hp);
+        return ret;
+}
+
+int
+hashdb_rm_var(struct hashdb *hp, void *key, hashdb_size_t key_size)
+{
+        int ret;
+
+        if (hashdb_sanity(hp) ||
+            hashdb_check_write(hp) ||
+            hashdb_check_var(hp, true))
+                return -1;
+
+        if (hashdb_lock_write(hp, true))
+                return -1;
+        ret = hashdb_var_rm(hp, key, key_size);
+        hashdb_unlock_resize(hp);
+        return ret;
+}
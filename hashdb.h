@@ -3,6 +3,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -20,20 +21,218 @@
 #define HASHDB_NODE_P(p) \
         ((struct hashdb_node *)(p))
 
+/* stored hash of node (only with HASHDB_FLAG_HASH) */
+#define HASHDB_NODE_HASH(p) \
+        (((hashdb_size_t *)(p))[1])
+
+/* nodes in block of node table are 1 << hd_block_shift (see HASHDB_FLAG_SOA) */
+#define HASHDB_BLOCK_MASK(hp) \
+        (((hashdb_size_t)1 << (hp)->hd_block_shift) - 1)
+
+/* start of block of node table at base that node i is in */
+#define HASHDB_BLOCK_AT(hp, base, i) \
+        ((base) + (((i) >> (hp)->hd_block_shift) * \
+                   ((hp)->hd_node_size << (hp)->hd_block_shift)))
+
+/* node i of node table at base (values are kept apart with HASHDB_FLAG_SOA) */
+#define HASHDB_NODE_AT(hp, base, i) \
+        (HASHDB_BLOCK_AT(hp, base, i) + \
+         (((i) & HASHDB_BLOCK_MASK(hp)) * (hp)->hd_head_size))
+
+/* value of node i of node table at base (right after key by default) */
+#define HASHDB_VALUE_AT(hp, base, i) \
+        (HASHDB_BLOCK_AT(hp, base, i) + \
+         ((hp)->hd_head_size << (hp)->hd_block_shift) + \
+         (((i) & HASHDB_BLOCK_MASK(hp)) * \
+          ((hp)->hd_node_size - (hp)->hd_head_size)))
+
+/* node i of node table */
+#define HASHDB_NODE(hp, i) \
+        HASHDB_NODE_AT(hp, (hp)->hd_actual, i)
+
+/* value of node i of node table */
+#define HASHDB_VALUE(hp, i) \
+        HASHDB_VALUE_AT(hp, (hp)->hd_actual, i)
+
+/* size of key of pair with HASHDB_FORMAT_VAR (p from hashdb_get_var()) */
+#define HASHDB_VAR_KEY_SIZE(p) \
+        (((struct hashdb_var *)(p))[-1].hv_key_size)
+
+/* size of value of pair with HASHDB_FORMAT_VAR */
+#define HASHDB_VAR_VALUE_SIZE(p) \
+        (((struct hashdb_var *)(p))[-1].hv_value_size)
+
+/* value of pair with HASHDB_FORMAT_VAR (follows key, aligned to 8) */
+#define HASHDB_VAR_VALUE(p) \
+        (UCHAR_P(p) + NEXT_MULTPLE_OF_8(HASHDB_VAR_KEY_SIZE(p)))
+
+/* bucket of hash with linear hashing (buckets before split use 2 * base) */
+#define HASHDB_BUCKET(hash, base, split) \
+        ((hash) % (base) < (split) ? (hash) % ((base) * 2) : (hash) % (base))
+
+/* address space reserved for mapping with HASHDB_FLAG_CONCURRENT */
+#define HASHDB_MAP_RESERVE \
+        ((hashdb_size_t)1 << 40)
+
 /* get next multiple of 8 (used for aligning data) */
 #define NEXT_MULTPLE_OF_8(n) \
         (((n) + 7) & (-8))
 
+/* get next multiple of 4 (pairs with HASHDB_FLAG_INDEX32) */
+#define NEXT_MULTPLE_OF_4(n) \
+        (((n) + 3) & (-4))
+
 /* misc constants */
 enum {
-        /* multiplier used for hashing */
-        HASHDB_MULTIPLIER       = 31,
+        /* minimum number of nodes added when growing node table */
+        HASHDB_GROW_MIN         = 64,
+        /* hash table words moved per insert while node table grows */
+        HASHDB_MOVE_CHUNK       = 512,
+        /* identifies a hashdb file ("hsdb") */
+        HASHDB_MAGIC            = 0x68736462,
+        /* version of file format */
+        HASHDB_VERSION          = 10,
+        /* default max load factor (percent), splitting is off until set */
+        HASHDB_DEFAULT_MAX_LOAD = 0,
+        /* number of slots probed at once by HASHDB_FORMAT_SWISS */
+        HASHDB_SWISS_GROUP      = 16,
+        /* number of slots in a bucket of HASHDB_FORMAT_CUCKOO */
+        HASHDB_CUCKOO_SLOTS     = 8,
+        /* log2 of number of nodes in a block with HASHDB_FLAG_SOA */
+        HASHDB_SOA_SHIFT        = 6,
+        /* number of nodes in a block with HASHDB_FLAG_SOA */
+        HASHDB_SOA_BLOCK        = 1 << HASHDB_SOA_SHIFT,
+        /* number of keys in flight in batched operations */
+        HASHDB_BATCH            = 16,
+        /* size of cache line */
+        HASHDB_CACHE_LINE       = 64,
+        /* number of bucket locks with HASHDB_FLAG_CONCURRENT */
+        HASHDB_NR_STRIPES       = 256,
+        /* number of bucket locks in file with HASHDB_FLAG_SHARED */
+        HASHDB_NR_LOCKS         = 64,
+        /* number of free node caches with HASHDB_FLAG_CONCURRENT */
+        HASHDB_NR_CACHES        = 64,
+        /* max number of nodes in a free node cache */
+        HASHDB_CACHE_SIZE       = 64,
+        /* number of nodes moved between cache and free list at once */
+        HASHDB_CACHE_BATCH      = 32,
+        /* number of reader slots with HASHDB_FLAG_CONCURRENT */
+        HASHDB_NR_READERS       = 64,
+        /* size of write-ahead log buffer */
+        HASHDB_WAL_BUF          = 1 << 16,
+        /* size of write-ahead log that triggers a checkpoint */
+        HASHDB_WAL_MAX          = 1 << 26,
+        /* number of run sizes with HASHDB_FORMAT_VAR */
+        HASHDB_VAR_NR_CLASS     = 32,
+        /* compacted node table keeps 1/n of its pairs as free nodes */
+        HASHDB_COMPACT_SLACK    = 8,
+        /* nodes compaction logs pairs of per sync (HASHDB_FLAG_WAL) */
+        HASHDB_COMPACT_LOG      = 1024,
+        /* number of operation counters with HASHDB_FLAG_STATS */
+        HASHDB_NR_COUNTERS      = 64,
+        /* number of chain lengths told apart by hashdb_stats() */
+        HASHDB_STATS_NR_HIST    = 16,
+        /* latency histogram: buckets per power of 2 (as a shift) */
+        HASHDB_LATENCY_SHIFT    = 4,
+        /* latency histogram: number of buckets (see hashdb_latency()) */
+        HASHDB_LATENCY_NR       = (64 - HASHDB_LATENCY_SHIFT + 1) <<
+                                  HASHDB_LATENCY_SHIFT,
+        /* one in this many calls is timed with HASHDB_TRACE */
+        HASHDB_TRACE_SAMPLE     = 64,
+};
+
+/* operations timed with HASHDB_TRACE (see hashdb_latency()) */
+enum {
+        HASHDB_OP_GET           = 0,
+        HASHDB_OP_SET           = 1,
+        HASHDB_OP_RM            = 2,
+        HASHDB_NR_OPS           = 3,
+};
+
+/* table formats */
+enum {
+        /* separate chaining through node table */
+        HASHDB_FORMAT_CHAIN     = 0,
+        /* open addressing with control byte groups (see hashdb_swiss.h) */
+        HASHDB_FORMAT_SWISS     = 1,
+        /* chaining with variable size pairs (see hashdb_var.h) */
+        HASHDB_FORMAT_VAR       = 2,
+        /* bucketized cuckoo hashing (see hashdb_cuckoo.h) */
+        HASHDB_FORMAT_CUCKOO    = 3,
+};
+
+/* hash functions (hh_hash) */
+enum {
+        /* passed by caller, hashdb_open() can not check it */
+        HASHDB_HASH_USER        = 0,
+        /* hashdb_hash_xx() (default) */
+        HASHDB_HASH_XX          = 1,
+        /* hashdb_hash_wy() */
+        HASHDB_HASH_WY          = 2,
+        /* hashdb_hash_crc32c() */
+        HASHDB_HASH_CRC32C      = 3,
 };
 
 /* database flags */
 enum {
         /* enable sanity mode */
         HASHDB_FLAG_SANE_MODE   = 1,
+        /* grow node table instead of failing with ENOMEM */
+        HASHDB_FLAG_GROW        = 2,
+        /* store hash of key in each node (file format, set at init) */
+        HASHDB_FLAG_HASH        = 4,
+        /* use HASHDB_FORMAT_SWISS (set at init) */
+        HASHDB_FLAG_SWISS       = 8,
+        /* allow calls from many threads at once (chain lookups lock-free) */
+        HASHDB_FLAG_CONCURRENT  = 16,
+        /* allow calls from many processes at once (locks kept in file) */
+        HASHDB_FLAG_SHARED      = 32,
+        /* log sets and removes to path + ".wal", synced by commits */
+        HASHDB_FLAG_WAL         = 64,
+        /* use HASHDB_FORMAT_VAR (set at init) */
+        HASHDB_FLAG_VAR         = 128,
+        /* fault in whole file when it is mapped */
+        HASHDB_FLAG_POPULATE    = 256,
+        /* ask for transparent huge pages (MADV_HUGEPAGE) */
+        HASHDB_FLAG_HUGE        = 512,
+        /* turn off readahead of mapping (MADV_RANDOM) */
+        HASHDB_FLAG_RANDOM      = 1024,
+        /* fault in hash table, then the rest, from a background thread */
+        HASHDB_FLAG_PREWARM     = 2048,
+        /* map file read-only, changes fail with EROFS, no locks taken */
+        HASHDB_FLAG_RDONLY      = 4096,
+        /* count operations and probes for hashdb_stats() */
+        HASHDB_FLAG_STATS       = 8192,
+        /* evict a pair instead of failing with ENOMEM (CLOCK, chains only) */
+        HASHDB_FLAG_EVICT       = 16384,
+        /* use HASHDB_FORMAT_CUCKOO (set at init) */
+        HASHDB_FLAG_CUCKOO      = 32768,
+        /* keep values apart from keys in blocks (file format, set at init) */
+        HASHDB_FLAG_SOA         = 65536,
+        /* 32-bit node indexes in links (file format, set at init) */
+        HASHDB_FLAG_INDEX32     = 131072,
+        /* flags that are part of the file format (see README.md) */
+        HASHDB_FLAGS_FORMAT     = HASHDB_FLAG_HASH |
+                                  HASHDB_FLAG_SOA |
+                                  HASHDB_FLAG_INDEX32,
+};
+
+/* when changes are on disk with HASHDB_FLAG_WAL */
+enum {
+        /* log is written by hashdb_commit() but never synced */
+        HASHDB_DURABLE_NONE     = 0,
+        /* hashdb_commit() syncs log (default) */
+        HASHDB_DURABLE_BATCH    = 1,
+        /* every change is committed before it returns */
+        HASHDB_DURABLE_OP       = 2,
+};
+
+/* what hashdb_build() does with records whose keys are the same */
+enum {
+        /* pair gets value of last record with key */
+        HASHDB_DUPS_LAST        = 0,
+        /* building fails with EEXIST */
+        HASHDB_DUPS_ERROR       = 1,
 };
 
 /* used for sizes and pointers */
@@ -49,11 +248,34 @@ typedef int (*hashdb_cmpfn_t)(const void *, const void *, hashdb_size_t);
 struct hashdb_node {
         /* next on free list or hash list */
         hashdb_size_t   hn_next;
-        /* everything after this is user data */
+        /*
+         * with HASHDB_FLAG_HASH the hash of the key comes next,
+         * everything after that is user data
+         */
+};
+
+/* sizes of pair with HASHDB_FORMAT_VAR (after hash, before key) */
+struct hashdb_var {
+        /* size of key */
+        uint32_t        hv_key_size;
+        /* size of value */
+        uint32_t        hv_value_size;
+};
+
+/* bucket lock of all processes (HASHDB_FLAG_SHARED) */
+struct hashdb_lock {
+        /* protects buckets whose index is this lock mod nr of locks */
+        _Alignas(HASHDB_CACHE_LINE) pthread_mutex_t hl_lock;
+        /* odd while a chain or value under lock is being changed */
+        hashdb_size_t   hl_seq;
 };
 
 /* hashdb file header */
 struct hashdb_header {
+        /* HASHDB_MAGIC */
+        hashdb_size_t   hh_magic;
+        /* HASHDB_VERSION */
+        hashdb_size_t   hh_version;
         /* number of nodes in node table minus the NULL node */
         hashdb_size_t   hh_nr_nodes;
         /* number of buckets in hash table */
@@ -64,12 +286,214 @@ struct hashdb_header {
         hashdb_size_t   hh_value_size;
         /* index in node table of head of free list */
         hashdb_size_t   hh_free;
+        /* number of key/value pairs in hashdb */
+        hashdb_size_t   hh_nr_live;
+        /* number of buckets there is room for in hash table */
+        hashdb_size_t   hh_bucket_cap;
+        /* linear hashing: next bucket to split */
+        hashdb_size_t   hh_split;
+        /* linear hashing: number of buckets at start of this round */
+        hashdb_size_t   hh_base_buckets;
+        /* max load factor (percent) before splitting, 0 disables */
+        hashdb_size_t   hh_max_load;
+        /* HASHDB_FLAGS_FORMAT flags (and RDONLY once published) */
+        hashdb_size_t   hh_flags;
+        /* table format (HASHDB_FORMAT_*) */
+        hashdb_size_t   hh_format;
+        /* open addressing: number of deleted slots */
+        hashdb_size_t   hh_nr_tomb;
+        /* growth: number of nodes before hash table moved, 0 if done */
+        hashdb_size_t   hh_move_from;
+        /* growth: number of hash table words still to move */
+        hashdb_size_t   hh_move_left;
+        /* index in node table of first node never handed out */
+        hashdb_size_t   hh_bump;
+        /* number of nodes on free list */
+        hashdb_size_t   hh_nr_free;
+        /* hash function hashdb was created with (HASHDB_HASH_*) */
+        hashdb_size_t   hh_hash;
+        /* compaction: next node to lay a pair out in, 0 if not running */
+        hashdb_size_t   hh_compact_next;
+        /* compaction: next bucket to lay out */
+        hashdb_size_t   hh_compact_bucket;
+        /* shards: index of this shard (see hashdb_shards_init()) */
+        hashdb_size_t   hh_shard;
+        /* shards: number of shards, 0 if hashdb is not one */
+        hashdb_size_t   hh_nr_shards;
+        /*
+         * variable size pairs: heads of free lists of runs of 2^i nodes
+         * ([0] is unused, single nodes go on hh_free)
+         */
+        hashdb_size_t   hh_var_free[HASHDB_VAR_NR_CLASS];
+        /*
+         * reserved for state shared by processes (HASHDB_FLAG_SHARED),
+         * set up when the file is created
+         */
+        /*
+         * protects free list. changes to the whole table hold it and
+         * every bucket lock (all locks are robust and process-shared)
+         */
+        _Alignas(HASHDB_CACHE_LINE) pthread_mutex_t hh_lock;
+        /* odd while buckets are split, node table grows or is repaired */
+        hashdb_size_t   hh_seq;
+        /* set once a lock owner was found dead, until table is repaired */
+        hashdb_size_t   hh_dirty;
+        /* bucket locks */
+        struct hashdb_lock hh_locks[HASHDB_NR_LOCKS];
+};
+
+/* bucket lock (HASHDB_FLAG_CONCURRENT) */
+struct hashdb_stripe {
+        /* protects buckets whose index is this stripe mod nr of stripes */
+        _Alignas(HASHDB_CACHE_LINE) pthread_rwlock_t hs_lock;
+        /* odd while a value in stripe is being overwritten */
+        hashdb_size_t   hs_seq;
+};
+
+/* lock-free reader slot (HASHDB_FLAG_CONCURRENT) */
+struct hashdb_reader {
+        /* number of readers inside each parity of epoch */
+        _Alignas(HASHDB_CACHE_LINE) hashdb_size_t hr_active[2];
+};
+
+/* free node cache (HASHDB_FLAG_CONCURRENT) */
+struct hashdb_cache {
+        /* protects cache */
+        _Alignas(HASHDB_CACHE_LINE) pthread_mutex_t hc_lock;
+        /* number of nodes in cache */
+        hashdb_size_t   hc_nr;
+        /* change in number of live pairs not yet in header */
+        int64_t         hc_live;
+        /* free nodes */
+        hashdb_size_t   hc_nodes[HASHDB_CACHE_SIZE];
+        /* number of removed nodes readers may still see */
+        hashdb_size_t   hc_nr_retired;
+        /* removed nodes, oldest first */
+        hashdb_size_t   hc_retired[HASHDB_CACHE_SIZE];
+        /* epoch each removed node was removed in */
+        hashdb_size_t   hc_retired_epoch[HASHDB_CACHE_SIZE];
+};
+
+/* write-ahead log (HASHDB_FLAG_WAL) */
+struct hashdb_wal {
+        /* protects everything below */
+        pthread_mutex_t hw_lock;
+        /* signaled when a sync of log finishes */
+        pthread_cond_t  hw_cond;
+        /* log file descriptor (opened with O_APPEND) */
+        int             hw_fd;
+        /* HASHDB_DURABLE_* */
+        int             hw_durability;
+        /* first error writing or syncing log since last checkpoint */
+        int             hw_err;
+        /* a thread is syncing log */
+        bool            hw_syncing;
+        /* records not yet written to log */
+        unsigned char   *hw_buf;
+        /* bytes in hw_buf */
+        hashdb_size_t   hw_len;
+        /* size of hw_buf */
+        hashdb_size_t   hw_cap;
+        /* bytes of records ever written to log */
+        hashdb_size_t   hw_written;
+        /* bytes of records known to be on disk */
+        hashdb_size_t   hw_synced;
+        /* bytes written to log since last checkpoint */
+        hashdb_size_t   hw_size;
+};
+
+/* background thread faulting in mapping (HASHDB_FLAG_PREWARM) */
+struct hashdb_prewarm {
+        /* held while touching pages and while mapping changes */
+        pthread_mutex_t hp_lock;
+        /* prewarm thread */
+        pthread_t       hp_thread;
+        /* set to make thread stop early */
+        bool            hp_stop;
+};
+
+/* operation counters of some threads (HASHDB_FLAG_STATS) */
+struct hashdb_counters {
+        /* lookups */
+        _Alignas(HASHDB_CACHE_LINE) hashdb_size_t ho_gets;
+        /* lookups that found key */
+        hashdb_size_t   ho_hits;
+        /* sets */
+        hashdb_size_t   ho_sets;
+        /* sets that added a pair */
+        hashdb_size_t   ho_inserts;
+        /* removes */
+        hashdb_size_t   ho_rms;
+        /* removes that found key */
+        hashdb_size_t   ho_rm_hits;
+        /* probes of all operations */
+        hashdb_size_t   ho_probes;
+        /* most probes of one operation */
+        hashdb_size_t   ho_max_probes;
+};
+
+/* statistics of hashdb (see hashdb_stats()) */
+struct hashdb_stats {
+        /* number of nodes (slots with HASHDB_FORMAT_SWISS) */
+        hashdb_size_t   ht_nr_nodes;
+        /* number of buckets (groups with HASHDB_FORMAT_SWISS) */
+        hashdb_size_t   ht_nr_buckets;
+        /* number of key/value pairs */
+        hashdb_size_t   ht_nr_live;
+        /* number of nodes not in use */
+        hashdb_size_t   ht_nr_free;
+        /* pairs per bucket (pairs per slot for swiss), in percent */
+        hashdb_size_t   ht_load;
+        /*
+         * number of buckets with i pairs in their chain, the last one
+         * counting all longer chains too. with HASHDB_FORMAT_SWISS,
+         * number of pairs i groups past the group their hash picks
+         */
+        hashdb_size_t   ht_hist[HASHDB_STATS_NR_HIST];
+        /* longest chain (farthest group with HASHDB_FORMAT_SWISS) */
+        hashdb_size_t   ht_hist_max;
+        /* counters below stay 0 without HASHDB_FLAG_STATS */
+        /* lookups */
+        hashdb_size_t   ht_gets;
+        /* lookups that found key */
+        hashdb_size_t   ht_hits;
+        /* lookups that did not */
+        hashdb_size_t   ht_misses;
+        /* sets */
+        hashdb_size_t   ht_sets;
+        /* sets that added a pair */
+        hashdb_size_t   ht_inserts;
+        /* sets that changed value of a pair */
+        hashdb_size_t   ht_updates;
+        /* removes */
+        hashdb_size_t   ht_rms;
+        /* removes of keys not there */
+        hashdb_size_t   ht_rm_misses;
+        /*
+         * nodes looked at (groups with HASHDB_FORMAT_SWISS) by all
+         * lookups, sets and removes
+         */
+        hashdb_size_t   ht_probes;
+        /* most nodes (groups) looked at by one operation */
+        hashdb_size_t   ht_max_probes;
+};
+
+/* latency histogram of one operation (see hashdb_latency()) */
+struct hashdb_latency {
+        /* number of calls timed */
+        hashdb_size_t   hy_count;
+        /* nanoseconds taken by all calls timed */
+        hashdb_size_t   hy_sum;
+        /* most nanoseconds taken by one call */
+        hashdb_size_t   hy_max;
+        /* calls by time taken (see hashdb_latency_value()) */
+        hashdb_size_t   hy_hist[HASHDB_LATENCY_NR];
 };
 
 /* hash table based database */
 struct hashdb {
-        /* file header */
-        struct hashdb_header    hd_hdr;
+        /* file header (start of hd_data) */
+        struct hashdb_header    *hd_hdr;
         /* hash function */
         hashdb_hashfn_t         hd_hashfn;
         /* key comparison function */
@@ -82,6 +506,14 @@ struct hashdb {
         unsigned char           *hd_hash_tab;
         /* size of hashdb_nodes */
         hashdb_size_t           hd_node_size;
+        /* offset of key in hashdb_nodes */
+        hashdb_size_t           hd_key_off;
+        /* size of hashdb_nodes up to value */
+        hashdb_size_t           hd_head_size;
+        /* log2 of nodes per block of node table (0 without HASHDB_FLAG_SOA) */
+        hashdb_size_t           hd_block_shift;
+        /* size of hn_next and buckets (4 with HASHDB_FLAG_INDEX32) */
+        hashdb_size_t           hd_link_size;
         /* total size of database file */
         hashdb_size_t           hd_file_size;
         /* flags for modifying behavior */
@@ -92,18 +524,111 @@ struct hashdb {
         char                    *hd_path;
         /* database file descriptor */
         int                     hd_fd;
+        /* size of reserved address space (0 if none) */
+        hashdb_size_t           hd_map_size;
+        /* shared by operations, exclusive for resizing */
+        pthread_rwlock_t        hd_resize_lock;
+        /* protects free list */
+        pthread_mutex_t         hd_alloc_lock;
+        /* bucket locks */
+        struct hashdb_stripe    *hd_stripes;
+        /* free node caches, picked by thread */
+        struct hashdb_cache     *hd_caches;
+        /* lock-free reader slots, picked by thread */
+        struct hashdb_reader    *hd_readers;
+        /* removed nodes are reused two epochs after removal */
+        hashdb_size_t           hd_epoch;
+        /* odd while buckets are split or node table grows */
+        hashdb_size_t           hd_seq;
+        /* times resize lock is held by this hashdb (HASHDB_FLAG_SHARED) */
+        hashdb_size_t           hd_lock_depth;
+        /* is every lock in file held (HASHDB_FLAG_SHARED)? */
+        bool                    hd_lock_excl;
+        /* hh_seq the resize lock was taken at (HASHDB_FLAG_SHARED) */
+        hashdb_size_t           hd_lock_seq;
+        /* hashdb_cursor_open() calls not yet closed */
+        hashdb_size_t           hd_nr_cursors;
+        /* write-ahead log (NULL if none) */
+        struct hashdb_wal       *hd_wal;
+        /* prewarm thread (NULL if none) */
+        struct hashdb_prewarm   *hd_prewarm;
+        /* operation counters, picked by thread (NULL if none) */
+        struct hashdb_counters  *hd_counters;
+        /* latency of each HASHDB_OP_* (NULL without HASHDB_TRACE) */
+        struct hashdb_latency   *hd_latency;
+        /* CLOCK state of each node (NULL without HASHDB_FLAG_EVICT) */
+        unsigned char           *hd_clock;
+        /* next node CLOCK sweep looks at */
+        hashdb_size_t           hd_clock_hand;
 };
 
+/* lock of one shard (see hashdb_shards_init()) */
+struct hashdb_shard_lock {
+        /* shared by readers of shard, exclusive for changes */
+        _Alignas(HASHDB_CACHE_LINE) pthread_rwlock_t hl_lock;
+};
+
+/* hashdb split into shards by hash (see hashdb_shards_init()) */
+struct hashdb_shards {
+        /* one hashdb per shard */
+        struct hashdb           **hm_shards;
+        /* shard locks (NULL with HASHDB_FLAG_CONCURRENT) */
+        struct hashdb_shard_lock *hm_locks;
+        /* number of shards */
+        hashdb_size_t           hm_nr_shards;
+};
+
+/* cursor over a range of node table (see hashdb_cursor_open()) */
+struct hashdb_cursor {
+        /* hashdb being scanned */
+        struct hashdb   *hi_hp;
+        /* bit per node, set where a pair starts (shared by a scan) */
+        uint64_t        *hi_live;
+        /* next node to look at */
+        hashdb_size_t   hi_node;
+        /* node after last one in range */
+        hashdb_size_t   hi_end;
+};
+
+/**
+ * Built-in hash functions:
+ *
+ * hashdb_hash_xx() takes 8 bytes per step and needs only 32 bit
+ * multiplies, hashdb_hash_wy() takes 16 to 48 bytes per step with 64 bit
+ * multiplies and is faster on long keys, and hashdb_hash_crc32c() uses
+ * the crc32 instruction if the CPU has it (and is slow if not). all
+ * of them mix their result, so any bits of the hash may pick a bucket.
+ *
+ * args:
+ *      @key:   key
+ *      @size:  size of key
+ * ret:
+ *      @success:       hash of key
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_hash_xx(const void *key, hashdb_size_t size);
+extern hashdb_size_t hashdb_hash_wy(const void *key, hashdb_size_t size);
+extern hashdb_size_t hashdb_hash_crc32c(const void *key, hashdb_size_t size);
+
 /**
  * Initialize a hashdb:
  *
+ * without @hashfn keys are hashed with hashdb_hash_xx(). the built-in
+ * hash function and the format flags are kept in the file header, so
+ * hashdb_open() picks them again. what each flag does is described
+ * with the flags above and in README.md.
+ *
  * args:
  *      @path:          pathname of database
  *      @flags:         flags
  *      @nr_nodes:      number of nodes in node table
- *      @nr_buckets:    number of buckets in hash table
- *      @key_size:      key size
- *      @value_size:    value size
+ *      @nr_buckets:    initial number of buckets in hash table
+ *                      (ignored by HASHDB_FLAG_SWISS and
+ *                      HASHDB_FLAG_CUCKOO)
+ *      @key_size:      key size (with HASHDB_FLAG_VAR, size of keys
+ *                      that fit in one node along with their value)
+ *      @value_size:    value size (with HASHDB_FLAG_VAR, size of
+ *                      values that fit in one node)
  *      @hashfn:        hash function (optional)
  *      @cmpfn:         key comparison function (optional)
  *      @mode:          file permissions
@@ -136,20 +661,65 @@ extern int hashdb_free(struct hashdb **hp, bool fully);
 /**
  * Open an existing hashdb:
  *
+ * @flags need not match the ones the file was created with, except
+ * that all processes sharing a file have to pass HASHDB_FLAG_SHARED.
+ * a log left next to the file is redone first (HASHDB_FLAG_WAL). what
+ * each flag does is described with the flags above and in README.md.
+ *
  * args:
  *      @path:          pathname of database
  *      @flags:         flags
- *      @hashfn:        hash function (optional)
+ *      @hashfn:        hash function (optional if file was created
+ *                      with a built-in one, must match it otherwise)
  *      @cmpfn:         key comparison function (optional)
  * ret:
  *      @success:       pointer to hashdb
- *      @failure:       NULL and errno set
+ *      @failure:       NULL and errno set (EINVAL if @hashfn is not
+ *                      the hash function file was created with)
  */
 extern struct hashdb *hashdb_open(const char *path,
                                   uint64_t flags,
                                   hashdb_hashfn_t hashfn,
                                   hashdb_cmpfn_t cmpfn);
 
+/**
+ * Build a new hashdb file from an array of records:
+ *
+ * each record is a key of @key_size bytes followed by a value of
+ * @value_size bytes. threads each write the chains of a range of
+ * buckets into nodes next to each other (see README.md). the file is
+ * not synced: open it and hashdb_publish() it to replace an older one.
+ *
+ * args:
+ *      @path:          pathname of database
+ *      @flags:         HASHDB_FLAGS_FORMAT flags (HASHDB_FORMAT_CHAIN)
+ *      @recs:          records
+ *      @nr_recs:       number of records (nodes in node table)
+ *      @nr_buckets:    number of buckets in hash table
+ *      @key_size:      size of key
+ *      @value_size:    size of value
+ *      @hashfn:        hash function (optional, see hashdb_init())
+ *      @cmpfn:         key comparison function (optional)
+ *      @mode:          file permissions
+ *      @dups:          HASHDB_DUPS_*
+ *      @nr_threads:    number of threads
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (no file is left at @path)
+ */
+extern int hashdb_build(const char *path,
+                        uint64_t flags,
+                        const void *recs,
+                        hashdb_size_t nr_recs,
+                        hashdb_size_t nr_buckets,
+                        hashdb_size_t key_size,
+                        hashdb_size_t value_size,
+                        hashdb_hashfn_t hashfn,
+                        hashdb_cmpfn_t cmpfn,
+                        mode_t mode,
+                        int dups,
+                        hashdb_size_t nr_threads);
+
 /**
  * Dump hashdb state:
  *
@@ -162,9 +732,63 @@ extern struct hashdb *hashdb_open(const char *path,
  */
 extern int hashdb_dump(struct hashdb *hp, FILE *fp);
 
+/**
+ * Set max load factor of hashdb:
+ *
+ * once the number of key/value pairs per bucket (in percent) goes
+ * over @max_load, each insert splits one bucket (linear hashing) so
+ * chains stay short. splitting is off until this is called, and the
+ * setting is stored in the file header.
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @max_load:      max load factor in percent (0 disables splitting)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_set_max_load(struct hashdb *hp, hashdb_size_t max_load);
+
+/**
+ * Set when changes are on disk (HASHDB_FLAG_WAL):
+ *
+ * with HASHDB_DURABLE_OP, hashdb_set(), hashdb_rm() and the batched
+ * calls fail if the commit after them fails, even though the change
+ * was made.
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @durability:    HASHDB_DURABLE_*
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_set_durability(struct hashdb *hp, int durability);
+
+/**
+ * Commit changes to write-ahead log (HASHDB_FLAG_WAL):
+ *
+ * with HASHDB_DURABLE_BATCH and HASHDB_DURABLE_OP, every change made
+ * before the call is on disk when it returns. callers that commit at
+ * the same time share one sync (group commit).
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_commit(struct hashdb *hp);
+
 /**
  * Add key/value pair to hashdb:
  *
+ * if the node table is full and HASHDB_FLAG_GROW is set then the
+ * node table is doubled in size, and once hashdb_set_max_load() is
+ * called a set may double the hash table. both may move the mapping,
+ * so any pointers returned by earlier calls are invalidated (except
+ * with HASHDB_FLAG_CONCURRENT, where the mapping never moves).
+ *
  * args:
  *      @hp:    pointer to hashdb
  *      @key:   key
@@ -188,6 +812,56 @@ extern void *hashdb_set(struct hashdb *hp, void *key, void *value);
  */
 extern void *hashdb_get(struct hashdb *hp, void *key);
 
+/**
+ * Get value of key/value pair:
+ *
+ * pairs returned by hashdb calls point at the key. the value follows
+ * it, except with HASHDB_FORMAT_VAR (see HASHDB_VAR_VALUE()) and with
+ * HASHDB_FLAG_SOA, where it is in the block of the node.
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @pair:  key/value pair
+ * ret:
+ *      @success:       pointer to value
+ *      @failure:       does not fail
+ */
+extern void *hashdb_value(struct hashdb *hp, void *pair);
+
+/**
+ * Retrieve key/value pair from hashdb for reading only:
+ *
+ * same as hashdb_get(), for HASHDB_FLAG_RDONLY where the pair can not
+ * be changed through the pointer.
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @key:   key
+ * ret:
+ *      @success:       pointer to key/value pair in mapping of file
+ *      @failure:       NULL (if error happens than errno is set)
+ */
+extern const void *hashdb_get_const(struct hashdb *hp, const void *key);
+
+/**
+ * Copy value of key/value pair out of hashdb:
+ *
+ * unlike dereferencing the pointer from hashdb_get(), the copy is
+ * never torn by another thread overwriting the value at the same time.
+ * with HASHDB_FLAG_CONCURRENT readers do not take locks: each value
+ * write bumps a version counter of its stripe of buckets, and the copy
+ * is retried until it did not overlap a write.
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @key:   key
+ *      @value: where to copy value (value size rounded up to 8 bytes)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (ENOENT if key is missing)
+ */
+extern int hashdb_get_copy(struct hashdb *hp, void *key, void *value);
+
 /**
  * Remove key/value pair from hashdb:
  *
@@ -200,4 +874,447 @@ extern void *hashdb_get(struct hashdb *hp, void *key);
  */
 extern int hashdb_rm(struct hashdb *hp, void *key);
 
+/**
+ * Retrieve many key/value pairs from hashdb:
+ *
+ * keys are hashed and their buckets and chains prefetched in groups
+ * of HASHDB_BATCH, so cache misses of different keys overlap.
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @keys:  keys
+ *      @ptrs:  where to store pointers to pairs (NULL if not found)
+ *      @n:     number of keys
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_get_many(struct hashdb *hp,
+                           void **keys,
+                           void **ptrs,
+                           hashdb_size_t n);
+
+/**
+ * Add many key/value pairs to hashdb:
+ *
+ * pairs are added in order, so a later key wins over an earlier
+ * equal key.
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @keys:          keys
+ *      @values:        values
+ *      @n:             number of pairs
+ * ret:
+ *      @success:       n
+ *      @failure:       number of pairs added and errno set
+ */
+extern hashdb_size_t hashdb_set_many(struct hashdb *hp,
+                                     void **keys,
+                                     void **values,
+                                     hashdb_size_t n);
+
+/**
+ * Remove many key/value pairs from hashdb:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @keys:  keys of pairs to remove
+ *      @n:     number of keys
+ * ret:
+ *      @success:       number of pairs removed (missing keys are skipped)
+ *      @failure:       0 and errno set
+ */
+extern hashdb_size_t hashdb_rm_many(struct hashdb *hp,
+                                    void **keys,
+                                    hashdb_size_t n);
+
+/**
+ * Hash many keys the way hashdb does:
+ *
+ * with hashdb_hash_xx() keys are hashed a few at a time with SIMD.
+ * the batched calls hash their keys this way.
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @keys:          keys
+ *      @hashes:        where to store hashes
+ *      @n:             number of keys
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_hash_many(struct hashdb *hp,
+                            void **keys,
+                            hashdb_size_t *hashes,
+                            hashdb_size_t n);
+
+/**
+ * Open cursors over all key/value pairs of hashdb:
+ *
+ * the node table is split into @nr ranges with one cursor each, which
+ * visits the pairs of its range in the order they are stored. until
+ * hashdb_cursor_close(), calls through @hp that change the hashdb fail
+ * with EBUSY, but values may be changed through the returned pointers.
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @cursors:       cursors to open
+ *      @nr:            number of cursors
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_cursor_open(struct hashdb *hp,
+                              struct hashdb_cursor *cursors,
+                              hashdb_size_t nr);
+
+/**
+ * Get next key/value pair of cursor:
+ *
+ * args:
+ *      @cp:    pointer to cursor
+ * ret:
+ *      @success:       pointer to key/value pair (as from hashdb_get()
+ *                      or hashdb_get_var())
+ *      @failure:       NULL at end of range
+ */
+extern void *hashdb_cursor_next(struct hashdb_cursor *cp);
+
+/**
+ * Close cursors opened together by hashdb_cursor_open():
+ *
+ * args:
+ *      @cursors:       cursors
+ *      @nr:            number of cursors
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_cursor_close(struct hashdb_cursor *cursors,
+                                hashdb_size_t nr);
+
+/**
+ * Compact hashdb a few nodes at a time (HASHDB_FORMAT_CHAIN):
+ *
+ * moves pairs so each chain takes nodes next to each other, bucket
+ * after bucket, and gives back free nodes at the end once done (see
+ * README.md). moving pairs invalidates pointers from earlier calls.
+ * with HASHDB_FLAG_WAL one call does it all (@max_nodes is ignored).
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @max_nodes:     max number of nodes to look at (0 for no limit)
+ * ret:
+ *      @success:       1 if compaction is done, 0 if more calls are
+ *                      needed
+ *      @failure:       -1 and errno set (ENOMEM if a pair in the way
+ *                      has no free node to go to)
+ */
+extern int hashdb_compact(struct hashdb *hp, hashdb_size_t max_nodes);
+
+/**
+ * Get statistics of hashdb:
+ *
+ * sizes and the chain length histogram are taken by walking all
+ * buckets with writers held off, so this takes time in proportion to
+ * the size of the table. counters are summed over all threads and
+ * cover calls made since hashdb was opened with HASHDB_FLAG_STATS. the
+ * average number of probes of an operation is ht_probes divided by
+ * ht_gets + ht_sets + ht_rms.
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @sp:    where to store statistics
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_stats(struct hashdb *hp, struct hashdb_stats *sp);
+
+/**
+ * Get latency histogram of an operation:
+ *
+ * only builds with HASHDB_TRACE defined keep histograms: one in
+ * HASHDB_TRACE_SAMPLE calls is timed into buckets that split each power
+ * of 2 of nanoseconds in 2^HASHDB_LATENCY_SHIFT (see README.md).
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @op:    HASHDB_OP_*
+ *      @lp:    where to store histogram
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (ENOTSUP without HASHDB_TRACE)
+ */
+extern int hashdb_latency(struct hashdb *hp,
+                          int op,
+                          struct hashdb_latency *lp);
+
+/**
+ * Get fewest nanoseconds counted in bucket of latency histogram:
+ *
+ * args:
+ *      @i:     index in hy_hist
+ * ret:
+ *      @success:       nanoseconds
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_latency_value(hashdb_size_t i);
+
+/**
+ * Get percentile of latency histogram:
+ *
+ * args:
+ *      @lp:    latency histogram
+ *      @pct:   percentile (99.9 for p99.9)
+ * ret:
+ *      @success:       nanoseconds within which @pct percent of calls
+ *                      took (0 if no calls were timed)
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_latency_percentile(const struct hashdb_latency *lp,
+                                               double pct);
+
+/**
+ * Publish file of hashdb under another name:
+ *
+ * the file is synced and then renamed to @path, so a process opening
+ * @path gets either the old file or all of the new one (see
+ * hashdb_replaced()). @hp stays open for lookups but is read-only from
+ * now on: changes fail with EROFS. the file header says so too, so
+ * this holds for other processes that have it open and later opens.
+ *
+ * args:
+ *      @hp:    pointer to hashdb (not HASHDB_FLAG_WAL)
+ *      @path:  pathname to publish file as
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_publish(struct hashdb *hp, const char *path);
+
+/**
+ * Has file of hashdb been replaced?:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       1 if pathname of hashdb now names another file
+ *                      (or none), 0 if not
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_replaced(struct hashdb *hp);
+
+/**
+ * Add key/value pair of any size to hashdb (HASHDB_FORMAT_VAR):
+ *
+ * the pair takes as many nodes as it needs, rounded up to a power of 2
+ * (see README.md). the returned pointer is to the key, and
+ * HASHDB_VAR_KEY_SIZE(), HASHDB_VAR_VALUE_SIZE() and HASHDB_VAR_VALUE()
+ * get the rest of the pair from it.
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @key:           key
+ *      @key_size:      size of key
+ *      @value:         value
+ *      @value_size:    size of value
+ * ret:
+ *      @success:       pointer to key/value pair
+ *      @failure:       NULL and errno set
+ */
+extern void *hashdb_set_var(struct hashdb *hp,
+                            void *key,
+                            hashdb_size_t key_size,
+                            void *value,
+                            hashdb_size_t value_size);
+
+/**
+ * Retrieve key/value pair of any size from hashdb (HASHDB_FORMAT_VAR):
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @key:           key
+ *      @key_size:      size of key
+ * ret:
+ *      @success:       pointer to key/value pair
+ *      @failure:       NULL (if error happens than errno is set)
+ */
+extern void *hashdb_get_var(struct hashdb *hp,
+                            void *key,
+                            hashdb_size_t key_size);
+
+/**
+ * Copy value of key/value pair of any size out of hashdb:
+ *
+ * with HASHDB_FLAG_CONCURRENT or HASHDB_FLAG_SHARED, other threads or
+ * processes may reuse the nodes of a pair once hashdb_get_var() has
+ * returned, so this is the only safe way to read it.
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @key:           key
+ *      @key_size:      size of key
+ *      @value:         where to copy value
+ *      @value_size:    size of @value, set to size of value
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (ENOENT if key is missing,
+ *                      ERANGE if @value is too small)
+ */
+extern int hashdb_get_copy_var(struct hashdb *hp,
+                               void *key,
+                               hashdb_size_t key_size,
+                               void *value,
+                               hashdb_size_t *value_size);
+
+/**
+ * Remove key/value pair of any size from hashdb (HASHDB_FORMAT_VAR):
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @key:           key of pair to remove
+ *      @key_size:      size of key
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_rm_var(struct hashdb *hp,
+                         void *key,
+                         hashdb_size_t key_size);
+
+/**
+ * Initialize a hashdb split into shards:
+ *
+ * keys are sent by the high bits of their hash to one of @nr_shards
+ * hashdbs, each in its own file (@path + "." + index), so writers of
+ * different shards share no cache lines (see README.md).
+ *
+ * args:
+ *      @path:          pathname prefix of shard files
+ *      @flags:         flags of each shard (not HASHDB_FLAG_VAR)
+ *      @nr_shards:     number of shards
+ *      @nr_nodes:      number of nodes, split over shards
+ *      @nr_buckets:    number of buckets, split over shards
+ *      @key_size:      key size
+ *      @value_size:    value size
+ *      @hashfn:        hash function (optional)
+ *      @cmpfn:         key comparison function (optional)
+ *      @mode:          file permissions
+ * ret:
+ *      @success:       pointer to hashdb_shards
+ *      @failure:       NULL and errno set
+ */
+extern struct hashdb_shards *hashdb_shards_init(const char *path,
+                                                uint64_t flags,
+                                                hashdb_size_t nr_shards,
+                                                hashdb_size_t nr_nodes,
+                                                hashdb_size_t nr_buckets,
+                                                hashdb_size_t key_size,
+                                                hashdb_size_t value_size,
+                                                hashdb_hashfn_t hashfn,
+                                                hashdb_cmpfn_t cmpfn,
+                                                mode_t mode);
+
+/**
+ * Open an existing hashdb split into shards:
+ *
+ * args:
+ *      @path:          pathname prefix of shard files
+ *      @flags:         flags of each shard
+ *      @nr_shards:     number of shards it was created with (each
+ *                      shard file says, EINVAL if they disagree)
+ *      @hashfn:        hash function (see hashdb_open())
+ *      @cmpfn:         key comparison function (optional)
+ * ret:
+ *      @success:       pointer to hashdb_shards
+ *      @failure:       NULL and errno set
+ */
+extern struct hashdb_shards *hashdb_shards_open(const char *path,
+                                                uint64_t flags,
+                                                hashdb_size_t nr_shards,
+                                                hashdb_hashfn_t hashfn,
+                                                hashdb_cmpfn_t cmpfn);
+
+/**
+ * Free hashdb_shards (see hashdb_free()):
+ *
+ * args:
+ *      @spp:   pointer to pointer to hashdb_shards
+ *      @fully: remove shard files too
+ * ret:
+ *      @success:       0 and *spp set to NULL
+ *      @failure:       -1 and errno set (shards not yet freed are
+ *                      still open)
+ */
+extern int hashdb_shards_free(struct hashdb_shards **spp, bool fully);
+
+/**
+ * Get shard a key goes to:
+ *
+ * args:
+ *      @sp:    pointer to hashdb_shards
+ *      @key:   key
+ * ret:
+ *      @success:       index in hm_shards
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_shards_which(struct hashdb_shards *sp,
+                                         void *key);
+
+/**
+ * Work like hashdb_set(), hashdb_get(), hashdb_get_copy() and
+ * hashdb_rm() on the shard of @key:
+ *
+ * without HASHDB_FLAG_CONCURRENT, a pointer returned by set or get
+ * stays valid only until another thread changes that shard.
+ */
+extern void *hashdb_shards_set(struct hashdb_shards *sp,
+                               void *key,
+                               void *value);
+extern void *hashdb_shards_get(struct hashdb_shards *sp, void *key);
+extern int hashdb_shards_get_copy(struct hashdb_shards *sp,
+                                  void *key,
+                                  void *value);
+extern int hashdb_shards_rm(struct hashdb_shards *sp, void *key);
+
+/**
+ * Work like hashdb_get_many(), hashdb_set_many() and hashdb_rm_many()
+ * across shards:
+ *
+ * keys are taken a batch at a time and sorted by shard, keeping their
+ * order, so each shard is locked once per batch and gets all of its
+ * keys in one call. set_many returns the number of pairs added, which
+ * on failure need not be the first ones.
+ */
+extern int hashdb_shards_get_many(struct hashdb_shards *sp,
+                                  void **keys,
+                                  void **ptrs,
+                                  hashdb_size_t n);
+extern hashdb_size_t hashdb_shards_set_many(struct hashdb_shards *sp,
+                                            void **keys,
+                                            void **values,
+                                            hashdb_size_t n);
+extern hashdb_size_t hashdb_shards_rm_many(struct hashdb_shards *sp,
+                                           void **keys,
+                                           hashdb_size_t n);
+
+/**
+ * Compact one shard (see hashdb_compact()):
+ *
+ * other shards are not held up.
+ *
+ * args:
+ *      @sp:            pointer to hashdb_shards
+ *      @shard:         index of shard
+ *      @max_nodes:     max number of nodes to look at (0 for no limit)
+ * ret:
+ *      @success:       1 if compaction of shard is done, 0 if not
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_shards_compact(struct hashdb_shards *sp,
+                                 hashdb_size_t shard,
+                                 hashdb_size_t max_nodes);
+
 #endif
@@ -0,0 +1,556 @@
+#include "hashdb_priv.h"
+
+enum {
+        /* max number of threads of hashdb_build() */
+        BUILD_MAX_THREAD        = 256,
+        /* buckets per partition, so sorting one stays in cache */
+        BUILD_PART_BUCKETS      = 1 << 14,
+        /* max number of partitions, so scattering to them does too */
+        BUILD_MAX_PART          = 1 << 12,
+};
+
+/* get record i (key, then value) */
+#define BUILD_REC(bp, i)                                                       \
+        ((bp)->hb_recs + (((bp)->hb_key_size + (bp)->hb_value_size) * (i)))
+
+/* get bucket of entry */
+#define BUILD_BUCKET(bp, ep) \
+        hashdb_bucket((bp)->hb_hp->hd_hdr, (ep)->be_hash)
+
+/* record and its hash, so sorting by bucket never goes back to hb_hashes */
+struct build_ent {
+        /* hash of key */
+        hashdb_size_t   be_hash;
+        /* index of record */
+        hashdb_size_t   be_rec;
+};
+
+/* state shared by threads of one hashdb_build() */
+struct build {
+        /* hashdb being built */
+        struct hashdb           *hb_hp;
+        /* records */
+        const unsigned char     *hb_recs;
+        /* number of records */
+        hashdb_size_t           hb_nr_recs;
+        /* size of key in record (hh_key_size may be padded) */
+        hashdb_size_t           hb_key_size;
+        /* size of value in record */
+        hashdb_size_t           hb_value_size;
+        /* number of threads */
+        hashdb_size_t           hb_nr_threads;
+        /* number of partitions of buckets (at least one per thread) */
+        hashdb_size_t           hb_nr_parts;
+        /* what to do with duplicate keys (HASHDB_DUPS_*) */
+        int                     hb_dups;
+        /* first error of any thread, 0 if none */
+        int                     hb_errno;
+        /* hash of each record */
+        hashdb_size_t           *hb_hashes;
+        /* records by partition, then pairs kept by bucket */
+        struct build_ent        *hb_ents;
+        /* records of each partition by bucket */
+        struct build_ent        *hb_tmp;
+        /* records per thread and partition, then where they go in hb_ents */
+        hashdb_size_t           *hb_counts;
+        /* first record of each partition in hb_ents (and one past last) */
+        hashdb_size_t           *hb_parts;
+        /* pairs kept per partition, then first node of each partition */
+        hashdb_size_t           *hb_kept;
+        /* records per bucket, then pairs kept per bucket */
+        hashdb_size_t           *hb_chains;
+        /* threads */
+        pthread_t               *hb_threads;
+        /* argument of each thread */
+        struct build_arg        *hb_args;
+};
+
+/* argument of one build thread */
+struct build_arg {
+        /* shared state */
+        struct build    *ba_bp;
+        /* index of thread */
+        hashdb_size_t   ba_id;
+        /* first partition of thread */
+        hashdb_size_t   ba_first;
+        /* one past last partition of thread */
+        hashdb_size_t   ba_last;
+};
+
+/* allocate arrays of build, returns -1 and sets errno on failure */
+static int build_alloc(struct build *bp);
+
+/* free arrays of build */
+static void build_free(struct build *bp);
+
+/* run fn on every thread, returns -1 and sets errno if one failed */
+static int build_run(struct build *bp, void *(*fn)(void *));
+
+/* save error of thread, unless another one was saved first */
+static void build_fail(struct build *bp, int err);
+
+/* get partition of bucket */
+static hashdb_size_t build_part(struct build *bp, hashdb_size_t bucket);
+
+/* get first bucket of partition */
+static hashdb_size_t build_first(struct build *bp, hashdb_size_t part);
+
+/* get key of record as hashdb sees it, padded in buf if it has to be */
+static const void *build_key(struct build *bp,
+                             hashdb_size_t rec,
+                             unsigned char *buf);
+
+/* do records have the same key? */
+static bool build_same(struct build *bp,
+                       const struct build_ent *a,
+                       const struct build_ent *b,
+                       unsigned char *bufs);
+
+/* hash records of thread and count them per partition */
+static void *build_hash(void *arg);
+
+/* put records of thread in hb_ents by partition */
+static void *build_scatter(void *arg);
+
+/* sort records of partitions of thread by bucket, dropping duplicates */
+static void *build_sort(void *arg);
+
+/* sort records of partition by bucket and drop duplicates */
+static int build_sort_part(struct build *bp,
+                           hashdb_size_t part,
+                           unsigned char *bufs);
+
+/* write chains of partitions of thread to nodes and buckets */
+static void *build_write(void *arg);
+
+/* write chains of partition to nodes and buckets */
+static void build_write_part(struct build *bp, hashdb_size_t part);
+
+int
+hashdb_build(const char *path,
+             uint64_t flags,
+             const void *recs,
+             hashdb_size_t nr_recs,
+             hashdb_size_t nr_buckets,
+             hashdb_size_t key_size,
+             hashdb_size_t value_size,
+             hashdb_hashfn_t hashfn,
+             hashdb_cmpfn_t cmpfn,
+             mode_t mode,
+             int dups,
+             hashdb_size_t nr_threads)
+{
+        struct build build;
+        struct build *bp = &build;
+        hashdb_size_t *counts = NULL;
+        hashdb_size_t nr_parts;
+        hashdb_size_t node;
+        hashdb_size_t off;
+        hashdb_size_t nr;
+        hashdb_size_t t;
+        hashdb_size_t p;
+        int saved_errno;
+
+        /* only the file format matters here, open decides the rest */
+        if (!recs || (flags & ~(uint64_t)HASHDB_FLAGS_FORMAT) ||
+            (dups != HASHDB_DUPS_LAST && dups != HASHDB_DUPS_ERROR) ||
+            !nr_threads || nr_threads > BUILD_MAX_THREAD) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        memset(bp, 0, sizeof(*bp));
+        bp->hb_recs = recs;
+        bp->hb_nr_recs = nr_recs;
+        bp->hb_key_size = key_size;
+        bp->hb_value_size = value_size;
+        bp->hb_nr_threads = nr_threads;
+        bp->hb_dups = dups;
+        bp->hb_hp = hashdb_init(path, flags, nr_recs, nr_buckets, key_size,
+                                value_size, hashfn, cmpfn, mode);
+        if (!bp->hb_hp)
+                return -1;
+        nr_parts = bp->hb_hp->hd_hdr->hh_nr_buckets / BUILD_PART_BUCKETS;
+        if (nr_parts > BUILD_MAX_PART)
+                nr_parts = BUILD_MAX_PART;
+        if (nr_parts < nr_threads)
+                nr_parts = nr_threads;
+        bp->hb_nr_parts = nr_parts;
+        if (build_alloc(bp))
+                goto fail;
+
+        if (build_run(bp, build_hash))
+                goto fail;
+
+        /* partitions in order, and records of a thread in order in each */
+        counts = bp->hb_counts;
+        off = 0;
+        for (p = 0; p < nr_parts; ++p) {
+                bp->hb_parts[p] = off;
+                for (t = 0; t < nr_threads; ++t) {
+                        nr = counts[(nr_parts * t) + p];
+                        counts[(nr_parts * t) + p] = off;
+                        off += nr;
+                }
+        }
+        bp->hb_parts[nr_parts] = off;
+
+        if (build_run(bp, build_scatter) || build_run(bp, build_sort))
+                goto fail;
+
+        /* chains are laid out in bucket order, like hashdb_compact() */
+        node = 1;
+        for (p = 0; p < nr_parts; ++p) {
+                nr = bp->hb_kept[p];
+                bp->hb_kept[p] = node;
+                node += nr;
+        }
+
+        if (build_run(bp, build_write))
+                goto fail;
+
+        bp->hb_hp->hd_hdr->hh_nr_live = node - 1;
+        bp->hb_hp->hd_hdr->hh_bump = node;
+        build_free(bp);
+        return hashdb_free(&bp->hb_hp, false);
+
+fail:
+        saved_errno = errno;
+        build_free(bp);
+        hashdb_free(&bp->hb_hp, true);
+        errno = saved_errno;
+        return -1;
+}
+
+static int
+build_alloc(struct build *bp)
+{
+        hashdb_size_t nr_threads = bp->hb_nr_threads;
+        hashdb_size_t nr_parts = bp->hb_nr_parts;
+        hashdb_size_t nr_recs = bp->hb_nr_recs;
+        hashdb_size_t i;
+
+        bp->hb_hashes = malloc(sizeof(*bp->hb_hashes) * nr_recs);
+        bp->hb_ents = malloc(sizeof(*bp->hb_ents) * nr_recs);
+        bp->hb_tmp = malloc(sizeof(*bp->hb_tmp) * nr_recs);
+        bp->hb_counts = calloc(nr_threads * nr_parts, sizeof(*bp->hb_counts));
+        bp->hb_parts = malloc(sizeof(*bp->hb_parts) * (nr_parts + 1));
+        bp->hb_kept = malloc(sizeof(*bp->hb_kept) * nr_parts);
+        bp->hb_chains = malloc(sizeof(*bp->hb_chains) *
+                               bp->hb_hp->hd_hdr->hh_nr_buckets);
+        bp->hb_threads = malloc(sizeof(*bp->hb_threads) * nr_threads);
+        bp->hb_args = malloc(sizeof(*bp->hb_args) * nr_threads);
+        if (!bp->hb_hashes || !bp->hb_ents || !bp->hb_tmp ||
+            !bp->hb_counts || !bp->hb_parts || !bp->hb_kept ||
+            !bp->hb_chains || !bp->hb_threads || !bp->hb_args)
+                return -1;
+
+        for (i = 0; i < nr_threads; ++i) {
+                bp->hb_args[i].ba_bp = bp;
+                bp->hb_args[i].ba_id = i;
+                bp->hb_args[i].ba_first = (nr_parts * i) / nr_threads;
+                bp->hb_args[i].ba_last = (nr_parts * (i + 1)) / nr_threads;
+        }
+        return 0;
+}
+
+static void
+build_free(struct build *bp)
+{
+        free(bp->hb_args);
+        free(bp->hb_threads);
+        free(bp->hb_chains);
+        free(bp->hb_kept);
+        free(bp->hb_parts);
+        free(bp->hb_counts);
+        free(bp->hb_tmp);
+        free(bp->hb_ents);
+        free(bp->hb_hashes);
+}
+
+static int
+build_run(struct build *bp, void *(*fn)(void *))
+{
+        hashdb_size_t nr;
+        hashdb_size_t i;
+        int err;
+
+        for (nr = 0; nr < bp->hb_nr_threads; ++nr) {
+                err = pthread_create(&bp->hb_threads[nr], NULL, fn,
+                                     &bp->hb_args[nr]);
+                if (err) {
+                        build_fail(bp, err);
+                        break;
+                }
+        }
+        for (i = 0; i < nr; ++i)
+                pthread_join(bp->hb_threads[i], NULL);
+
+        if (bp->hb_errno) {
+                errno = bp->hb_errno;
+                return -1;
+        }
+        return 0;
+}
+
+static void
+build_fail(struct build *bp, int err)
+{
+        int none = 0;
+
+        __atomic_compare_exchange_n(&bp->hb_errno, &none, err, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static hashdb_size_t
+build_part(struct build *bp, hashdb_size_t bucket)
+{
+        return (bucket * bp->hb_nr_parts) / bp->hb_hp->hd_hdr->hh_nr_buckets;
+}
+
+static hashdb_size_t
+build_first(struct build *bp, hashdb_size_t part)
+{
+        hashdb_size_t nr_buckets = bp->hb_hp->hd_hdr->hh_nr_buckets;
+
+        /* first bucket b with build_part(b) == part */
+        return ((part * nr_buckets) + bp->hb_nr_parts - 1) / bp->hb_nr_parts;
+}
+
+static const void *
+build_key(struct build *bp, hashdb_size_t rec, unsigned char *buf)
+{
+        /* padding in buf is zero, like padding of keys in nodes */
+        if (!buf)
+                return BUILD_REC(bp, rec);
+
+        memcpy(buf, BUILD_REC(bp, rec), bp->hb_key_size);
+        return buf;
+}
+
+static bool
+build_same(struct build *bp,
+           const struct build_ent *a,
+           const struct build_ent *b,
+           unsigned char *bufs)
+{
+        struct hashdb *hp = bp->hb_hp;
+        hashdb_size_t key_size = hp->hd_hdr->hh_key_size;
+
+        if (a->be_hash != b->be_hash)
+                return false;
+
+        return !hp->hd_cmpfn(build_key(bp, a->be_rec, bufs),
+                             build_key(bp, b->be_rec,
+                                       bufs ? bufs + key_size : NULL),
+                             key_size);
+}
+
+static void *
+build_hash(void *arg)
+{
+        struct build_arg *ap = arg;
+        struct build *bp = ap->ba_bp;
+        struct hashdb *hp = bp->hb_hp;
+        hashdb_size_t key_size = hp->hd_hdr->hh_key_size;
+        hashdb_size_t *counts = NULL;
+        unsigned char *buf = NULL;
+        hashdb_size_t hash;
+        hashdb_size_t start;
+        hashdb_size_t end;
+        hashdb_size_t i;
+
+        if (bp->hb_key_size != key_size) {
+                buf = calloc(1, key_size);
+                if (!buf) {
+                        build_fail(bp, errno);
+                        return NULL;
+                }
+        }
+
+        counts = bp->hb_counts + (bp->hb_nr_parts * ap->ba_id);
+        start = (bp->hb_nr_recs * ap->ba_id) / bp->hb_nr_threads;
+        end = (bp->hb_nr_recs * (ap->ba_id + 1)) / bp->hb_nr_threads;
+        for (i = start; i < end; ++i) {
+                hash = hp->hd_hashfn(build_key(bp, i, buf), key_size);
+                bp->hb_hashes[i] = hash;
+                ++counts[build_part(bp, hashdb_bucket(hp->hd_hdr, hash))];
+        }
+
+        free(buf);
+        return NULL;
+}
+
+static void *
+build_scatter(void *arg)
+{
+        struct build_arg *ap = arg;
+        struct build *bp = ap->ba_bp;
+        hashdb_size_t *counts = NULL;
+        struct build_ent *ep = NULL;
+        hashdb_size_t hash;
+        hashdb_size_t start;
+        hashdb_size_t end;
+        hashdb_size_t i;
+
+        counts = bp->hb_counts + (bp->hb_nr_parts * ap->ba_id);
+        start = (bp->hb_nr_recs * ap->ba_id) / bp->hb_nr_threads;
+        end = (bp->hb_nr_recs * (ap->ba_id + 1)) / bp->hb_nr_threads;
+        for (i = start; i < end; ++i) {
+                hash = bp->hb_hashes[i];
+                ep = &bp->hb_ents[counts[build_part(bp,
+                                hashdb_bucket(bp->hb_hp->hd_hdr, hash))]++];
+                ep->be_hash = hash;
+                ep->be_rec = i;
+        }
+
+        return NULL;
+}
+
+static void *
+build_sort(void *arg)
+{
+        struct build_arg *ap = arg;
+        struct build *bp = ap->ba_bp;
+        hashdb_size_t key_size = bp->hb_hp->hd_hdr->hh_key_size;
+        unsigned char *bufs = NULL;
+        hashdb_size_t part;
+
+        if (bp->hb_key_size != key_size) {
+                bufs = calloc(2, key_size);
+                if (!bufs) {
+                        build_fail(bp, errno);
+                        return NULL;
+                }
+        }
+
+        for (part = ap->ba_first; part < ap->ba_last; ++part) {
+                if (build_sort_part(bp, part, bufs))
+                        break;
+        }
+
+        free(bufs);
+        return NULL;
+}
+
+static int
+build_sort_part(struct build *bp, hashdb_size_t part, unsigned char *bufs)
+{
+        struct build_ent *ents = bp->hb_ents;
+        struct build_ent *tmp = bp->hb_tmp;
+        hashdb_size_t *chains = bp->hb_chains;
+        hashdb_size_t bucket;
+        hashdb_size_t first;
+        hashdb_size_t kept;
+        hashdb_size_t last;
+        hashdb_size_t off;
+        hashdb_size_t end;
+        hashdb_size_t nr;
+        hashdb_size_t lo;
+        hashdb_size_t hi;
+        hashdb_size_t j;
+        hashdb_size_t k;
+
+        lo = build_first(bp, part);
+        hi = build_first(bp, part + 1);
+        first = bp->hb_parts[part];
+        last = bp->hb_parts[part + 1];
+
+        /* counting sort keeps records of a bucket in order */
+        for (bucket = lo; bucket < hi; ++bucket)
+                chains[bucket] = 0;
+        for (j = first; j < last; ++j)
+                ++chains[BUILD_BUCKET(bp, &ents[j])];
+        off = first;
+        for (bucket = lo; bucket < hi; ++bucket) {
+                nr = chains[bucket];
+                chains[bucket] = off;
+                off += nr;
+        }
+        for (j = first; j < last; ++j)
+                tmp[chains[BUILD_BUCKET(bp, &ents[j])]++] = ents[j];
+
+        /*
+         * chains[] now has end of each bucket in tmp. pairs kept go back
+         * to ents, a later duplicate taking the place of the first one
+         */
+        kept = first;
+        j = first;
+        for (bucket = lo; bucket < hi; ++bucket) {
+                end = chains[bucket];
+                for (nr = 0; j < end; ++j) {
+                        for (k = kept; k < kept + nr; ++k) {
+                                if (build_same(bp, &ents[k], &tmp[j], bufs))
+                                        break;
+                        }
+                        if (k == kept + nr) {
+                                ents[kept + nr++] = tmp[j];
+                                continue;
+                        }
+                        if (bp->hb_dups == HASHDB_DUPS_ERROR) {
+                                build_fail(bp, EEXIST);
+                                return -1;
+                        }
+                        ents[k] = tmp[j];
+                }
+                chains[bucket] = nr;
+                kept += nr;
+        }
+
+        bp->hb_kept[part] = kept - first;
+        return 0;
+}
+
+static void *
+build_write(void *arg)
+{
+        struct build_arg *ap = arg;
+        hashdb_size_t part;
+
+        for (part = ap->ba_first; part < ap->ba_last; ++part)
+                build_write_part(ap->ba_bp, part);
+
+        return NULL;
+}
+
+static void
+build_write_part(struct build *bp, hashdb_size_t part)
+{
+        struct hashdb *hp = bp->hb_hp;
+        const unsigned char *rec = NULL;
+        struct build_ent *ep = NULL;
+        unsigned char *p = NULL;
+        hashdb_size_t bucket;
+        hashdb_size_t node;
+        hashdb_size_t nr;
+        hashdb_size_t hi;
+        hashdb_size_t j;
+        hashdb_size_t k;
+
+        /* file starts out as holes, so empty buckets and padding are 0 */
+        node = bp->hb_kept[part];
+        j = bp->hb_parts[part];
+        hi = build_first(bp, part + 1);
+        for (bucket = build_first(bp, part); bucket < hi; ++bucket) {
+                nr = bp->hb_chains[bucket];
+                if (!nr)
+                        continue;
+
+                hashdb_link_set(hp,
+                                HASHDB_BUCKET_LINK(hp, hp->hd_hash_tab, bucket),
+                                node);
+                for (k = 0; k < nr; ++k, ++node) {
+                        ep = &bp->hb_ents[j + k];
+                        rec = BUILD_REC(bp, ep->be_rec);
+                        p = HASHDB_NODE(hp, node);
+                        memcpy(p + hp->hd_key_off, rec, bp->hb_key_size);
+                        memcpy(HASHDB_VALUE(hp, node),
+                               rec + bp->hb_key_size,
+                               bp->hb_value_size);
+                        if (hp->hd_flags & HASHDB_FLAG_HASH)
+                                HASHDB_NODE_HASH(p) = ep->be_hash;
+                        hashdb_link_set(hp, p, k + 1 < nr ? node + 1 : 0);
+                }
+                j += nr;
+        }
+}
@@ -0,0 +1,259 @@
+#include "hashdb_priv.h"
+#include "hashdb_compact.h"
+#include "hashdb_evict.h"
+#include "hashdb_wal.h"
+
+/* get node of hashdb */
+#define COMPACT_NODE(hp, i) \
+        HASHDB_NODE(hp, i)
+
+/* get hn_next of node (a link, see hashdb_link_get()) */
+#define COMPACT_NEXT(hp, i) \
+        ((void *)COMPACT_NODE(hp, i))
+
+/* start compaction: link free list both ways */
+static void compact_begin(struct hashdb *hp);
+
+/* find link that points to node, NULL if node is not in a chain */
+static void *compact_pred(struct hashdb *hp, hashdb_size_t node);
+
+/* take free node off free list wherever it is */
+static void compact_unlink(struct hashdb *hp, hashdb_size_t node);
+
+/* copy node and its value (apart from it with HASHDB_FLAG_SOA) */
+static void compact_copy(struct hashdb *hp,
+                         hashdb_size_t dst,
+                         hashdb_size_t src);
+
+/* log pairs in nodes about to be written over, up to *endp (one sync) */
+static int compact_log(struct hashdb *hp,
+                       unsigned char *held,
+                       hashdb_size_t *endp);
+
+/* take node at hh_compact_next for the next pair of a chain */
+static void compact_take(struct hashdb *hp, hashdb_size_t node,
+                         unsigned char *held);
+
+/* move pair *link points to into hh_compact_next */
+static int compact_place(struct hashdb *hp, void *link, unsigned char *held);
+
+static void
+compact_begin(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t prev;
+        hashdb_size_t node;
+
+        prev = 0;
+        node = hdr->hh_free;
+        while (node) {
+                hashdb_link_set(hp,
+                                HASHDB_FREE_PREV(hp, COMPACT_NODE(hp, node)),
+                                prev);
+                prev = node;
+                node = hashdb_link_get(hp, COMPACT_NEXT(hp, node));
+        }
+
+        hdr->hh_compact_bucket = 0;
+        hdr->hh_compact_next = 1;
+}
+
+static void *
+compact_pred(struct hashdb *hp, hashdb_size_t node)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *p = NULL;
+        hashdb_size_t curr;
+        hashdb_size_t hash;
+        void *link = NULL;
+
+        /* a free node hashes to some bucket too, it just is not there */
+        p = COMPACT_NODE(hp, node);
+        if (hp->hd_flags & HASHDB_FLAG_HASH)
+                hash = HASHDB_NODE_HASH(p);
+        else
+                hash = hp->hd_hashfn(p + hp->hd_key_off, hdr->hh_key_size);
+
+        link = hashdb_bucket_link(hp, hashdb_bucket(hdr, hash));
+        while ((curr = hashdb_link_get(hp, link)) && curr != node)
+                link = COMPACT_NEXT(hp, curr);
+
+        return curr ? link : NULL;
+}
+
+static void
+compact_unlink(struct hashdb *hp, hashdb_size_t node)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *p = NULL;
+        hashdb_size_t prev;
+        hashdb_size_t next;
+
+        p = COMPACT_NODE(hp, node);
+        prev = hashdb_link_get(hp, HASHDB_FREE_PREV(hp, p));
+        next = hashdb_link_get(hp, p);
+        if (prev)
+                hashdb_link_set(hp, COMPACT_NEXT(hp, prev), next);
+        else
+                hdr->hh_free = next;
+        if (next) {
+                hashdb_link_set(hp,
+                                HASHDB_FREE_PREV(hp, COMPACT_NODE(hp, next)),
+                                prev);
+        }
+        --hdr->hh_nr_free;
+}
+
+static void
+compact_copy(struct hashdb *hp, hashdb_size_t dst, hashdb_size_t src)
+{
+        if (!hp->hd_block_shift) {
+                memcpy(COMPACT_NODE(hp, dst),
+                       COMPACT_NODE(hp, src),
+                       hp->hd_node_size);
+                return;
+        }
+
+        memcpy(COMPACT_NODE(hp, dst), COMPACT_NODE(hp, src), hp->hd_head_size);
+        memcpy(HASHDB_VALUE(hp, dst),
+               HASHDB_VALUE(hp, src),
+               hp->hd_node_size - hp->hd_head_size);
+}
+
+static int
+compact_log(struct hashdb *hp, unsigned char *held, hashdb_size_t *endp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t node;
+        hashdb_size_t end;
+
+        /*
+         * pairs are placed at hh_compact_next on up, so the nodes past
+         * it are the ones written over next. a node held back still
+         * has the pair moved out of it, which may be in no other node
+         * the last checkpoint knows of
+         */
+        end = hdr->hh_compact_next + HASHDB_COMPACT_LOG;
+        if (end > hdr->hh_bump)
+                end = hdr->hh_bump;
+        for (node = hdr->hh_compact_next; node < end; ++node) {
+                if (!held[node] && !compact_pred(hp, node))
+                        continue;
+                hashdb_wal_append(hp, HASHDB_WAL_SET,
+                                  COMPACT_NODE(hp, node) + hp->hd_key_off,
+                                  HASHDB_VALUE(hp, node));
+        }
+
+        *endp = end;
+        return hashdb_wal_commit(hp);
+}
+
+static void
+compact_take(struct hashdb *hp, hashdb_size_t node, unsigned char *held)
+{
+        if (held && held[node])
+                held[node] = 0;
+        else
+                compact_unlink(hp, node);
+}
+
+static int
+compact_place(struct hashdb *hp, void *link, unsigned char *held)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        void *pred = NULL;
+        hashdb_size_t node;
+        hashdb_size_t dst;
+        hashdb_size_t to;
+
+        /*
+         * pair in the way is copied out before its link is changed, so
+         * lock-free readers that get past the sequence check never see
+         * it half moved
+         */
+        node = hashdb_link_get(hp, link);
+        dst = hdr->hh_compact_next;
+        pred = compact_pred(hp, dst);
+        if (pred) {
+                to = hashdb_free_pop(hp);
+                if (!to) {
+                        errno = ENOMEM;
+                        return -1;
+                }
+                compact_copy(hp, to, dst);
+                HASHDB_EVICT_MOVE(hp, dst, to);
+                hashdb_link_store(hp, pred, to);
+        } else {
+                compact_take(hp, dst, held);
+        }
+
+        compact_copy(hp, dst, node);
+        HASHDB_EVICT_MOVE(hp, node, dst);
+        hashdb_link_store(hp, link, dst);
+        if (held)
+                held[node] = 1;
+        else
+                hashdb_free_push(hp, node);
+        ++hdr->hh_compact_next;
+        return 0;
+}
+
+int
+hashdb_compact_step(struct hashdb *hp,
+                    hashdb_size_t max_nodes,
+                    unsigned char *held)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t logged;
+        hashdb_size_t curr;
+        hashdb_size_t nr;
+        void *link = NULL;
+
+        if (!hdr->hh_compact_next)
+                compact_begin(hp);
+
+        /*
+         * a bucket cut short is walked again from its head. pairs below
+         * hh_compact_next are already laid out, so only moves count and
+         * each step gets at least one node or bucket further
+         */
+        nr = 0;
+        logged = 0;
+        while (hdr->hh_compact_bucket < hdr->hh_nr_buckets) {
+                link = hashdb_bucket_link(hp, hdr->hh_compact_bucket);
+                while ((curr = hashdb_link_get(hp, link))) {
+                        if (curr < hdr->hh_compact_next) {
+                                link = COMPACT_NEXT(hp, curr);
+                                continue;
+                        }
+
+                        if (curr == hdr->hh_compact_next) {
+                                ++hdr->hh_compact_next;
+                        } else {
+                                if (held && hdr->hh_compact_next >= logged &&
+                                    compact_log(hp, held, &logged))
+                                        return -1;
+                                if (compact_place(hp, link, held))
+                                        return -1;
+                        }
+                        link = COMPACT_NEXT(hp, hashdb_link_get(hp, link));
+                        if (max_nodes && ++nr >= max_nodes)
+                                return 0;
+                }
+
+                ++hdr->hh_compact_bucket;
+                if (max_nodes && ++nr >= max_nodes)
+                        return 0;
+        }
+
+        /* free nodes left at the end need no free list */
+        while (hdr->hh_bump > 1 && !compact_pred(hp, hdr->hh_bump - 1)) {
+                compact_take(hp, --hdr->hh_bump, held);
+                if (max_nodes && ++nr >= max_nodes)
+                        return 0;
+        }
+
+        hdr->hh_compact_next = 0;
+        hdr->hh_compact_bucket = 0;
+        return 1;
+}
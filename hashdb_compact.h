@@ -0,0 +1,44 @@
+#ifndef HASHDB_COMPACT_H
+#define HASHDB_COMPACT_H
+
+#include "hashdb.h"
+
+/*
+ * compaction (see hashdb_compact()):
+ *
+ * buckets are walked in order and each pair is moved to node
+ * hh_compact_next, which then goes up by one. a pair already there is
+ * first moved to a free node, and a free node there is taken off the
+ * free list. to do that without walking the list, free nodes keep the
+ * node before them in their second link (HASHDB_FREE_PREV()) while
+ * hh_compact_next is set. once all buckets are done, free nodes at the
+ * end of the node table go back behind hh_bump.
+ *
+ * with HASHDB_FLAG_WAL a crash rebuilds chains from the nodes in them
+ * at the last checkpoint, so those must keep their pairs: a pair in the
+ * way is logged before it is written over, and nodes moved out of are
+ * held back from the free list until the next checkpoint (and logged
+ * too if they are written over before that).
+ */
+
+/**
+ * Do one step of compaction (resize lock held exclusively, free node
+ * caches drained):
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @max_nodes:     max number of nodes and buckets to lay out
+ *                      (0 for no limit)
+ *      @held:          byte for each node, set for nodes moved out of
+ *                      instead of freeing them, and pairs are logged
+ *                      before their nodes are written over (NULL to
+ *                      free them and log nothing)
+ * ret:
+ *      @success:       1 if compaction is done, 0 if not
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_compact_step(struct hashdb *hp,
+                               hashdb_size_t max_nodes,
+                               unsigned char *held);
+
+#endif
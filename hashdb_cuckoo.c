@@ -0,0 +1,482 @@
+#include "hashdb_priv.h"
+#include "hashdb_cuckoo.h"
+#include "hashdb_stats.h"
+#include "hashdb_swiss.h"
+#include "hashdb_trace.h"
+
+enum {
+        /* control byte of empty slot (same as HASHDB_FORMAT_SWISS) */
+        CUCKOO_EMPTY    = 0x80,
+        /* bits of hash stored in control byte */
+        CUCKOO_TAG_MASK = 0x7f,
+        /* control byte comes from top bits of mixed hash */
+        CUCKOO_TAG_SHIFT = 57,
+        /* most buckets looked at by one search for room */
+        CUCKOO_BFS_MAX  = 512,
+};
+
+/* odd constant that spreads control byte over bucket bits */
+#define CUCKOO_MIX \
+        ((hashdb_size_t)0x5bd1e995)
+
+/* golden ratio, moves all bits of hash into top bits taken as tag */
+#define CUCKOO_TAG_MIX  0x9e3779b97f4a7c15ULL
+
+/* get slot of hashdb */
+#define CUCKOO_SLOT(hp, i) \
+        ((hp)->hd_node_tab + ((hp)->hd_node_size * (i)))
+
+/* get control byte of hash (narrow hashes leave top bits zero) */
+#define CUCKOO_TAG(hash) \
+        ((((hash) * CUCKOO_TAG_MIX) >> CUCKOO_TAG_SHIFT) & CUCKOO_TAG_MASK)
+
+/* get first bucket of hash */
+#define CUCKOO_HOME(hp, hash) \
+        ((hash) & ((hp)->hd_hdr->hh_nr_buckets - 1))
+
+/* get other bucket of pair with control byte tag in bucket */
+#define CUCKOO_ALT(hp, bucket, tag)                                            \
+        (((bucket) ^ (((hashdb_size_t)(tag) + 1) * CUCKOO_MIX)) &              \
+         ((hp)->hd_hdr->hh_nr_buckets - 1))
+
+/* bucket looked at while searching for room */
+struct cuckoo_step {
+        /* bucket */
+        hashdb_size_t   hk_bucket;
+        /* slot in bucket of hk_parent whose pair would move here */
+        hashdb_size_t   hk_slot;
+        /* step this one came from (CUCKOO_BFS_MAX for the two buckets) */
+        hashdb_size_t   hk_parent;
+};
+
+/* find key, returns slot + 1 (or 0) and number of buckets looked at */
+static hashdb_size_t cuckoo_find(struct hashdb *hp,
+                                 const void *key,
+                                 hashdb_size_t hash,
+                                 hashdb_size_t *probesp);
+
+/* get empty slot + 1 in bucket (or 0) */
+static hashdb_size_t cuckoo_empty(struct hashdb *hp, hashdb_size_t bucket);
+
+/*
+ * make room in one of the buckets of hash, moving pairs found by
+ * breadth-first search, returns empty slot + 1 (or 0)
+ */
+static hashdb_size_t cuckoo_room(struct hashdb *hp, hashdb_size_t hash);
+
+/* is bucket on path from step i back to one of the first buckets? */
+static bool cuckoo_on_path(const struct cuckoo_step *steps,
+                           hashdb_size_t i,
+                           hashdb_size_t bucket);
+
+/* move pairs along path ending in step i, returns slot left empty */
+static hashdb_size_t cuckoo_shift(struct hashdb *hp,
+                                  const struct cuckoo_step *steps,
+                                  hashdb_size_t i,
+                                  hashdb_size_t empty);
+
+/* rebuild table with nr_slots slots (or more if pairs do not fit) */
+static int cuckoo_resize(struct hashdb *hp, hashdb_size_t nr_slots);
+
+/* size table for nr_slots slots (or more) and put saved pairs in it */
+static int cuckoo_fill(struct hashdb *hp,
+                       const unsigned char *saved,
+                       hashdb_size_t nr_saved,
+                       hashdb_size_t nr_slots);
+
+hashdb_size_t
+hashdb_cuckoo_cap(hashdb_size_t nr_nodes)
+{
+        hashdb_size_t cap = HASHDB_CUCKOO_SLOTS * 2;
+
+        /* two buckets of 8 slots fill to about 98% before inserts fail */
+        while (cap - (cap / 16) < nr_nodes)
+                cap *= 2;
+
+        return cap;
+}
+
+static hashdb_size_t
+cuckoo_find(struct hashdb *hp,
+            const void *key,
+            hashdb_size_t hash,
+            hashdb_size_t *probesp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *ctrl = NULL;
+        hashdb_size_t buckets[2];
+        hashdb_size_t slot;
+        hashdb_size_t i;
+        hashdb_size_t j;
+        unsigned char tag;
+
+        tag = CUCKOO_TAG(hash);
+        buckets[0] = CUCKOO_HOME(hp, hash);
+        buckets[1] = CUCKOO_ALT(hp, buckets[0], tag);
+
+        /* both control byte loads are started before either is used */
+        __builtin_prefetch(hp->hd_hash_tab +
+                           (buckets[1] * HASHDB_CUCKOO_SLOTS));
+        for (i = 0; i < 2; ++i) {
+                slot = buckets[i] * HASHDB_CUCKOO_SLOTS;
+                ctrl = hp->hd_hash_tab + slot;
+                for (j = 0; j < HASHDB_CUCKOO_SLOTS; ++j) {
+                        if (ctrl[j] != tag)
+                                continue;
+                        if (!hp->hd_cmpfn(key,
+                                          CUCKOO_SLOT(hp, slot + j),
+                                          hdr->hh_key_size)) {
+                                if (probesp)
+                                        *probesp = i + 1;
+                                return slot + j + 1;
+                        }
+                }
+
+                /* with few buckets both may be the same one */
+                if (buckets[1] == buckets[0])
+                        break;
+        }
+
+        if (probesp)
+                *probesp = i < 2 ? i + 1 : 2;
+        return 0;
+}
+
+static hashdb_size_t
+cuckoo_empty(struct hashdb *hp, hashdb_size_t bucket)
+{
+        unsigned char *ctrl = NULL;
+        hashdb_size_t j;
+
+        ctrl = hp->hd_hash_tab + (bucket * HASHDB_CUCKOO_SLOTS);
+        for (j = 0; j < HASHDB_CUCKOO_SLOTS; ++j) {
+                if (ctrl[j] & CUCKOO_EMPTY)
+                        return (bucket * HASHDB_CUCKOO_SLOTS) + j + 1;
+        }
+
+        return 0;
+}
+
+static bool
+cuckoo_on_path(const struct cuckoo_step *steps,
+               hashdb_size_t i,
+               hashdb_size_t bucket)
+{
+        for (; i != CUCKOO_BFS_MAX; i = steps[i].hk_parent) {
+                if (steps[i].hk_bucket == bucket)
+                        return true;
+        }
+
+        return false;
+}
+
+static hashdb_size_t
+cuckoo_shift(struct hashdb *hp,
+             const struct cuckoo_step *steps,
+             hashdb_size_t i,
+             hashdb_size_t empty)
+{
+        unsigned char *ctrl = hp->hd_hash_tab;
+        hashdb_size_t from;
+
+        /*
+         * pair is copied before its old slot is emptied, so a writer
+         * that dies part way leaves it in two slots, never in none
+         */
+        for (; steps[i].hk_parent != CUCKOO_BFS_MAX; i = steps[i].hk_parent) {
+                from = steps[i].hk_slot;
+                memcpy(CUCKOO_SLOT(hp, empty),
+                       CUCKOO_SLOT(hp, from),
+                       hp->hd_node_size);
+                ctrl[empty] = ctrl[from];
+                ctrl[from] = CUCKOO_EMPTY;
+                empty = from;
+        }
+
+        return empty;
+}
+
+static hashdb_size_t
+cuckoo_room(struct hashdb *hp, hashdb_size_t hash)
+{
+        struct cuckoo_step steps[CUCKOO_BFS_MAX];
+        hashdb_size_t bucket;
+        hashdb_size_t empty;
+        hashdb_size_t head;
+        hashdb_size_t slot;
+        hashdb_size_t nr;
+        hashdb_size_t j;
+
+        steps[0].hk_bucket = CUCKOO_HOME(hp, hash);
+        steps[0].hk_parent = CUCKOO_BFS_MAX;
+        steps[1].hk_bucket = CUCKOO_ALT(hp, steps[0].hk_bucket,
+                                        CUCKOO_TAG(hash));
+        steps[1].hk_parent = CUCKOO_BFS_MAX;
+        nr = 1 + (steps[1].hk_bucket != steps[0].hk_bucket);
+        for (head = 0; head < nr; ++head) {
+                empty = cuckoo_empty(hp, steps[head].hk_bucket);
+                if (empty)
+                        return empty;
+        }
+
+        /* shortest path moves fewest pairs */
+        for (head = 0; head < nr; ++head) {
+                for (j = 0; j < HASHDB_CUCKOO_SLOTS; ++j) {
+                        if (nr == CUCKOO_BFS_MAX)
+                                return 0;
+
+                        slot = (steps[head].hk_bucket * HASHDB_CUCKOO_SLOTS) +
+                                j;
+                        bucket = CUCKOO_ALT(hp, steps[head].hk_bucket,
+                                            hp->hd_hash_tab[slot]);
+                        if (cuckoo_on_path(steps, head, bucket))
+                                continue;
+
+                        steps[nr].hk_bucket = bucket;
+                        steps[nr].hk_slot = slot;
+                        steps[nr].hk_parent = head;
+                        empty = cuckoo_empty(hp, bucket);
+                        if (empty)
+                                return cuckoo_shift(hp, steps, nr,
+                                                    empty - 1) + 1;
+                        ++nr;
+                }
+        }
+
+        return 0;
+}
+
+static int
+cuckoo_resize(struct hashdb *hp, hashdb_size_t nr_slots)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *saved = NULL;
+        unsigned char *p = NULL;
+        hashdb_size_t nr_saved;
+        hashdb_size_t i;
+
+        /* copy out live pairs */
+        saved = malloc((hdr->hh_nr_live + 1) * hp->hd_node_size);
+        if (!saved)
+                return -1;
+
+        p = saved;
+        nr_saved = 0;
+        for (i = 0; i < hdr->hh_nr_nodes; ++i) {
+                if (hp->hd_hash_tab[i] & CUCKOO_EMPTY)
+                        continue;
+                memcpy(p, CUCKOO_SLOT(hp, i), hp->hd_node_size);
+                p += hp->hd_node_size;
+                ++nr_saved;
+        }
+
+        /* a crash while the table is wiped brings them back */
+        if (hashdb_slots_save(hp, saved, nr_saved))
+                goto free_saved;
+        if (cuckoo_fill(hp, saved, nr_saved, nr_slots))
+                goto free_saved;
+        if (hashdb_slots_done(hp))
+                goto free_saved;
+
+        free(saved);
+        return 0;
+
+free_saved:
+        free(saved);
+        return -1;
+}
+
+static int
+cuckoo_fill(struct hashdb *hp,
+            const unsigned char *saved,
+            hashdb_size_t nr_saved,
+            hashdb_size_t nr_slots)
+{
+        struct hashdb_header *hdr = NULL;
+        const unsigned char *p = NULL;
+        hashdb_size_t file_size;
+        hashdb_size_t hash;
+        hashdb_size_t slot;
+        hashdb_size_t i;
+
+        /* pairs are safe in saved, so a table they do not fit is redone */
+        for (;;) {
+                file_size = hashdb_swiss_file_size(nr_slots,
+                                                   hp->hd_node_size);
+                if (file_size != hp->hd_file_size &&
+                    (ftruncate(hp->hd_fd, file_size) ||
+                     hashdb_remap(hp, file_size)))
+                        return -1;
+
+                hdr = hp->hd_hdr;
+                hdr->hh_nr_nodes = nr_slots;
+                hdr->hh_nr_buckets = nr_slots / HASHDB_CUCKOO_SLOTS;
+                hdr->hh_base_buckets = hdr->hh_nr_buckets;
+                hdr->hh_bucket_cap = hdr->hh_nr_buckets;
+                hashdb_swiss_set_ptrs(hp);
+                hashdb_swiss_format(hp);
+
+                p = saved;
+                for (i = 0; i < nr_saved; ++i) {
+                        hash = hp->hd_hashfn(p, hdr->hh_key_size);
+                        slot = cuckoo_room(hp, hash);
+                        if (!slot)
+                                break;
+                        --slot;
+                        memcpy(CUCKOO_SLOT(hp, slot), p, hp->hd_node_size);
+                        hp->hd_hash_tab[slot] = CUCKOO_TAG(hash);
+                        p += hp->hd_node_size;
+                }
+                if (i == nr_saved)
+                        break;
+                nr_slots *= 2;
+        }
+
+        hdr->hh_nr_live = nr_saved;
+        return 0;
+}
+
+void *
+hashdb_cuckoo_set(struct hashdb *hp, void *key, void *value)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *p = NULL;
+        hashdb_size_t probes;
+        hashdb_size_t hash;
+        hashdb_size_t slot;
+
+        hash = hp->hd_hashfn(key, hdr->hh_key_size);
+        slot = cuckoo_find(hp, key, hash, &probes);
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_SET, slot != 0, probes);
+        HASHDB_TRACE_PROBE(set, CUCKOO_HOME(hp, hash), probes, slot != 0);
+        if (slot) {
+                p = CUCKOO_SLOT(hp, slot - 1);
+                memcpy(p + hdr->hh_key_size, value, hdr->hh_value_size);
+                return p;
+        }
+
+        while (!(slot = cuckoo_room(hp, hash))) {
+                if (!(hp->hd_flags & HASHDB_FLAG_GROW)) {
+                        errno = ENOMEM;
+                        return NULL;
+                }
+                if (cuckoo_resize(hp, hdr->hh_nr_nodes * 2))
+                        return NULL;
+                hdr = hp->hd_hdr;
+        }
+
+        /* pair is filled in before its slot is marked full */
+        --slot;
+        p = CUCKOO_SLOT(hp, slot);
+        memcpy(p, key, hdr->hh_key_size);
+        memcpy(p + hdr->hh_key_size, value, hdr->hh_value_size);
+        hp->hd_hash_tab[slot] = CUCKOO_TAG(hash);
+        ++hdr->hh_nr_live;
+        return p;
+}
+
+void *
+hashdb_cuckoo_get(struct hashdb *hp, void *key)
+{
+        hashdb_size_t probes;
+        hashdb_size_t hash;
+        hashdb_size_t slot;
+
+        hash = hp->hd_hashfn(key, hp->hd_hdr->hh_key_size);
+        slot = cuckoo_find(hp, key, hash, &probes);
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_GET, slot != 0, probes);
+        HASHDB_TRACE_PROBE(get, CUCKOO_HOME(hp, hash), probes, slot != 0);
+        if (!slot)
+                return NULL;
+
+        return CUCKOO_SLOT(hp, slot - 1);
+}
+
+int
+hashdb_cuckoo_rm(struct hashdb *hp, void *key)
+{
+        hashdb_size_t probes;
+        hashdb_size_t hash;
+        hashdb_size_t slot;
+
+        hash = hp->hd_hashfn(key, hp->hd_hdr->hh_key_size);
+        slot = cuckoo_find(hp, key, hash, &probes);
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_RM, slot != 0, probes);
+        HASHDB_TRACE_PROBE(rm, CUCKOO_HOME(hp, hash), probes, slot != 0);
+        if (!slot) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        /* no probe goes past a bucket, so no tombstone is needed */
+        hp->hd_hash_tab[slot - 1] = CUCKOO_EMPTY;
+        --hp->hd_hdr->hh_nr_live;
+        return 0;
+}
+
+int
+hashdb_cuckoo_repair(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = NULL;
+        unsigned char *saved = NULL;
+        hashdb_size_t nr_saved;
+        hashdb_size_t nr_slots;
+        hashdb_size_t hash;
+        hashdb_size_t i;
+        int ret;
+
+        /* rebuild that did not finish is done again from its pairs */
+        saved = hashdb_slots_load(hp, &nr_saved, &nr_slots);
+        if (!saved && errno != ENOENT)
+                return -1;
+        if (saved) {
+                ret = cuckoo_fill(hp, saved, nr_saved, nr_slots);
+                if (!ret)
+                        ret = hashdb_slots_done(hp);
+                free(saved);
+                if (ret)
+                        return -1;
+        }
+
+        /* lookups find one copy of a pair moved part way, drop the other */
+        hdr = hp->hd_hdr;
+        hdr->hh_nr_live = 0;
+        hdr->hh_nr_tomb = 0;
+        for (i = 0; i < hdr->hh_nr_nodes; ++i) {
+                if (hp->hd_hash_tab[i] & CUCKOO_EMPTY)
+                        continue;
+
+                hash = hp->hd_hashfn(CUCKOO_SLOT(hp, i), hdr->hh_key_size);
+                if (cuckoo_find(hp, CUCKOO_SLOT(hp, i), hash, NULL) != i + 1)
+                        hp->hd_hash_tab[i] = CUCKOO_EMPTY;
+                else
+                        ++hdr->hh_nr_live;
+        }
+        return 0;
+}
+
+void
+hashdb_cuckoo_stats(struct hashdb *hp, struct hashdb_stats *sp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t hash;
+        hashdb_size_t dist;
+        hashdb_size_t i;
+
+        for (i = 0; i < hdr->hh_nr_nodes; ++i) {
+                if (hp->hd_hash_tab[i] & CUCKOO_EMPTY)
+                        continue;
+
+                hash = hp->hd_hashfn(CUCKOO_SLOT(hp, i), hdr->hh_key_size);
+                dist = CUCKOO_HOME(hp, hash) != i / HASHDB_CUCKOO_SLOTS;
+                ++sp->ht_nr_live;
+                if (dist > sp->ht_hist_max)
+                        sp->ht_hist_max = dist;
+                ++sp->ht_hist[dist];
+        }
+
+        sp->ht_nr_nodes = hdr->hh_nr_nodes;
+        sp->ht_nr_buckets = hdr->hh_nr_buckets;
+        sp->ht_nr_free = hdr->hh_nr_nodes - sp->ht_nr_live;
+        sp->ht_load = (sp->ht_nr_live * 100) / hdr->hh_nr_nodes;
+}
@@ -0,0 +1,95 @@
+#ifndef HASHDB_CUCKOO_H
+#define HASHDB_CUCKOO_H
+
+#include "hashdb.h"
+
+/*
+ * bucketized cuckoo hashing table format (HASHDB_FORMAT_CUCKOO):
+ *
+ *      header | control bytes[nr_nodes] | slots[nr_nodes]
+ *
+ * laid out like HASHDB_FORMAT_SWISS, and control bytes mean the same:
+ * 7 bits of hash for a full slot, high bit set for an empty one. the 7
+ * bits come from the hash multiplied by an odd constant, so hashes of
+ * 32 bits or less still get all of them. slots
+ * are split into buckets of HASHDB_CUCKOO_SLOTS. low bits of the hash
+ * pick the first bucket of a key, and its other bucket is the first
+ * one mixed with its control byte, so the other bucket of a pair can
+ * be found without hashing its key again.
+ */
+
+/**
+ * Get number of slots needed to hold some number of pairs:
+ *
+ * args:
+ *      @nr_nodes:      number of key/value pairs
+ * ret:
+ *      @success:       number of slots (power of 2)
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_cuckoo_cap(hashdb_size_t nr_nodes);
+
+/**
+ * Add key/value pair (see hashdb_set()):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @key:   key
+ *      @value: value
+ * ret:
+ *      @success:       pointer to key/value pair
+ *      @failure:       NULL and errno set
+ */
+extern void *hashdb_cuckoo_set(struct hashdb *hp, void *key, void *value);
+
+/**
+ * Retrieve key/value pair (see hashdb_get()):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @key:   key
+ * ret:
+ *      @success:       pointer to key/value pair
+ *      @failure:       NULL
+ */
+extern void *hashdb_cuckoo_get(struct hashdb *hp, void *key);
+
+/**
+ * Remove key/value pair (see hashdb_rm()):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @key:   key of pair to remove
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_cuckoo_rm(struct hashdb *hp, void *key);
+
+/**
+ * Finish rebuild a writer died in (see hashdb_slots_load()), then drop
+ * pairs left in two slots and recount pairs after a writer died
+ * mid-change:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_cuckoo_repair(struct hashdb *hp);
+
+/**
+ * Fill in sizes and histogram of pairs in their first (0) and other
+ * (1) bucket (see hashdb_stats()):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @sp:    statistics (zeroed)
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_cuckoo_stats(struct hashdb *hp, struct hashdb_stats *sp);
+
+#endif
@@ -0,0 +1,189 @@
+#include "hashdb_priv.h"
+#include "hashdb_cursor.h"
+#include "hashdb_var.h"
+
+enum {
+        /* number of nodes per word of bitmap */
+        CURSOR_WORD_BITS        = 64,
+        /* bit of control byte set for empty and deleted slots */
+        CURSOR_SWISS_FREE       = 0x80,
+};
+
+/* mark node as not holding start of pair */
+static void cursor_clear(uint64_t *live, hashdb_size_t node);
+
+/* clear nodes on free list starting at node, each a run of nr nodes */
+static void cursor_clear_list(struct hashdb *hp,
+                              uint64_t *live,
+                              hashdb_size_t node,
+                              hashdb_size_t nr);
+
+/* clear nodes held by free node caches (HASHDB_FLAG_CONCURRENT) */
+static void cursor_clear_caches(struct hashdb *hp, uint64_t *live);
+
+/* clear all but first node of each run in use (HASHDB_FORMAT_VAR) */
+static void cursor_clear_runs(struct hashdb *hp,
+                              uint64_t *live,
+                              hashdb_size_t end);
+
+/* find first node at or after node and before end with its bit set */
+static hashdb_size_t cursor_find(const uint64_t *live,
+                                 hashdb_size_t node,
+                                 hashdb_size_t end);
+
+static void
+cursor_clear(uint64_t *live, hashdb_size_t node)
+{
+        live[node / CURSOR_WORD_BITS] &=
+                ~((uint64_t)1 << (node % CURSOR_WORD_BITS));
+}
+
+static void
+cursor_clear_list(struct hashdb *hp,
+                  uint64_t *live,
+                  hashdb_size_t node,
+                  hashdb_size_t nr)
+{
+        unsigned char *p = NULL;
+        hashdb_size_t i;
+
+        while (node) {
+                for (i = 0; i < nr; ++i)
+                        cursor_clear(live, node + i);
+                p = HASHDB_NODE(hp, node);
+                node = hashdb_link_get(hp, p);
+        }
+}
+
+static void
+cursor_clear_caches(struct hashdb *hp, uint64_t *live)
+{
+        struct hashdb_cache *cp = NULL;
+        hashdb_size_t i;
+        hashdb_size_t j;
+
+        if (!(hp->hd_flags & HASHDB_FLAG_CONCURRENT))
+                return;
+
+        for (i = 0; i < HASHDB_NR_CACHES; ++i) {
+                cp = &hp->hd_caches[i];
+                pthread_mutex_lock(&cp->hc_lock);
+                for (j = 0; j < cp->hc_nr; ++j)
+                        cursor_clear(live, cp->hc_nodes[j]);
+                for (j = 0; j < cp->hc_nr_retired; ++j)
+                        cursor_clear(live, cp->hc_retired[j]);
+                pthread_mutex_unlock(&cp->hc_lock);
+        }
+}
+
+static void
+cursor_clear_runs(struct hashdb *hp, uint64_t *live, hashdb_size_t end)
+{
+        unsigned char *keyp = NULL;
+        hashdb_size_t node;
+        hashdb_size_t run;
+        hashdb_size_t i;
+
+        /* free runs are already clear, so the next set bit starts a run */
+        node = cursor_find(live, 1, end);
+        while (node < end) {
+                keyp = HASHDB_NODE(hp, node);
+                keyp += hp->hd_key_off;
+                run = hashdb_var_run(hp,
+                                     HASHDB_VAR_KEY_SIZE(keyp),
+                                     HASHDB_VAR_VALUE_SIZE(keyp));
+                for (i = 1; i < run && node + i < end; ++i)
+                        cursor_clear(live, node + i);
+                node = cursor_find(live, node + run, end);
+        }
+}
+
+static hashdb_size_t
+cursor_find(const uint64_t *live, hashdb_size_t node, hashdb_size_t end)
+{
+        uint64_t word;
+
+        /* whole words of free nodes are skipped at once */
+        while (node < end) {
+                word = live[node / CURSOR_WORD_BITS];
+                word >>= node % CURSOR_WORD_BITS;
+                if (word) {
+                        node += __builtin_ctzll(word);
+                        break;
+                }
+                node -= node % CURSOR_WORD_BITS;
+                node += CURSOR_WORD_BITS;
+        }
+
+        return node < end ? node : end;
+}
+
+uint64_t *
+hashdb_cursor_map(struct hashdb *hp,
+                  hashdb_size_t *firstp,
+                  hashdb_size_t *endp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        uint64_t *live = NULL;
+        hashdb_size_t first;
+        hashdb_size_t end;
+        hashdb_size_t i;
+        bool slotted;
+
+        slotted = hdr->hh_format == HASHDB_FORMAT_SWISS ||
+                  hdr->hh_format == HASHDB_FORMAT_CUCKOO;
+        first = 1;
+        end = hdr->hh_bump;
+        if (slotted) {
+                first = 0;
+                end = hdr->hh_nr_nodes;
+        }
+
+        live = calloc((end / CURSOR_WORD_BITS) + 1, sizeof(*live));
+        if (!live)
+                return NULL;
+
+        if (slotted) {
+                for (i = 0; i < end; ++i) {
+                        if (!(hp->hd_hash_tab[i] & CURSOR_SWISS_FREE))
+                                live[i / CURSOR_WORD_BITS] |=
+                                        (uint64_t)1 << (i % CURSOR_WORD_BITS);
+                }
+                goto done;
+        }
+
+        /* nodes past hh_bump were never used */
+        for (i = first; i < end; ++i)
+                live[i / CURSOR_WORD_BITS] |=
+                        (uint64_t)1 << (i % CURSOR_WORD_BITS);
+        cursor_clear_list(hp, live, hdr->hh_free, 1);
+        cursor_clear_caches(hp, live);
+        if (hdr->hh_format == HASHDB_FORMAT_VAR) {
+                for (i = 1; i < HASHDB_VAR_NR_CLASS; ++i) {
+                        cursor_clear_list(hp,
+                                          live,
+                                          hdr->hh_var_free[i],
+                                          (hashdb_size_t)1 << i);
+                }
+                cursor_clear_runs(hp, live, end);
+        }
+
+done:
+        *firstp = first;
+        *endp = end;
+        return live;
+}
+
+void *
+hashdb_cursor_next(struct hashdb_cursor *cp)
+{
+        struct hashdb *hp = cp->hi_hp;
+        hashdb_size_t node;
+
+        cp->hi_node = cursor_find(cp->hi_live, cp->hi_node, cp->hi_end);
+        if (cp->hi_node == cp->hi_end)
+                return NULL;
+
+        node = cp->hi_node++;
+        return HASHDB_NODE(hp, node) + hp->hd_key_off;
+}
@@ -0,0 +1,34 @@
+#ifndef HASHDB_CURSOR_H
+#define HASHDB_CURSOR_H
+
+#include "hashdb.h"
+
+/*
+ * cursors (see hashdb_cursor_open()):
+ *
+ * pairs are found without walking chains. every node below hh_bump
+ * starts out live, then nodes on the free lists and in the free node
+ * caches are cleared. with HASHDB_FORMAT_VAR the rest of each run
+ * is cleared too, by stepping from the first node of one run to the
+ * next. with HASHDB_FORMAT_SWISS and HASHDB_FORMAT_CUCKOO the
+ * control bytes say which slots are full. the bitmap that is left is
+ * shared by all cursors of one scan.
+ */
+
+/**
+ * Build bitmap of nodes where a pair starts (resize lock held
+ * exclusively):
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @firstp:        where to store first node that may hold a pair
+ *      @endp:          where to store node after last one
+ * ret:
+ *      @success:       bitmap (one bit per node, free() it)
+ *      @failure:       NULL and errno set
+ */
+extern uint64_t *hashdb_cursor_map(struct hashdb *hp,
+                                   hashdb_size_t *firstp,
+                                   hashdb_size_t *endp);
+
+#endif
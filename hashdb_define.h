@@ -0,0 +1,267 @@
+#ifndef HASHDB_DEFINE_H
+#define HASHDB_DEFINE_H
+
+#include "hashdb.h"
+
+/*
+ * typed tables, header only:
+ *
+ *      HASHDB_DEFINE(name, key_t, val_t, hashfn, eqfn)
+ *
+ * emits static inline functions for a table of key_t keys and val_t
+ * values (both at most 8 byte aligned, or 4 with HASHDB_FLAG_INDEX32
+ * and no HASHDB_FLAG_HASH):
+ *
+ *      struct hashdb *name_init(path, flags, nr_nodes, nr_buckets, mode)
+ *      struct hashdb *name_open(path, flags)
+ *      val_t *name_set(struct hashdb *hp, key_t key, val_t value)
+ *      val_t *name_get(struct hashdb *hp, key_t key)
+ *      int name_rm(struct hashdb *hp, key_t key)
+ *
+ * hashfn(key) hashes a key and eqfn(a, b) is true if two keys are
+ * equal. either may be a macro. set, get and rm work like hashdb_set(),
+ * hashdb_get() and hashdb_rm(), but return a pointer to the value.
+ *
+ * with HASHDB_FORMAT_CHAIN and none of HASHDB_FLAG_SANE_MODE,
+ * HASHDB_FLAG_CONCURRENT, HASHDB_FLAG_SHARED, HASHDB_FLAG_WAL,
+ * HASHDB_FLAG_STATS, HASHDB_FLAG_EVICT or HASHDB_FLAG_INDEX32, and in
+ * builds without HASHDB_TRACE, they walk chains themselves, with hashfn
+ * and eqfn inlined and copies of constant size. set and rm also take
+ * and give back free nodes themselves, unless the hashdb is
+ * HASHDB_FLAG_RDONLY, has cursors open or a hashdb_compact() is part
+ * way done. everything else, inserts that need the node table grown or
+ * a bucket split, and all calls while growth still moves the hash table
+ * a chunk at a time, go through the generic calls. the file format is
+ * the same, and name_init() and name_open() hand hashdb_init() and
+ * hashdb_open() functions that hash and compare the same way, so a
+ * table has to be created or opened through them.
+ */
+
+/* traced builds time every call, so typed calls take the generic path */
+#ifdef HASHDB_TRACE
+#define HASHDB_DEFINE_TRACED    1
+#else
+#define HASHDB_DEFINE_TRACED    0
+#endif
+
+/* can typed calls do the work themselves? */
+#define HASHDB_DEFINE_FAST(hp)                                                 \
+        (!HASHDB_DEFINE_TRACED &&                                              \
+         (hp)->hd_hdr->hh_format == HASHDB_FORMAT_CHAIN &&                     \
+         !((hp)->hd_flags & (HASHDB_FLAG_SANE_MODE |                           \
+                             HASHDB_FLAG_CONCURRENT |                          \
+                             HASHDB_FLAG_SHARED |                              \
+                             HASHDB_FLAG_WAL |                                 \
+                             HASHDB_FLAG_STATS |                               \
+                             HASHDB_FLAG_EVICT |                               \
+                             HASHDB_FLAG_INDEX32)) &&                          \
+         !(hp)->hd_hdr->hh_move_left)
+
+/* can typed calls change the table themselves? */
+#define HASHDB_DEFINE_FAST_WRITE(hp)                                           \
+        (HASHDB_DEFINE_FAST(hp) &&                                             \
+         !((hp)->hd_flags & HASHDB_FLAG_RDONLY) &&                             \
+         !(hp)->hd_nr_cursors &&                                               \
+         !(hp)->hd_hdr->hh_compact_next)
+
+/* size of key or value in node (see hashdb_init()) */
+#define HASHDB_DEFINE_SIZE(type) \
+        NEXT_MULTPLE_OF_8(sizeof(type))
+
+#define HASHDB_DEFINE(name, key_t, val_t, hashfn, eqfn)                        \
+                                                                               \
+/* hash function handed to hashdb_init() and hashdb_open() */                  \
+static inline hashdb_size_t                                                    \
+name##_hashfn(const void *key, hashdb_size_t size)                             \
+{                                                                              \
+        key_t k;                                                               \
+                                                                               \
+        memcpy(&k, key, sizeof(k));                                            \
+        return hashfn(k);                                                      \
+}                                                                              \
+                                                                               \
+/* key comparison function handed to hashdb_init() and hashdb_open() */        \
+static inline int                                                              \
+name##_cmpfn(const void *a, const void *b, hashdb_size_t size)                 \
+{                                                                              \
+        key_t ka;                                                              \
+        key_t kb;                                                              \
+                                                                               \
+        memcpy(&ka, a, sizeof(ka));                                            \
+        memcpy(&kb, b, sizeof(kb));                                            \
+        return !(eqfn(ka, kb));                                                \
+}                                                                              \
+                                                                               \
+static inline struct hashdb *                                                  \
+name##_init(const char *path,                                                  \
+            uint64_t flags,                                                    \
+            hashdb_size_t nr_nodes,                                            \
+            hashdb_size_t nr_buckets,                                          \
+            mode_t mode)                                                       \
+{                                                                              \
+        return hashdb_init(path,                                               \
+                           flags,                                              \
+                           nr_nodes,                                           \
+                           nr_buckets,                                         \
+                           sizeof(key_t),                                      \
+                           sizeof(val_t),                                      \
+                           name##_hashfn,                                      \
+                           name##_cmpfn,                                       \
+                           mode);                                              \
+}                                                                              \
+                                                                               \
+static inline struct hashdb *                                                  \
+name##_open(const char *path, uint64_t flags)                                  \
+{                                                                              \
+        return hashdb_open(path, flags, name##_hashfn, name##_cmpfn);          \
+}                                                                              \
+                                                                               \
+/* find key in chain, *linkp is set to what points to it (or chain end) */     \
+static inline unsigned char *                                                  \
+name##_find(struct hashdb *hp,                                                 \
+            key_t key,                                                         \
+            hashdb_size_t hash,                                                \
+            hashdb_size_t **linkp)                                             \
+{                                                                              \
+        struct hashdb_header *hdr = hp->hd_hdr;                                \
+        hashdb_size_t *link = NULL;                                            \
+        unsigned char *p = NULL;                                               \
+        key_t k;                                                               \
+                                                                               \
+        link = (hashdb_size_t *)(hp->hd_hash_tab + (sizeof(hashdb_size_t) *    \
+                HASHDB_BUCKET(hash, hdr->hh_base_buckets, hdr->hh_split)));    \
+        while (*link) {                                                        \
+                p = HASHDB_NODE(hp, *link);                                    \
+                if (!(hp->hd_flags & HASHDB_FLAG_HASH) ||                      \
+                    HASHDB_NODE_HASH(p) == hash) {                             \
+                        memcpy(&k, p + hp->hd_key_off, sizeof(k));             \
+                        if (eqfn(key, k))                                      \
+                                break;                                         \
+                }                                                              \
+                link = &HASHDB_NODE_P(p)->hn_next;                             \
+        }                                                                      \
+                                                                               \
+        *linkp = link;                                                         \
+        return *link ? p : NULL;                                               \
+}                                                                              \
+                                                                               \
+static inline val_t *                                                          \
+name##_set(struct hashdb *hp, key_t key, val_t value)                          \
+{                                                                              \
+        unsigned char kbuf[HASHDB_DEFINE_SIZE(key_t)];                         \
+        unsigned char vbuf[HASHDB_DEFINE_SIZE(val_t)];                         \
+        struct hashdb_header *hdr = NULL;                                      \
+        hashdb_size_t *link = NULL;                                            \
+        unsigned char *p = NULL;                                               \
+        hashdb_size_t hash;                                                    \
+        hashdb_size_t node;                                                    \
+                                                                               \
+        if (!HASHDB_DEFINE_FAST_WRITE(hp))                                     \
+                goto slow;                                                     \
+                                                                               \
+        hash = hashfn(key);                                                    \
+        p = name##_find(hp, key, hash, &link);                                 \
+        if (p) {                                                               \
+                p = HASHDB_VALUE(hp, *link);                                   \
+                memcpy(p, &value, sizeof(value));                              \
+                return (val_t *)p;                                             \
+        }                                                                      \
+                                                                               \
+        /* growing and splitting are left to hashdb_set() */                   \
+        hdr = hp->hd_hdr;                                                      \
+        if (!hdr->hh_free && hdr->hh_bump > hdr->hh_nr_nodes)                  \
+                goto slow;                                                     \
+        if (hdr->hh_max_load && (hdr->hh_nr_live + 1) * 100 >                  \
+            hdr->hh_max_load * hdr->hh_nr_buckets)                             \
+                goto slow;                                                     \
+                                                                               \
+        node = hdr->hh_free;                                                   \
+        if (node) {                                                            \
+                p = HASHDB_NODE(hp, node);                                     \
+                hdr->hh_free = HASHDB_NODE_P(p)->hn_next;                      \
+                --hdr->hh_nr_free;                                             \
+        } else {                                                               \
+                node = hdr->hh_bump++;                                         \
+                p = HASHDB_NODE(hp, node);                                     \
+        }                                                                      \
+                                                                               \
+        if (hp->hd_flags & HASHDB_FLAG_HASH)                                   \
+                HASHDB_NODE_HASH(p) = hash;                                    \
+        memcpy(p + hp->hd_key_off, &key, sizeof(key));                         \
+        p = HASHDB_VALUE(hp, node);                                            \
+        memcpy(p, &value, sizeof(value));                                      \
+                                                                               \
+        /* new node goes at head of chain, like hashdb_set() does */           \
+        link = (hashdb_size_t *)(hp->hd_hash_tab + (sizeof(hashdb_size_t) *    \
+                HASHDB_BUCKET(hash, hdr->hh_base_buckets, hdr->hh_split)));    \
+        HASHDB_NODE_P(HASHDB_NODE(hp, node))->hn_next = *link;                 \
+        *link = node;                                                          \
+        ++hdr->hh_nr_live;                                                     \
+        return (val_t *)p;                                                     \
+                                                                               \
+slow:                                                                          \
+        /* generic calls copy whole key and value size of node */              \
+        memset(kbuf, 0, sizeof(kbuf));                                         \
+        memset(vbuf, 0, sizeof(vbuf));                                         \
+        memcpy(kbuf, &key, sizeof(key));                                       \
+        memcpy(vbuf, &value, sizeof(value));                                   \
+        p = hashdb_set(hp, kbuf, vbuf);                                        \
+        if (!p)                                                                \
+                return NULL;                                                   \
+        return (val_t *)hashdb_value(hp, p);                                   \
+}                                                                              \
+                                                                               \
+static inline val_t *                                                          \
+name##_get(struct hashdb *hp, key_t key)                                       \
+{                                                                              \
+        unsigned char kbuf[HASHDB_DEFINE_SIZE(key_t)];                         \
+        hashdb_size_t *link = NULL;                                            \
+        unsigned char *p = NULL;                                               \
+                                                                               \
+        if (!HASHDB_DEFINE_FAST(hp)) {                                         \
+                memset(kbuf, 0, sizeof(kbuf));                                 \
+                memcpy(kbuf, &key, sizeof(key));                               \
+                p = hashdb_get(hp, kbuf);                                      \
+                if (!p)                                                        \
+                        return NULL;                                           \
+                return (val_t *)hashdb_value(hp, p);                           \
+        }                                                                      \
+                                                                               \
+        p = name##_find(hp, key, hashfn(key), &link);                          \
+        if (!p)                                                                \
+                return NULL;                                                   \
+        return (val_t *)HASHDB_VALUE(hp, *link);                               \
+}                                                                              \
+                                                                               \
+static inline int                                                              \
+name##_rm(struct hashdb *hp, key_t key)                                        \
+{                                                                              \
+        unsigned char kbuf[HASHDB_DEFINE_SIZE(key_t)];                         \
+        struct hashdb_header *hdr = NULL;                                      \
+        hashdb_size_t *link = NULL;                                            \
+        unsigned char *p = NULL;                                               \
+        hashdb_size_t node;                                                    \
+                                                                               \
+        if (!HASHDB_DEFINE_FAST_WRITE(hp)) {                                   \
+                memset(kbuf, 0, sizeof(kbuf));                                 \
+                memcpy(kbuf, &key, sizeof(key));                               \
+                return hashdb_rm(hp, kbuf);                                    \
+        }                                                                      \
+                                                                               \
+        p = name##_find(hp, key, hashfn(key), &link);                          \
+        if (!p) {                                                              \
+                errno = ENOENT;                                                \
+                return -1;                                                     \
+        }                                                                      \
+                                                                               \
+        hdr = hp->hd_hdr;                                                      \
+        node = *link;                                                          \
+        *link = HASHDB_NODE_P(p)->hn_next;                                     \
+        HASHDB_NODE_P(p)->hn_next = hdr->hh_free;                              \
+        hdr->hh_free = node;                                                   \
+        ++hdr->hh_nr_free;                                                     \
+        --hdr->hh_nr_live;                                                     \
+        return 0;                                                              \
+}
+
+#endif
@@ -0,0 +1,112 @@
+#include "hashdb_priv.h"
+#include "hashdb_evict.h"
+#include "hashdb_wal.h"
+
+/* get node of hashdb */
+#define EVICT_NODE(hp, i) \
+        HASHDB_NODE(hp, i)
+
+/* find link that points to node, NULL if node is not in a chain */
+static void *evict_pred(struct hashdb *hp, hashdb_size_t node);
+
+static void *
+evict_pred(struct hashdb *hp, hashdb_size_t node)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *p = NULL;
+        hashdb_size_t curr;
+        hashdb_size_t hash;
+        void *link = NULL;
+
+        p = EVICT_NODE(hp, node);
+        if (hp->hd_flags & HASHDB_FLAG_HASH)
+                hash = HASHDB_NODE_HASH(p);
+        else
+                hash = hp->hd_hashfn(p + hp->hd_key_off, hdr->hh_key_size);
+
+        link = hashdb_bucket_link(hp, hashdb_bucket(hdr, hash));
+        while ((curr = hashdb_link_get(hp, link)) && curr != node)
+                link = EVICT_NODE(hp, curr);
+
+        return curr ? link : NULL;
+}
+
+int
+hashdb_evict_init(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t bucket;
+        hashdb_size_t curr;
+
+        hp->hd_clock = NULL;
+        hp->hd_clock_hand = 1;
+        if (!(hp->hd_flags & HASHDB_FLAG_EVICT))
+                return 0;
+
+        /* node 0 is the NULL node, so it only takes up a byte */
+        hp->hd_clock = calloc(hdr->hh_nr_nodes + 1, 1);
+        if (!hp->hd_clock)
+                return -1;
+
+        for (bucket = 0; bucket < hdr->hh_nr_buckets; ++bucket) {
+                curr = hashdb_link_get(hp, hashdb_bucket_link(hp, bucket));
+                while (curr) {
+                        hp->hd_clock[curr] = HASHDB_EVICT_USED;
+                        curr = hashdb_link_get(hp, EVICT_NODE(hp, curr));
+                }
+        }
+
+        return 0;
+}
+
+void
+hashdb_evict_free(struct hashdb *hp)
+{
+        free(hp->hd_clock);
+        hp->hd_clock = NULL;
+}
+
+int
+hashdb_evict(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *clock = hp->hd_clock;
+        unsigned char *p = NULL;
+        hashdb_size_t node;
+        hashdb_size_t i;
+        void *link = NULL;
+
+        /* in two turns every used pair has had its bit cleared */
+        for (i = 0; i <= 2 * hdr->hh_nr_nodes; ++i) {
+                node = hp->hd_clock_hand;
+                if (++hp->hd_clock_hand > hdr->hh_nr_nodes)
+                        hp->hd_clock_hand = 1;
+
+                if (clock[node] == HASHDB_EVICT_USED) {
+                        clock[node] = HASHDB_EVICT_LIVE;
+                        continue;
+                }
+                if (clock[node] != HASHDB_EVICT_LIVE)
+                        continue;
+
+                /* state is only a hint, chains have the last word */
+                clock[node] = HASHDB_EVICT_FREE;
+                link = evict_pred(hp, node);
+                if (link)
+                        break;
+        }
+        if (!link) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        p = EVICT_NODE(hp, node);
+        if (hp->hd_wal) {
+                hashdb_wal_append(hp, HASHDB_WAL_RM,
+                                  p + hp->hd_key_off, NULL);
+        }
+        hashdb_link_set(hp, link, hashdb_link_get(hp, p));
+        hashdb_free_push(hp, node);
+        --hdr->hh_nr_live;
+        return 0;
+}
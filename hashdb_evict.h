@@ -0,0 +1,72 @@
+#ifndef HASHDB_EVICT_H
+#define HASHDB_EVICT_H
+
+#include "hashdb.h"
+
+/*
+ * eviction (HASHDB_FLAG_EVICT):
+ *
+ * hd_clock has a byte for each node: HASHDB_EVICT_FREE if it holds no
+ * pair, HASHDB_EVICT_LIVE if it does and HASHDB_EVICT_USED if that pair
+ * was also set or found since the hand last went by. without the flag
+ * hd_clock is NULL and the macros below are one test.
+ */
+
+/* CLOCK state of node */
+enum {
+        HASHDB_EVICT_FREE       = 0,
+        HASHDB_EVICT_LIVE       = 1,
+        HASHDB_EVICT_USED       = 2,
+};
+
+/* mark pair in node as used (it is set or found) */
+#define HASHDB_EVICT_TOUCH(hp, node)                                           \
+        ((hp)->hd_clock && (hp)->hd_clock[node] != HASHDB_EVICT_USED ?         \
+         (void)((hp)->hd_clock[node] = HASHDB_EVICT_USED) : (void)0)
+
+/* mark node as holding no pair */
+#define HASHDB_EVICT_DROP(hp, node)                                            \
+        ((hp)->hd_clock ?                                                      \
+         (void)((hp)->hd_clock[node] = HASHDB_EVICT_FREE) : (void)0)
+
+/* pair in node from moved to node to */
+#define HASHDB_EVICT_MOVE(hp, from, to)                                        \
+        ((hp)->hd_clock ?                                                      \
+         (void)((hp)->hd_clock[to] = (hp)->hd_clock[from],                     \
+                (hp)->hd_clock[from] = HASHDB_EVICT_FREE) : (void)0)
+
+/**
+ * Allocate CLOCK state if HASHDB_FLAG_EVICT is set, marking nodes in
+ * chains as used, and set hd_clock:
+ *
+ * args:
+ *      @hp:    pointer to hashdb (mapped, log redone)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_evict_init(struct hashdb *hp);
+
+/**
+ * Free CLOCK state:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       nothing (hd_clock set to NULL)
+ *      @failure:       does not fail
+ */
+extern void hashdb_evict_free(struct hashdb *hp);
+
+/**
+ * Remove pair picked by CLOCK sweep and put its node on free list:
+ *
+ * args:
+ *      @hp:    pointer to hashdb (hd_clock set)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (ENOMEM if there are no pairs)
+ */
+extern int hashdb_evict(struct hashdb *hp);
+
+#endif
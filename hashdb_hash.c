@@ -0,0 +1,387 @@
+#include "hashdb_priv.h"
+#include "hashdb_hash.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+/* multiplier of size that starts hashdb_hash_xx() */
+#define XX_PRIME \
+        0x9e3779b185ebca87ULL
+
+/* multipliers of final mix (splitmix64) */
+#define MIX_PRIME1 \
+        0xbf58476d1ce4e5b9ULL
+#define MIX_PRIME2 \
+        0x94d049bb133111ebULL
+
+/* constants of hashdb_hash_wy() */
+#define WY_PRIME0 \
+        0x2d358dccaa6c78a5ULL
+#define WY_PRIME1 \
+        0x8bb84b93962eacc9ULL
+#define WY_PRIME2 \
+        0x4b33a62ed433d4a3ULL
+#define WY_PRIME3 \
+        0x4d5a2da51de1aa47ULL
+
+/* crc32c polynomial (reversed) */
+#define CRC_POLY \
+        0x82f63b78U
+
+enum {
+        /* number of words hashdb_hash_xx() xors with in turn */
+        XX_NR_SECRET    = 8,
+        /* bits state of hashdb_hash_xx() is rotated by per word */
+        XX_ROTATE       = 23,
+        /* number of keys hashed at once with SIMD */
+        XX_LANES        = 2,
+};
+
+/* 128 bit product for hashdb_hash_wy() */
+__extension__ typedef unsigned __int128 wy_u128;
+
+/* words key is xored with by hashdb_hash_xx() */
+static const uint64_t xx_secret[XX_NR_SECRET] = {
+        0x4a6f188a424e617bULL,
+        0xe8d79f49af6d114dULL,
+        0xcd502d42af1ffe0dULL,
+        0xe3d6e4b9d96e182dULL,
+        0xa6ea1c0d2f8b9e9dULL,
+        0xaa8b230f3b05e393ULL,
+        0xde85eb9025ac45a1ULL,
+        0xa415c4c839a44721ULL,
+};
+
+/* load 8 bytes of key */
+static uint64_t hash_read64(const unsigned char *p);
+
+/* load 4 bytes of key */
+static uint64_t hash_read32(const unsigned char *p);
+
+/* load last size % 8 bytes of key, zero padded */
+static uint64_t hash_read_tail(const unsigned char *p, hashdb_size_t size);
+
+/* spread bits of state over whole hash */
+static uint64_t hash_final(uint64_t x);
+
+/* add one word of key to state of hashdb_hash_xx() */
+static uint64_t xx_step(uint64_t acc, uint64_t w, uint64_t secret);
+
+/* fold 128 bit product of a and b */
+static uint64_t wy_mix(uint64_t a, uint64_t b);
+
+/* crc32c of one word in software */
+static uint32_t crc_word(uint32_t crc, uint64_t w);
+
+#ifdef __SSE2__
+/* hashdb_hash_xx() of XX_LANES keys at once */
+static void xx_lanes(void **keys, hashdb_size_t size, hashdb_size_t *hashes);
+#endif
+
+#ifdef __x86_64__
+/* hashdb_hash_crc32c() with crc32 instruction */
+static hashdb_size_t crc_hw(const void *key, hashdb_size_t size)
+        __attribute__((target("sse4.2")));
+#endif
+
+/* hashdb_hash_crc32c() without crc32 instruction */
+static hashdb_size_t crc_sw(const void *key, hashdb_size_t size);
+
+static uint64_t
+hash_read64(const unsigned char *p)
+{
+        uint64_t w;
+
+        memcpy(&w, p, sizeof(w));
+        return w;
+}
+
+static uint64_t
+hash_read32(const unsigned char *p)
+{
+        uint32_t w;
+
+        memcpy(&w, p, sizeof(w));
+        return w;
+}
+
+static uint64_t
+hash_read_tail(const unsigned char *p, hashdb_size_t size)
+{
+        uint64_t w = 0;
+
+        memcpy(&w, p + (size & ~(hashdb_size_t)7), size & 7);
+        return w;
+}
+
+static uint64_t
+hash_final(uint64_t x)
+{
+        x ^= x >> 30;
+        x *= MIX_PRIME1;
+        x ^= x >> 27;
+        x *= MIX_PRIME2;
+        x ^= x >> 31;
+        return x;
+}
+
+static uint64_t
+xx_step(uint64_t acc, uint64_t w, uint64_t secret)
+{
+        uint64_t dk = w ^ secret;
+
+        /* the swapped word keeps what the product of its halves loses */
+        acc = (acc << XX_ROTATE) | (acc >> (64 - XX_ROTATE));
+        acc += (w << 32) | (w >> 32);
+        acc += (dk & 0xffffffff) * (dk >> 32);
+        return acc;
+}
+
+hashdb_size_t
+hashdb_hash_xx(const void *key, hashdb_size_t size)
+{
+        const unsigned char *p = key;
+        uint64_t acc = size * XX_PRIME;
+        hashdb_size_t i;
+
+        for (i = 0; i + 8 <= size; i += 8) {
+                acc = xx_step(acc,
+                              hash_read64(p + i),
+                              xx_secret[(i / 8) % XX_NR_SECRET]);
+        }
+        if (i < size) {
+                acc = xx_step(acc,
+                              hash_read_tail(p, size),
+                              xx_secret[(i / 8) % XX_NR_SECRET]);
+        }
+
+        return hash_final(acc);
+}
+
+#ifdef __SSE2__
+static void
+xx_lanes(void **keys, hashdb_size_t size, hashdb_size_t *hashes)
+{
+        const unsigned char *k0 = keys[0];
+        const unsigned char *k1 = keys[1];
+        uint64_t out[XX_LANES];
+        __m128i secret;
+        __m128i acc;
+        __m128i dk;
+        __m128i w;
+        hashdb_size_t i;
+
+        /* each 64 bit lane does what xx_step() does for one key */
+        acc = _mm_set1_epi64x(size * XX_PRIME);
+        for (i = 0; i < size; i += 8) {
+                if (i + 8 <= size) {
+                        w = _mm_set_epi64x(hash_read64(k1 + i),
+                                           hash_read64(k0 + i));
+                } else {
+                        w = _mm_set_epi64x(hash_read_tail(k1, size),
+                                           hash_read_tail(k0, size));
+                }
+                secret = _mm_set1_epi64x(xx_secret[(i / 8) % XX_NR_SECRET]);
+                dk = _mm_xor_si128(w, secret);
+
+                acc = _mm_or_si128(_mm_slli_epi64(acc, XX_ROTATE),
+                                   _mm_srli_epi64(acc, 64 - XX_ROTATE));
+                acc = _mm_add_epi64(acc, _mm_shuffle_epi32(w, 0xb1));
+                acc = _mm_add_epi64(acc,
+                                    _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32)));
+        }
+
+        _mm_storeu_si128((__m128i *)out, acc);
+        for (i = 0; i < XX_LANES; ++i)
+                hashes[i] = hash_final(out[i]);
+}
+#endif
+
+static uint64_t
+wy_mix(uint64_t a, uint64_t b)
+{
+        wy_u128 r = (wy_u128)a * b;
+
+        return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+hashdb_size_t
+hashdb_hash_wy(const void *key, hashdb_size_t size)
+{
+        const unsigned char *p = key;
+        hashdb_size_t left = size;
+        hashdb_size_t mid;
+        uint64_t seed;
+        uint64_t see1;
+        uint64_t see2;
+        uint64_t a;
+        uint64_t b;
+        wy_u128 r;
+
+        seed = wy_mix(WY_PRIME0, WY_PRIME1);
+        if (size <= 16) {
+                /* short keys are read as (possibly overlapping) halves */
+                if (size >= 4) {
+                        mid = (size >> 3) << 2;
+                        a = (hash_read32(p) << 32) | hash_read32(p + mid);
+                        b = (hash_read32(p + size - 4) << 32) |
+                                hash_read32(p + size - 4 - mid);
+                } else if (size) {
+                        a = ((uint64_t)p[0] << 16) |
+                                ((uint64_t)p[size >> 1] << 8) | p[size - 1];
+                        b = 0;
+                } else {
+                        a = 0;
+                        b = 0;
+                }
+        } else {
+                /* three independent chains of 16 bytes each */
+                if (left > 48) {
+                        see1 = seed;
+                        see2 = seed;
+                        do {
+                                seed = wy_mix(hash_read64(p) ^ WY_PRIME1,
+                                              hash_read64(p + 8) ^ seed);
+                                see1 = wy_mix(hash_read64(p + 16) ^ WY_PRIME2,
+                                              hash_read64(p + 24) ^ see1);
+                                see2 = wy_mix(hash_read64(p + 32) ^ WY_PRIME3,
+                                              hash_read64(p + 40) ^ see2);
+                                p += 48;
+                                left -= 48;
+                        } while (left > 48);
+                        seed ^= see1 ^ see2;
+                }
+                while (left > 16) {
+                        seed = wy_mix(hash_read64(p) ^ WY_PRIME1,
+                                      hash_read64(p + 8) ^ seed);
+                        p += 16;
+                        left -= 16;
+                }
+                a = hash_read64(p + left - 16);
+                b = hash_read64(p + left - 8);
+        }
+
+        a ^= WY_PRIME1;
+        b ^= seed;
+        r = (wy_u128)a * b;
+        a = (uint64_t)r;
+        b = (uint64_t)(r >> 64);
+        return wy_mix(a ^ WY_PRIME0 ^ size, b ^ WY_PRIME1);
+}
+
+static uint32_t
+crc_word(uint32_t crc, uint64_t w)
+{
+        int i;
+
+        /* low half first, like the crc32 instruction */
+        crc ^= (uint32_t)w;
+        for (i = 0; i < 32; ++i)
+                crc = (crc >> 1) ^ (CRC_POLY & -(crc & 1));
+        crc ^= (uint32_t)(w >> 32);
+        for (i = 0; i < 32; ++i)
+                crc = (crc >> 1) ^ (CRC_POLY & -(crc & 1));
+
+        return crc;
+}
+
+#ifdef __x86_64__
+static hashdb_size_t
+crc_hw(const void *key, hashdb_size_t size)
+{
+        const unsigned char *p = key;
+        uint64_t lo = 0xffffffff;
+        uint64_t hi = 0;
+        uint64_t w;
+        hashdb_size_t i;
+
+        for (i = 0; i < size; i += 8) {
+                w = i + 8 <= size ? hash_read64(p + i) :
+                                    hash_read_tail(p, size);
+                lo = _mm_crc32_u64(lo, w);
+                hi = _mm_crc32_u64(hi, (w << 32) | (w >> 32));
+        }
+
+        return hash_final(((hi << 32) | lo) ^ (size * XX_PRIME));
+}
+#endif
+
+static hashdb_size_t
+crc_sw(const void *key, hashdb_size_t size)
+{
+        const unsigned char *p = key;
+        uint32_t lo = 0xffffffff;
+        uint32_t hi = 0;
+        uint64_t w;
+        hashdb_size_t i;
+
+        for (i = 0; i < size; i += 8) {
+                w = i + 8 <= size ? hash_read64(p + i) :
+                                    hash_read_tail(p, size);
+                lo = crc_word(lo, w);
+                hi = crc_word(hi, (w << 32) | (w >> 32));
+        }
+
+        return hash_final((((uint64_t)hi << 32) | lo) ^ (size * XX_PRIME));
+}
+
+hashdb_size_t
+hashdb_hash_crc32c(const void *key, hashdb_size_t size)
+{
+#ifdef __x86_64__
+        if (__builtin_cpu_supports("sse4.2"))
+                return crc_hw(key, size);
+#endif
+        return crc_sw(key, size);
+}
+
+hashdb_hashfn_t
+hashdb_hash_fn(hashdb_size_t id)
+{
+        switch (id) {
+        case HASHDB_HASH_XX:
+                return hashdb_hash_xx;
+        case HASHDB_HASH_WY:
+                return hashdb_hash_wy;
+        case HASHDB_HASH_CRC32C:
+                return hashdb_hash_crc32c;
+        default:
+                return NULL;
+        }
+}
+
+hashdb_size_t
+hashdb_hash_id(hashdb_hashfn_t hashfn)
+{
+        if (hashfn == hashdb_hash_xx)
+                return HASHDB_HASH_XX;
+        if (hashfn == hashdb_hash_wy)
+                return HASHDB_HASH_WY;
+        if (hashfn == hashdb_hash_crc32c)
+                return HASHDB_HASH_CRC32C;
+
+        return HASHDB_HASH_USER;
+}
+
+void
+hashdb_hash_keys(struct hashdb *hp,
+                 void **keys,
+                 hashdb_size_t *hashes,
+                 hashdb_size_t nr)
+{
+        hashdb_size_t size = hp->hd_hdr->hh_key_size;
+        hashdb_size_t i = 0;
+
+#ifdef __SSE2__
+        if (hp->hd_hashfn == hashdb_hash_xx) {
+                for (; i + XX_LANES <= nr; i += XX_LANES)
+                        xx_lanes(keys + i, size, hashes + i);
+        }
+#endif
+        for (; i < nr; ++i)
+                hashes[i] = hp->hd_hashfn(keys[i], size);
+}
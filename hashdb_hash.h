@@ -0,0 +1,56 @@
+#ifndef HASHDB_HASH_H
+#define HASHDB_HASH_H
+
+#include "hashdb.h"
+
+/*
+ * built-in hash functions (HASHDB_HASH_*):
+ *
+ * the id of the one a file was created with is kept in hh_hash, so
+ * hashdb_open() can pick it again and refuse another one. a hash
+ * function passed by the caller is HASHDB_HASH_USER and is not checked.
+ * hashdb_hash_xx() only adds, xors and multiplies 32 bit halves of
+ * words, so several keys are hashed at once with SIMD by
+ * hashdb_hash_keys().
+ */
+
+/**
+ * Get built-in hash function:
+ *
+ * args:
+ *      @id:    HASHDB_HASH_*
+ * ret:
+ *      @success:       hash function
+ *      @failure:       NULL if @id is HASHDB_HASH_USER or unknown
+ */
+extern hashdb_hashfn_t hashdb_hash_fn(hashdb_size_t id);
+
+/**
+ * Get id of hash function:
+ *
+ * args:
+ *      @hashfn:        hash function
+ * ret:
+ *      @success:       HASHDB_HASH_* (HASHDB_HASH_USER if not built-in)
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_hash_id(hashdb_hashfn_t hashfn);
+
+/**
+ * Hash keys of hashdb (see hashdb_hash_many()):
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @keys:          keys (hh_key_size bytes each)
+ *      @hashes:        where to store hashes
+ *      @nr:            number of keys
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_hash_keys(struct hashdb *hp,
+                             void **keys,
+                             hashdb_size_t *hashes,
+                             hashdb_size_t nr);
+
+#endif
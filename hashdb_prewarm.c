@@ -0,0 +1,130 @@
+#include "hashdb_priv.h"
+#include "hashdb_prewarm.h"
+
+enum {
+        /* bytes of mapping read per hold of hp_lock */
+        PREWARM_CHUNK   = 1 << 20,
+};
+
+/* read one byte of each page in [start, end) of mapping */
+static void prewarm_range(struct hashdb *hp,
+                          hashdb_size_t start,
+                          hashdb_size_t end);
+
+/* fault in hash table, then whole file */
+static void *prewarm_thread(void *arg);
+
+static void
+prewarm_range(struct hashdb *hp, hashdb_size_t start, hashdb_size_t end)
+{
+        struct hashdb_prewarm *pp = hp->hd_prewarm;
+        volatile unsigned char *data = NULL;
+        hashdb_size_t page;
+        hashdb_size_t stop;
+        hashdb_size_t off;
+        bool done;
+
+        page = sysconf(_SC_PAGESIZE);
+        off = start - (start % page);
+        done = false;
+        while (!done) {
+                /* mapping may have moved or shrunk since last chunk */
+                pthread_mutex_lock(&pp->hp_lock);
+                stop = off + PREWARM_CHUNK;
+                if (stop > end)
+                        stop = end;
+                if (stop > hp->hd_file_size)
+                        stop = hp->hd_file_size;
+                data = hp->hd_data;
+                for (; off < stop; off += page)
+                        (void)data[off];
+                done = pp->hp_stop || off >= end || off >= hp->hd_file_size;
+                pthread_mutex_unlock(&pp->hp_lock);
+        }
+}
+
+static void *
+prewarm_thread(void *arg)
+{
+        struct hashdb *hp = arg;
+        struct hashdb_header *hdr = NULL;
+        hashdb_size_t start;
+        hashdb_size_t size;
+
+        /* every lookup goes through the hash table, so it comes first */
+        pthread_mutex_lock(&hp->hd_prewarm->hp_lock);
+        hdr = hp->hd_hdr;
+        start = UCHAR_P(__atomic_load_n(&hp->hd_hash_tab, __ATOMIC_RELAXED)) -
+                UCHAR_P(hp->hd_data);
+        size = hp->hd_link_size *
+                __atomic_load_n(&hdr->hh_bucket_cap, __ATOMIC_RELAXED);
+        if (hdr->hh_format == HASHDB_FORMAT_SWISS ||
+            hdr->hh_format == HASHDB_FORMAT_CUCKOO)
+                size = __atomic_load_n(&hdr->hh_nr_nodes, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&hp->hd_prewarm->hp_lock);
+
+        prewarm_range(hp, start, start + size);
+        prewarm_range(hp, 0, (hashdb_size_t)-1);
+        return NULL;
+}
+
+int
+hashdb_prewarm_start(struct hashdb *hp)
+{
+        struct hashdb_prewarm *pp = NULL;
+        int err;
+
+        hp->hd_prewarm = NULL;
+        if (!(hp->hd_flags & HASHDB_FLAG_PREWARM))
+                return 0;
+
+        pp = malloc(sizeof(*pp));
+        if (!pp)
+                return -1;
+        pthread_mutex_init(&pp->hp_lock, NULL);
+        pp->hp_stop = false;
+
+        hp->hd_prewarm = pp;
+        err = pthread_create(&pp->hp_thread, NULL, prewarm_thread, hp);
+        if (err) {
+                hp->hd_prewarm = NULL;
+                pthread_mutex_destroy(&pp->hp_lock);
+                free(pp);
+                errno = err;
+                return -1;
+        }
+
+        return 0;
+}
+
+void
+hashdb_prewarm_stop(struct hashdb *hp)
+{
+        struct hashdb_prewarm *pp = hp->hd_prewarm;
+
+        if (!pp)
+                return;
+
+        pthread_mutex_lock(&pp->hp_lock);
+        pp->hp_stop = true;
+        pthread_mutex_unlock(&pp->hp_lock);
+        pthread_join(pp->hp_thread, NULL);
+
+        pthread_mutex_destroy(&pp->hp_lock);
+        free(pp);
+        hp->hd_prewarm = NULL;
+}
+
+void
+hashdb_prewarm_lock(struct hashdb *hp)
+{
+        if (hp->hd_prewarm)
+                pthread_mutex_lock(&hp->hd_prewarm->hp_lock);
+}
+
+void
+hashdb_prewarm_unlock(struct hashdb *hp)
+{
+        if (hp->hd_prewarm)
+                pthread_mutex_unlock(&hp->hd_prewarm->hp_lock);
+}
@@ -0,0 +1,60 @@
+#ifndef HASHDB_PREWARM_H
+#define HASHDB_PREWARM_H
+
+#include "hashdb.h"
+
+/*
+ * prewarm thread (HASHDB_FLAG_PREWARM):
+ *
+ * reads one byte of each page, first of the hash table and then of the
+ * whole file, a chunk at a time. it holds hp_lock for each chunk and
+ * hashdb_remap() holds it while the mapping changes, so it never reads
+ * a page that is no longer mapped or past the end of the file.
+ */
+
+/**
+ * Start prewarm thread if HASHDB_FLAG_PREWARM is set, and set
+ * hd_prewarm:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_prewarm_start(struct hashdb *hp);
+
+/**
+ * Stop prewarm thread and wait for it:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       nothing (hd_prewarm set to NULL)
+ *      @failure:       does not fail
+ */
+extern void hashdb_prewarm_stop(struct hashdb *hp);
+
+/**
+ * Keep prewarm thread off the mapping:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_prewarm_lock(struct hashdb *hp);
+
+/**
+ * Let prewarm thread go on:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_prewarm_unlock(struct hashdb *hp);
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef HASHDB_PRIV_H
+#define HASHDB_PRIV_H
+
+/* internal helpers shared by hashdb source files */
+
+/* for mremap() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "hashdb.h"
+
+/* link to previous node on free list while compacting (hashdb_compact.h) */
+#define HASHDB_FREE_PREV(hp, p) \
+        ((void *)(UCHAR_P(p) + (hp)->hd_link_size))
+
+/* link that is head of bucket of hash table at tab */
+#define HASHDB_BUCKET_LINK(hp, tab, bucket) \
+        ((void *)((tab) + ((hp)->hd_link_size * (bucket))))
+
+/* round nr_nodes up so node table (with node 0) is whole HASHDB_SOA_BLOCKs */
+#define HASHDB_SOA_ROUND(n) \
+        ((((n) + HASHDB_SOA_BLOCK) & \
+          ~(hashdb_size_t)(HASHDB_SOA_BLOCK - 1)) - 1)
+
+/*
+ * links (bucket heads, hn_next and HASHDB_FREE_PREV()) hold node
+ * indexes hd_link_size bytes wide. hashdb_link_get() and
+ * hashdb_link_set() are for links no lock-free reader can see at the
+ * same time, hashdb_link_load() and hashdb_link_store() for the rest.
+ */
+
+/* get node index in link */
+static inline hashdb_size_t
+hashdb_link_get(const struct hashdb *hp, const void *link)
+{
+        if (hp->hd_link_size == sizeof(uint32_t))
+                return *(const uint32_t *)link;
+        return *(const hashdb_size_t *)link;
+}
+
+/* set node index in link */
+static inline void
+hashdb_link_set(const struct hashdb *hp, void *link, hashdb_size_t node)
+{
+        if (hp->hd_link_size == sizeof(uint32_t))
+                *(uint32_t *)link = node;
+        else
+                *(hashdb_size_t *)link = node;
+}
+
+/* get node index in link that lock-free readers may see */
+static inline hashdb_size_t
+hashdb_link_load(const struct hashdb *hp, const void *link)
+{
+        if (hp->hd_link_size == sizeof(uint32_t))
+                return __atomic_load_n((const uint32_t *)link,
+                                       __ATOMIC_ACQUIRE);
+        return __atomic_load_n((const hashdb_size_t *)link, __ATOMIC_ACQUIRE);
+}
+
+/* set node index in link that lock-free readers may see */
+static inline void
+hashdb_link_store(const struct hashdb *hp, void *link, hashdb_size_t node)
+{
+        if (hp->hd_link_size == sizeof(uint32_t))
+                __atomic_store_n((uint32_t *)link, node, __ATOMIC_RELEASE);
+        else
+                __atomic_store_n((hashdb_size_t *)link, node,
+                                 __ATOMIC_RELEASE);
+}
+
+/*
+ * while the node table grows, the hash table moves past the added
+ * nodes a chunk at a time, first buckets first. buckets below
+ * hh_bucket_cap - hh_move_left are at hd_hash_tab already, the rest are
+ * still where it was, right after the old node table.
+ */
+
+/* link that is head of bucket */
+static inline void *
+hashdb_bucket_link(const struct hashdb *hp, hashdb_size_t bucket)
+{
+        const struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *tab = NULL;
+        hashdb_size_t from;
+        hashdb_size_t left;
+
+        /* lock-free readers retry if a chunk moved under them */
+        tab = __atomic_load_n(&hp->hd_hash_tab, __ATOMIC_RELAXED);
+        left = __atomic_load_n(&hdr->hh_move_left, __ATOMIC_RELAXED);
+        if (left &&
+            bucket >= __atomic_load_n(&hdr->hh_bucket_cap,
+                                      __ATOMIC_RELAXED) - left) {
+                from = __atomic_load_n(&hdr->hh_move_from, __ATOMIC_RELAXED);
+                tab = HASHDB_BLOCK_AT(hp,
+                                __atomic_load_n(&hp->hd_actual,
+                                                __ATOMIC_RELAXED),
+                                from + 1);
+        }
+        return HASHDB_BUCKET_LINK(hp, tab, bucket);
+}
+
+/**
+ * Resize mapping of database file:
+ *
+ * the file must already be @file_size bytes long.
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @file_size:     new size of mapping
+ * ret:
+ *      @success:       0 (hd_data and hd_file_size updated)
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_remap(struct hashdb *hp, hashdb_size_t file_size);
+
+/**
+ * Sync directory that path is in (a rename or unlink in it is only on
+ * disk once this is done):
+ *
+ * args:
+ *      @path:  pathname of a file in the directory
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_sync_dir(const char *path);
+
+/**
+ * Save pairs of a slotted table before it is wiped and rebuilt (path +
+ * ".slots", only with HASHDB_FLAG_WAL or HASHDB_FLAG_SHARED):
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @pairs:         pairs, hd_node_size bytes each
+ *      @nr_pairs:      number of pairs
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_slots_save(struct hashdb *hp,
+                             const unsigned char *pairs,
+                             hashdb_size_t nr_pairs);
+
+/**
+ * Drop pairs saved by hashdb_slots_save() once table is rebuilt (synced
+ * first with HASHDB_FLAG_WAL):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_slots_done(struct hashdb *hp);
+
+/**
+ * Load pairs of a rebuild that did not finish and map whole file (free()
+ * them, then rebuild and call hashdb_slots_done()):
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @nr_pairsp:     set to number of pairs
+ *      @nr_slotsp:     set to number of slots file was sized for
+ * ret:
+ *      @success:       pairs
+ *      @failure:       NULL and errno set (ENOENT if there are none)
+ */
+extern unsigned char *hashdb_slots_load(struct hashdb *hp,
+                                        hashdb_size_t *nr_pairsp,
+                                        hashdb_size_t *nr_slotsp);
+
+/**
+ * Map hash to bucket index (linear hashing):
+ *
+ * args:
+ *      @hdr:   file header
+ *      @hash:  hash of key
+ * ret:
+ *      @success:       bucket index
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_bucket(const struct hashdb_header *hdr,
+                                   hashdb_size_t hash);
+
+/**
+ * Take node off free list, or a node never used before:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       index in node table of node
+ *      @failure:       0 if there are no free nodes
+ */
+extern hashdb_size_t hashdb_free_pop(struct hashdb *hp);
+
+/**
+ * Put node on free list:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @node:  index in node table of node
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_free_push(struct hashdb *hp, hashdb_size_t node);
+
+/**
+ * Get index of calling thread (for picking per-thread slots):
+ *
+ * ret:
+ *      @success:       index (never 0)
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_thread(void);
+
+/**
+ * Grow node table (resize lock held exclusively):
+ *
+ * new nodes are past hh_bump and follow the old ones, and the hash
+ * table starts moving to the end of the file (see hashdb_move_step()).
+ * this may move the mapping.
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_grow(struct hashdb *hp);
+
+/**
+ * Move next chunk of hash table past grown node table (resize lock
+ * held exclusively):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       nothing (nothing is done if hash table is not
+ *                      moving)
+ *      @failure:       does not fail
+ */
+extern void hashdb_move_step(struct hashdb *hp);
+
+/**
+ * Get first node hh_bump can not hand out yet:
+ *
+ * nodes added by growth are only free once the hash table has moved
+ * off them.
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       index in node table (hh_nr_nodes + 1 if all are)
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_bump_end(const struct hashdb *hp);
+
+#endif
@@ -0,0 +1,594 @@
+#include "hashdb_priv.h"
+#include "hashdb_hash.h"
+
+enum {
+        /* keys sorted by shard at a time by batched calls */
+        SHARD_BATCH     = 64,
+};
+
+/* golden ratio, spreads hash bits that pick shard */
+#define SHARD_MIX       0x9e3779b97f4a7c15ULL
+
+/* check hashdb_shards pointer */
+static int shard_sanity(struct hashdb_shards *sp);
+
+/* make pathname of shard file */
+static char *shard_path(const char *path, hashdb_size_t shard);
+
+/* record index and number of shards in header of new shard */
+static int shard_mark(struct hashdb *hp,
+                      hashdb_size_t shard,
+                      hashdb_size_t nr_shards);
+
+/* allocate hashdb_shards with no shards open yet */
+static struct hashdb_shards *shard_alloc(uint64_t flags,
+                                         hashdb_size_t nr_shards);
+
+/* close shards that are open and free hashdb_shards */
+static void shard_abort(struct hashdb_shards *sp);
+
+/* map hash to shard index */
+static hashdb_size_t shard_of(struct hashdb_shards *sp, hashdb_size_t hash);
+
+/* lock shard, shared if read is true */
+static void shard_lock(struct hashdb_shards *sp,
+                       hashdb_size_t shard,
+                       bool read);
+
+/* unlock shard */
+static void shard_unlock(struct hashdb_shards *sp, hashdb_size_t shard);
+
+/* route keys of batch to shards */
+static void shard_route(struct hashdb_shards *sp,
+                        void **keys,
+                        hashdb_size_t *shards,
+                        hashdb_size_t nr);
+
+/*
+ * gather indexes of keys in batch that go to first shard not yet done,
+ * in order, and mark them done. returns number of indexes
+ */
+static hashdb_size_t shard_gather(const hashdb_size_t *shards,
+                                  bool *done,
+                                  hashdb_size_t *idx,
+                                  hashdb_size_t nr);
+
+static int
+shard_sanity(struct hashdb_shards *sp)
+{
+        if (sp == NULL || sp->hm_shards == NULL || !sp->hm_nr_shards) {
+                errno = EINVAL;
+                return -1;
+        }
+        return 0;
+}
+
+static char *
+shard_path(const char *path, hashdb_size_t shard)
+{
+        char suffix[32];
+        char *p = NULL;
+
+        snprintf(suffix, sizeof(suffix), ".%llu", (unsigned long long)shard);
+        p = malloc(strlen(path) + strlen(suffix) + 1);
+        if (!p)
+                return NULL;
+
+        strcpy(p, path);
+        strcat(p, suffix);
+        return p;
+}
+
+static int
+shard_mark(struct hashdb *hp, hashdb_size_t shard, hashdb_size_t nr_shards)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+
+        hdr->hh_shard = shard;
+        hdr->hh_nr_shards = nr_shards;
+
+        /* the log does not redo the header, so it goes to disk now */
+        if (hp->hd_wal && msync(hp->hd_data, sizeof(*hdr), MS_SYNC))
+                return -1;
+        return 0;
+}
+
+static struct hashdb_shards *
+shard_alloc(uint64_t flags, hashdb_size_t nr_shards)
+{
+        struct hashdb_shards *sp = NULL;
+        hashdb_size_t i;
+
+        if (!nr_shards || nr_shards > UINT32_MAX) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        sp = malloc(sizeof(*sp));
+        if (!sp)
+                return NULL;
+        sp->hm_nr_shards = nr_shards;
+        sp->hm_locks = NULL;
+
+        sp->hm_shards = calloc(nr_shards, sizeof(*sp->hm_shards));
+        if (!sp->hm_shards)
+                goto free_sp;
+
+        /* concurrent shards already lock themselves */
+        if (flags & HASHDB_FLAG_CONCURRENT)
+                return sp;
+
+        sp->hm_locks = aligned_alloc(HASHDB_CACHE_LINE,
+                                     nr_shards * sizeof(*sp->hm_locks));
+        if (!sp->hm_locks)
+                goto free_shards;
+        for (i = 0; i < nr_shards; ++i)
+                pthread_rwlock_init(&sp->hm_locks[i].hl_lock, NULL);
+
+        return sp;
+free_shards:
+        free(sp->hm_shards);
+free_sp:
+        free(sp);
+        return NULL;
+}
+
+static void
+shard_abort(struct hashdb_shards *sp)
+{
+        hashdb_size_t i;
+        int err;
+
+        /* keep errno of whatever failed */
+        err = errno;
+        for (i = 0; i < sp->hm_nr_shards; ++i) {
+                if (sp->hm_shards[i])
+                        hashdb_free(&sp->hm_shards[i], false);
+        }
+        for (i = 0; sp->hm_locks && i < sp->hm_nr_shards; ++i)
+                pthread_rwlock_destroy(&sp->hm_locks[i].hl_lock);
+
+        free(sp->hm_locks);
+        free(sp->hm_shards);
+        free(sp);
+        errno = err;
+}
+
+static hashdb_size_t
+shard_of(struct hashdb_shards *sp, hashdb_size_t hash)
+{
+        /*
+         * buckets come from the low bits of the hash, so the shard comes
+         * from the high ones. hashes of only 32 bits are mixed up first
+         */
+        hash = (hash * SHARD_MIX) >> 32;
+        return (hash * sp->hm_nr_shards) >> 32;
+}
+
+static void
+shard_lock(struct hashdb_shards *sp, hashdb_size_t shard, bool read)
+{
+        if (!sp->hm_locks)
+                return;
+        if (read)
+                pthread_rwlock_rdlock(&sp->hm_locks[shard].hl_lock);
+        else
+                pthread_rwlock_wrlock(&sp->hm_locks[shard].hl_lock);
+}
+
+static void
+shard_unlock(struct hashdb_shards *sp, hashdb_size_t shard)
+{
+        if (sp->hm_locks)
+                pthread_rwlock_unlock(&sp->hm_locks[shard].hl_lock);
+}
+
+static void
+shard_route(struct hashdb_shards *sp,
+            void **keys,
+            hashdb_size_t *shards,
+            hashdb_size_t nr)
+{
+        hashdb_size_t i;
+
+        /* all shards hash the same way */
+        hashdb_hash_keys(sp->hm_shards[0], keys, shards, nr);
+        for (i = 0; i < nr; ++i)
+                shards[i] = shard_of(sp, shards[i]);
+}
+
+static hashdb_size_t
+shard_gather(const hashdb_size_t *shards,
+             bool *done,
+             hashdb_size_t *idx,
+             hashdb_size_t nr)
+{
+        hashdb_size_t first;
+        hashdb_size_t n;
+        hashdb_size_t i;
+
+        for (first = 0; first < nr && done[first]; ++first)
+                ;
+
+        n = 0;
+        for (i = first; i < nr; ++i) {
+                if (!done[i] && shards[i] == shards[first]) {
+                        done[i] = true;
+                        idx[n++] = i;
+                }
+        }
+
+        return n;
+}
+
+struct hashdb_shards *
+hashdb_shards_init(const char *path,
+                   uint64_t flags,
+                   hashdb_size_t nr_shards,
+                   hashdb_size_t nr_nodes,
+                   hashdb_size_t nr_buckets,
+                   hashdb_size_t key_size,
+                   hashdb_size_t value_size,
+                   hashdb_hashfn_t hashfn,
+                   hashdb_cmpfn_t cmpfn,
+                   mode_t mode)
+{
+        struct hashdb_shards *sp = NULL;
+        hashdb_size_t i;
+        char *p = NULL;
+
+        /* variable sized keys cannot be hashed a batch at a time */
+        if (path == NULL || (flags & HASHDB_FLAG_VAR)) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        sp = shard_alloc(flags, nr_shards);
+        if (!sp)
+                return NULL;
+
+        /* each shard gets its part of nodes and buckets */
+        nr_nodes = (nr_nodes + nr_shards - 1) / nr_shards;
+        nr_buckets = (nr_buckets + nr_shards - 1) / nr_shards;
+        if (!nr_nodes)
+                nr_nodes = 1;
+        if (!nr_buckets)
+                nr_buckets = 1;
+
+        for (i = 0; i < nr_shards; ++i) {
+                p = shard_path(path, i);
+                if (!p)
+                        goto abort;
+                sp->hm_shards[i] = hashdb_init(p, flags, nr_nodes, nr_buckets,
+                                               key_size, value_size, hashfn,
+                                               cmpfn, mode);
+                free(p);
+                if (!sp->hm_shards[i])
+                        goto abort;
+                if (shard_mark(sp->hm_shards[i], i, nr_shards))
+                        goto abort;
+        }
+
+        return sp;
+abort:
+        shard_abort(sp);
+        return NULL;
+}
+
+struct hashdb_shards *
+hashdb_shards_open(const char *path,
+                   uint64_t flags,
+                   hashdb_size_t nr_shards,
+                   hashdb_hashfn_t hashfn,
+                   hashdb_cmpfn_t cmpfn)
+{
+        struct hashdb_shards *sp = NULL;
+        struct hashdb *hp = NULL;
+        hashdb_size_t i;
+        char *p = NULL;
+
+        if (path == NULL) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        sp = shard_alloc(flags, nr_shards);
+        if (!sp)
+                return NULL;
+
+        for (i = 0; i < nr_shards; ++i) {
+                p = shard_path(path, i);
+                if (!p)
+                        goto abort;
+                sp->hm_shards[i] = hashdb_open(p, flags, hashfn, cmpfn);
+                free(p);
+                if (!sp->hm_shards[i])
+                        goto abort;
+        }
+
+        /* keys would go to the wrong shard */
+        for (i = 0; i < nr_shards; ++i) {
+                hp = sp->hm_shards[i];
+                if (hp->hd_hashfn != sp->hm_shards[0]->hd_hashfn ||
+                    hp->hd_hdr->hh_nr_shards != nr_shards ||
+                    hp->hd_hdr->hh_shard != i ||
+                    (hp->hd_flags & HASHDB_FLAG_VAR)) {
+                        errno = EINVAL;
+                        goto abort;
+                }
+        }
+
+        return sp;
+abort:
+        shard_abort(sp);
+        return NULL;
+}
+
+int
+hashdb_shards_free(struct hashdb_shards **spp, bool fully)
+{
+        struct hashdb_shards *sp = NULL;
+        hashdb_size_t i;
+
+        if (spp == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+        sp = *spp;
+
+        if (shard_sanity(sp))
+                return -1;
+
+        /* a shard that fails stays open, so free can be tried again */
+        for (i = 0; i < sp->hm_nr_shards; ++i) {
+                if (sp->hm_shards[i] && hashdb_free(&sp->hm_shards[i], fully))
+                        return -1;
+        }
+        for (i = 0; sp->hm_locks && i < sp->hm_nr_shards; ++i)
+                pthread_rwlock_destroy(&sp->hm_locks[i].hl_lock);
+
+        free(sp->hm_locks);
+        free(sp->hm_shards);
+        free(sp);
+        *spp = NULL;
+        return 0;
+}
+
+hashdb_size_t
+hashdb_shards_which(struct hashdb_shards *sp, void *key)
+{
+        struct hashdb *hp = sp->hm_shards[0];
+
+        return shard_of(sp, hp->hd_hashfn(key, hp->hd_hdr->hh_key_size));
+}
+
+void *
+hashdb_shards_set(struct hashdb_shards *sp, void *key, void *value)
+{
+        hashdb_size_t shard;
+        void *keyp = NULL;
+
+        if (shard_sanity(sp))
+                return NULL;
+
+        shard = hashdb_shards_which(sp, key);
+        shard_lock(sp, shard, false);
+        keyp = hashdb_set(sp->hm_shards[shard], key, value);
+        shard_unlock(sp, shard);
+        return keyp;
+}
+
+void *
+hashdb_shards_get(struct hashdb_shards *sp, void *key)
+{
+        hashdb_size_t shard;
+        void *keyp = NULL;
+
+        if (shard_sanity(sp))
+                return NULL;
+
+        shard = hashdb_shards_which(sp, key);
+        shard_lock(sp, shard, true);
+        keyp = hashdb_get(sp->hm_shards[shard], key);
+        shard_unlock(sp, shard);
+        return keyp;
+}
+
+int
+hashdb_shards_get_copy(struct hashdb_shards *sp, void *key, void *value)
+{
+        hashdb_size_t shard;
+        int ret;
+
+        if (shard_sanity(sp))
+                return -1;
+
+        shard = hashdb_shards_which(sp, key);
+        shard_lock(sp, shard, true);
+        ret = hashdb_get_copy(sp->hm_shards[shard], key, value);
+        shard_unlock(sp, shard);
+        return ret;
+}
+
+int
+hashdb_shards_rm(struct hashdb_shards *sp, void *key)
+{
+        hashdb_size_t shard;
+        int ret;
+
+        if (shard_sanity(sp))
+                return -1;
+
+        shard = hashdb_shards_which(sp, key);
+        shard_lock(sp, shard, false);
+        ret = hashdb_rm(sp->hm_shards[shard], key);
+        shard_unlock(sp, shard);
+        return ret;
+}
+
+int
+hashdb_shards_get_many(struct hashdb_shards *sp,
+                       void **keys,
+                       void **ptrs,
+                       hashdb_size_t n)
+{
+        hashdb_size_t shards[SHARD_BATCH];
+        hashdb_size_t idx[SHARD_BATCH];
+        void *skeys[SHARD_BATCH];
+        void *sptrs[SHARD_BATCH];
+        bool done[SHARD_BATCH];
+        hashdb_size_t shard;
+        hashdb_size_t nr;
+        hashdb_size_t m;
+        hashdb_size_t i;
+        hashdb_size_t j;
+        int ret;
+
+        if (shard_sanity(sp))
+                return -1;
+
+        for (i = 0; i < n; i += nr) {
+                nr = n - i;
+                if (nr > SHARD_BATCH)
+                        nr = SHARD_BATCH;
+
+                shard_route(sp, keys + i, shards, nr);
+                memset(done, 0, sizeof(done));
+                while ((m = shard_gather(shards, done, idx, nr))) {
+                        for (j = 0; j < m; ++j)
+                                skeys[j] = keys[i + idx[j]];
+
+                        shard = shards[idx[0]];
+                        shard_lock(sp, shard, true);
+                        ret = hashdb_get_many(sp->hm_shards[shard],
+                                              skeys, sptrs, m);
+                        shard_unlock(sp, shard);
+                        if (ret)
+                                return -1;
+
+                        for (j = 0; j < m; ++j)
+                                ptrs[i + idx[j]] = sptrs[j];
+                }
+        }
+
+        return 0;
+}
+
+hashdb_size_t
+hashdb_shards_set_many(struct hashdb_shards *sp,
+                       void **keys,
+                       void **values,
+                       hashdb_size_t n)
+{
+        hashdb_size_t shards[SHARD_BATCH];
+        hashdb_size_t idx[SHARD_BATCH];
+        void *skeys[SHARD_BATCH];
+        void *svalues[SHARD_BATCH];
+        bool done[SHARD_BATCH];
+        hashdb_size_t nr_set;
+        hashdb_size_t shard;
+        hashdb_size_t nr;
+        hashdb_size_t m;
+        hashdb_size_t i;
+        hashdb_size_t j;
+        hashdb_size_t k;
+
+        if (shard_sanity(sp))
+                return 0;
+
+        /* equal keys go to one shard, so order between them is kept */
+        nr_set = 0;
+        for (i = 0; i < n; i += nr) {
+                nr = n - i;
+                if (nr > SHARD_BATCH)
+                        nr = SHARD_BATCH;
+
+                shard_route(sp, keys + i, shards, nr);
+                memset(done, 0, sizeof(done));
+                while ((m = shard_gather(shards, done, idx, nr))) {
+                        for (j = 0; j < m; ++j) {
+                                skeys[j] = keys[i + idx[j]];
+                                svalues[j] = values[i + idx[j]];
+                        }
+
+                        shard = shards[idx[0]];
+                        shard_lock(sp, shard, false);
+                        k = hashdb_set_many(sp->hm_shards[shard],
+                                            skeys, svalues, m);
+                        shard_unlock(sp, shard);
+                        nr_set += k;
+                        if (k != m)
+                                return nr_set;
+                }
+        }
+
+        return nr_set;
+}
+
+hashdb_size_t
+hashdb_shards_rm_many(struct hashdb_shards *sp,
+                      void **keys,
+                      hashdb_size_t n)
+{
+        hashdb_size_t shards[SHARD_BATCH];
+        hashdb_size_t idx[SHARD_BATCH];
+        void *skeys[SHARD_BATCH];
+        bool done[SHARD_BATCH];
+        hashdb_size_t nr_rm;
+        hashdb_size_t shard;
+        hashdb_size_t nr;
+        hashdb_size_t m;
+        hashdb_size_t i;
+        hashdb_size_t j;
+        hashdb_size_t k;
+
+        if (shard_sanity(sp))
+                return 0;
+
+        nr_rm = 0;
+        for (i = 0; i < n; i += nr) {
+                nr = n - i;
+                if (nr > SHARD_BATCH)
+                        nr = SHARD_BATCH;
+
+                shard_route(sp, keys + i, shards, nr);
+                memset(done, 0, sizeof(done));
+                while ((m = shard_gather(shards, done, idx, nr))) {
+                        for (j = 0; j < m; ++j)
+                                skeys[j] = keys[i + idx[j]];
+
+                        shard = shards[idx[0]];
+                        shard_lock(sp, shard, false);
+                        k = hashdb_rm_many(sp->hm_shards[shard], skeys, m);
+                        shard_unlock(sp, shard);
+
+                        /* hashdb_rm_many() clears errno when it works */
+                        if (!k && errno)
+                                return 0;
+                        nr_rm += k;
+                }
+        }
+
+        errno = 0;
+        return nr_rm;
+}
+
+int
+hashdb_shards_compact(struct hashdb_shards *sp,
+                      hashdb_size_t shard,
+                      hashdb_size_t max_nodes)
+{
+        int ret;
+
+        if (shard_sanity(sp))
+                return -1;
+        if (shard >= sp->hm_nr_shards) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        shard_lock(sp, shard, false);
+        ret = hashdb_compact(sp->hm_shards[shard], max_nodes);
+        shard_unlock(sp, shard);
+        return ret;
+}
@@ -0,0 +1,165 @@
+#include "hashdb_priv.h"
+#include "hashdb_stats.h"
+#include "hashdb_var.h"
+
+/* get node of hashdb */
+#define STATS_NODE(hp, i) \
+        HASHDB_NODE(hp, i)
+
+/* number of nodes pair in node takes up */
+static hashdb_size_t stats_run(struct hashdb *hp, hashdb_size_t node);
+
+static hashdb_size_t
+stats_run(struct hashdb *hp, hashdb_size_t node)
+{
+        unsigned char *keyp = NULL;
+
+        if (hp->hd_hdr->hh_format != HASHDB_FORMAT_VAR)
+                return 1;
+
+        keyp = STATS_NODE(hp, node) + hp->hd_key_off;
+        return hashdb_var_run(hp,
+                              HASHDB_VAR_KEY_SIZE(keyp),
+                              HASHDB_VAR_VALUE_SIZE(keyp));
+}
+
+int
+hashdb_stats_init(struct hashdb *hp)
+{
+        struct hashdb_counters *cp = NULL;
+
+        hp->hd_counters = NULL;
+        if (!(hp->hd_flags & HASHDB_FLAG_STATS))
+                return 0;
+
+        cp = aligned_alloc(HASHDB_CACHE_LINE,
+                           sizeof(*cp) * HASHDB_NR_COUNTERS);
+        if (!cp)
+                return -1;
+        memset(cp, 0, sizeof(*cp) * HASHDB_NR_COUNTERS);
+
+        hp->hd_counters = cp;
+        return 0;
+}
+
+void
+hashdb_stats_free(struct hashdb *hp)
+{
+        free(hp->hd_counters);
+        hp->hd_counters = NULL;
+}
+
+void
+hashdb_stats_count(struct hashdb *hp,
+                   int op,
+                   bool found,
+                   hashdb_size_t probes)
+{
+        struct hashdb_counters *cp = NULL;
+        hashdb_size_t *hitp = NULL;
+        hashdb_size_t *nrp = NULL;
+        hashdb_size_t max;
+
+        cp = &hp->hd_counters[hashdb_thread() % HASHDB_NR_COUNTERS];
+        switch (op) {
+        case HASHDB_STATS_GET:
+                nrp = &cp->ho_gets;
+                hitp = found ? &cp->ho_hits : NULL;
+                break;
+        case HASHDB_STATS_SET:
+                nrp = &cp->ho_sets;
+                hitp = found ? NULL : &cp->ho_inserts;
+                break;
+        default:
+                nrp = &cp->ho_rms;
+                hitp = found ? &cp->ho_rm_hits : NULL;
+                break;
+        }
+
+        /* threads past HASHDB_NR_COUNTERS share counters */
+        __atomic_add_fetch(nrp, 1, __ATOMIC_RELAXED);
+        if (hitp)
+                __atomic_add_fetch(hitp, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&cp->ho_probes, probes, __ATOMIC_RELAXED);
+
+        max = __atomic_load_n(&cp->ho_max_probes, __ATOMIC_RELAXED);
+        while (probes > max &&
+               !__atomic_compare_exchange_n(&cp->ho_max_probes, &max, probes,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                ;
+}
+
+void
+hashdb_stats_walk(struct hashdb *hp, struct hashdb_stats *sp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t bucket;
+        hashdb_size_t used;
+        hashdb_size_t curr;
+        hashdb_size_t len;
+
+        /* nodes in caches or waiting on readers are free here too */
+        used = 0;
+        for (bucket = 0; bucket < hdr->hh_nr_buckets; ++bucket) {
+                curr = hashdb_link_get(hp, hashdb_bucket_link(hp, bucket));
+                for (len = 0; curr; ++len) {
+                        used += stats_run(hp, curr);
+                        curr = hashdb_link_get(hp, STATS_NODE(hp, curr));
+                }
+
+                sp->ht_nr_live += len;
+                if (len > sp->ht_hist_max)
+                        sp->ht_hist_max = len;
+                if (len >= HASHDB_STATS_NR_HIST)
+                        len = HASHDB_STATS_NR_HIST - 1;
+                ++sp->ht_hist[len];
+        }
+
+        sp->ht_nr_nodes = hdr->hh_nr_nodes;
+        sp->ht_nr_buckets = hdr->hh_nr_buckets;
+        sp->ht_nr_free = hdr->hh_nr_nodes - used;
+        sp->ht_load = (sp->ht_nr_live * 100) / hdr->hh_nr_buckets;
+}
+
+void
+hashdb_stats_sum(struct hashdb *hp, struct hashdb_stats *sp)
+{
+        struct hashdb_counters *cp = NULL;
+        hashdb_size_t rm_hits;
+        hashdb_size_t inserts;
+        hashdb_size_t max;
+        hashdb_size_t i;
+
+        if (!hp->hd_counters)
+                return;
+
+        rm_hits = 0;
+        inserts = 0;
+        for (i = 0; i < HASHDB_NR_COUNTERS; ++i) {
+                cp = &hp->hd_counters[i];
+                sp->ht_gets += __atomic_load_n(&cp->ho_gets, __ATOMIC_RELAXED);
+                sp->ht_hits += __atomic_load_n(&cp->ho_hits, __ATOMIC_RELAXED);
+                sp->ht_sets += __atomic_load_n(&cp->ho_sets, __ATOMIC_RELAXED);
+                inserts += __atomic_load_n(&cp->ho_inserts, __ATOMIC_RELAXED);
+                sp->ht_rms += __atomic_load_n(&cp->ho_rms, __ATOMIC_RELAXED);
+                rm_hits += __atomic_load_n(&cp->ho_rm_hits, __ATOMIC_RELAXED);
+                sp->ht_probes += __atomic_load_n(&cp->ho_probes,
+                                                 __ATOMIC_RELAXED);
+                max = __atomic_load_n(&cp->ho_max_probes, __ATOMIC_RELAXED);
+                if (max > sp->ht_max_probes)
+                        sp->ht_max_probes = max;
+        }
+
+        /* counters of a running call may be read half updated */
+        if (sp->ht_hits > sp->ht_gets)
+                sp->ht_hits = sp->ht_gets;
+        if (inserts > sp->ht_sets)
+                inserts = sp->ht_sets;
+        if (rm_hits > sp->ht_rms)
+                rm_hits = sp->ht_rms;
+        sp->ht_misses = sp->ht_gets - sp->ht_hits;
+        sp->ht_inserts = inserts;
+        sp->ht_updates = sp->ht_sets - inserts;
+        sp->ht_rm_misses = sp->ht_rms - rm_hits;
+}
@@ -0,0 +1,92 @@
+#ifndef HASHDB_STATS_H
+#define HASHDB_STATS_H
+
+#include "hashdb.h"
+
+/*
+ * statistics (see hashdb_stats()):
+ *
+ * with HASHDB_FLAG_STATS each operation adds itself and the number of
+ * nodes (or groups) it looked at to counters picked by thread, so
+ * threads mostly write cache lines of their own. without it
+ * hd_counters is NULL and HASHDB_STATS_COUNT() is one test.
+ */
+
+/* kinds of operations counted */
+enum {
+        HASHDB_STATS_GET        = 0,
+        HASHDB_STATS_SET        = 1,
+        HASHDB_STATS_RM         = 2,
+};
+
+/* count operation if HASHDB_FLAG_STATS is set */
+#define HASHDB_STATS_COUNT(hp, op, found, probes)                              \
+        ((hp)->hd_counters ?                                                   \
+         hashdb_stats_count((hp), (op), (found), (probes)) : (void)0)
+
+/**
+ * Allocate counters if HASHDB_FLAG_STATS is set, and set hd_counters:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_stats_init(struct hashdb *hp);
+
+/**
+ * Free counters:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       nothing (hd_counters set to NULL)
+ *      @failure:       does not fail
+ */
+extern void hashdb_stats_free(struct hashdb *hp);
+
+/**
+ * Count one operation:
+ *
+ * args:
+ *      @hp:            pointer to hashdb (hd_counters set)
+ *      @op:            HASHDB_STATS_*
+ *      @found:         key was there
+ *      @probes:        number of nodes or groups looked at
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_stats_count(struct hashdb *hp,
+                               int op,
+                               bool found,
+                               hashdb_size_t probes);
+
+/**
+ * Fill in sizes and chain length histogram by walking all chains
+ * (HASHDB_FORMAT_CHAIN and HASHDB_FORMAT_VAR, resize lock held
+ * exclusively):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @sp:    statistics (zeroed)
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_stats_walk(struct hashdb *hp, struct hashdb_stats *sp);
+
+/**
+ * Add up counters of all threads:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @sp:    statistics
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_stats_sum(struct hashdb *hp, struct hashdb_stats *sp);
+
+#endif
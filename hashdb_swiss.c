@@ -0,0 +1,455 @@
+#include "hashdb_priv.h"
+#include "hashdb_stats.h"
+#include "hashdb_swiss.h"
+#include "hashdb_trace.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* control byte values (full slots hold 7 bits of hash) */
+enum {
+        /* slot was never used, ends probing */
+        SWISS_EMPTY     = 0x80,
+        /* slot was removed, probing goes on */
+        SWISS_DELETED   = 0xfe,
+        /* bits of hash stored in control byte */
+        SWISS_H2_MASK   = 0x7f,
+        /* bits of hash not used for control byte */
+        SWISS_H1_SHIFT  = 7,
+};
+
+/* get slot of hashdb */
+#define SWISS_SLOT(hp, i) \
+        ((hp)->hd_node_tab + ((hp)->hd_node_size * (i)))
+
+/* get group probing for hash starts at */
+#define SWISS_HOME(hp, hash)                                                   \
+        (((hash) >> SWISS_H1_SHIFT) &                                          \
+         (((hp)->hd_hdr->hh_nr_nodes / HASHDB_SWISS_GROUP) - 1))
+
+/* bitmask of control bytes in group equal to c */
+static unsigned swiss_match(const unsigned char *group, unsigned char c);
+
+/* bitmask of control bytes in group that are empty or deleted */
+static unsigned swiss_match_free(const unsigned char *group);
+
+/*
+ * find key, returns slot + 1 (or 0), first free slot + 1 in *freep and
+ * number of groups probed in *probesp
+ */
+static hashdb_size_t swiss_find(struct hashdb *hp,
+                                const void *key,
+                                hashdb_size_t hash,
+                                hashdb_size_t *freep,
+                                hashdb_size_t *probesp);
+
+/* number of groups probed to get from group of hash to group g */
+static hashdb_size_t swiss_dist(struct hashdb *hp,
+                                hashdb_size_t hash,
+                                hashdb_size_t g);
+
+/* rebuild table with nr_slots slots, dropping deleted slots */
+static int swiss_resize(struct hashdb *hp, hashdb_size_t nr_slots);
+
+/* size table for nr_slots slots and put saved pairs in it */
+static int swiss_fill(struct hashdb *hp,
+                      const unsigned char *saved,
+                      hashdb_size_t nr_saved,
+                      hashdb_size_t nr_slots);
+
+hashdb_size_t
+hashdb_swiss_cap(hashdb_size_t nr_nodes)
+{
+        hashdb_size_t cap = HASHDB_SWISS_GROUP;
+
+        /* keep load factor at or below 7/8 */
+        while (cap - (cap / 8) < nr_nodes)
+                cap *= 2;
+
+        return cap;
+}
+
+hashdb_size_t
+hashdb_swiss_file_size(hashdb_size_t nr_slots, hashdb_size_t slot_size)
+{
+        return sizeof(struct hashdb_header) + nr_slots + (nr_slots * slot_size);
+}
+
+void
+hashdb_swiss_set_ptrs(struct hashdb *hp)
+{
+        unsigned char *p = UCHAR_P(hp->hd_data);
+
+        hp->hd_hash_tab = p + sizeof(*hp->hd_hdr);
+        hp->hd_node_tab = hp->hd_hash_tab + hp->hd_hdr->hh_nr_nodes;
+        hp->hd_actual = hp->hd_node_tab;
+}
+
+void
+hashdb_swiss_format(struct hashdb *hp)
+{
+        memset(hp->hd_hash_tab, SWISS_EMPTY, hp->hd_hdr->hh_nr_nodes);
+}
+
+static unsigned
+swiss_match(const unsigned char *group, unsigned char c)
+{
+#ifdef __SSE2__
+        __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+        unsigned mask = 0;
+        int i;
+
+        for (i = 0; i < HASHDB_SWISS_GROUP; ++i) {
+                if (group[i] == c)
+                        mask |= 1U << i;
+        }
+
+        return mask;
+#endif
+}
+
+static unsigned
+swiss_match_free(const unsigned char *group)
+{
+#ifdef __SSE2__
+        __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+
+        /* empty and deleted are the only bytes with the high bit set */
+        return _mm_movemask_epi8(ctrl);
+#else
+        unsigned mask = 0;
+        int i;
+
+        for (i = 0; i < HASHDB_SWISS_GROUP; ++i) {
+                if (group[i] & SWISS_EMPTY)
+                        mask |= 1U << i;
+        }
+
+        return mask;
+#endif
+}
+
+static hashdb_size_t
+swiss_find(struct hashdb *hp,
+           const void *key,
+           hashdb_size_t hash,
+           hashdb_size_t *freep,
+           hashdb_size_t *probesp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *group = NULL;
+        hashdb_size_t nr_groups;
+        hashdb_size_t slot;
+        hashdb_size_t g;
+        hashdb_size_t i;
+        unsigned mask;
+        unsigned char h2;
+
+        nr_groups = hdr->hh_nr_nodes / HASHDB_SWISS_GROUP;
+        g = SWISS_HOME(hp, hash);
+        h2 = hash & SWISS_H2_MASK;
+        if (freep)
+                *freep = 0;
+
+        /* triangular probing visits every group once */
+        for (i = 0; i < nr_groups; ++i) {
+                group = hp->hd_hash_tab + (g * HASHDB_SWISS_GROUP);
+
+                mask = swiss_match(group, h2);
+                while (mask) {
+                        slot = (g * HASHDB_SWISS_GROUP) + __builtin_ctz(mask);
+                        if (!hp->hd_cmpfn(key,
+                                          SWISS_SLOT(hp, slot),
+                                          hdr->hh_key_size)) {
+                                if (probesp)
+                                        *probesp = i + 1;
+                                return slot + 1;
+                        }
+                        mask &= mask - 1;
+                }
+
+                mask = swiss_match_free(group);
+                if (freep && !*freep && mask) {
+                        *freep = (g * HASHDB_SWISS_GROUP) + 1;
+                        *freep += __builtin_ctz(mask);
+                }
+                if (swiss_match(group, SWISS_EMPTY))
+                        break;
+
+                g = (g + i + 1) & (nr_groups - 1);
+        }
+
+        if (probesp)
+                *probesp = i < nr_groups ? i + 1 : nr_groups;
+        return 0;
+}
+
+static hashdb_size_t
+swiss_dist(struct hashdb *hp, hashdb_size_t hash, hashdb_size_t g)
+{
+        hashdb_size_t nr_groups;
+        hashdb_size_t home;
+        hashdb_size_t i;
+
+        /* same probe sequence as swiss_find() */
+        nr_groups = hp->hd_hdr->hh_nr_nodes / HASHDB_SWISS_GROUP;
+        home = SWISS_HOME(hp, hash);
+        for (i = 0; home != g && i < nr_groups; ++i)
+                home = (home + i + 1) & (nr_groups - 1);
+
+        return i;
+}
+
+static int
+swiss_resize(struct hashdb *hp, hashdb_size_t nr_slots)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *saved = NULL;
+        unsigned char *p = NULL;
+        hashdb_size_t nr_saved;
+        hashdb_size_t i;
+
+        /* copy out live pairs */
+        saved = malloc((hdr->hh_nr_live + 1) * hp->hd_node_size);
+        if (!saved)
+                return -1;
+
+        p = saved;
+        nr_saved = 0;
+        for (i = 0; i < hdr->hh_nr_nodes; ++i) {
+                if (hp->hd_hash_tab[i] & SWISS_EMPTY)
+                        continue;
+                memcpy(p, SWISS_SLOT(hp, i), hp->hd_node_size);
+                p += hp->hd_node_size;
+                ++nr_saved;
+        }
+
+        /* a crash while the table is wiped brings them back */
+        if (hashdb_slots_save(hp, saved, nr_saved))
+                goto free_saved;
+        if (swiss_fill(hp, saved, nr_saved, nr_slots))
+                goto free_saved;
+        if (hashdb_slots_done(hp))
+                goto free_saved;
+
+        free(saved);
+        return 0;
+
+free_saved:
+        free(saved);
+        return -1;
+}
+
+static int
+swiss_fill(struct hashdb *hp,
+           const unsigned char *saved,
+           hashdb_size_t nr_saved,
+           hashdb_size_t nr_slots)
+{
+        struct hashdb_header *hdr = NULL;
+        hashdb_size_t file_size;
+        hashdb_size_t hash;
+        hashdb_size_t slot;
+        hashdb_size_t i;
+
+        file_size = hashdb_swiss_file_size(nr_slots, hp->hd_node_size);
+        if (file_size != hp->hd_file_size) {
+                if (ftruncate(hp->hd_fd, file_size))
+                        return -1;
+                if (hashdb_remap(hp, file_size))
+                        return -1;
+        }
+
+        hdr = hp->hd_hdr;
+        hdr->hh_nr_nodes = nr_slots;
+        hdr->hh_nr_buckets = nr_slots / HASHDB_SWISS_GROUP;
+        hdr->hh_base_buckets = hdr->hh_nr_buckets;
+        hdr->hh_bucket_cap = hdr->hh_nr_buckets;
+        hashdb_swiss_set_ptrs(hp);
+
+        /* put pairs back */
+        hashdb_swiss_format(hp);
+        for (i = 0; i < nr_saved; ++i) {
+                hash = hp->hd_hashfn(saved, hdr->hh_key_size);
+                swiss_find(hp, saved, hash, &slot, NULL);
+                --slot;
+                hp->hd_hash_tab[slot] = hash & SWISS_H2_MASK;
+                memcpy(SWISS_SLOT(hp, slot), saved, hp->hd_node_size);
+                saved += hp->hd_node_size;
+        }
+        hdr->hh_nr_live = nr_saved;
+        hdr->hh_nr_tomb = 0;
+        return 0;
+}
+
+void *
+hashdb_swiss_set(struct hashdb *hp, void *key, void *value)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *p = NULL;
+        hashdb_size_t probes;
+        hashdb_size_t limit;
+        hashdb_size_t hash;
+        hashdb_size_t slot;
+        hashdb_size_t free;
+
+        hash = hp->hd_hashfn(key, hdr->hh_key_size);
+        slot = swiss_find(hp, key, hash, &free, &probes);
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_SET, slot != 0, probes);
+        HASHDB_TRACE_PROBE(set, SWISS_HOME(hp, hash), probes, slot != 0);
+        if (slot) {
+                p = SWISS_SLOT(hp, slot - 1);
+                memcpy(p + hdr->hh_key_size, value, hdr->hh_value_size);
+                return p;
+        }
+
+        /* deleted slots count against load factor too */
+        limit = hdr->hh_nr_nodes - (hdr->hh_nr_nodes / 8);
+        if (!free || hdr->hh_nr_live + hdr->hh_nr_tomb >= limit) {
+                if (hdr->hh_nr_live < limit) {
+                        if (swiss_resize(hp, hdr->hh_nr_nodes))
+                                return NULL;
+                } else if (hp->hd_flags & HASHDB_FLAG_GROW) {
+                        if (swiss_resize(hp, hdr->hh_nr_nodes * 2))
+                                return NULL;
+                } else {
+                        errno = ENOMEM;
+                        return NULL;
+                }
+                hdr = hp->hd_hdr;
+                swiss_find(hp, key, hash, &free, NULL);
+        }
+
+        /* pair is filled in before its slot is marked full */
+        slot = free - 1;
+        if (hp->hd_hash_tab[slot] == SWISS_DELETED)
+                --hdr->hh_nr_tomb;
+        p = SWISS_SLOT(hp, slot);
+        memcpy(p, key, hdr->hh_key_size);
+        memcpy(p + hdr->hh_key_size, value, hdr->hh_value_size);
+        hp->hd_hash_tab[slot] = hash & SWISS_H2_MASK;
+        ++hdr->hh_nr_live;
+        return p;
+}
+
+void *
+hashdb_swiss_get(struct hashdb *hp, void *key)
+{
+        hashdb_size_t probes;
+        hashdb_size_t hash;
+        hashdb_size_t slot;
+
+        hash = hp->hd_hashfn(key, hp->hd_hdr->hh_key_size);
+        slot = swiss_find(hp, key, hash, NULL, &probes);
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_GET, slot != 0, probes);
+        HASHDB_TRACE_PROBE(get, SWISS_HOME(hp, hash), probes, slot != 0);
+        if (!slot)
+                return NULL;
+
+        return SWISS_SLOT(hp, slot - 1);
+}
+
+int
+hashdb_swiss_rm(struct hashdb *hp, void *key)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        unsigned char *group = NULL;
+        hashdb_size_t probes;
+        hashdb_size_t hash;
+        hashdb_size_t slot;
+
+        hash = hp->hd_hashfn(key, hdr->hh_key_size);
+        slot = swiss_find(hp, key, hash, NULL, &probes);
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_RM, slot != 0, probes);
+        HASHDB_TRACE_PROBE(rm, SWISS_HOME(hp, hash), probes, slot != 0);
+        if (!slot) {
+                errno = ENOENT;
+                return -1;
+        }
+        --slot;
+
+        /*
+         * if group still has an empty slot no probe ever went past it,
+         * so this slot can be empty too instead of a tombstone
+         */
+        group = hp->hd_hash_tab;
+        group += slot - (slot % HASHDB_SWISS_GROUP);
+        if (swiss_match(group, SWISS_EMPTY)) {
+                hp->hd_hash_tab[slot] = SWISS_EMPTY;
+        } else {
+                hp->hd_hash_tab[slot] = SWISS_DELETED;
+                ++hdr->hh_nr_tomb;
+        }
+
+        --hdr->hh_nr_live;
+        return 0;
+}
+
+int
+hashdb_swiss_repair(struct hashdb *hp)
+{
+        struct hashdb_header *hdr = NULL;
+        unsigned char *saved = NULL;
+        hashdb_size_t nr_saved;
+        hashdb_size_t nr_slots;
+        hashdb_size_t i;
+        int ret;
+
+        /* rebuild that did not finish is done again from its pairs */
+        saved = hashdb_slots_load(hp, &nr_saved, &nr_slots);
+        if (!saved && errno != ENOENT)
+                return -1;
+        if (saved) {
+                ret = swiss_fill(hp, saved, nr_saved, nr_slots);
+                if (!ret)
+                        ret = hashdb_slots_done(hp);
+                free(saved);
+                if (ret)
+                        return -1;
+        }
+
+        /* control bytes are the only truth, counts are rebuilt from them */
+        hdr = hp->hd_hdr;
+        hdr->hh_nr_live = 0;
+        hdr->hh_nr_tomb = 0;
+        for (i = 0; i < hdr->hh_nr_nodes; ++i) {
+                if (!(hp->hd_hash_tab[i] & SWISS_EMPTY))
+                        ++hdr->hh_nr_live;
+                else if (hp->hd_hash_tab[i] == SWISS_DELETED)
+                        ++hdr->hh_nr_tomb;
+        }
+        return 0;
+}
+
+void
+hashdb_swiss_stats(struct hashdb *hp, struct hashdb_stats *sp)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t hash;
+        hashdb_size_t dist;
+        hashdb_size_t i;
+
+        for (i = 0; i < hdr->hh_nr_nodes; ++i) {
+                if (hp->hd_hash_tab[i] & SWISS_EMPTY)
+                        continue;
+
+                hash = hp->hd_hashfn(SWISS_SLOT(hp, i), hdr->hh_key_size);
+                dist = swiss_dist(hp, hash, i / HASHDB_SWISS_GROUP);
+                ++sp->ht_nr_live;
+                if (dist > sp->ht_hist_max)
+                        sp->ht_hist_max = dist;
+                if (dist >= HASHDB_STATS_NR_HIST)
+                        dist = HASHDB_STATS_NR_HIST - 1;
+                ++sp->ht_hist[dist];
+        }
+
+        /* deleted slots are not free until the table is rebuilt */
+        sp->ht_nr_nodes = hdr->hh_nr_nodes;
+        sp->ht_nr_buckets = hdr->hh_nr_buckets;
+        sp->ht_nr_free = hdr->hh_nr_nodes - sp->ht_nr_live - hdr->hh_nr_tomb;
+        sp->ht_load = (sp->ht_nr_live * 100) / hdr->hh_nr_nodes;
+}
@@ -0,0 +1,126 @@
+#ifndef HASHDB_SWISS_H
+#define HASHDB_SWISS_H
+
+#include "hashdb.h"
+
+/*
+ * open addressing table format (HASHDB_FORMAT_SWISS):
+ *
+ *      header | control bytes[nr_nodes] | slots[nr_nodes]
+ *
+ * each slot is a key/value pair. slots are split into groups of
+ * HASHDB_SWISS_GROUP and each group is probed at once by comparing its
+ * control bytes (7 bits of hash, or empty/deleted) against the key.
+ * in struct hashdb, hd_hash_tab points to the control bytes and
+ * hd_node_tab to the slots.
+ */
+
+/**
+ * Get number of slots needed to hold some number of pairs:
+ *
+ * args:
+ *      @nr_nodes:      number of key/value pairs
+ * ret:
+ *      @success:       number of slots (power of 2)
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_swiss_cap(hashdb_size_t nr_nodes);
+
+/**
+ * Get size of database file:
+ *
+ * args:
+ *      @nr_slots:      number of slots
+ *      @slot_size:     size of slot
+ * ret:
+ *      @success:       size of file
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_swiss_file_size(hashdb_size_t nr_slots,
+                                            hashdb_size_t slot_size);
+
+/**
+ * Set pointers into mapping from hd_data and header:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_swiss_set_ptrs(struct hashdb *hp);
+
+/**
+ * Mark all slots empty:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_swiss_format(struct hashdb *hp);
+
+/**
+ * Add key/value pair (see hashdb_set()):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @key:   key
+ *      @value: value
+ * ret:
+ *      @success:       pointer to key/value pair
+ *      @failure:       NULL and errno set
+ */
+extern void *hashdb_swiss_set(struct hashdb *hp, void *key, void *value);
+
+/**
+ * Retrieve key/value pair (see hashdb_get()):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @key:   key
+ * ret:
+ *      @success:       pointer to key/value pair
+ *      @failure:       NULL
+ */
+extern void *hashdb_swiss_get(struct hashdb *hp, void *key);
+
+/**
+ * Remove key/value pair (see hashdb_rm()):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @key:   key of pair to remove
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_swiss_rm(struct hashdb *hp, void *key);
+
+/**
+ * Finish rebuild a writer died in (see hashdb_slots_load()), then
+ * recount pairs and deleted slots after a writer died mid-change:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_swiss_repair(struct hashdb *hp);
+
+/**
+ * Fill in sizes and histogram of how far pairs are from the group
+ * their hash picks (see hashdb_stats()):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @sp:    statistics (zeroed)
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_swiss_stats(struct hashdb *hp, struct hashdb_stats *sp);
+
+#endif
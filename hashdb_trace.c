@@ -0,0 +1,162 @@
+#include "hashdb_priv.h"
+#include "hashdb_trace.h"
+#include <time.h>
+
+/* calls to hashdb_get(), hashdb_set() and hashdb_rm() made by thread */
+static _Thread_local hashdb_size_t trace_tick;
+
+/* get bucket of latency histogram nanoseconds go in */
+static hashdb_size_t trace_index(hashdb_size_t ns);
+
+static hashdb_size_t
+trace_index(hashdb_size_t ns)
+{
+        hashdb_size_t sub = (hashdb_size_t)1 << HASHDB_LATENCY_SHIFT;
+        int shift;
+
+        /* below sub each nanosecond has a bucket of its own */
+        if (ns < sub)
+                return ns;
+
+        /* keep top HASHDB_LATENCY_SHIFT bits below most significant */
+        shift = 63 - __builtin_clzll(ns) - HASHDB_LATENCY_SHIFT;
+        return ((shift + 1) << HASHDB_LATENCY_SHIFT) +
+                ((ns >> shift) & (sub - 1));
+}
+
+int
+hashdb_trace_init(struct hashdb *hp)
+{
+        hp->hd_latency = NULL;
+#ifdef HASHDB_TRACE
+        hp->hd_latency = calloc(HASHDB_NR_OPS, sizeof(*hp->hd_latency));
+        if (!hp->hd_latency)
+                return -1;
+#endif
+        return 0;
+}
+
+void
+hashdb_trace_free(struct hashdb *hp)
+{
+        free(hp->hd_latency);
+        hp->hd_latency = NULL;
+}
+
+hashdb_size_t
+hashdb_trace_begin(void)
+{
+        struct timespec ts;
+
+        if (++trace_tick % HASHDB_TRACE_SAMPLE)
+                return 0;
+        if (clock_gettime(CLOCK_MONOTONIC, &ts))
+                return 0;
+
+        /* 0 means not timed, and clock is never there after boot */
+        return ((hashdb_size_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+void
+hashdb_trace_end(struct hashdb *hp, int op, hashdb_size_t start)
+{
+        struct hashdb_latency *lp = &hp->hd_latency[op];
+        struct timespec ts;
+        hashdb_size_t max;
+        hashdb_size_t ns;
+
+        if (clock_gettime(CLOCK_MONOTONIC, &ts))
+                return;
+        ns = ((hashdb_size_t)ts.tv_sec * 1000000000) + ts.tv_nsec - start;
+
+        __atomic_add_fetch(&lp->hy_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&lp->hy_sum, ns, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&lp->hy_hist[trace_index(ns)], 1,
+                           __ATOMIC_RELAXED);
+
+        max = __atomic_load_n(&lp->hy_max, __ATOMIC_RELAXED);
+        while (ns > max &&
+               !__atomic_compare_exchange_n(&lp->hy_max, &max, ns,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                ;
+}
+
+void
+hashdb_trace_copy(struct hashdb *hp, int op, struct hashdb_latency *lp)
+{
+        struct hashdb_latency *src = &hp->hd_latency[op];
+        hashdb_size_t i;
+
+        lp->hy_count = __atomic_load_n(&src->hy_count, __ATOMIC_RELAXED);
+        lp->hy_sum = __atomic_load_n(&src->hy_sum, __ATOMIC_RELAXED);
+        lp->hy_max = __atomic_load_n(&src->hy_max, __ATOMIC_RELAXED);
+        for (i = 0; i < HASHDB_LATENCY_NR; ++i) {
+                lp->hy_hist[i] = __atomic_load_n(&src->hy_hist[i],
+                                                 __ATOMIC_RELAXED);
+        }
+}
+
+/* empty bodies with a barrier, so calls to them are not dropped */
+__attribute__((noinline)) void
+hashdb_trace_get(hashdb_size_t bucket, hashdb_size_t probes, bool found)
+{
+        __asm__ volatile("" : : "r"(bucket), "r"(probes), "r"(found));
+}
+
+__attribute__((noinline)) void
+hashdb_trace_set(hashdb_size_t bucket, hashdb_size_t probes, bool found)
+{
+        __asm__ volatile("" : : "r"(bucket), "r"(probes), "r"(found));
+}
+
+__attribute__((noinline)) void
+hashdb_trace_rm(hashdb_size_t bucket, hashdb_size_t probes, bool found)
+{
+        __asm__ volatile("" : : "r"(bucket), "r"(probes), "r"(found));
+}
+
+hashdb_size_t
+hashdb_latency_value(hashdb_size_t i)
+{
+        hashdb_size_t sub = (hashdb_size_t)1 << HASHDB_LATENCY_SHIFT;
+
+        if (i < sub)
+                return i;
+        return (sub + (i & (sub - 1))) <<
+                ((i >> HASHDB_LATENCY_SHIFT) - 1);
+}
+
+hashdb_size_t
+hashdb_latency_percentile(const struct hashdb_latency *lp, double pct)
+{
+        hashdb_size_t want;
+        hashdb_size_t seen;
+        double exact;
+        hashdb_size_t ns;
+        hashdb_size_t i;
+
+        if (!lp->hy_count)
+                return 0;
+        if (pct > 100)
+                pct = 100;
+
+        /* fewest calls that make up @pct percent, at least one */
+        exact = (lp->hy_count * pct) / 100;
+        want = (hashdb_size_t)exact;
+        if (want < exact || want < 1)
+                ++want;
+
+        seen = 0;
+        for (i = 0; i < HASHDB_LATENCY_NR; ++i) {
+                seen += lp->hy_hist[i];
+                if (seen >= want)
+                        break;
+        }
+
+        /* top of bucket, but no call took longer than hy_max */
+        if (i + 1 >= HASHDB_LATENCY_NR)
+                return lp->hy_max;
+        ns = hashdb_latency_value(i + 1) - 1;
+        return ns < lp->hy_max ? ns : lp->hy_max;
+}
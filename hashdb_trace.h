@@ -0,0 +1,134 @@
+#ifndef HASHDB_TRACE_H
+#define HASHDB_TRACE_H
+
+#include "hashdb.h"
+
+/*
+ * tracing (see hashdb_latency()):
+ *
+ * everything here is only compiled in with HASHDB_TRACE defined.
+ * without it hd_latency stays NULL, HASHDB_TRACE_BEGIN() is 0 and the
+ * other macros expand to nothing, so calls cost what they did before.
+ */
+
+#if defined(HASHDB_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HASHDB_TRACE_SDT        1
+#endif
+#endif
+
+#ifdef HASHDB_TRACE
+
+/* start timing call (0 if this one is not sampled) */
+#define HASHDB_TRACE_BEGIN(hp)                                                 \
+        ((hp)->hd_latency ? hashdb_trace_begin() : 0)
+
+/* stop timing call started at @start */
+#define HASHDB_TRACE_END(hp, op, start)                                        \
+        ((start) ? hashdb_trace_end((hp), (op), (start)) : (void)0)
+
+#ifdef HASHDB_TRACE_SDT
+/* fire tracepoint hashdb:@name */
+#define HASHDB_TRACE_PROBE(name, bucket, probes, found)                        \
+        DTRACE_PROBE3(hashdb, name, (bucket), (probes), (found))
+#else
+/* fire tracepoint hashdb:@name */
+#define HASHDB_TRACE_PROBE(name, bucket, probes, found)                        \
+        hashdb_trace_##name((bucket), (probes), (found))
+#endif
+
+#else
+
+#define HASHDB_TRACE_BEGIN(hp)                          ((hashdb_size_t)0)
+#define HASHDB_TRACE_END(hp, op, start)                 ((void)(start))
+#define HASHDB_TRACE_PROBE(name, bucket, probes, found) ((void)0)
+
+#endif
+
+/**
+ * Allocate latency histograms if HASHDB_TRACE is defined, and set
+ * hd_latency:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_trace_init(struct hashdb *hp);
+
+/**
+ * Free latency histograms:
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       nothing (hd_latency set to NULL)
+ *      @failure:       does not fail
+ */
+extern void hashdb_trace_free(struct hashdb *hp);
+
+/**
+ * Start timing call if it is one in HASHDB_TRACE_SAMPLE of thread:
+ *
+ * args:
+ *      none
+ * ret:
+ *      @success:       nanoseconds since some fixed point (0 if call is
+ *                      not timed)
+ *      @failure:       does not fail (0 if clock could not be read)
+ */
+extern hashdb_size_t hashdb_trace_begin(void);
+
+/**
+ * Add time taken by call to latency histogram:
+ *
+ * args:
+ *      @hp:    pointer to hashdb (hd_latency set)
+ *      @op:    HASHDB_OP_*
+ *      @start: return value of hashdb_trace_begin()
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_trace_end(struct hashdb *hp, int op, hashdb_size_t start);
+
+/**
+ * Copy latency histogram:
+ *
+ * args:
+ *      @hp:    pointer to hashdb (hd_latency set)
+ *      @op:    HASHDB_OP_*
+ *      @lp:    where to store histogram
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_trace_copy(struct hashdb *hp,
+                              int op,
+                              struct hashdb_latency *lp);
+
+/**
+ * Tracepoints for uprobes where <sys/sdt.h> is missing (they do
+ * nothing, but are never inlined):
+ *
+ * args:
+ *      @bucket:        bucket (or group) key hashes to
+ *      @probes:        number of nodes (or groups) looked at
+ *      @found:         key was there
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_trace_get(hashdb_size_t bucket,
+                             hashdb_size_t probes,
+                             bool found);
+extern void hashdb_trace_set(hashdb_size_t bucket,
+                             hashdb_size_t probes,
+                             bool found);
+extern void hashdb_trace_rm(hashdb_size_t bucket,
+                            hashdb_size_t probes,
+                            bool found);
+
+#endif
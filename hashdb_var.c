@@ -0,0 +1,295 @@
+#include "hashdb_priv.h"
+#include "hashdb_stats.h"
+#include "hashdb_trace.h"
+#include "hashdb_var.h"
+
+/* get node of hashdb */
+#define VAR_NODE(hp, i) \
+        HASHDB_NODE(hp, i)
+
+/* get bucket head, or hn_next of node if prev is not 0 */
+static hashdb_size_t *var_link(struct hashdb *hp,
+                               hashdb_size_t bucket,
+                               hashdb_size_t prev);
+
+/*
+ * find key, returns node (or 0), node before it in *prevp and number of
+ * nodes looked at in *probesp
+ */
+static hashdb_size_t var_find(struct hashdb *hp,
+                              const void *key,
+                              hashdb_size_t key_size,
+                              hashdb_size_t hash,
+                              hashdb_size_t *prevp,
+                              hashdb_size_t *probesp);
+
+/* take run of nodes off free list of its class, or cut it from hh_bump */
+static hashdb_size_t var_alloc(struct hashdb *hp, hashdb_size_t run);
+
+/* put run of nodes on free list of its class */
+static void var_free(struct hashdb *hp, hashdb_size_t node, hashdb_size_t run);
+
+/* copy pair into run of nodes (everything but hn_next) */
+static void var_fill(struct hashdb *hp,
+                     hashdb_size_t node,
+                     hashdb_size_t hash,
+                     const void *key,
+                     hashdb_size_t key_size,
+                     const void *value,
+                     hashdb_size_t value_size);
+
+hashdb_size_t
+hashdb_var_run(const struct hashdb *hp,
+               hashdb_size_t key_size,
+               hashdb_size_t value_size)
+{
+        hashdb_size_t size;
+        hashdb_size_t nr;
+        hashdb_size_t run;
+
+        size = hp->hd_key_off;
+        size += NEXT_MULTPLE_OF_8(key_size);
+        size += NEXT_MULTPLE_OF_8(value_size);
+        nr = (size + hp->hd_node_size - 1) / hp->hd_node_size;
+        for (run = 1; run < nr; run *= 2)
+                ;
+
+        return run;
+}
+
+static hashdb_size_t *
+var_link(struct hashdb *hp, hashdb_size_t bucket, hashdb_size_t prev)
+{
+        if (!prev) {
+                return hashdb_bucket_link(hp, bucket);
+        }
+
+        return &HASHDB_NODE_P(VAR_NODE(hp, prev))->hn_next;
+}
+
+static hashdb_size_t
+var_find(struct hashdb *hp,
+         const void *key,
+         hashdb_size_t key_size,
+         hashdb_size_t hash,
+         hashdb_size_t *prevp,
+         hashdb_size_t *probesp)
+{
+        unsigned char *p = NULL;
+        hashdb_size_t curr;
+        hashdb_size_t prev;
+        void *keyp = NULL;
+
+        prev = 0;
+        *probesp = 0;
+        curr = *var_link(hp, hashdb_bucket(hp->hd_hdr, hash), 0);
+        while (curr) {
+                ++*probesp;
+                p = VAR_NODE(hp, curr);
+                keyp = p + hp->hd_key_off;
+                if (HASHDB_NODE_HASH(p) == hash &&
+                    HASHDB_VAR_KEY_SIZE(keyp) == key_size &&
+                    !hp->hd_cmpfn(key, keyp, key_size))
+                        break;
+
+                prev = curr;
+                curr = HASHDB_NODE_P(p)->hn_next;
+        }
+
+        if (prevp)
+                *prevp = prev;
+        return curr;
+}
+
+static hashdb_size_t
+var_alloc(struct hashdb *hp, hashdb_size_t run)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t class;
+        hashdb_size_t node;
+
+        class = __builtin_ctzll(run);
+        if (class >= HASHDB_VAR_NR_CLASS) {
+                errno = ENOMEM;
+                return 0;
+        }
+
+        if (!class) {
+                node = hashdb_free_pop(hp);
+                if (node)
+                        return node;
+        } else if ((node = hdr->hh_var_free[class])) {
+                hdr->hh_var_free[class] =
+                        HASHDB_NODE_P(VAR_NODE(hp, node))->hn_next;
+                return node;
+        }
+
+        /*
+         * new nodes come right after old ones, so a run can span both
+         * once the hash table has moved off them
+         */
+        while (hdr->hh_bump + run > hashdb_bump_end(hp)) {
+                if (hdr->hh_move_left) {
+                        hashdb_move_step(hp);
+                        continue;
+                }
+                if (!(hp->hd_flags & HASHDB_FLAG_GROW)) {
+                        errno = ENOMEM;
+                        return 0;
+                }
+                if (hashdb_grow(hp))
+                        return 0;
+                hdr = hp->hd_hdr;
+        }
+
+        node = hdr->hh_bump;
+        hdr->hh_bump += run;
+        return node;
+}
+
+static void
+var_free(struct hashdb *hp, hashdb_size_t node, hashdb_size_t run)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        hashdb_size_t class;
+
+        class = __builtin_ctzll(run);
+        if (!class) {
+                hashdb_free_push(hp, node);
+                return;
+        }
+
+        HASHDB_NODE_P(VAR_NODE(hp, node))->hn_next = hdr->hh_var_free[class];
+        hdr->hh_var_free[class] = node;
+}
+
+static void
+var_fill(struct hashdb *hp,
+         hashdb_size_t node,
+         hashdb_size_t hash,
+         const void *key,
+         hashdb_size_t key_size,
+         const void *value,
+         hashdb_size_t value_size)
+{
+        unsigned char *p = VAR_NODE(hp, node);
+        unsigned char *keyp = p + hp->hd_key_off;
+
+        HASHDB_NODE_HASH(p) = hash;
+        HASHDB_VAR_KEY_SIZE(keyp) = key_size;
+        HASHDB_VAR_VALUE_SIZE(keyp) = value_size;
+        memcpy(keyp, key, key_size);
+        memcpy(HASHDB_VAR_VALUE(keyp), value, value_size);
+}
+
+hashdb_size_t
+hashdb_var_set(struct hashdb *hp,
+               const void *key,
+               hashdb_size_t key_size,
+               const void *value,
+               hashdb_size_t value_size)
+{
+        hashdb_size_t bucket;
+        hashdb_size_t probes;
+        hashdb_size_t hash;
+        hashdb_size_t node;
+        hashdb_size_t curr;
+        hashdb_size_t prev;
+        hashdb_size_t run;
+        hashdb_size_t old;
+        void *keyp = NULL;
+
+        if (key_size > UINT32_MAX || value_size > UINT32_MAX) {
+                errno = EINVAL;
+                return 0;
+        }
+
+        hash = hp->hd_hashfn(key, key_size);
+        bucket = hashdb_bucket(hp->hd_hdr, hash);
+        run = hashdb_var_run(hp, key_size, value_size);
+        old = 0;
+        curr = var_find(hp, key, key_size, hash, &prev, &probes);
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_SET, curr != 0, probes);
+        HASHDB_TRACE_PROBE(set, bucket, probes, curr != 0);
+        if (curr) {
+                /* new value fits in old run */
+                keyp = VAR_NODE(hp, curr) + hp->hd_key_off;
+                old = hashdb_var_run(hp, key_size,
+                                     HASHDB_VAR_VALUE_SIZE(keyp));
+                if (old == run) {
+                        memcpy(HASHDB_VAR_VALUE(keyp), value, value_size);
+                        HASHDB_VAR_VALUE_SIZE(keyp) = value_size;
+                        return curr;
+                }
+        }
+
+        /* growing may move the mapping, so only indices are kept */
+        node = var_alloc(hp, run);
+        if (!node)
+                return 0;
+
+        /* pair is filled in before it is linked */
+        var_fill(hp, node, hash, key, key_size, value, value_size);
+        if (curr) {
+                HASHDB_NODE_P(VAR_NODE(hp, node))->hn_next =
+                        HASHDB_NODE_P(VAR_NODE(hp, curr))->hn_next;
+                *var_link(hp, bucket, prev) = node;
+                var_free(hp, curr, old);
+                return node;
+        }
+
+        HASHDB_NODE_P(VAR_NODE(hp, node))->hn_next =
+                *var_link(hp, bucket, 0);
+        *var_link(hp, bucket, 0) = node;
+        ++hp->hd_hdr->hh_nr_live;
+        return node;
+}
+
+void *
+hashdb_var_get(struct hashdb *hp, const void *key, hashdb_size_t key_size)
+{
+        hashdb_size_t probes;
+        hashdb_size_t hash;
+        hashdb_size_t node;
+
+        hash = hp->hd_hashfn(key, key_size);
+        node = var_find(hp, key, key_size, hash, NULL, &probes);
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_GET, node != 0, probes);
+        HASHDB_TRACE_PROBE(get, hashdb_bucket(hp->hd_hdr, hash), probes,
+                           node != 0);
+        if (!node)
+                return NULL;
+
+        return VAR_NODE(hp, node) + hp->hd_key_off;
+}
+
+int
+hashdb_var_rm(struct hashdb *hp, const void *key, hashdb_size_t key_size)
+{
+        hashdb_size_t bucket;
+        hashdb_size_t probes;
+        hashdb_size_t hash;
+        hashdb_size_t node;
+        hashdb_size_t prev;
+        unsigned char *p = NULL;
+        void *keyp = NULL;
+
+        hash = hp->hd_hashfn(key, key_size);
+        bucket = hashdb_bucket(hp->hd_hdr, hash);
+        node = var_find(hp, key, key_size, hash, &prev, &probes);
+        HASHDB_STATS_COUNT(hp, HASHDB_STATS_RM, node != 0, probes);
+        HASHDB_TRACE_PROBE(rm, bucket, probes, node != 0);
+        if (!node) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        p = VAR_NODE(hp, node);
+        keyp = p + hp->hd_key_off;
+        *var_link(hp, bucket, prev) = HASHDB_NODE_P(p)->hn_next;
+        var_free(hp, node, hashdb_var_run(hp,
+                                          HASHDB_VAR_KEY_SIZE(keyp),
+                                          HASHDB_VAR_VALUE_SIZE(keyp)));
+        --hp->hd_hdr->hh_nr_live;
+        return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef HASHDB_VAR_H
+#define HASHDB_VAR_H
+
+#include "hashdb.h"
+
+/*
+ * variable size pairs (HASHDB_FORMAT_VAR):
+ *
+ *      header | NULL node | node table | hash table
+ *
+ * laid out like HASHDB_FORMAT_CHAIN, but each pair takes a run of
+ * 2^class nodes in a row instead of one node:
+ *
+ *      hn_next | hash | struct hashdb_var | key | value
+ *
+ * the first node of a run is the one on the hash chain, the rest just
+ * hold the end of the key and value. node size is picked at init, so
+ * pairs up to the key and value sizes given there fit in one node.
+ * removed runs go on a free list per class (hh_var_free, class 0 uses
+ * hh_free) and new ones are cut from hh_bump. runs are never merged or
+ * split, so up to half of a run may be unused.
+ */
+
+/**
+ * Get number of nodes in run holding pair:
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @key_size:      size of key
+ *      @value_size:    size of value
+ * ret:
+ *      @success:       number of nodes (power of 2)
+ *      @failure:       does not fail
+ */
+extern hashdb_size_t hashdb_var_run(const struct hashdb *hp,
+                                    hashdb_size_t key_size,
+                                    hashdb_size_t value_size);
+
+/**
+ * Add key/value pair (see hashdb_set_var(), resize lock held):
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @key:           key
+ *      @key_size:      size of key
+ *      @value:         value
+ *      @value_size:    size of value
+ * ret:
+ *      @success:       index in node table of first node of pair
+ *      @failure:       0 and errno set
+ */
+extern hashdb_size_t hashdb_var_set(struct hashdb *hp,
+                                    const void *key,
+                                    hashdb_size_t key_size,
+                                    const void *value,
+                                    hashdb_size_t value_size);
+
+/**
+ * Retrieve key/value pair (see hashdb_get_var(), resize lock held):
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @key:           key
+ *      @key_size:      size of key
+ * ret:
+ *      @success:       pointer to key/value pair
+ *      @failure:       NULL
+ */
+extern void *hashdb_var_get(struct hashdb *hp,
+                            const void *key,
+                            hashdb_size_t key_size);
+
+/**
+ * Remove key/value pair (see hashdb_rm_var(), resize lock held):
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @key:           key of pair to remove
+ *      @key_size:      size of key
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_var_rm(struct hashdb *hp,
+                         const void *key,
+                         hashdb_size_t key_size);
+
+#endif
@@ -0,0 +1,636 @@
+#include "hashdb_priv.h"
+#include "hashdb_wal.h"
+
+/* FNV-1a offset basis */
+#define WAL_SUM_BASIS \
+        ((hashdb_size_t)0xcbf29ce484222325ULL)
+
+/* FNV-1a prime */
+#define WAL_SUM_PRIME \
+        ((hashdb_size_t)0x100000001b3ULL)
+
+/* get path with suffix added (free() it) */
+static char *wal_path(const char *path, const char *suffix);
+
+/* get size of record of type */
+static hashdb_size_t wal_rec_size(struct hashdb *hp, hashdb_size_t type);
+
+/* checksum of record (everything but the checksum itself) */
+static hashdb_size_t wal_sum(const unsigned char *rec, hashdb_size_t size);
+
+/* write hw_buf to log (hw_lock held) */
+static void wal_write(struct hashdb_wal *wp);
+
+/* read whole file into memory */
+static unsigned char *wal_read(int fd, hashdb_size_t *sizep);
+
+/* replace path + suffix with buf, synced before it takes the old place */
+static int wal_save(struct hashdb *hp,
+                    const char *suffix,
+                    const unsigned char *buf,
+                    hashdb_size_t size);
+
+/* read path + suffix into memory (NULL and ENOENT if there is none) */
+static unsigned char *wal_load(struct hashdb *hp,
+                               const char *suffix,
+                               hashdb_size_t *sizep);
+
+/* is path + suffix there? */
+static bool wal_has(struct hashdb *hp, const char *suffix);
+
+/* remove path + suffix and sync directory (fine if there is none) */
+static int wal_drop(struct hashdb *hp, const char *suffix);
+
+static char *
+wal_path(const char *path, const char *suffix)
+{
+        char *p = NULL;
+
+        p = malloc(strlen(path) + strlen(suffix) + 1);
+        if (!p)
+                return NULL;
+
+        strcpy(p, path);
+        strcat(p, suffix);
+        return p;
+}
+
+static hashdb_size_t
+wal_rec_size(struct hashdb *hp, hashdb_size_t type)
+{
+        hashdb_size_t size;
+
+        /* type and checksum come first */
+        size = sizeof(hashdb_size_t) * 2;
+        size += hp->hd_hdr->hh_key_size;
+        if (type == HASHDB_WAL_SET)
+                size += hp->hd_hdr->hh_value_size;
+
+        /* pairs are only 4 byte padded with HASHDB_FLAG_INDEX32 */
+        return NEXT_MULTPLE_OF_8(size);
+}
+
+static hashdb_size_t
+wal_sum(const unsigned char *rec, hashdb_size_t size)
+{
+        hashdb_size_t sum = WAL_SUM_BASIS;
+        hashdb_size_t i;
+
+        for (i = 0; i < size; ++i) {
+                if (i == sizeof(hashdb_size_t))
+                        i += sizeof(hashdb_size_t);
+                sum ^= rec[i];
+                sum *= WAL_SUM_PRIME;
+        }
+
+        return sum;
+}
+
+int
+hashdb_wal_open(struct hashdb *hp, mode_t mode, bool create)
+{
+        struct hashdb_wal *wp = NULL;
+        struct stat stats;
+        char *path = NULL;
+        int saved_errno;
+        int flags;
+
+        wp = malloc(sizeof(*wp));
+        if (!wp)
+                return -1;
+
+        /* biggest record always fits */
+        wp->hw_cap = HASHDB_WAL_BUF;
+        while (wp->hw_cap < wal_rec_size(hp, HASHDB_WAL_SET))
+                wp->hw_cap *= 2;
+        wp->hw_buf = malloc(wp->hw_cap);
+        if (!wp->hw_buf)
+                goto free_wp;
+
+        path = wal_path(hp->hd_path, ".wal");
+        if (!path)
+                goto free_buf;
+
+        /* other processes append to it too (HASHDB_FLAG_SHARED) */
+        flags = O_CREAT | O_RDWR | O_APPEND;
+        if (create)
+                flags |= O_TRUNC;
+        wp->hw_fd = open(path, flags, mode);
+        free(path);
+        if (wp->hw_fd < 0)
+                goto free_buf;
+
+        if (fstat(wp->hw_fd, &stats))
+                goto close_fd;
+
+        pthread_mutex_init(&wp->hw_lock, NULL);
+        pthread_cond_init(&wp->hw_cond, NULL);
+        wp->hw_durability = HASHDB_DURABLE_BATCH;
+        wp->hw_err = 0;
+        wp->hw_syncing = false;
+        wp->hw_len = 0;
+        wp->hw_written = 0;
+        wp->hw_synced = 0;
+        wp->hw_size = stats.st_size;
+        hp->hd_wal = wp;
+        return 0;
+
+close_fd:
+        saved_errno = errno;
+        close(wp->hw_fd);
+        errno = saved_errno;
+free_buf:
+        free(wp->hw_buf);
+free_wp:
+        free(wp);
+        return -1;
+}
+
+int
+hashdb_wal_close(struct hashdb *hp, bool fully)
+{
+        struct hashdb_wal *wp = hp->hd_wal;
+        char *path = NULL;
+        int ret = 0;
+
+        if (close(wp->hw_fd))
+                ret = -1;
+
+        if (fully) {
+                path = wal_path(hp->hd_path, ".wal");
+                if (!path || unlink(path))
+                        ret = -1;
+                free(path);
+                if (hashdb_wal_drop_live(hp))
+                        ret = -1;
+        }
+
+        pthread_cond_destroy(&wp->hw_cond);
+        pthread_mutex_destroy(&wp->hw_lock);
+        free(wp->hw_buf);
+        free(wp);
+        hp->hd_wal = NULL;
+        return ret;
+}
+
+static void
+wal_write(struct hashdb_wal *wp)
+{
+        hashdb_size_t off;
+        ssize_t n;
+
+        for (off = 0; off < wp->hw_len; off += n) {
+                n = write(wp->hw_fd, wp->hw_buf + off, wp->hw_len - off);
+                if (n < 0 && errno == EINTR) {
+                        n = 0;
+                        continue;
+                }
+                if (n < 0) {
+                        /* records are gone, so commits must fail now */
+                        if (!wp->hw_err)
+                                wp->hw_err = errno;
+                        break;
+                }
+        }
+
+        /* read without lock to decide on checkpoints */
+        __atomic_store_n(&wp->hw_size, wp->hw_size + wp->hw_len,
+                         __ATOMIC_RELAXED);
+        wp->hw_written += wp->hw_len;
+        wp->hw_len = 0;
+}
+
+void
+hashdb_wal_append(struct hashdb *hp,
+                  hashdb_size_t type,
+                  const void *key,
+                  const void *value)
+{
+        struct hashdb_header *hdr = hp->hd_hdr;
+        struct hashdb_wal *wp = hp->hd_wal;
+        hashdb_size_t *rec = NULL;
+        unsigned char *p = NULL;
+        hashdb_size_t size;
+
+        size = wal_rec_size(hp, type);
+        pthread_mutex_lock(&wp->hw_lock);
+        if (wp->hw_len + size > wp->hw_cap)
+                wal_write(wp);
+
+        p = wp->hw_buf + wp->hw_len;
+        rec = (hashdb_size_t *)p;
+        memset(p + size - sizeof(*rec), 0, sizeof(*rec));
+        rec[0] = type;
+        memcpy(p + (sizeof(*rec) * 2), key, hdr->hh_key_size);
+        if (type == HASHDB_WAL_SET) {
+                memcpy(p + (sizeof(*rec) * 2) + hdr->hh_key_size,
+                       value,
+                       hdr->hh_value_size);
+        }
+        rec[1] = wal_sum(p, size);
+        wp->hw_len += size;
+
+        /*
+         * the bucket lock orders records of a key across processes, so
+         * they have to reach the log before it is released
+         */
+        if (hp->hd_flags & HASHDB_FLAG_SHARED)
+                wal_write(wp);
+        pthread_mutex_unlock(&wp->hw_lock);
+}
+
+int
+hashdb_wal_commit(struct hashdb *hp)
+{
+        struct hashdb_wal *wp = hp->hd_wal;
+        hashdb_size_t target;
+        hashdb_size_t end;
+        int err;
+        int fd;
+
+        pthread_mutex_lock(&wp->hw_lock);
+        wal_write(wp);
+        target = wp->hw_written;
+        if (wp->hw_durability == HASHDB_DURABLE_NONE)
+                goto unlock;
+
+        /*
+         * one thread syncs while the others wait, and its sync covers
+         * every record written before it started
+         */
+        while (wp->hw_synced < target && !wp->hw_err) {
+                if (wp->hw_syncing) {
+                        pthread_cond_wait(&wp->hw_cond, &wp->hw_lock);
+                        continue;
+                }
+
+                wp->hw_syncing = true;
+                end = wp->hw_written;
+                fd = wp->hw_fd;
+                pthread_mutex_unlock(&wp->hw_lock);
+                err = fdatasync(fd) ? errno : 0;
+                pthread_mutex_lock(&wp->hw_lock);
+
+                wp->hw_syncing = false;
+                if (err && !wp->hw_err)
+                        wp->hw_err = err;
+                if (!err && end > wp->hw_synced)
+                        wp->hw_synced = end;
+                pthread_cond_broadcast(&wp->hw_cond);
+        }
+
+unlock:
+        err = wp->hw_err;
+        pthread_mutex_unlock(&wp->hw_lock);
+        if (err) {
+                errno = err;
+                return -1;
+        }
+
+        return 0;
+}
+
+bool
+hashdb_wal_full(struct hashdb *hp)
+{
+        return __atomic_load_n(&hp->hd_wal->hw_size, __ATOMIC_RELAXED) >=
+                HASHDB_WAL_MAX;
+}
+
+int
+hashdb_wal_reset(struct hashdb *hp)
+{
+        struct hashdb_wal *wp = hp->hd_wal;
+        int ret = 0;
+
+        pthread_mutex_lock(&wp->hw_lock);
+        if (ftruncate(wp->hw_fd, 0))
+                ret = -1;
+
+        /* database file has every change, buffered ones too */
+        if (!ret) {
+                wp->hw_written += wp->hw_len;
+                wp->hw_synced = wp->hw_written;
+                wp->hw_len = 0;
+                __atomic_store_n(&wp->hw_size, 0, __ATOMIC_RELAXED);
+                wp->hw_err = 0;
+                pthread_cond_broadcast(&wp->hw_cond);
+        }
+
+        pthread_mutex_unlock(&wp->hw_lock);
+        return ret;
+}
+
+int
+hashdb_wal_save_live(struct hashdb *hp,
+                     const unsigned char *live,
+                     hashdb_size_t size)
+{
+        return wal_save(hp, ".live", live, size);
+}
+
+unsigned char *
+hashdb_wal_load_live(struct hashdb *hp, hashdb_size_t *sizep)
+{
+        return wal_load(hp, ".live", sizep);
+}
+
+int
+hashdb_wal_drop_live(struct hashdb *hp)
+{
+        return wal_drop(hp, ".live");
+}
+
+int
+hashdb_wal_save_slots(struct hashdb *hp,
+                      const unsigned char *pairs,
+                      hashdb_size_t size)
+{
+        return wal_save(hp, ".slots", pairs, size);
+}
+
+unsigned char *
+hashdb_wal_load_slots(struct hashdb *hp, hashdb_size_t *sizep)
+{
+        return wal_load(hp, ".slots", sizep);
+}
+
+bool
+hashdb_wal_has_slots(struct hashdb *hp)
+{
+        return wal_has(hp, ".slots");
+}
+
+int
+hashdb_wal_drop_slots(struct hashdb *hp)
+{
+        return wal_drop(hp, ".slots");
+}
+
+int
+hashdb_wal_save_clean(struct hashdb *hp)
+{
+        /* the mark is the file itself, it holds nothing */
+        return wal_save(hp, ".clean", NULL, 0);
+}
+
+bool
+hashdb_wal_has_clean(struct hashdb *hp)
+{
+        return wal_has(hp, ".clean");
+}
+
+int
+hashdb_wal_drop_clean(struct hashdb *hp)
+{
+        return wal_drop(hp, ".clean");
+}
+
+static int
+wal_save(struct hashdb *hp,
+         const char *suffix,
+         const unsigned char *buf,
+         hashdb_size_t size)
+{
+        struct stat stats;
+        char *path = NULL;
+        char *tmp = NULL;
+        hashdb_size_t off;
+        int saved_errno;
+        int ret = -1;
+        ssize_t n;
+        int fd;
+
+        if (fstat(hp->hd_fd, &stats))
+                return -1;
+
+        path = wal_path(hp->hd_path, suffix);
+        tmp = wal_path(hp->hd_path, ".tmp");
+        if (!path || !tmp)
+                goto free_paths;
+
+        fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, stats.st_mode & 0777);
+        if (fd < 0)
+                goto free_paths;
+        for (off = 0; off < size; off += n) {
+                n = write(fd, buf + off, size - off);
+                if (n < 0 && errno == EINTR) {
+                        n = 0;
+                        continue;
+                }
+                if (n < 0)
+                        goto close_fd;
+        }
+        if (!fsync(fd))
+                ret = 0;
+
+close_fd:
+        saved_errno = errno;
+        if (close(fd))
+                ret = -1;
+        else
+                errno = saved_errno;
+
+        /* a crash leaves either the old file or the new one */
+        if (!ret && (rename(tmp, path) || hashdb_sync_dir(path)))
+                ret = -1;
+free_paths:
+        free(tmp);
+        free(path);
+        return ret;
+}
+
+static unsigned char *
+wal_load(struct hashdb *hp, const char *suffix, hashdb_size_t *sizep)
+{
+        unsigned char *buf = NULL;
+        char *path = NULL;
+        int saved_errno;
+        int fd;
+
+        path = wal_path(hp->hd_path, suffix);
+        if (!path)
+                return NULL;
+        fd = open(path, O_RDONLY);
+        free(path);
+        if (fd < 0)
+                return NULL;
+
+        buf = wal_read(fd, sizep);
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return buf;
+}
+
+static bool
+wal_has(struct hashdb *hp, const char *suffix)
+{
+        char *path = NULL;
+        bool ret;
+
+        path = wal_path(hp->hd_path, suffix);
+        if (!path)
+                return false;
+
+        ret = !access(path, F_OK);
+        free(path);
+        return ret;
+}
+
+static int
+wal_drop(struct hashdb *hp, const char *suffix)
+{
+        char *path = NULL;
+        int ret = 0;
+
+        path = wal_path(hp->hd_path, suffix);
+        if (!path)
+                return -1;
+
+        /* a stale file coming back after a crash would lose pairs */
+        if (!unlink(path))
+                ret = hashdb_sync_dir(path);
+        else if (errno != ENOENT)
+                ret = -1;
+
+        free(path);
+        return ret;
+}
+
+static unsigned char *
+wal_read(int fd, hashdb_size_t *sizep)
+{
+        unsigned char *buf = NULL;
+        struct stat stats;
+        hashdb_size_t off;
+        ssize_t n;
+
+        if (fstat(fd, &stats))
+                return NULL;
+
+        /* one extra byte so an empty file is not mistaken for an error */
+        buf = malloc(stats.st_size + 1);
+        if (!buf)
+                return NULL;
+
+        for (off = 0; off < (hashdb_size_t)stats.st_size; off += n) {
+                n = pread(fd, buf + off, stats.st_size - off, off);
+                if (n < 0 && errno == EINTR) {
+                        n = 0;
+                        continue;
+                }
+                if (n < 0) {
+                        free(buf);
+                        return NULL;
+                }
+                if (!n)
+                        break;
+        }
+
+        *sizep = off;
+        return buf;
+}
+
+int
+hashdb_wal_replay(struct hashdb *hp)
+{
+        struct hashdb_wal *wp = hp->hd_wal;
+        hashdb_size_t *offs = NULL;
+        struct hashdb *last = NULL;
+        unsigned char *buf = NULL;
+        unsigned char *p = NULL;
+        hashdb_size_t *rec = NULL;
+        hashdb_size_t key_size;
+        hashdb_size_t nr_recs;
+        hashdb_size_t size;
+        hashdb_size_t off;
+        hashdb_size_t pass;
+        hashdb_size_t idx;
+        hashdb_size_t min;
+        hashdb_size_t i;
+        char *path = NULL;
+        int saved_errno;
+        int ret = -1;
+
+        buf = wal_read(wp->hw_fd, &size);
+        if (!buf)
+                return -1;
+
+        /* find records, stopping at a torn one */
+        min = wal_rec_size(hp, HASHDB_WAL_RM);
+        offs = malloc(sizeof(*offs) * ((size / min) + 1));
+        if (!offs)
+                goto free_buf;
+        nr_recs = 0;
+        for (off = 0; off + min <= size; off += i) {
+                rec = (hashdb_size_t *)(buf + off);
+                if (rec[0] != HASHDB_WAL_SET && rec[0] != HASHDB_WAL_RM)
+                        break;
+                i = wal_rec_size(hp, rec[0]);
+                if (off + i > size || wal_sum(buf + off, i) != rec[1])
+                        break;
+                offs[nr_recs++] = off;
+        }
+        ret = 0;
+        if (!nr_recs)
+                goto free_offs;
+
+        /* remember last record of each key in a scratch hashdb */
+        ret = -1;
+        path = wal_path(hp->hd_path, ".wal.tmp");
+        if (!path)
+                goto free_offs;
+        key_size = hp->hd_hdr->hh_key_size;
+        last = hashdb_init(path,
+                           HASHDB_FLAG_GROW,
+                           nr_recs,
+                           nr_recs,
+                           key_size,
+                           sizeof(idx),
+                           hp->hd_hashfn,
+                           hp->hd_cmpfn,
+                           0600);
+        if (!last)
+                goto free_path;
+        for (i = 0; i < nr_recs; ++i) {
+                p = buf + offs[i] + (sizeof(*rec) * 2);
+                if (!hashdb_set(last, p, &i))
+                        goto free_last;
+        }
+
+        /* changes being redone must not be logged again */
+        hp->hd_wal = NULL;
+        for (pass = 0; pass < 2; ++pass) {
+                for (i = 0; i < nr_recs; ++i) {
+                        rec = (hashdb_size_t *)(buf + offs[i]);
+                        p = buf + offs[i] + (sizeof(*rec) * 2);
+                        if (hashdb_get_copy(last, p, &idx) || idx != i)
+                                continue;
+
+                        if (!pass && rec[0] == HASHDB_WAL_RM &&
+                            hashdb_rm(hp, p) && errno != ENOENT)
+                                goto restore;
+                        if (pass && rec[0] == HASHDB_WAL_SET &&
+                            !hashdb_set(hp, p, p + key_size))
+                                goto restore;
+                }
+        }
+        ret = 0;
+
+restore:
+        hp->hd_wal = wp;
+free_last:
+        saved_errno = errno;
+        if (hashdb_free(&last, true))
+                ret = -1;
+        else
+                errno = saved_errno;
+free_path:
+        free(path);
+free_offs:
+        free(offs);
+free_buf:
+        free(buf);
+        return ret;
+}
@@ -0,0 +1,248 @@
+#ifndef HASHDB_WAL_H
+#define HASHDB_WAL_H
+
+#include "hashdb.h"
+
+/*
+ * write-ahead log (HASHDB_FLAG_WAL), kept in path + ".wal":
+ *
+ *      record | record | ...
+ *
+ * each record is its type, a checksum of everything else in it, the
+ * key and (for HASHDB_WAL_SET) the value. records are collected in
+ * hw_buf and written when it fills up or on commit. a torn record at
+ * the end of the log fails its checksum and ends replay.
+ *
+ * links are not logged, so each checkpoint also saves which nodes are
+ * in chains (path + ".live"). after a crash chains are rebuilt from
+ * those nodes alone and the log redoes every change made since. the
+ * checkpoint of a clean hashdb_free() leaves path + ".clean", so the
+ * next open has nothing to rebuild or redo.
+ */
+
+/* log record types */
+enum {
+        /* key/value pair was set ("set ") */
+        HASHDB_WAL_SET  = 0x73657420,
+        /* key/value pair was removed ("rm  ") */
+        HASHDB_WAL_RM   = 0x726d2020,
+};
+
+/**
+ * Open write-ahead log of hashdb and set hd_wal:
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @mode:          file permissions if log is created
+ *      @create:        throw away old log
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_wal_open(struct hashdb *hp, mode_t mode, bool create);
+
+/**
+ * Close write-ahead log of hashdb:
+ *
+ * args:
+ *      @hp:            pointer to hashdb
+ *      @fully:         remove log file
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_wal_close(struct hashdb *hp, bool fully);
+
+/**
+ * Append record of change (lock of changed bucket held):
+ *
+ * errors are kept and returned by the next hashdb_wal_commit().
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @type:  HASHDB_WAL_SET or HASHDB_WAL_RM
+ *      @key:   key
+ *      @value: value (ignored by HASHDB_WAL_RM)
+ * ret:
+ *      @success:       nothing
+ *      @failure:       does not fail
+ */
+extern void hashdb_wal_append(struct hashdb *hp,
+                              hashdb_size_t type,
+                              const void *key,
+                              const void *value);
+
+/**
+ * Write out appended records and sync them (see hashdb_commit()):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_wal_commit(struct hashdb *hp);
+
+/**
+ * Is log big enough for a checkpoint?
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @true:  if it is
+ *      @false: if not
+ */
+extern bool hashdb_wal_full(struct hashdb *hp);
+
+/**
+ * Empty log once database file is synced (no changes in flight):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_wal_reset(struct hashdb *hp);
+
+/**
+ * Save which nodes are in chains, replacing the last list (path +
+ * ".live", written with the database file synced):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @live:  bit for each node in node table, set if it is in a chain
+ *      @size:  size of @live in bytes
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_wal_save_live(struct hashdb *hp,
+                                const unsigned char *live,
+                                hashdb_size_t size);
+
+/**
+ * Load nodes that were in chains at last checkpoint (free() them):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @sizep: set to size of list in bytes
+ * ret:
+ *      @success:       list (see hashdb_wal_save_live())
+ *      @failure:       NULL and errno set (ENOENT if there is none)
+ */
+extern unsigned char *hashdb_wal_load_live(struct hashdb *hp,
+                                           hashdb_size_t *sizep);
+
+/**
+ * Remove list of nodes in chains (changes made without a log make it
+ * stale):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0 (also if there is none)
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_wal_drop_live(struct hashdb *hp);
+
+/**
+ * Save pairs of slotted table about to be rebuilt, replacing the last
+ * ones (path + ".slots", see hashdb_slots_save()):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @pairs: pairs, hd_node_size bytes each
+ *      @size:  size of @pairs in bytes
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_wal_save_slots(struct hashdb *hp,
+                                 const unsigned char *pairs,
+                                 hashdb_size_t size);
+
+/**
+ * Load pairs of slotted table whose rebuild did not finish (free() them):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ *      @sizep: set to size of pairs in bytes
+ * ret:
+ *      @success:       pairs
+ *      @failure:       NULL and errno set (ENOENT if there are none)
+ */
+extern unsigned char *hashdb_wal_load_slots(struct hashdb *hp,
+                                            hashdb_size_t *sizep);
+
+/**
+ * Are there pairs of a slotted table whose rebuild did not finish?
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       true if path + ".slots" is there
+ *      @failure:       false
+ */
+extern bool hashdb_wal_has_slots(struct hashdb *hp);
+
+/**
+ * Remove pairs saved for rebuild of slotted table (once it is done):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0 (also if there are none)
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_wal_drop_slots(struct hashdb *hp);
+
+/**
+ * Mark database file as closed cleanly (path + ".clean", written after
+ * the last checkpoint):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_wal_save_clean(struct hashdb *hp);
+
+/**
+ * Was database file closed cleanly?
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       true if path + ".clean" is there
+ *      @failure:       false
+ */
+extern bool hashdb_wal_has_clean(struct hashdb *hp);
+
+/**
+ * Remove mark of clean close (before the file can change again):
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0 (also if there is none)
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_wal_drop_clean(struct hashdb *hp);
+
+/**
+ * Redo changes in log (no changes in flight):
+ *
+ * only the last change of each key is redone, removes first, so a
+ * table without HASHDB_FLAG_GROW never needs more room than it had.
+ *
+ * args:
+ *      @hp:    pointer to hashdb
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int hashdb_wal_replay(struct hashdb *hp);
+
+#endif
@@ -0,0 +1,655 @@
+#include "hashdb.h"
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+enum {
+        /* default number of keys per worker */
+        DEFAULT_NR_KEY          = 4096,
+        /* default number of operations per worker */
+        DEFAULT_NR_OP           = 100000,
+        /* default number of kills (-p) or crashes (-l) */
+        DEFAULT_NR_ROUND        = 20,
+        /* max number of threads or processes */
+        MAX_WORKER              = 64,
+        /* time between kills of writer processes (usec) */
+        KILL_USEC               = 2000,
+        /* max time a logging writer runs before it is killed (usec) */
+        CRASH_USEC              = 200000,
+        /* logging writer checkpoints every this many operations */
+        CHECKPOINT_EVERY        = 1024,
+        /* load factor (percent) past which buckets are split */
+        MAX_LOAD                = 100,
+};
+
+/* keys and model of one worker */
+struct worker {
+        struct hashdb   *wk_hp;
+        hashdb_size_t   wk_id;
+        hashdb_size_t   wk_nr_workers;
+        hashdb_size_t   wk_nr_keys;
+        hashdb_size_t   wk_nr_ops;
+        /* value of each key of worker (NULL if not tracked) */
+        uint64_t        *wk_values;
+        /* is key of worker set? */
+        unsigned char   *wk_have;
+        /* number of keys of worker set at end */
+        hashdb_size_t   wk_nr_live;
+        /* if set, every key is set and waited on before operations */
+        pthread_barrier_t *wk_filled;
+};
+
+/* strtol with error checking */
+static long e_strtol(const char *nptr, char **endptr, int base);
+
+/* print usage and exit */
+static void usage(char *progname);
+
+/* value stored for key (low half of key, so any value can be checked) */
+static uint64_t value_of(uint64_t key, hashdb_size_t seq);
+
+/* exit if value could not have been stored for key */
+static void check_value(uint64_t key, uint64_t value);
+
+/* do one random operation on own keys, then look up someone else's */
+static void step(struct worker *wp, unsigned int *seed, hashdb_size_t seq);
+
+/* run operations of one worker thread and check its keys after */
+static void *run_thread(void *arg);
+
+/* set and remove every key, so this thread caches free nodes */
+static void fill_and_empty(struct hashdb *hp, hashdb_size_t nr_keys);
+
+/* check every pair can be found and return their number */
+static hashdb_size_t check_pairs(struct hashdb *hp);
+
+/*
+ * threads change and look up keys while table splits and grows, or
+ * (fixed) in a node table with room for just all of their keys
+ */
+static void stress_threads(hashdb_size_t nr, hashdb_size_t nr_keys,
+                           hashdb_size_t nr_ops, bool fixed);
+
+/* get format flag named by -f */
+static uint64_t format_of(const char *name);
+
+/* create table of format that starts small, so it grows under writers */
+static void create_small(uint64_t flags);
+
+/* processes change keys while some of them are killed */
+static void stress_procs(hashdb_size_t nr, hashdb_size_t nr_keys,
+                         hashdb_size_t nr_ops, hashdb_size_t nr_rounds,
+                         uint64_t format);
+
+/* logging writer is killed, then its log is redone and checked */
+static void stress_log(hashdb_size_t nr_keys, hashdb_size_t nr_ops,
+                       hashdb_size_t nr_rounds, uint64_t format);
+
+/* open table for logging writer, syncing only on commit */
+static struct hashdb *log_open(uint64_t flags);
+
+/* key, value and kind of operation number seq of logging writer */
+static int log_op(unsigned int *seed, hashdb_size_t nr_keys,
+                  hashdb_size_t seq, uint64_t *keyp, uint64_t *valuep);
+
+int
+main(int argc, char **argv)
+{
+        hashdb_size_t nr_threads = 0;
+        hashdb_size_t nr_procs = 0;
+        hashdb_size_t nr_keys = DEFAULT_NR_KEY;
+        hashdb_size_t nr_ops = DEFAULT_NR_OP;
+        hashdb_size_t nr_rounds = DEFAULT_NR_ROUND;
+        uint64_t format = 0;
+        bool fixed = false;
+        bool log = false;
+        int c;
+
+        while ((c = getopt(argc, argv, "t:p:ln:o:r:f:F")) != -1) {
+                switch (c) {
+                case 't':
+                        nr_threads = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'p':
+                        nr_procs = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'l':
+                        log = true;
+                        break;
+                case 'n':
+                        nr_keys = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'o':
+                        nr_ops = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'r':
+                        nr_rounds = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'f':
+                        format = format_of(optarg);
+                        break;
+                case 'F':
+                        fixed = true;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (!nr_threads && !nr_procs && !log)
+                usage(argv[0]);
+        if (nr_threads > MAX_WORKER || nr_procs > MAX_WORKER || !nr_keys)
+                usage(argv[0]);
+
+        if (nr_threads)
+                stress_threads(nr_threads, nr_keys, nr_ops, fixed);
+        if (nr_procs)
+                stress_procs(nr_procs, nr_keys, nr_ops, nr_rounds, format);
+        if (log)
+                stress_log(nr_keys, nr_ops, nr_rounds, format);
+
+        return 0;
+}
+
+static long
+e_strtol(const char *nptr, char **endptr, int base)
+{
+        long res;
+
+        errno = 0;
+        res = strtol(nptr, endptr, base);
+        if (errno)
+                err(EX_SOFTWARE, "strtol(%s)", nptr);
+
+        return res;
+}
+
+static void
+usage(char *progname)
+{
+        fprintf(stderr, "%s: Usage\n", progname);
+        fprintf(stderr, "\t-t:  number of threads (run thread test)\n");
+        fprintf(stderr, "\t-p:  number of processes (run kill test)\n");
+        fprintf(stderr, "\t-l:  run crash test of write-ahead log\n");
+        fprintf(stderr, "\t-n:  number of keys per thread or process\n");
+        fprintf(stderr, "\t-o:  number of operations per thread or process\n");
+        fprintf(stderr, "\t-r:  number of kills or crashes\n");
+        fprintf(stderr, "\t-f:  swiss or cuckoo format (-p and -l)\n");
+        fprintf(stderr, "\t-F:  no growth, room for just all keys (-t)\n");
+        exit(EXIT_FAILURE);
+}
+
+static uint64_t
+format_of(const char *name)
+{
+        if (!strcmp(name, "swiss"))
+                return HASHDB_FLAG_SWISS;
+        if (!strcmp(name, "cuckoo"))
+                return HASHDB_FLAG_CUCKOO;
+
+        errx(EX_USAGE, "unknown format %s", name);
+}
+
+static void
+create_small(uint64_t flags)
+{
+        struct hashdb *hp = NULL;
+
+        hp = hashdb_init("stressdb", flags, 64, 16, 8, 8, NULL, NULL, 0644);
+        if (!hp)
+                err(EX_SOFTWARE, "hashdb_init()");
+        /* slotted formats double instead of splitting buckets */
+        if (!(flags & (HASHDB_FLAG_SWISS | HASHDB_FLAG_CUCKOO)) &&
+            hashdb_set_max_load(hp, MAX_LOAD))
+                err(EX_SOFTWARE, "hashdb_set_max_load()");
+        if (hashdb_free(&hp, false))
+                err(EX_SOFTWARE, "hashdb_free()");
+}
+
+static uint64_t
+value_of(uint64_t key, hashdb_size_t seq)
+{
+        return ((uint64_t)seq << 32) | (key & 0xffffffff);
+}
+
+static void
+check_value(uint64_t key, uint64_t value)
+{
+        if ((value & 0xffffffff) != (key & 0xffffffff))
+                errx(EX_SOFTWARE, "key %llx has value %llx",
+                     (unsigned long long)key,
+                     (unsigned long long)value);
+}
+
+static void
+step(struct worker *wp, unsigned int *seed, hashdb_size_t seq)
+{
+        hashdb_size_t i = rand_r(seed) % wp->wk_nr_keys;
+        uint64_t key = wp->wk_id * wp->wk_nr_keys + i;
+        uint64_t value = value_of(key, seq);
+        uint64_t out;
+        int ret;
+
+        switch (rand_r(seed) % 4) {
+        case 0:
+        case 1:
+                if (!hashdb_set(wp->wk_hp, &key, &value))
+                        err(EX_SOFTWARE, "hashdb_set()");
+                if (wp->wk_values) {
+                        wp->wk_values[i] = value;
+                        wp->wk_have[i] = 1;
+                }
+                break;
+        case 2:
+                ret = hashdb_rm(wp->wk_hp, &key);
+                if (wp->wk_values && (ret == 0) != wp->wk_have[i])
+                        errx(EX_SOFTWARE, "hashdb_rm(%llx)",
+                             (unsigned long long)key);
+                if (wp->wk_values)
+                        wp->wk_have[i] = 0;
+                break;
+        default:
+                ret = hashdb_get_copy(wp->wk_hp, &key, &out);
+                if (!ret)
+                        check_value(key, out);
+                if (wp->wk_values &&
+                    ((ret == 0) != wp->wk_have[i] ||
+                     (!ret && out != wp->wk_values[i])))
+                        errx(EX_SOFTWARE, "hashdb_get_copy(%llx)",
+                             (unsigned long long)key);
+                break;
+        }
+
+        /* other workers change their keys at the same time */
+        key = rand_r(seed) % (wp->wk_nr_workers * wp->wk_nr_keys);
+        if (!hashdb_get_copy(wp->wk_hp, &key, &out))
+                check_value(key, out);
+}
+
+static void *
+run_thread(void *arg)
+{
+        struct worker *wp = arg;
+        unsigned int seed = wp->wk_id + 1;
+        uint64_t key;
+        uint64_t out;
+        hashdb_size_t i;
+        int ret;
+
+        /* table is full once all workers are past the barrier */
+        for (i = 0; wp->wk_filled && i < wp->wk_nr_keys; ++i) {
+                key = wp->wk_id * wp->wk_nr_keys + i;
+                wp->wk_values[i] = value_of(key, 0);
+                wp->wk_have[i] = 1;
+                if (!hashdb_set(wp->wk_hp, &key, &wp->wk_values[i]))
+                        err(EX_SOFTWARE, "hashdb_set()");
+        }
+        if (wp->wk_filled)
+                pthread_barrier_wait(wp->wk_filled);
+
+        for (i = 0; i < wp->wk_nr_ops; ++i)
+                step(wp, &seed, i);
+
+        for (i = 0; i < wp->wk_nr_keys; ++i) {
+                key = wp->wk_id * wp->wk_nr_keys + i;
+                ret = hashdb_get_copy(wp->wk_hp, &key, &out);
+                if ((ret == 0) != wp->wk_have[i] ||
+                    (!ret && out != wp->wk_values[i]))
+                        errx(EX_SOFTWARE, "key %llx lost",
+                             (unsigned long long)key);
+                wp->wk_nr_live += wp->wk_have[i];
+        }
+
+        return NULL;
+}
+
+static void
+fill_and_empty(struct hashdb *hp, hashdb_size_t nr_keys)
+{
+        uint64_t key;
+        uint64_t value;
+
+        for (key = 0; key < nr_keys; ++key) {
+                value = value_of(key, 0);
+                if (!hashdb_set(hp, &key, &value))
+                        err(EX_SOFTWARE, "hashdb_set()");
+        }
+        for (key = 0; key < nr_keys; ++key) {
+                if (hashdb_rm(hp, &key))
+                        err(EX_SOFTWARE, "hashdb_rm()");
+        }
+}
+
+static hashdb_size_t
+check_pairs(struct hashdb *hp)
+{
+        struct hashdb_cursor cursor;
+        struct hashdb_stats stats;
+        hashdb_size_t found = 0;
+        uint64_t *pair = NULL;
+        uint64_t out;
+
+        if (hashdb_cursor_open(hp, &cursor, 1))
+                err(EX_SOFTWARE, "hashdb_cursor_open()");
+        while ((pair = hashdb_cursor_next(&cursor))) {
+                check_value(pair[0], pair[1]);
+                if (hashdb_get_copy(hp, &pair[0], &out) || out != pair[1])
+                        errx(EX_SOFTWARE, "key %llx not in its chain",
+                             (unsigned long long)pair[0]);
+                ++found;
+        }
+        hashdb_cursor_close(&cursor, 1);
+
+        if (hashdb_stats(hp, &stats))
+                err(EX_SOFTWARE, "hashdb_stats()");
+        if (stats.ht_nr_live != found)
+                errx(EX_SOFTWARE, "%zu pairs counted, %zu found",
+                     (size_t)stats.ht_nr_live,
+                     (size_t)found);
+
+        return found;
+}
+
+static void
+stress_threads(hashdb_size_t nr,
+               hashdb_size_t nr_keys,
+               hashdb_size_t nr_ops,
+               bool fixed)
+{
+        uint64_t flags = HASHDB_FLAG_CONCURRENT | HASHDB_FLAG_GROW;
+        struct worker workers[MAX_WORKER];
+        pthread_t threads[MAX_WORKER];
+        pthread_barrier_t filled;
+        struct hashdb *hp = NULL;
+        hashdb_size_t nr_live = 0;
+        hashdb_size_t i;
+
+        /*
+         * start small, so table splits and grows under the threads. a
+         * fixed table only fits every key of the threads if the nodes
+         * cached by this one are given back
+         */
+        if (fixed) {
+                flags &= ~HASHDB_FLAG_GROW;
+                hp = hashdb_init("stressdb", flags, nr * nr_keys, nr * nr_keys,
+                                 8, 8, NULL, NULL, 0644);
+        } else {
+                hp = hashdb_init("stressdb", flags, 64, 16, 8, 8,
+                                 NULL, NULL, 0644);
+        }
+        if (!hp)
+                err(EX_SOFTWARE, "hashdb_init()");
+        if (!fixed && hashdb_set_max_load(hp, MAX_LOAD))
+                err(EX_SOFTWARE, "hashdb_set_max_load()");
+        if (fixed) {
+                fill_and_empty(hp, nr * nr_keys);
+                if (pthread_barrier_init(&filled, NULL, nr))
+                        errx(EX_SOFTWARE, "pthread_barrier_init()");
+        }
+
+        for (i = 0; i < nr; ++i) {
+                workers[i].wk_hp = hp;
+                workers[i].wk_id = i;
+                workers[i].wk_nr_workers = nr;
+                workers[i].wk_nr_keys = nr_keys;
+                workers[i].wk_nr_ops = nr_ops;
+                workers[i].wk_values = calloc(nr_keys, sizeof(uint64_t));
+                workers[i].wk_have = calloc(nr_keys, 1);
+                workers[i].wk_nr_live = 0;
+                workers[i].wk_filled = fixed ? &filled : NULL;
+                if (!workers[i].wk_values || !workers[i].wk_have)
+                        err(EX_SOFTWARE, "calloc()");
+                if (pthread_create(&threads[i], NULL, run_thread, &workers[i]))
+                        errx(EX_SOFTWARE, "pthread_create()");
+        }
+        for (i = 0; i < nr; ++i) {
+                pthread_join(threads[i], NULL);
+                nr_live += workers[i].wk_nr_live;
+                free(workers[i].wk_values);
+                free(workers[i].wk_have);
+        }
+        if (fixed)
+                pthread_barrier_destroy(&filled);
+
+        if (hashdb_free(&hp, false))
+                err(EX_SOFTWARE, "hashdb_free()");
+        hp = hashdb_open("stressdb", HASHDB_FLAG_SANE_MODE, NULL, NULL);
+        if (!hp)
+                err(EX_SOFTWARE, "hashdb_open()");
+        if (check_pairs(hp) != nr_live)
+                errx(EX_SOFTWARE, "pairs left over after threads");
+        if (hashdb_free(&hp, true))
+                err(EX_SOFTWARE, "hashdb_free()");
+
+        printf("threads: %zu pairs\n", (size_t)nr_live);
+}
+
+static void
+stress_procs(hashdb_size_t nr,
+             hashdb_size_t nr_keys,
+             hashdb_size_t nr_ops,
+             hashdb_size_t nr_rounds,
+             uint64_t format)
+{
+        uint64_t flags = HASHDB_FLAG_SHARED | HASHDB_FLAG_GROW | format;
+        pid_t pids[MAX_WORKER];
+        struct hashdb *hp = NULL;
+        struct worker worker;
+        hashdb_size_t round;
+        hashdb_size_t nr_killed = 0;
+        unsigned int seed = 1;
+        hashdb_size_t i;
+        hashdb_size_t j;
+        int status;
+
+        create_small(flags);
+
+        /* restarted writers do not know their keys, so only values count */
+        for (i = 0; i < nr + nr_rounds; ++i) {
+                j = i < nr ? i : rand_r(&seed) % nr;
+                if (i >= nr) {
+                        usleep(KILL_USEC);
+                        kill(pids[j], SIGKILL);
+                        if (waitpid(pids[j], &status, 0) < 0)
+                                err(EX_SOFTWARE, "waitpid()");
+                        if (!WIFSIGNALED(status) && WEXITSTATUS(status))
+                                errx(EX_SOFTWARE, "writer %zu failed",
+                                     (size_t)j);
+                        nr_killed += WIFSIGNALED(status);
+                }
+
+                pids[j] = fork();
+                if (pids[j] < 0)
+                        err(EX_SOFTWARE, "fork()");
+                if (pids[j])
+                        continue;
+
+                worker.wk_hp = hashdb_open("stressdb", flags, NULL, NULL);
+                if (!worker.wk_hp)
+                        err(EX_SOFTWARE, "hashdb_open()");
+                worker.wk_id = j;
+                worker.wk_nr_workers = nr;
+                worker.wk_nr_keys = nr_keys;
+                worker.wk_values = NULL;
+                worker.wk_have = NULL;
+                seed = i + 1;
+                for (round = 0; round < nr_ops; ++round)
+                        step(&worker, &seed, round);
+                if (hashdb_free(&worker.wk_hp, false))
+                        err(EX_SOFTWARE, "hashdb_free()");
+                exit(0);
+        }
+        for (i = 0; i < nr; ++i) {
+                if (waitpid(pids[i], &status, 0) < 0)
+                        err(EX_SOFTWARE, "waitpid()");
+                if (!WIFEXITED(status) || WEXITSTATUS(status))
+                        errx(EX_SOFTWARE, "writer %zu failed", (size_t)i);
+        }
+
+        /* taking every lock repairs what killed writers left behind */
+        hp = hashdb_open("stressdb", flags, NULL, NULL);
+        if (!hp)
+                err(EX_SOFTWARE, "hashdb_open()");
+        i = check_pairs(hp);
+        if (hashdb_free(&hp, true))
+                err(EX_SOFTWARE, "hashdb_free()");
+
+        printf("procs: %zu writers killed, %zu pairs\n",
+               (size_t)nr_killed,
+               (size_t)i);
+}
+
+static struct hashdb *
+log_open(uint64_t flags)
+{
+        struct hashdb *hp = NULL;
+
+        hp = hashdb_open("stressdb", flags, NULL, NULL);
+        if (hp && hashdb_set_durability(hp, HASHDB_DURABLE_NONE)) {
+                hashdb_free(&hp, false);
+                hp = NULL;
+        }
+
+        return hp;
+}
+
+static int
+log_op(unsigned int *seed,
+       hashdb_size_t nr_keys,
+       hashdb_size_t seq,
+       uint64_t *keyp,
+       uint64_t *valuep)
+{
+        *keyp = rand_r(seed) % nr_keys;
+        *valuep = value_of(*keyp, seq);
+        return rand_r(seed) % 3;
+}
+
+static void
+stress_log(hashdb_size_t nr_keys,
+           hashdb_size_t nr_ops,
+           hashdb_size_t nr_rounds,
+           uint64_t format)
+{
+        uint64_t flags = HASHDB_FLAG_WAL | HASHDB_FLAG_GROW | format;
+        uint64_t *values = NULL;
+        unsigned char *have = NULL;
+        struct hashdb *hp = NULL;
+        hashdb_size_t nr_replayed = 0;
+        unsigned int delay_seed = 1;
+        hashdb_size_t nr_done;
+        hashdb_size_t round;
+        hashdb_size_t i;
+        unsigned int seed;
+        uint64_t pending;
+        uint64_t value;
+        uint64_t key;
+        uint64_t out;
+        char buf[4096];
+        int fds[2];
+        struct stat stats;
+        ssize_t len;
+        pid_t pid;
+        int status;
+        int ret;
+        int op;
+
+        values = calloc(nr_keys, sizeof(*values));
+        have = calloc(nr_keys, 1);
+        if (!values || !have)
+                err(EX_SOFTWARE, "calloc()");
+
+        for (round = 0; round < nr_rounds; ++round) {
+                create_small(flags);
+                if (pipe(fds))
+                        err(EX_SOFTWARE, "pipe()");
+
+                /* writer tells how many changes are in the log so far */
+                pid = fork();
+                if (pid < 0)
+                        err(EX_SOFTWARE, "fork()");
+                if (!pid) {
+                        close(fds[0]);
+                        hp = log_open(flags);
+                        if (!hp)
+                                _exit(EX_SOFTWARE);
+                        seed = round + 1;
+                        for (i = 0; i < nr_ops; ++i) {
+                                op = log_op(&seed, nr_keys, i, &key, &value);
+                                if (op && !hashdb_set(hp, &key, &value))
+                                        _exit(EX_SOFTWARE);
+                                if (!op)
+                                        hashdb_rm(hp, &key);
+                                if (hashdb_commit(hp))
+                                        _exit(EX_SOFTWARE);
+                                if (write(fds[1], "", 1) != 1)
+                                        _exit(EX_SOFTWARE);
+                                if (i % CHECKPOINT_EVERY !=
+                                    CHECKPOINT_EVERY - 1)
+                                        continue;
+                                /* older pairs are then only in the file */
+                                if (!format && hashdb_compact(hp, 0) < 0)
+                                        _exit(EX_SOFTWARE);
+                                if (format && (hashdb_free(&hp, false) ||
+                                               !(hp = log_open(flags))))
+                                        _exit(EX_SOFTWARE);
+                        }
+                        /* not freed, so log is left to be redone */
+                        _exit(0);
+                }
+                close(fds[1]);
+                usleep(rand_r(&delay_seed) % CRASH_USEC);
+                kill(pid, SIGKILL);
+                if (waitpid(pid, &status, 0) < 0)
+                        err(EX_SOFTWARE, "waitpid()");
+                if (!WIFSIGNALED(status) && WEXITSTATUS(status))
+                        errx(EX_SOFTWARE, "writer failed");
+                nr_done = 0;
+                while ((len = read(fds[0], buf, sizeof(buf))) > 0)
+                        nr_done += len;
+                close(fds[0]);
+
+                /* change after last one told about may or may not be in */
+                memset(have, 0, nr_keys);
+                seed = round + 1;
+                for (i = 0; i < nr_done; ++i) {
+                        op = log_op(&seed, nr_keys, i, &key, &value);
+                        have[key] = !!op;
+                        values[key] = value;
+                }
+                pending = nr_keys;
+                if (nr_done < nr_ops)
+                        log_op(&seed, nr_keys, nr_done, &pending, &value);
+
+                if (!stat("stressdb.wal", &stats) && stats.st_size)
+                        ++nr_replayed;
+                hp = hashdb_open("stressdb", flags, NULL, NULL);
+                if (!hp)
+                        err(EX_SOFTWARE, "hashdb_open()");
+                for (key = 0; key < nr_keys; ++key) {
+                        ret = hashdb_get_copy(hp, &key, &out);
+                        if (key == pending)
+                                continue;
+                        if ((ret == 0) != have[key] ||
+                            (!ret && out != values[key]))
+                                errx(EX_SOFTWARE, "round %zu: key %llx lost",
+                                     (size_t)round,
+                                     (unsigned long long)key);
+                }
+                check_pairs(hp);
+                if (hashdb_free(&hp, true))
+                        err(EX_SOFTWARE, "hashdb_free()");
+        }
+        free(values);
+        free(have);
+
+        printf("log: %zu crashes, %zu logs redone\n",
+               (size_t)nr_rounds,
+               (size_t)nr_replayed);
+}
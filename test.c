@@ -1,4 +1,5 @@
 #include "hashdb.h"
+#include "hashdb_define.h"
 #include <err.h>
 #include <errno.h>
 #include <stdio.h>
@@ -14,12 +15,13 @@ enum {
         DEFAULT_NR_BUCKET       = 4096,
         /* max size of word */
         WORD_SIZE               = 127,
+        /* max number of cursors */
+        MAX_CURSOR              = 16,
 };
 
-/* word frequency */
-struct word_freq {
-        char word[WORD_SIZE + 1];
-        hashdb_size_t count;
+/* key of typed calls */
+struct word {
+        char    w_str[WORD_SIZE + 1];
 };
 
 /* strtol with error checking */
@@ -31,29 +33,78 @@ static void usage(char *progname);
 /* hash table for storing word frequencies */
 static struct hashdb *g_wordfreq;
 
-/* list of all words read */
-static char     **words;
-static size_t   words_len;
-static size_t   words_cap;
+/* are words counted through typed calls? */
+static bool g_typed;
 
 /* key comparison */
 static int word_cmp(const void *a, const void *b, hashdb_size_t size);
 
 static size_t word_hash(const void *key, hashdb_size_t size);
 
+/* word_hash() cut to 32 bits, so the top bits of the hash are zero */
+static hashdb_size_t word_narrow_hash(const void *key, hashdb_size_t size);
+
+/* hash of typed key (same as word_hash()) */
+static hashdb_size_t word_typed_hash(struct word w);
+
+/* are typed keys equal? */
+#define WORD_EQ(a, b) \
+        (!strcmp((a).w_str, (b).w_str))
+
+/* typed calls for words and their counts (words_set(), words_get(), ...) */
+HASHDB_DEFINE(words, struct word, int, word_typed_hash, WORD_EQ)
+
+/* get built-in hash function */
+static hashdb_hashfn_t word_hashfn(long id);
+
 /* increment word frequency */
 static void word_inc(char *base, char *end);
 
+/* increment word frequency through typed calls */
+static void word_inc_typed(char *word);
+
+/* look up word */
+static void *word_get(char *word);
+
+/* add word with count of 0 */
+static void *word_set(char *word);
+
+/* get count of word from pair */
+static int *word_count(void *pair);
+
+/* print statistics of hashdb */
+static void stats_print(struct hashdb *hp, FILE *fp);
+
+/* check adding a word to hashdb fails once it is published */
+static void publish_check(struct hashdb *hp);
+
+/* copy counts into shards, then reopen them with right and wrong count */
+static void shards_check(struct hashdb *hp, hashdb_size_t nr_shards);
+
 int
 main(int argc, char **argv)
 {
         hashdb_size_t nr_nodes = 0;
         hashdb_size_t nr_buckets = 0;
+        hashdb_size_t key_size = WORD_SIZE + 1;
+        uint64_t flags = HASHDB_FLAG_SANE_MODE;
+        hashdb_hashfn_t hashfn = word_hash;
+        struct hashdb_cursor cursors[MAX_CURSOR];
+        struct hashdb *other = NULL;
+        const char *path = "wordfreq";
+        hashdb_size_t nr_cursors = 1;
+        hashdb_size_t compact = 0;
+        hashdb_size_t max_load = 0;
+        hashdb_size_t nr_shards = 0;
+        bool rdonly = false;
+        bool publish = false;
+        bool stats = false;
         size_t i;
         char buf[BUFSIZ];
         int c;
 
-        while ((c = getopt(argc, argv, "n:b:")) != -1) {
+        while ((c = getopt(argc, argv,
+                           "n:b:gl:HsKAIcSwvx:Np:C:PURWrODM:T")) != -1) {
                 switch (c) {
                 case 'n':
                         nr_nodes = e_strtol(optarg, NULL, 10);
@@ -61,28 +112,123 @@ main(int argc, char **argv)
                 case 'b':
                         nr_buckets = e_strtol(optarg, NULL, 10);
                         break;
+                case 'g':
+                        flags |= HASHDB_FLAG_GROW;
+                        break;
+                case 'l':
+                        max_load = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'H':
+                        flags |= HASHDB_FLAG_HASH;
+                        break;
+                case 's':
+                        flags |= HASHDB_FLAG_SWISS;
+                        break;
+                case 'K':
+                        flags |= HASHDB_FLAG_CUCKOO;
+                        break;
+                case 'A':
+                        flags |= HASHDB_FLAG_SOA;
+                        break;
+                case 'I':
+                        flags |= HASHDB_FLAG_INDEX32;
+                        break;
+                case 'c':
+                        flags |= HASHDB_FLAG_CONCURRENT;
+                        break;
+                case 'S':
+                        flags |= HASHDB_FLAG_SHARED;
+                        break;
+                case 'w':
+                        flags |= HASHDB_FLAG_WAL;
+                        break;
+                case 'v':
+                        /* most words fit in one node */
+                        flags |= HASHDB_FLAG_VAR;
+                        key_size = sizeof(hashdb_size_t);
+                        break;
+                case 'x':
+                        hashfn = word_hashfn(e_strtol(optarg, NULL, 10));
+                        break;
+                case 'N':
+                        hashfn = word_narrow_hash;
+                        break;
+                case 'p':
+                        nr_cursors = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'C':
+                        compact = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'P':
+                        flags |= HASHDB_FLAG_POPULATE;
+                        break;
+                case 'U':
+                        flags |= HASHDB_FLAG_HUGE;
+                        break;
+                case 'R':
+                        flags |= HASHDB_FLAG_RANDOM;
+                        break;
+                case 'W':
+                        flags |= HASHDB_FLAG_PREWARM;
+                        break;
+                case 'r':
+                        rdonly = true;
+                        break;
+                case 'O':
+                        publish = true;
+                        break;
+                case 'D':
+                        /* typed calls only do the work without checks */
+                        g_typed = true;
+                        flags &= ~HASHDB_FLAG_SANE_MODE;
+                        break;
+                case 'M':
+                        nr_shards = e_strtol(optarg, NULL, 10);
+                        break;
+                case 'T':
+                        flags |= HASHDB_FLAG_STATS;
+                        stats = true;
+                        break;
                 default:
                         usage(argv[0]);
                         /* does not return */
                 }
         }
 
+        if (!nr_cursors || nr_cursors > MAX_CURSOR)
+                usage(argv[0]);
+        if (publish && (flags & HASHDB_FLAG_WAL))
+                usage(argv[0]);
+        if (g_typed && ((flags & HASHDB_FLAG_VAR) || hashfn != word_hash))
+                usage(argv[0]);
+        if (nr_shards && (flags & HASHDB_FLAG_VAR))
+                usage(argv[0]);
         if (!nr_nodes)
                 nr_nodes = DEFAULT_NR_NODE;
         if (!nr_buckets)
                 nr_buckets = DEFAULT_NR_BUCKET;
 
-        g_wordfreq = hashdb_init("wordfreq",
-                                 HASHDB_FLAG_SANE_MODE,
-                                 nr_nodes,
-                                 nr_buckets,
-                                 (WORD_SIZE + 1),
-                                 sizeof(int),
-                                 word_hash,
-                                 word_cmp,
-                                 0666);
+        if (g_typed) {
+                g_wordfreq = words_init("wordfreq",
+                                        flags,
+                                        nr_nodes,
+                                        nr_buckets,
+                                        0666);
+        } else {
+                g_wordfreq = hashdb_init("wordfreq",
+                                         flags,
+                                         nr_nodes,
+                                         nr_buckets,
+                                         key_size,
+                                         sizeof(int),
+                                         hashfn,
+                                         word_cmp,
+                                         0666);
+        }
         if (!g_wordfreq)
                 err(EX_SOFTWARE, "wordfreq()");
+        if (max_load && hashdb_set_max_load(g_wordfreq, max_load))
+                err(EX_SOFTWARE, "hashdb_set_max_load()");
 
         while (fgets(buf, sizeof(buf), stdin)) {
                 char *base, *end;
@@ -99,26 +245,81 @@ main(int argc, char **argv)
                 word_inc(base, end);
         }
 
+        /* lay chains out a few nodes at a time */
+        if (compact) {
+                int ret;
+
+                while (!(ret = hashdb_compact(g_wordfreq, compact)))
+                        ;
+                if (ret < 0)
+                        err(EX_SOFTWARE, "hashdb_compact()");
+        }
+
+        /* words go to stdout, so statistics go to stderr */
+        if (stats)
+                stats_print(g_wordfreq, stderr);
+
+        /* a second open of a shared file stands in for another process */
+        if (publish && (flags & HASHDB_FLAG_SHARED)) {
+                other = hashdb_open("wordfreq", flags, hashfn, word_cmp);
+                if (!other)
+                        err(EX_SOFTWARE, "hashdb_open()");
+        }
+        if (publish) {
+                path = "wordfreq.pub";
+                if (hashdb_publish(g_wordfreq, path))
+                        err(EX_SOFTWARE, "hashdb_publish()");
+                publish_check(g_wordfreq);
+        }
+        if (other) {
+                publish_check(other);
+                if (hashdb_free(&other, false))
+                        err(EX_SOFTWARE, "hashdb_free()");
+        }
+
         if (hashdb_free(&g_wordfreq, false))
                 err(EX_SOFTWARE, "hashdb_free()");
 
-        g_wordfreq = hashdb_open("wordfreq", HASHDB_FLAG_SANE_MODE,
-                        word_hash, word_cmp);
+        /* built-in hash is picked from file */
+        if (hashfn != word_hash && hashfn != word_narrow_hash)
+                hashfn = NULL;
+        if (rdonly) {
+                flags &= ~(HASHDB_FLAG_CONCURRENT |
+                           HASHDB_FLAG_SHARED |
+                           HASHDB_FLAG_WAL);
+                flags |= HASHDB_FLAG_RDONLY;
+        }
+        g_wordfreq = hashdb_open(path, flags, hashfn, word_cmp);
         if (!g_wordfreq)
                 err(EX_SOFTWARE, "hashdb_open()");
-
-        for (i = 0; i < words_len; ++i) {
-                struct word_freq *wf;
-                char *word = words[i];
-
-                wf = hashdb_get(g_wordfreq, word);
-                if (!wf)
-                        err(EX_SOFTWARE, "hashdb_get(%s)", word);
-
-                printf("%ld: %s\n", (long)wf->count, wf->word);
-                free(word);
+        if (publish)
+                publish_check(g_wordfreq);
+        if (nr_shards)
+                shards_check(g_wordfreq, nr_shards);
+
+        /* pairs come back in the order they are stored */
+        if (hashdb_cursor_open(g_wordfreq, cursors, nr_cursors))
+                err(EX_SOFTWARE, "hashdb_cursor_open()");
+        if (!rdonly && !publish &&
+            (hashdb_compact(g_wordfreq, 0) != -1 || errno != EBUSY))
+                errx(EX_SOFTWARE, "hashdb_compact() with cursors open");
+        if (g_typed && !rdonly && !publish) {
+                struct word key = {"cursor"};
+
+                if (words_set(g_wordfreq, key, 0) || errno != EBUSY)
+                        errx(EX_SOFTWARE, "words_set() with cursors open");
+        }
+        for (i = 0; i < nr_cursors; ++i) {
+                void *wf;
+
+                while ((wf = hashdb_cursor_next(&cursors[i]))) {
+                        /* pairs start with key */
+                        if (word_get(wf) != wf)
+                                errx(EX_SOFTWARE, "hashdb_get(%s)", (char *)wf);
+                        printf("%ld: %s\n", (long)*word_count(wf), (char *)wf);
+                }
         }
-        free(words);
+        hashdb_cursor_close(cursors, nr_cursors);
 
         if (hashdb_free(&g_wordfreq, false))
                 err(EX_SOFTWARE, "hashdb_free()");
@@ -143,14 +344,38 @@ usage(char *progname)
         fprintf(stderr, "%s: Usage\n", progname);
         fprintf(stderr, "\t-n:  number of nodes in node table\n");
         fprintf(stderr, "\t-b:  number of buckets in hash table\n");
+        fprintf(stderr, "\t-g:  grow node table when full\n");
+        fprintf(stderr, "\t-l:  split buckets over this load (percent)\n");
+        fprintf(stderr, "\t-H:  store hash of key in each node\n");
+        fprintf(stderr, "\t-s:  use open addressing table format\n");
+        fprintf(stderr, "\t-K:  use cuckoo hashing table format\n");
+        fprintf(stderr, "\t-A:  keep counts apart from words\n");
+        fprintf(stderr, "\t-I:  link nodes by 32-bit index\n");
+        fprintf(stderr, "\t-c:  enable concurrent mode\n");
+        fprintf(stderr, "\t-S:  share database between processes\n");
+        fprintf(stderr, "\t-w:  log changes to write-ahead log\n");
+        fprintf(stderr, "\t-v:  store words in as many bytes as they need\n");
         fprintf(stderr, "\t-k:  key size\n");
+        fprintf(stderr, "\t-x:  built-in hash (1: xx, 2: wy, 3: crc32c)\n");
+        fprintf(stderr, "\t-N:  hash words to 32 bits\n");
+        fprintf(stderr, "\t-p:  number of cursors to read words back with\n");
+        fprintf(stderr, "\t-C:  compact this many nodes at a time\n");
+        fprintf(stderr, "\t-P:  fault in whole file when mapping it\n");
+        fprintf(stderr, "\t-U:  ask for huge pages\n");
+        fprintf(stderr, "\t-R:  turn off readahead\n");
+        fprintf(stderr, "\t-W:  fault in file from a background thread\n");
+        fprintf(stderr, "\t-r:  read words back read-only\n");
+        fprintf(stderr, "\t-O:  publish counts before reading them back\n");
+        fprintf(stderr, "\t-D:  count words through typed calls\n");
+        fprintf(stderr, "\t-M:  copy counts into this many shards\n");
+        fprintf(stderr, "\t-T:  print statistics of counting words\n");
         exit(EXIT_FAILURE);
 }
 
 static void
 word_inc(char *base, char *end)
 {
-        struct word_freq *wf = NULL;
+        void *wf = NULL;
 
         /* empty word */
         if (!(end - base))
@@ -164,28 +389,70 @@ word_inc(char *base, char *end)
                 return;
         }
 
-        wf = hashdb_get(g_wordfreq, base);
-        if (!wf) {
-                char *dup;
-                hashdb_size_t count = 0;
+        if (g_typed) {
+                word_inc_typed(base);
+                return;
+        }
 
-                wf = hashdb_set(g_wordfreq, base, &count);
+        wf = word_get(base);
+        if (!wf) {
+                wf = word_set(base);
                 if (!wf)
                         err(EX_SOFTWARE, "hashdb_set(%s)", base);
+        }
+        ++*word_count(wf);
+}
 
-                if (words_len == words_cap) {
-                        words_cap = words_cap ? words_cap * 2 : 1;
-                        words = realloc(words, sizeof(*words) * words_cap);
-                        if (!words)
-                                err(EX_SOFTWARE, "realloc()");
-                }
+static void
+word_inc_typed(char *word)
+{
+        struct word key = {{0}};
+        int *count = NULL;
+
+        strcpy(key.w_str, word);
+        count = words_get(g_wordfreq, key);
+        if (!count)
+                count = words_set(g_wordfreq, key, 0);
+        if (!count)
+                err(EX_SOFTWARE, "words_set(%s)", word);
+        ++*count;
+}
+
+static void *
+word_get(char *word)
+{
+        char key[WORD_SIZE + 1] = {0};
 
-                dup = strdup(base);
-                if (!dup)
-                        err(EX_SOFTWARE, "strdup(%s)", base);
-                words[words_len++] = dup;
+        if (g_wordfreq->hd_hdr->hh_format == HASHDB_FORMAT_VAR)
+                return hashdb_get_var(g_wordfreq, word, strlen(word) + 1);
+
+        /* built-in hashes read the whole key */
+        strcpy(key, word);
+        return hashdb_get(g_wordfreq, key);
+}
+
+static void *
+word_set(char *word)
+{
+        char key[WORD_SIZE + 1] = {0};
+        hashdb_size_t count = 0;
+
+        if (g_wordfreq->hd_hdr->hh_format == HASHDB_FORMAT_VAR) {
+                return hashdb_set_var(g_wordfreq,
+                                      word,
+                                      strlen(word) + 1,
+                                      &count,
+                                      sizeof(count));
         }
-        ++wf->count;
+
+        strcpy(key, word);
+        return hashdb_set(g_wordfreq, key, &count);
+}
+
+static int *
+word_count(void *pair)
+{
+        return hashdb_value(g_wordfreq, pair);
 }
 
 static int
@@ -207,3 +474,153 @@ word_hash(const void *key, hashdb_size_t size)
 
         return hash;
 }
+
+static hashdb_size_t
+word_narrow_hash(const void *key, hashdb_size_t size)
+{
+        return (uint32_t)word_hash(key, size);
+}
+
+static hashdb_size_t
+word_typed_hash(struct word w)
+{
+        return word_hash(w.w_str, sizeof(w.w_str));
+}
+
+static hashdb_hashfn_t
+word_hashfn(long id)
+{
+        switch (id) {
+        case HASHDB_HASH_XX:
+                return hashdb_hash_xx;
+        case HASHDB_HASH_WY:
+                return hashdb_hash_wy;
+        case HASHDB_HASH_CRC32C:
+                return hashdb_hash_crc32c;
+        default:
+                errx(EX_USAGE, "unknown hash %ld", id);
+        }
+}
+
+static void
+publish_check(struct hashdb *hp)
+{
+        struct hashdb *saved = g_wordfreq;
+
+        g_wordfreq = hp;
+        if (word_set("published") || errno != EROFS)
+                errx(EX_SOFTWARE, "hashdb_set() after hashdb_publish()");
+        g_wordfreq = saved;
+}
+
+static void
+shards_check(struct hashdb *hp, hashdb_size_t nr_shards)
+{
+        struct hashdb_shards *sp = NULL;
+        struct hashdb_cursor cursor;
+        hashdb_size_t value;
+        void *wf = NULL;
+
+        sp = hashdb_shards_init("wordshards",
+                                HASHDB_FLAG_SANE_MODE,
+                                nr_shards,
+                                DEFAULT_NR_NODE,
+                                DEFAULT_NR_BUCKET,
+                                WORD_SIZE + 1,
+                                sizeof(int),
+                                word_hash,
+                                word_cmp,
+                                0666);
+        if (!sp)
+                err(EX_SOFTWARE, "hashdb_shards_init()");
+        if (hashdb_cursor_open(hp, &cursor, 1))
+                err(EX_SOFTWARE, "hashdb_cursor_open()");
+        while ((wf = hashdb_cursor_next(&cursor))) {
+                if (!hashdb_shards_set(sp, wf, word_count(wf)))
+                        err(EX_SOFTWARE, "hashdb_shards_set(%s)", (char *)wf);
+        }
+        hashdb_cursor_close(&cursor, 1);
+        if (hashdb_shards_free(&sp, false))
+                err(EX_SOFTWARE, "hashdb_shards_free()");
+
+        /* keys would be looked for in the wrong shard */
+        sp = hashdb_shards_open("wordshards", HASHDB_FLAG_SANE_MODE,
+                                nr_shards + 1, word_hash, word_cmp);
+        if (sp)
+                errx(EX_SOFTWARE, "hashdb_shards_open() of too many shards");
+        if (nr_shards > 1) {
+                sp = hashdb_shards_open("wordshards", HASHDB_FLAG_SANE_MODE,
+                                        nr_shards - 1, word_hash, word_cmp);
+                if (sp || errno != EINVAL)
+                        errx(EX_SOFTWARE,
+                             "hashdb_shards_open() of too few shards");
+        }
+
+        sp = hashdb_shards_open("wordshards", HASHDB_FLAG_SANE_MODE,
+                                nr_shards, word_hash, word_cmp);
+        if (!sp)
+                err(EX_SOFTWARE, "hashdb_shards_open()");
+        if (hashdb_cursor_open(hp, &cursor, 1))
+                err(EX_SOFTWARE, "hashdb_cursor_open()");
+        while ((wf = hashdb_cursor_next(&cursor))) {
+                /* values are padded like keys */
+                if (hashdb_shards_get_copy(sp, wf, &value) ||
+                    memcmp(&value, word_count(wf), sizeof(int)))
+                        errx(EX_SOFTWARE, "hashdb_shards_get(%s)", (char *)wf);
+        }
+        hashdb_cursor_close(&cursor, 1);
+        if (hashdb_shards_free(&sp, true))
+                err(EX_SOFTWARE, "hashdb_shards_free()");
+}
+
+static void
+stats_print(struct hashdb *hp, FILE *fp)
+{
+        struct hashdb_stats st;
+        hashdb_size_t nr_ops;
+        hashdb_size_t i;
+
+        if (hashdb_stats(hp, &st))
+                err(EX_SOFTWARE, "hashdb_stats()");
+
+        fprintf(fp, "nodes:       %zu\n", (size_t)st.ht_nr_nodes);
+        fprintf(fp, "buckets:     %zu\n", (size_t)st.ht_nr_buckets);
+        fprintf(fp, "live:        %zu\n", (size_t)st.ht_nr_live);
+        fprintf(fp, "free:        %zu\n", (size_t)st.ht_nr_free);
+        fprintf(fp, "load:        %zu%%\n", (size_t)st.ht_load);
+        for (i = 0; i < HASHDB_STATS_NR_HIST; ++i) {
+                if (st.ht_hist[i])
+                        fprintf(fp, "hist[%2zu]:    %zu\n",
+                                (size_t)i, (size_t)st.ht_hist[i]);
+        }
+        fprintf(fp, "hist_max:    %zu\n", (size_t)st.ht_hist_max);
+        fprintf(fp, "gets:        %zu (%zu hits, %zu misses)\n",
+                (size_t)st.ht_gets, (size_t)st.ht_hits,
+                (size_t)st.ht_misses);
+        fprintf(fp, "sets:        %zu (%zu inserts, %zu updates)\n",
+                (size_t)st.ht_sets, (size_t)st.ht_inserts,
+                (size_t)st.ht_updates);
+        fprintf(fp, "rms:         %zu (%zu misses)\n",
+                (size_t)st.ht_rms, (size_t)st.ht_rm_misses);
+
+        nr_ops = st.ht_gets + st.ht_sets + st.ht_rms;
+        fprintf(fp, "probes:      %.2f avg, %zu max\n",
+                nr_ops ? (double)st.ht_probes / nr_ops : 0.0,
+                (size_t)st.ht_max_probes);
+
+        /* only builds with HASHDB_TRACE keep latencies */
+        for (i = 0; i < HASHDB_NR_OPS; ++i) {
+                struct hashdb_latency lat;
+
+                if (hashdb_latency(hp, i, &lat))
+                        break;
+                fprintf(fp, "%-12s %zu timed, p50 %zuns, p99 %zuns, "
+                        "max %zuns\n",
+                        i == HASHDB_OP_GET ? "get:" :
+                        i == HASHDB_OP_SET ? "set:" : "rm:",
+                        (size_t)lat.hy_count,
+                        (size_t)hashdb_latency_percentile(&lat, 50),
+                        (size_t)hashdb_latency_percentile(&lat, 99),
+                        (size_t)lat.hy_max);
+        }
+}